@@ -4,6 +4,7 @@
 
 #include <string>
 #include <memory>
+#include <algorithm>
 #include <boost/thread.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/filesystem.hpp>
@@ -24,6 +25,7 @@
 #include "Series/SeriesController.h"
 #include "Image/ImageRepository.h"
 #include "Image/ImageController.h"
+#include "Image/ImageBatchController.h"
 #include "Language/LanguageController.h"
 #include "CustomCommand/CustomCommandController.h"
 #include "Annotation/AnnotationRepository.h"
@@ -31,6 +33,7 @@
 #include "Config/WebViewerConfiguration.h"
 #include "ShortTermCache/CacheContext.h"
 #include "ShortTermCache/CacheScheduler.h"
+#include "ShortTermCache/CacheStatisticsController.h"
 #include "ShortTermCache/ViewerPrefetchPolicy.h"
 #include "SeriesInformationAdapter.h"
 
@@ -107,15 +110,19 @@ void AbstractWebViewer::_serveBackEnd()
   ConfigController::setConfig(_config.get());
   CustomCommandController::setConfig(_config.get());
   SeriesController::setConfig(_config.get());
+  ImageBatchController::setConfig(_config.get());
+  ImageBatchController::startWorkers(static_cast<size_t>(std::max(_config->shortTermCacheDecoderThreadsCound, 1)));
 
   // Register routes & controllers
   // Note: if you add some routes here, don't forget to add them in the authorization plugin
+  RegisterRoute<ImageBatchController>("/osimis-viewer/images/batch"); // before the ImageController route, which would match it too
   RegisterRoute<ImageController>("/osimis-viewer/images/");
   RegisterRoute<SeriesController>("/osimis-viewer/series/");
   RegisterRoute<ConfigController>("/osimis-viewer/config.js");
   RegisterRoute<StudyController>("/osimis-viewer/studies/");
   RegisterRoute<LanguageController>("/osimis-viewer/languages/");
   RegisterRoute<CustomCommandController>("/osimis-viewer/custom-command/");
+  RegisterRoute<CacheStatisticsController>("/osimis-viewer/cache/statistics");
 }
 
 AbstractWebViewer::AbstractWebViewer(OrthancPluginContext* context)
@@ -140,6 +147,7 @@ AbstractWebViewer::AbstractWebViewer(OrthancPluginContext* context)
   StudyController::Inject(_annotationRepository.get());
   ImageController::Inject(_imageRepository.get());
   ImageController::Inject(_annotationRepository.get());
+  ImageBatchController::Inject(_imageRepository.get());
   SeriesController::Inject(_seriesRepository.get());
 
   ::_instanceRepository = _instanceRepository.get();
@@ -183,23 +191,45 @@ int32_t AbstractWebViewer::start()
                  );
     ::_cache = _cache.get();
 
+    if (_config->shortTermCachePackFilesEnabled) {
+      _cache->EnablePackFiles((_config->shortTermCachePath / "packs").string());
+    }
+
+    if (!_config->shortTermCacheSharedPath.empty()) {
+      _cache->EnableSharedDirectory(_config->shortTermCacheSharedPath,
+                                    static_cast<uint64_t>(_config->shortTermCacheSharedSize) * 1024 * 1024);
+    }
+
     OrthancPlugins::CacheScheduler& scheduler = _cache->GetScheduler();
     scheduler.RegisterPolicy(new OrthancPlugins::ViewerPrefetchPolicy(_context, _seriesRepository.get()));
     scheduler.Register(CacheBundle_SeriesInformation,
-                       new OrthancPlugins::SeriesInformationAdapter(_context, scheduler), 1);
+                       new OrthancPlugins::SeriesInformationAdapter(_context, scheduler, _seriesRepository.get()), 1);
+    scheduler.SetBundleVersion(CacheBundle_SeriesInformation, CACHE_SERIES_INFORMATION_VERSION);
     /* Set the quotas */
     scheduler.SetQuota(CacheBundle_SeriesInformation, 1000, 0);    // Keep info about 1000 series
 
     scheduler.Register(CacheBundle_DecodedImage,
                        new ImageControllerCacheFactory(_imageRepository.get()),
                        _config->shortTermCacheDecoderThreadsCound);
+    scheduler.SetBundleVersion(CacheBundle_DecodedImage, CACHE_DECODED_IMAGE_VERSION);
     scheduler.SetQuota(CacheBundle_DecodedImage, 0, static_cast<uint64_t>(_config->shortTermCacheSize) * 1024 * 1024);
+    scheduler.SetMemoryCacheSize(static_cast<uint64_t>(_config->shortTermCacheMemorySize) * 1024 * 1024);
+
+    // Share of the cores given to the background work (prefetch)
+    unsigned int backgroundCpuShare = static_cast<unsigned int>(std::max(0, std::min(_config->shortTermCacheBackgroundCpuShare, 100)));
+    scheduler.SetMaxBackgroundJobs(std::max(1u, boost::thread::hardware_concurrency() * backgroundCpuShare / 100));
 
     ImageController::Inject(_cache.get());
+    ImageBatchController::Inject(_cache.get());
+    CacheStatisticsController::Inject(_cache.get());
+    StudyController::Inject(_cache.get());
   }
 
   _instanceRepository->EnableCachingInMetadata(_config->instanceInfoCacheEnabled);
   _seriesRepository->EnableCachingInMetadata(_config->instanceInfoCacheEnabled);
+  _dicomRepository->setMaxCacheSize(static_cast<uint64_t>(_config->dicomFileCacheSize) * 1024 * 1024);
+  _dicomRepository->enableFrameIndex(_config->dicomFrameIndexEnabled, _config->orthancStorageDirectory.string());
+  _dicomRepository->enableFrameIndexInMetadata(_config->dicomFrameIndexInMetadataEnabled);
 
   if (_config->keyImageCaptureEnabled) {
     // register the OsimisNote tag
@@ -233,6 +263,7 @@ int32_t AbstractWebViewer::start()
 AbstractWebViewer::~AbstractWebViewer()
 {
   OrthancPluginLogWarning(_context, "Finalizing the Web viewer");
+  ImageBatchController::stopWorkers();
   ::_instanceRepository = NULL;
 }
 
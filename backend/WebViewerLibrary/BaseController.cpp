@@ -1,7 +1,10 @@
 #include "BaseController.h"
 
+#include <string.h>
 #include <json/writer.h>
 #include <json/value.h>
+#include <boost/functional/hash.hpp>
+#include <boost/lexical_cast.hpp>
 
 #include "OrthancContextManager.h"
 
@@ -56,3 +59,28 @@ int BaseController::_AnswerBuffer(const Json::Value& output) {
   OrthancPluginAnswerBuffer(OrthancContextManager::Get(), response_, outputStr.c_str(), outputStr.size(), "application/json");
   return 200;
 }
+
+std::string BaseController::_GetClientKey() const {
+  // Orthanc does not give the address of the client to the plugins: the
+  // clients are told apart by these headers (lower case in Orthanc), that
+  // are hashed not to keep the credentials
+  static const char* const IDENTIFYING_HEADERS[] = { "x-forwarded-for", "authorization", "cookie", "user-agent" };
+
+  std::string identity;
+  bool found = false;
+  for (size_t h = 0; h < sizeof(IDENTIFYING_HEADERS) / sizeof(IDENTIFYING_HEADERS[0]); h++) {
+    for (uint32_t i = 0; i < this->request_->headersCount; i++) {
+      if (strcmp(this->request_->headersKeys[i], IDENTIFYING_HEADERS[h]) == 0) {
+        identity += this->request_->headersValues[i];
+        found = true;
+      }
+    }
+    identity += '\n';
+  }
+
+  if (!found) {
+    return std::string();
+  }
+
+  return boost::lexical_cast<std::string>(boost::hash<std::string>()(identity));
+}
@@ -32,6 +32,10 @@ protected:
   int _AnswerBuffer(const std::string& output, const std::string& mimeType);
   int _AnswerBuffer(const Json::Value& output);
 
+  // Identifies the viewer that sent the request (ie. for the prefetching
+  // to follow its scrolling), empty if the request has no identifying header
+  std::string _GetClientKey() const;
+
 protected:
   OrthancPluginRestOutput* response_;
   const std::string url_;
@@ -109,6 +109,9 @@ void WebViewerConfiguration::_parseFile(const Json::Value& wvConfig)
   keyboardShortcuts["enter"] = "loadSeriesInPane";
 
   instanceInfoCacheEnabled = OrthancPlugins::GetBoolValue(wvConfig, "InstanceInfoCacheEnabled", false);
+  dicomFileCacheSize = OrthancPlugins::GetIntegerValue(wvConfig, "DicomFileCacheSize", 256);
+  dicomFrameIndexEnabled = OrthancPlugins::GetBoolValue(wvConfig, "DicomFrameIndexEnabled", true);
+  dicomFrameIndexInMetadataEnabled = OrthancPlugins::GetBoolValue(wvConfig, "DicomFrameIndexInMetadataEnabled", instanceInfoCacheEnabled);
 
   bool hasGdcmPlugin = OrthancPlugins::CheckMinimalOrthancVersion(1, 7, 0);
   gdcmEnabled = OrthancPlugins::GetBoolValue(wvConfig, "GdcmEnabled", !hasGdcmPlugin); // now that the GDCM plugin is available (Orthanc 1.7.0)
@@ -258,7 +261,12 @@ void WebViewerConfiguration::_parseFile(const Json::Value& wvConfig)
   shortTermCacheDebugLogsEnabled = OrthancPlugins::GetBoolValue(wvConfig, "ShortTermCacheDebugLogsEnabled", false);
   shortTermCachePath = OrthancPlugins::GetStringValue(wvConfig, "ShortTermCachePath", shortTermCachePath.string());
   shortTermCacheSize = OrthancPlugins::GetIntegerValue(wvConfig, "ShortTermCacheSize", 1000);
+  shortTermCacheMemorySize = OrthancPlugins::GetIntegerValue(wvConfig, "ShortTermCacheMemorySize", 128);
   shortTermCacheDecoderThreadsCound = OrthancPlugins::GetIntegerValue(wvConfig, "Threads", std::max(boost::thread::hardware_concurrency() / 2, 1u));
+  shortTermCacheBackgroundCpuShare = OrthancPlugins::GetIntegerValue(wvConfig, "ShortTermCacheBackgroundCpuShare", 50);
+  shortTermCacheSharedPath = OrthancPlugins::GetStringValue(wvConfig, "ShortTermCacheSharedPath", "");
+  shortTermCacheSharedSize = OrthancPlugins::GetIntegerValue(wvConfig, "ShortTermCacheSharedSize", 4000);
+  shortTermCachePackFilesEnabled = OrthancPlugins::GetBoolValue(wvConfig, "ShortTermCachePackFilesEnabled", false);
   highQualityImagePreloadingEnabled = OrthancPlugins::GetBoolValue(wvConfig, "HighQualityImagePreloadingEnabled", true);
   reduceTimelineHeightOnSingleFrameSeries = OrthancPlugins::GetBoolValue(wvConfig, "ReduceTimelineHeightOnSingleFrameSeries", false);
   showNoReportIconInSeriesList = OrthancPlugins::GetBoolValue(wvConfig, "ShowNoReportIconInSeriesList", false);
@@ -507,6 +515,7 @@ void WebViewerConfiguration::parseFile()
 
     shortTermCachePath = OrthancPlugins::GetStringValue(configuration, "StorageDirectory", "."); // By default, the cache of the Web viewer is located inside the "StorageDirectory" of Orthanc
     shortTermCachePath /= "OsimisWebViewerCache";
+    orthancStorageDirectory = OrthancPlugins::GetStringValue(configuration, "StorageDirectory", "OrthancStorage"); // same default as Orthanc
 
     static const char* CONFIG_WEB_VIEWER = "WebViewer";
     if (configuration.isMember(CONFIG_WEB_VIEWER)) {
@@ -48,8 +48,17 @@ public:
   boost::filesystem::path shortTermCachePath;
   int shortTermCacheDecoderThreadsCound;
   int shortTermCacheSize;
+  int shortTermCacheMemorySize;
+  int shortTermCacheBackgroundCpuShare;
+  std::string shortTermCacheSharedPath;
+  int shortTermCacheSharedSize;
+  bool shortTermCachePackFilesEnabled;
 
   bool instanceInfoCacheEnabled;
+  int dicomFileCacheSize;
+  bool dicomFrameIndexEnabled;
+  bool dicomFrameIndexInMetadataEnabled;
+  boost::filesystem::path orthancStorageDirectory; // "StorageDirectory" of Orthanc, used to read the frames directly from the DICOM files
 
   bool gdcmEnabled;
   bool restrictTransferSyntaxes;
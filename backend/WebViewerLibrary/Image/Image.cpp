@@ -1,5 +1,9 @@
 #include "Image.h"
 
+#include <string.h> // for memcpy
+#include <OrthancException.h> // for throws
+#include "../BenchmarkHelper.h" // for BENCH(*)
+
 Image::Image(const std::string& instanceId, uint32_t frameIndex, std::auto_ptr<RawImageContainer> data, const Json::Value& dicomTags)
   : metaData_(data.get(), dicomTags), data_(data)
 {
@@ -26,6 +30,39 @@ Image::Image(const std::string& instanceId, uint32_t frameIndex, std::auto_ptr<C
   assert(data_.get() != NULL);
 }
 
+Image::Image(const std::string& instanceId, uint32_t frameIndex, std::auto_ptr<RawImageContainer> data, const ImageMetaData& metaData)
+  : metaData_(metaData), data_(data)
+{
+  instanceId_ = instanceId;
+  frameIndex_ = frameIndex;
+  assert(data_.get() != NULL);
+}
+
+std::auto_ptr<Image> Image::CloneRaw() const
+{
+  BENCH(CLONE_RAW_IMAGE);
+
+  RawImageContainer* rawImage = dynamic_cast<RawImageContainer*>(data_.get());
+  if (rawImage == NULL) {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+  }
+
+  const Orthanc::ImageAccessor* source = rawImage->GetOrthancImageAccessor();
+  Orthanc::ImageBuffer* buffer = new Orthanc::ImageBuffer(source->GetFormat(),
+                                                          source->GetWidth(),
+                                                          source->GetHeight(),
+                                                          false);
+  std::auto_ptr<RawImageContainer> data(new RawImageContainer(buffer)); // takes buffer memory ownership
+
+  Orthanc::ImageAccessor* target = data->GetOrthancImageAccessor();
+  size_t rowSize = source->GetWidth() * source->GetBytesPerPixel();
+  for (unsigned int y = 0; y < source->GetHeight(); y++) {
+    memcpy(target->GetRow(y), source->GetConstRow(y), rowSize);
+  }
+
+  return std::auto_ptr<Image>(new Image(instanceId_, frameIndex_, data, metaData_));
+}
+
 void Image::ApplyProcessing(IImageProcessingPolicy* policy)
 {
   std::auto_ptr<IImageContainer> input = data_;
@@ -48,8 +48,18 @@ private:
   // klv image (available in attachment).
   Image(const std::string& instanceId, uint32_t frameIndex, std::auto_ptr<CornerstoneKLVContainer> data);
 
+  // takes memory ownership
+  // This constructor is called when copying a decoded image so that several
+  // processing policies can be applied to the same decoded frame. The
+  // metadata are copied instead of being computed once again.
+  Image(const std::string& instanceId, uint32_t frameIndex, std::auto_ptr<RawImageContainer> data, const ImageMetaData& metaData);
+
   void ApplyProcessing(IImageProcessingPolicy* policy);
 
+  // Deep copy of an image whose pixels have not been processed yet (throws
+  // if the image data is not raw).
+  std::auto_ptr<Image> CloneRaw() const;
+
 private:
   std::string instanceId_;
   uint32_t frameIndex_;
@@ -0,0 +1,385 @@
+#include "ImageBatchController.h"
+
+#include <list>
+#include <algorithm>
+#include <boost/foreach.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/lexical_cast.hpp> // to retrieve exception error code for log
+#include <json/reader.h>
+#include <json/value.h>
+#include <OrthancException.h>
+
+#include "../BenchmarkHelper.h" // for BENCH(*)
+#include "../Config/WebViewerConfiguration.h"
+#include "ImageController.h" // for ImageControllerUrlParser
+#include "Utilities/KLVWriter.h"
+
+ImageRepository* ImageBatchController::imageRepository_ = NULL;
+CacheContext* ImageBatchController::cacheContext_ = NULL;
+const WebViewerConfiguration* ImageBatchController::_config = NULL;
+std::auto_ptr<ImageBatchController::WorkerPool> ImageBatchController::workers_;
+const size_t ImageBatchController::MAX_BATCH_SIZE;
+
+template<>
+void ImageBatchController::Inject<ImageRepository>(ImageRepository* obj) {
+  ImageBatchController::imageRepository_ = obj;
+}
+template<>
+void ImageBatchController::Inject<CacheContext>(CacheContext* obj) {
+  ImageBatchController::cacheContext_ = obj;
+}
+
+// Produces the images of a batch in the worker threads of the pool; the
+// request thread retrieves them in the order of completion.
+class ImageBatchController::Batch : public boost::noncopyable
+{
+  struct Result
+  {
+    int         status;
+    std::string content;
+  };
+
+  const std::vector<std::string>&   routes_;
+  const std::string                 client_;     // see BaseController::_GetClientKey()
+  std::vector<Result>               results_;
+  boost::mutex                      mutex_;
+  boost::condition_variable         completedCondition_;
+  std::list<size_t>                 completed_;  // produced, not yet retrieved
+
+  // protected by the mutex of the WorkerPool
+  size_t                            next_;       // next route to produce
+  unsigned int                      running_;    // routes being produced by the workers
+
+  friend class WorkerPool;
+
+  static int _produce(std::string& content, const std::string& route, const std::string& client)
+  {
+    try
+    {
+      std::string instanceId;
+      uint32_t frameIndex;
+      std::auto_ptr<IImageProcessingPolicy> processingPolicy;
+
+      if (!ImageControllerUrlParser::parseUrlPostfix(route, instanceId, frameIndex, processingPolicy))
+      {
+        return 404;
+      }
+
+      if (cacheContext_ != NULL)  //if there is a cache enabled
+      {
+        return cacheContext_->GetScheduler().Access(content, CacheBundle_DecodedImage, route, client) ? 200 : 500;
+      }
+
+      std::auto_ptr<Image> image = imageRepository_->GetImage(instanceId, frameIndex, processingPolicy.get(), true);
+      if (image.get() == NULL)
+      {
+        return 500;
+      }
+
+      content.assign(image->GetBinary(), image->GetBinarySize());
+      return 200;
+    }
+    catch (const std::invalid_argument&) {
+      return 404; // processing policy not found
+    }
+    catch (const boost::bad_lexical_cast&) {
+      return 404;
+    }
+    catch (const Orthanc::OrthancException& exc) {
+      std::string message("(ImageBatchController) Orthanc::OrthancException ");
+      message += boost::lexical_cast<std::string>(exc.GetErrorCode());
+      message += " ";
+      message += exc.What();
+      message += " for ";
+      message += route;
+      OrthancPluginLogError(OrthancContextManager::Get(), message.c_str());
+      return exc.GetHttpStatus();
+    }
+    catch (const std::exception& exc) {
+      std::string message("(ImageBatchController) std::exception ");
+      message += exc.what();
+      message += " for ";
+      message += route;
+      OrthancPluginLogError(OrthancContextManager::Get(), message.c_str());
+      return 500;
+    }
+    catch (...) {
+      std::string message("(ImageBatchController) Unknown Exception for ");
+      message += route;
+      OrthancPluginLogError(OrthancContextManager::Get(), message.c_str());
+      return 500;
+    }
+  }
+
+  // Called by a worker of the pool
+  void _produceOne(size_t index)
+  {
+    std::string content;
+    int status = _produce(content, routes_[index], client_);
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      results_[index].status = status;
+      results_[index].content.swap(content);
+      completed_.push_back(index);
+    }
+    completedCondition_.notify_one();
+  }
+
+public:
+  Batch(const std::vector<std::string>& routes, const std::string& client)
+    : routes_(routes),
+      client_(client),
+      results_(routes.size()),
+      next_(0),
+      running_(0)
+  {
+  }
+
+  // Waits for the next completed image
+  void GetNext(size_t& index, int& status, std::string& content)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    while (completed_.empty())
+    {
+      completedCondition_.wait(lock);
+    }
+
+    index = completed_.front();
+    completed_.pop_front();
+    status = results_[index].status;
+    content.swap(results_[index].content);
+  }
+};
+
+// The worker threads shared by all the batches, so that the concurrent
+// batches don't start more decoding threads than configured.  The batches
+// are served in turn, one image at a time.
+class ImageBatchController::WorkerPool : public boost::noncopyable
+{
+  boost::mutex                mutex_;
+  boost::condition_variable   availableCondition_;
+  boost::condition_variable   idleCondition_;
+  std::list<Batch*>           batches_;   // with images left to produce
+  bool                        stopped_;
+  boost::thread_group         workers_;
+
+  static void _worker(WorkerPool* that)
+  {
+    for (;;)
+    {
+      Batch* batch;
+      size_t index;
+      {
+        boost::mutex::scoped_lock lock(that->mutex_);
+        while (!that->stopped_ && that->batches_.empty())
+        {
+          that->availableCondition_.wait(lock);
+        }
+
+        if (that->stopped_)
+        {
+          return;
+        }
+
+        batch = that->batches_.front();
+        that->batches_.pop_front();
+
+        index = batch->next_++;
+        batch->running_++;
+        if (batch->next_ < batch->routes_.size())
+        {
+          that->batches_.push_back(batch);  // its next image after the other batches
+        }
+      }
+
+      batch->_produceOne(index);
+
+      {
+        boost::mutex::scoped_lock lock(that->mutex_);
+        batch->running_--;
+      }
+      that->idleCondition_.notify_all();
+    }
+  }
+
+public:
+  explicit WorkerPool(size_t threadsCount)
+    : stopped_(false)
+  {
+    for (size_t i = 0; i < threadsCount; i++)
+    {
+      workers_.create_thread(boost::bind(&WorkerPool::_worker, this));
+    }
+  }
+
+  ~WorkerPool()
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      stopped_ = true;
+    }
+    availableCondition_.notify_all();
+    workers_.join_all();
+  }
+
+  void Add(Batch& batch)
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      batches_.push_back(&batch);
+    }
+    availableCondition_.notify_all();
+  }
+
+  // The images being produced are completed, the others are skipped
+  void Abort(Batch& batch)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    batches_.remove(&batch);
+    batch.next_ = batch.routes_.size();
+  }
+
+  // Aborts the batch and waits for its images being produced, the batch can
+  // then be deleted
+  void Remove(Batch& batch)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    batches_.remove(&batch);
+    batch.next_ = batch.routes_.size();
+
+    while (batch.running_ > 0)
+    {
+      idleCondition_.wait(lock);
+    }
+  }
+};
+
+// Adds a batch to the pool, removes it on destruction
+class ImageBatchController::ScopedBatch : public boost::noncopyable
+{
+  WorkerPool& pool_;
+  Batch       batch_;
+
+public:
+  ScopedBatch(WorkerPool& pool, const std::vector<std::string>& routes, const std::string& client)
+    : pool_(pool),
+      batch_(routes, client)
+  {
+    pool_.Add(batch_);
+  }
+
+  ~ScopedBatch()
+  {
+    pool_.Remove(batch_);
+  }
+
+  Batch& GetBatch()
+  {
+    return batch_;
+  }
+
+  void Abort()
+  {
+    pool_.Abort(batch_);
+  }
+};
+
+void ImageBatchController::startWorkers(size_t threadsCount) {
+  workers_.reset(new WorkerPool(std::max(threadsCount, static_cast<size_t>(1))));
+}
+
+void ImageBatchController::stopWorkers() {
+  workers_.reset(NULL);
+}
+
+ImageBatchController::ImageBatchController(OrthancPluginRestOutput* response, const std::string& url, const OrthancPluginHttpRequest* request)
+  : BaseController(response, url, request)
+{
+  ImageControllerUrlParser::init();  // create the route parser before the worker threads use it
+}
+
+int ImageBatchController::_ParseURLPostFix(const std::string& urlPostfix) {
+  // the route is registered as "/osimis-viewer/images/batch": nothing may follow
+  if (!urlPostfix.empty()) {
+    return this->_AnswerError(404);
+  }
+
+  return 200;
+}
+
+int ImageBatchController::_ProcessRequest()
+{
+  // Retrieve context so we can use orthanc's logger.
+  OrthancPluginContext* context = OrthancContextManager::Get();
+
+  if (this->request_->method != OrthancPluginHttpMethod_Post) {
+    return this->_AnswerError(404);
+  }
+
+  // Parse the list of image routes
+  {
+    BENCH(BATCH_PARSING);
+    std::string requestBody(this->request_->body, this->request_->bodySize);
+    Json::Value value;
+    Json::Reader reader;
+    if (!reader.parse(requestBody.c_str(), value) || !value.isArray() ||
+        value.size() == 0 || value.size() > MAX_BATCH_SIZE) {
+      std::string message("(ImageBatchController) Invalid batch request: a json array of 1 to ");
+      message += boost::lexical_cast<std::string>(MAX_BATCH_SIZE);
+      message += " image routes is expected";
+      OrthancPluginLogInfo(context, message.c_str());
+
+      return this->_AnswerError(400);
+    }
+
+    for (Json::ArrayIndex i = 0; i < value.size(); i++) {
+      if (!value[i].isString()) {
+        return this->_AnswerError(400);
+      }
+      routes_.push_back(value[i].asString());
+    }
+  }
+
+  BENCH(FULL_BATCH_PROCESS);
+
+  if (workers_.get() == NULL) {
+    OrthancPluginLogError(context, "(ImageBatchController) The worker threads are not started");
+    return this->_AnswerError(500);
+  }
+
+  ScopedBatch batch(*workers_, routes_, this->_GetClientKey());
+
+  if (OrthancPluginStartMultipartAnswer(context, this->response_, "mixed", "application/octet-stream") != OrthancPluginErrorCode_Success) {
+    return 500;
+  }
+
+  for (size_t sent = 0; sent < routes_.size(); sent++) {
+    size_t index;
+    int status;
+    std::string content;
+    batch.GetBatch().GetNext(index, status, content);
+
+    // the values must be kept in memory until the KLV is written
+    uint32_t klvIndex = static_cast<uint32_t>(index);
+    uint32_t klvStatus = static_cast<uint32_t>(status);
+
+    KLVWriter klvWriter;
+    klvWriter.setValue(Index, klvIndex);
+    klvWriter.setValue(Status, klvStatus);
+    if (status == 200) {
+      klvWriter.setValue(ImageContent, content.size(), content.c_str());
+    }
+    std::string part = klvWriter.write();
+
+    if (OrthancPluginSendMultipartItem(context, this->response_, part.c_str(), static_cast<uint32_t>(part.size())) != OrthancPluginErrorCode_Success) {
+      // the connection has been closed by the client, don't produce the remaining images
+      OrthancPluginLogInfo(context, "(ImageBatchController) Connection closed by the client, batch aborted");
+      batch.Abort();
+      break;
+    }
+  }
+
+  return 200;
+}
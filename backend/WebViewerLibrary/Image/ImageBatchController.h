@@ -0,0 +1,72 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../BaseController.h"
+#include "ImageRepository.h"
+#include "ShortTermCache/CacheContext.h"
+
+class WebViewerConfiguration;
+
+/** ImageBatchController
+ *
+ * POST /osimis-viewer/images/batch
+ *
+ * Retrieves many images in a single HTTP request (ie. when scrolling a CT
+ * series), so the request overhead is paid once instead of once per frame.
+ *
+ * The body is a json array of image routes, as used by the ImageController:
+ * ["<instance_id>/<frame_index>/<quality>", ...].
+ *
+ * The images are produced in parallel by a pool of worker threads shared by
+ * all the batches (as many threads as the decoder threads of the short term
+ * cache, the concurrent batches being served in turn) and streamed as soon as
+ * each of them is ready, in a `multipart/mixed` answer.  The parts are therefore not in the
+ * order of the request: each part is a KLV (see KLVWriter) containing the
+ * index of the image in the request, the HTTP status of the image and the
+ * image itself (same content as /osimis-viewer/images/<route>).
+ *
+ */
+class ImageBatchController : public BaseController, public boost::noncopyable {
+public:
+  static const size_t MAX_BATCH_SIZE = 1000;
+
+  enum Keys
+  {
+    Index,        // uint32, index of the image in the request
+    Status,       // uint32, HTTP status of the image
+    ImageContent  // image binary (only if status is 200)
+  };
+
+  ImageBatchController(OrthancPluginRestOutput* response, const std::string& url, const OrthancPluginHttpRequest* request);
+
+  template<typename T>
+  static void Inject(T* obj);
+
+  static void setConfig(const WebViewerConfiguration* config) {_config = config; }
+
+  // Starts/stops the worker threads shared by all the batches
+  static void startWorkers(size_t threadsCount);
+  static void stopWorkers();
+
+protected:
+  virtual int _ParseURLPostFix(const std::string& urlPostfix);
+  virtual int _ProcessRequest();
+
+private:
+  class Batch;
+  class WorkerPool;
+  class ScopedBatch;
+
+  static ImageRepository* imageRepository_;
+  static CacheContext* cacheContext_;
+  static const WebViewerConfiguration* _config;
+  static std::auto_ptr<WorkerPool> workers_;
+
+  std::vector<std::string> routes_;
+
+  friend class Batch;
+  friend class WorkerPool;
+};
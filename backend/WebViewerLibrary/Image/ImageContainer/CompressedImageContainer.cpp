@@ -5,9 +5,19 @@
 CompressedImageContainer::CompressedImageContainer(OrthancPluginMemoryBuffer& buffer): data_(OrthancContextManager::Get(), buffer) {
 }
 
+CompressedImageContainer::CompressedImageContainer(std::string& content): data_(OrthancContextManager::Get()) {
+  content_.swap(content);
+}
+
 const char* CompressedImageContainer::GetBinary() const {
+  if (data_.getData() == NULL) {
+    return content_.c_str();
+  }
   return reinterpret_cast<const char*>(data_.getData());
 }
 uint32_t CompressedImageContainer::GetBinarySize() const {
+  if (data_.getData() == NULL) {
+    return static_cast<uint32_t>(content_.size());
+  }
   return data_.getSize();
 }
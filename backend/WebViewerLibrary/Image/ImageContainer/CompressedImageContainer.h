@@ -1,5 +1,6 @@
 #pragma once
 
+#include <string>
 #include <orthanc/OrthancCPlugin.h> // for OrthancPluginMemoryBuffer
 #include "IImageContainer.h"
 #include "../Utilities/ScopedBuffers.h"
@@ -9,12 +10,15 @@ class CompressedImageContainer : public IImageContainer {
 public:
   // takes ownership
   CompressedImageContainer(OrthancPluginMemoryBuffer& buffer);
+  // takes the content (swapped, no copy)
+  CompressedImageContainer(std::string& content);
   virtual ~CompressedImageContainer() {}
 
   virtual const char* GetBinary() const;
   virtual uint32_t GetBinarySize() const;
 
 private:
-  ScopedOrthancPluginMemoryBuffer data_;
+  ScopedOrthancPluginMemoryBuffer data_;     // empty when the content is stored in content_
+  std::string content_;
 };
 
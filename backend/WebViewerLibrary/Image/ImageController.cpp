@@ -218,7 +218,7 @@ int ImageController::_ProcessRequest()
       if (cacheContext_ != NULL)  //if there is a cache enabled
       {
         std::string content;
-        if (cacheContext_->GetScheduler().Access(content, CacheBundle_DecodedImage, this->urlPostfix_))
+        if (cacheContext_->GetScheduler().Access(content, CacheBundle_DecodedImage, this->urlPostfix_, this->_GetClientKey()))
         {
           BENCH(REQUEST_ANSWERING);
 
@@ -381,6 +381,76 @@ void ImageControllerCacheFactory::Invalidate(const std::string& item)
   this->imageRepository_->invalidateInstance(item);
 }
 
+std::string ImageControllerCacheFactory::GetPrefetchGroup(const std::string& uri)
+{
+  size_t instanceEnd = uri.find('/');
+  if (instanceEnd == std::string::npos) {
+    return uri;
+  }
+
+  size_t frameEnd = uri.find('/', instanceEnd + 1);
+  if (frameEnd == std::string::npos) {
+    return uri;
+  }
+
+  return uri.substr(0, frameEnd);
+}
+
+void ImageControllerCacheFactory::CreateMany(std::map<std::string, std::string>& contents,
+                                             const std::vector<std::string>& uris)
+{
+  std::string groupInstanceId;
+  std::map<uint32_t, std::vector<size_t> > frames;  // the uris of each frame
+  boost::ptr_vector<IImageProcessingPolicy> policies;
+
+  for (size_t i = 0; i < uris.size(); i++)
+  {
+    std::string instanceId;
+    uint32_t frameIndex;
+    std::auto_ptr<IImageProcessingPolicy> processingPolicy;
+
+    if (!ImageControllerUrlParser::parseUrlPostfix(uris[i], instanceId, frameIndex, processingPolicy) ||
+        (!policies.empty() && instanceId != groupInstanceId))
+    {
+      // not a set of frames of the same instance: create the images one by one
+      OrthancPlugins::ICacheFactory::CreateMany(contents, uris);
+      return;
+    }
+
+    groupInstanceId = instanceId;
+    frames[frameIndex].push_back(i);
+    policies.push_back(processingPolicy.release());
+  }
+
+  // the qualities of the same frame are consecutive
+  std::vector<size_t> order;
+  std::vector<uint32_t> frameIndexes;
+  std::vector<IImageProcessingPolicy*> policiesPtr;
+  for (std::map<uint32_t, std::vector<size_t> >::const_iterator frame = frames.begin(); frame != frames.end(); ++frame)
+  {
+    BOOST_FOREACH(size_t i, frame->second)
+    {
+      order.push_back(i);
+      frameIndexes.push_back(frame->first);
+      policiesPtr.push_back(&policies[i]);
+    }
+  }
+
+  // retrieve processed images (the dicom file is loaded once and each frame is decoded once)
+  boost::ptr_vector<boost::nullable<Image> > images;
+  imageRepository_->GetImages(images, groupInstanceId, frameIndexes, policiesPtr);
+
+  //transform the images to strings that can be stored in cache (the frames
+  //that could not be produced are missing from "contents")
+  for (size_t i = 0; i < order.size(); i++)
+  {
+    if (!images.is_null(i))
+    {
+      contents[uris[order[i]]] = std::string(images[i].GetBinary(), images[i].GetBinarySize());
+    }
+  }
+}
+
 std::auto_ptr<ImageProcessingRouteParser> ImageControllerUrlParser::imageProcessingRouteParser_;
 
 void ImageControllerUrlParser::init()
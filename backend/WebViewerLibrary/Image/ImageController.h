@@ -71,6 +71,15 @@ public:
 
   virtual void Invalidate(const std::string& item);
 
+  // All the qualities of a frame belong to the same group: <instance_id>/<frame_index>
+  virtual std::string GetPrefetchGroup(const std::string& uri);
+
+  // Decodes each frame only once to produce all the requested qualities,
+  // and loads the dicom file once when several frames of the instance are
+  // requested (see CacheScheduler::Precompute())
+  virtual void CreateMany(std::map<std::string, std::string>& contents,
+                          const std::vector<std::string>& uris);
+
 };
 
 #endif // IMAGE_ROUTE_H
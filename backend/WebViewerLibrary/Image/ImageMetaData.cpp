@@ -9,9 +9,9 @@
 
 #include "../BenchmarkHelper.h"
 #include <Toolbox.h> // for TokenizeString && StripSpaces
-#include <Images/ImageProcessing.h> // for GetMinMaxValue
 #include <OrthancException.h> // for throws
 #include "ViewerToolbox.h"
+#include "Utilities/PixelKernels.h" // for GetMinMaxIntegerValue
 
 namespace
 {
@@ -64,7 +64,7 @@ ImageMetaData::ImageMetaData(RawImageContainer* rawImage, const Json::Value& dic
       int64_t a, b;
 
       // @todo don't process when tag is available
-      ImageProcessing::GetMinMaxIntegerValue(a, b, *accessor);
+      PixelKernels::GetMinMaxIntegerValue(a, b, *accessor);
       minPixelValue = (a < 0 ? static_cast<int32_t>(a) : 0);
       maxPixelValue = (b > 0 ? static_cast<int32_t>(b) : 1);
       break;
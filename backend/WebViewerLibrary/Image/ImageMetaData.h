@@ -11,7 +11,7 @@
 /** ImageMetaData [@Entity]
  * 
  */
-struct ImageMetaData : public boost::noncopyable {
+struct ImageMetaData {
   ImageMetaData();
 
   // @todo const RawImageContainer
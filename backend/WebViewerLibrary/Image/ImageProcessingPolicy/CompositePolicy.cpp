@@ -27,6 +27,22 @@ std::auto_ptr<IImageContainer> CompositePolicy::Apply(std::auto_ptr<IImageContai
   return output;
 }
 
+unsigned int CompositePolicy::GetMaxOutputSize() const
+{
+  unsigned int maxOutputSize = 0;
+
+  BOOST_FOREACH(IImageProcessingPolicy* policy, policyChain_)
+  {
+    unsigned int policyMaxOutputSize = policy->GetMaxOutputSize();
+    if (policyMaxOutputSize > 0 && (maxOutputSize == 0 || policyMaxOutputSize < maxOutputSize))
+    {
+      maxOutputSize = policyMaxOutputSize;
+    }
+  }
+
+  return maxOutputSize;
+}
+
 void CompositePolicy::AddPolicy(IImageProcessingPolicy* policy)
 {
   policyChain_.push_back(policy);
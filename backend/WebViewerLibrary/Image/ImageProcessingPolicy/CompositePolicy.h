@@ -25,6 +25,9 @@ public:
     std::transform(policyChain_.begin(), policyChain_.end(), policyStrChain.begin(), &CompositePolicy::ConvertPolicyToString);
     return boost::algorithm::join(policyStrChain, "~");
   }
+
+  // smallest output size of the chained policies
+  virtual unsigned int GetMaxOutputSize() const;
 public:
   std::vector<IImageProcessingPolicy*> policyChain_;
   static inline std::string ConvertPolicyToString(IImageProcessingPolicy* policy) { return policy->ToString(); }
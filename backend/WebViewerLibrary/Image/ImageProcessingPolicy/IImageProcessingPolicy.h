@@ -12,6 +12,14 @@ public:
 
   // to create a generic route based on composed policies
   virtual std::string ToString() const = 0;
+
+  // Largest width/height of the output image when the policy downscales the
+  // image, 0 otherwise. Allows the frame to be decoded at a reduced
+  // resolution (as long as it stays larger than this size).
+  virtual unsigned int GetMaxOutputSize() const
+  {
+    return 0;
+  }
 };
 
 #endif // I_IMAGE_PROCESSING_POLICY_H
@@ -19,6 +19,11 @@ public:
     return "low-quality";
   }
 
+  virtual unsigned int GetMaxOutputSize() const
+  {
+    return resampleAndJpegPolicy_.GetMaxOutputSize();
+  }
+
 private:
   CompositePolicy resampleAndJpegPolicy_;
 };
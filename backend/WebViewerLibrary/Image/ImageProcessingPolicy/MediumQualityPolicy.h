@@ -20,6 +20,11 @@ public:
     return "medium-quality";
   }
 
+  virtual unsigned int GetMaxOutputSize() const
+  {
+    return resampleAndJpegPolicy_.GetMaxOutputSize();
+  }
+
 private:
   CompositePolicy resampleAndJpegPolicy_;
 };
@@ -1,10 +1,10 @@
 #include "Monochrome1InversionPolicy.h"
 
-#include <Images/ImageProcessing.h>
 #include <OrthancException.h>
 
 #include "../../Logging.h"
 #include "../../BenchmarkHelper.h"
+#include "../Utilities/PixelKernels.h"
 
 Monochrome1InversionPolicy::Monochrome1InversionPolicy()
 {
@@ -31,7 +31,7 @@ std::auto_ptr<IImageContainer> Monochrome1InversionPolicy::Apply(std::auto_ptr<I
     Orthanc::ImageAccessor* accessor = inRawImage->GetOrthancImageAccessor();
 
     // This throws `ErrorCode_NotImplemented` if the image is not in 8bit !
-    Orthanc::ImageProcessing::Invert(*accessor);
+    PixelKernels::Invert(*accessor);
   }
 
   return input;
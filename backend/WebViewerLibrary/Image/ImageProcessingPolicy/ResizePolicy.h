@@ -19,6 +19,11 @@ public:
 
   virtual std::string ToString() const;
 
+  virtual unsigned int GetMaxOutputSize() const
+  {
+    return maxWidthHeight_;
+  }
+
 private:
   unsigned int maxWidthHeight_;
 };
\ No newline at end of file
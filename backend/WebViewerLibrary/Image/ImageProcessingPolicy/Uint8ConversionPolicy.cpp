@@ -8,8 +8,7 @@
 #include "../../BenchmarkHelper.h"
 
 #include "../ImageContainer/RawImageContainer.h"
-
-#include <cmath> // for std::floor
+#include "../Utilities/PixelKernels.h"
 
 namespace {
   template <typename TargetType, typename SourceType>
@@ -95,34 +94,7 @@ namespace {
     float scale = static_cast<float>(target2 - target1) / static_cast<float>(source2 - source1);
     float offset = static_cast<float>(target1) - scale * static_cast<float>(source1);
 
-    const float minValue = static_cast<float>(std::numeric_limits<TargetType>::min());
-    const float maxValue = static_cast<float>(std::numeric_limits<TargetType>::max());
-
-    for (unsigned int y = 0; y < source.GetHeight(); y++)
-    {
-      const SourceType* p = reinterpret_cast<const SourceType*>(source.GetConstRow(y));
-      TargetType* q = reinterpret_cast<TargetType*>(target.GetRow(y));
-
-      for (unsigned int x = 0; x < source.GetWidth(); x++, p++, q++)
-      {
-        float v = (scale * static_cast<float>(*p)) + offset;
-
-        if (v > maxValue)
-        {
-          *q = std::numeric_limits<TargetType>::max();
-        }
-        else if (v < minValue)
-        {
-          *q = std::numeric_limits<TargetType>::min();
-        }
-        else
-        {
-          //*q = static_cast<TargetType>(boost::math::iround(v));
-          
-          // http://stackoverflow.com/a/485546/881731
-          *q = static_cast<TargetType>(std::floor(v + 0.5f));
-        }
-      }
-    }
+    // vectorized pixel loop (clamps to [0, 255] and rounds like std::floor(v + 0.5f))
+    PixelKernels::ChangeDynamics(target, source, scale, offset);
   }
 }
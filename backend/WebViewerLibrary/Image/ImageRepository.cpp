@@ -1,4 +1,5 @@
 #include <string>
+#include <algorithm> // for std::max
 #include <orthanc/OrthancCPlugin.h>
 #include <json/writer.h>
 #include <boost/lexical_cast.hpp>
@@ -7,6 +8,7 @@
 #include <OrthancException.h> // for throws
 #include <DicomFormat/DicomMap.h>
 #include <Enumerations.h>
+#include <Toolbox.h> // for StripSpaces
 #include "../ViewerToolbox.h" // for OrthancPlugins::get*FromOrthanc && OrthancPluginImage
 #include "../BenchmarkHelper.h" // for BENCH(*)
 #include "../OrthancContextManager.h" // for context_ global
@@ -17,36 +19,15 @@
 #include "ImageContainer/CompressedImageContainer.h" // For orthanc pixeldata retrieval
 #include "ImageProcessingPolicy/PixelDataQualityPolicy.h" // For orthanc pixeldata retrieval
 #include "Utilities/ScopedBuffers.h"
+#include "Utilities/PixelKernels.h"
+#include "Utilities/ScaledJpegDecoder.h"
 #include "ShortTermCache/CacheContext.h"
+#include "ShortTermCache/BackgroundGovernor.h"
 
 namespace
 {
   void _loadDicomTags(Json::Value& jsonOutput, const std::string& instanceId);
   std::string _getAttachmentNumber(int frameIndex, const IImageProcessingPolicy* policy);
-  void ConvertRGB48ToRGB24(Orthanc::ImageAccessor& target,
-                           const Orthanc::ImageAccessor& source)
-  {
-    //  if (source.GetWidth() != target.GetWidth() ||
-    //      source.GetHeight() != target.GetHeight())
-    //  {
-    //    throw Orthanc::OrthancException(Orthanc::ErrorCode_IncompatibleImageSize);
-    //  }
-
-    for (unsigned int y = 0; y < source.GetHeight(); y++)
-    {
-      const uint16_t* p = reinterpret_cast<const uint16_t*>(source.GetConstRow(y));
-      uint8_t* q = reinterpret_cast<uint8_t*>(target.GetRow(y));
-
-      for (unsigned int x = 0; x < source.GetWidth(); x++)
-      {
-        q[0] = p[0] >> 8;
-        q[1] = p[1] >> 8;
-        q[2] = p[2] >> 8;
-        p += 3;
-        q += 3;
-      }
-    }
-  }
 }
 
 ImageRepository::ImageRepository(DicomRepository* dicomRepository, CacheContext* cache)
@@ -121,119 +102,347 @@ std::auto_ptr<Image> ImageRepository::_LoadImageFromOrthanc(const std::string& i
   // Load already compressed instance frame (if the policy type is PixelDataQuality, because it's faster
   // then loading the dicom file & checking the transferSyntax tag)
   if (dynamic_cast<PixelDataQualityPolicy*>(policy) != NULL) {
-    BENCH(GET_FRAME_FROM_DICOM__RAW_TOTAL);
-    //boost::lock_guard<boost::mutex> guard(mutex_); // check what happens if only one thread asks for frame at a time
+    image = _LoadPixelDataFromOrthanc(instanceId, frameIndex, dicomTags);
+  }
+  // Load bitmap orthanc instance frame
+  else {
+    image = _DecodeFrameFromOrthanc(instanceId, frameIndex, dicomTags, policy != NULL ? policy->GetMaxOutputSize() : 0);
+  }
 
-    // Retrieve dicom header tags (for transferSyntax which determine PixelData format)
-    //   Get instance's dicom file
-    OrthancPluginMemoryBuffer dicom; // no need to free - memory managed by dicomRepository
-    {
-      BENCH(GET_FRAME_FROM_DICOM__RAW_GET_DICOM_FILE);
-      _dicomRepository->getDicomFile(instanceId, dicom);
+  if (policy != NULL) {
+    image->ApplyProcessing(policy);
+  }
+
+  return image;
+}
+
+void ImageRepository::GetImages(boost::ptr_vector<Image>& images, const std::string& instanceId, uint32_t frameIndex, const std::vector<IImageProcessingPolicy*>& policies) const
+{
+  BENCH_LOG(IMAGES_FORMATING, policies.size());
+
+  images.clear();
+
+  // Load dicom tags (once for all policies)
+  Json::Value dicomTags;
+  _loadDicomTags(dicomTags, instanceId);
+
+  _GetFrameImages(images, instanceId, frameIndex, dicomTags, policies);
+}
+
+void ImageRepository::GetImages(boost::ptr_vector<boost::nullable<Image> >& images, const std::string& instanceId, const std::vector<uint32_t>& frameIndexes, const std::vector<IImageProcessingPolicy*>& policies) const
+{
+  assert(frameIndexes.size() == policies.size());
+  BENCH_LOG(FRAMES_FORMATING, policies.size());
+
+  images.clear();
+
+  // Load dicom tags (once for all frames)
+  Json::Value dicomTags;
+  _loadDicomTags(dicomTags, instanceId);
+
+  // Keep the dicom file loaded while walking its frames (the frames are
+  // decoded from the same buffer instead of getting the file for each frame)
+  OrthancPluginMemoryBuffer dicom; // no need to free - memory managed by dicomRepository
+  _dicomRepository->getDicomFile(instanceId, dicom);
+  DicomRepository::ScopedDecref autoDecref(_dicomRepository, instanceId, dicom);
+
+  size_t first = 0;
+  while (first < policies.size()) {
+    // the policies of the same frame are consecutive
+    size_t end = first + 1;
+    while (end < policies.size() && frameIndexes[end] == frameIndexes[first]) {
+      end++;
     }
-    //   Clean dicom file (at scope end)
-    DicomRepository::ScopedDecref autoDecref(_dicomRepository, instanceId);
 
-    //   Get instance's tags (the DICOM meta-informations)
-    Orthanc::DicomMap headerTags;
-    {
-      BENCH(GET_FRAME_FROM_DICOM__RAW_PARSE_DICOM_FILE);
-      if (!Orthanc::DicomMap::ParseDicomMetaInformation(headerTags, reinterpret_cast<const char*>(dicom.data), dicom.size))
-      {
-        throw Orthanc::OrthancException(static_cast<Orthanc::ErrorCode>(OrthancPluginErrorCode_CorruptedFile));
+    std::vector<IImageProcessingPolicy*> framePolicies(policies.begin() + first, policies.begin() + end);
+    boost::ptr_vector<Image> frameImages;
+    try {
+      _GetFrameImages(frameImages, instanceId, frameIndexes[first], dicomTags, framePolicies);
+    }
+    catch (Orthanc::OrthancException& e) {
+      // a corrupted frame does not prevent the other frames from being produced
+      OrthancPluginLogWarning(OrthancContextManager::Get(), ("Cannot produce frame " + boost::lexical_cast<std::string>(frameIndexes[first]) + " of instance " + instanceId + ": " + e.What()).c_str());
+      frameImages.clear();
+    }
+
+    if (frameImages.empty()) {
+      for (size_t i = first; i < end; i++) {
+        images.push_back(NULL);
+      }
+    }
+    else {
+      while (!frameImages.empty()) {
+        images.push_back(frameImages.release(frameImages.begin()).release());
       }
     }
 
-    // Retrieve the frame as Raw PixelData
-    OrthancPluginMemoryBuffer frame;
-    std::string url = "/instances/" + instanceId + "/frames/" + boost::lexical_cast<std::string>(frameIndex) + "/raw";
-    OrthancPluginErrorCode error = OrthancPluginRestApiGetAfterPlugins(OrthancContextManager::Get(), &frame, url.c_str());
+    first = end;
+
+    // a precompute job lets the viewers go first between two frames
+    OrthancPlugins::BackgroundGovernor::YieldToInteractive();
+  }
+}
+
+void ImageRepository::_GetFrameImages(boost::ptr_vector<Image>& images, const std::string& instanceId, uint32_t frameIndex, const Json::Value& dicomTags, const std::vector<IImageProcessingPolicy*>& policies) const
+{
+  // The last policy that needs decoded pixels can use the decoded image
+  // itself; the other ones work on a copy
+  size_t lastDecodingPolicy = policies.size();
+  // The frame is decoded at a reduced resolution only if all these policies
+  // downscale it (a single full resolution decode is cheaper than two decodes)
+  unsigned int maxWidthHeight = 0;
+  bool fullResolution = false;
+  for (size_t i = 0; i < policies.size(); i++) {
+    if (dynamic_cast<PixelDataQualityPolicy*>(policies[i]) == NULL) {
+      lastDecodingPolicy = i;
+
+      unsigned int maxOutputSize = policies[i]->GetMaxOutputSize();
+      fullResolution |= (maxOutputSize == 0);
+      maxWidthHeight = std::max(maxWidthHeight, maxOutputSize);
+    }
+  }
+  if (fullResolution) {
+    maxWidthHeight = 0;
+  }
 
-    // Throw exception on error
-    if (error != OrthancPluginErrorCode_Success) {
-      throw Orthanc::OrthancException(static_cast<Orthanc::ErrorCode>(error));
+  std::auto_ptr<Image> decodedImage;
+  for (size_t i = 0; i < policies.size(); i++) {
+    assert(policies[i] != NULL);
+    std::auto_ptr<Image> image;
+
+    if (dynamic_cast<PixelDataQualityPolicy*>(policies[i]) != NULL) {
+      image = _LoadPixelDataFromOrthanc(instanceId, frameIndex, dicomTags);
+    }
+    else {
+      // Decode the frame only once
+      if (decodedImage.get() == NULL) {
+        decodedImage = _DecodeFrameFromOrthanc(instanceId, frameIndex, dicomTags, maxWidthHeight);
+      }
+
+      if (i == lastDecodingPolicy) {
+        image = decodedImage;
+      }
+      else {
+        image = decodedImage->CloneRaw();
+      }
     }
 
-    // Store the frame inside
-    std::auto_ptr<IImageContainer> data(new CompressedImageContainer(frame));
- 
-    image.reset(new Image(instanceId, frameIndex, data, headerTags, dicomTags));
+    image->ApplyProcessing(policies[i]);
+    images.push_back(image.release());
   }
-  // Load bitmap orthanc instance frame
-  else {
-    BENCH(GET_FRAME_FROM_DICOM_TOTAL);
+}
 
-    //boost::lock_guard<boost::mutex> guard(mutex_); // check what happens if only one thread asks for frame at a time
+std::auto_ptr<Image> ImageRepository::_LoadPixelDataFromOrthanc(const std::string& instanceId, uint32_t frameIndex, const Json::Value& dicomTags) const
+{
+  BENCH(GET_FRAME_FROM_DICOM__RAW_TOTAL);
+  //boost::lock_guard<boost::mutex> guard(mutex_); // check what happens if only one thread asks for frame at a time
 
-    // Retrieve dicom file
-    OrthancPluginMemoryBuffer dicom;
+  // Fast path: the PixelData of the frame is located thanks to the frame offset index of the instance
+  {
+    std::string frame, transferSyntax;
+    bool found;
     {
-      BENCH(GET_FRAME_FROM_DICOM__GET_DICOM_FILE);
-      _dicomRepository->getDicomFile(instanceId, dicom);
+      BENCH(GET_FRAME_FROM_DICOM__RAW_GET_INDEXED_FRAME);
+      found = _dicomRepository->getDicomFrame(frame, transferSyntax, instanceId, frameIndex);
     }
-    // @note dicom tags could be gathered from DICOM instance in this case
 
-    OrthancPluginImage* frame = NULL;
+    if (found)
     {
-      BENCH(GET_FRAME_FROM_DICOM__DECODE_DICOM_IMAGE);
-      // Retrieve frame from dicom file
-       frame = OrthancPluginDecodeDicomImage(OrthancContextManager::Get(),
-                                                                reinterpret_cast<const void*>(dicom.data), dicom.size, frameIndex);
-    }
-    // Clean dicom file (at scope end)
-    DicomRepository::ScopedDecref autoDecref(_dicomRepository, instanceId);
+      Orthanc::DicomMap headerTags;
+      headerTags.SetValue(0x0002, 0x0010, transferSyntax, false);
 
-    // Throw exception if frame couldn't be decoded
-    if (frame == NULL) {
-      throw Orthanc::OrthancException(static_cast<Orthanc::ErrorCode>(OrthancPluginErrorCode_IncompatibleImageFormat));
+      std::auto_ptr<IImageContainer> data(new CompressedImageContainer(frame));
+      return std::auto_ptr<Image>(new Image(instanceId, frameIndex, data, headerTags, dicomTags));
     }
+  }
 
-    {// Store the frame inside a container
-      OrthancPluginPixelFormat pixelFormat = OrthancPluginGetImagePixelFormat(OrthancContextManager::Get(), frame);
+  // Retrieve dicom header tags (for transferSyntax which determine PixelData format)
+  //   Get instance's dicom file
+  OrthancPluginMemoryBuffer dicom; // no need to free - memory managed by dicomRepository
+  {
+    BENCH(GET_FRAME_FROM_DICOM__RAW_GET_DICOM_FILE);
+    _dicomRepository->getDicomFile(instanceId, dicom);
+  }
+  //   Clean dicom file (at scope end)
+  DicomRepository::ScopedDecref autoDecref(_dicomRepository, instanceId, dicom);
 
-      // if the image is RGB48, convert it to RGB24 asap
-      if (pixelFormat == OrthancPluginPixelFormat_RGB48) {
-        Orthanc::ImageAccessor sourceRgb48;
-        Orthanc::ImageAccessor destRgb24;
+  //   Get instance's tags (the DICOM meta-informations)
+  Orthanc::DicomMap headerTags;
+  {
+    BENCH(GET_FRAME_FROM_DICOM__RAW_PARSE_DICOM_FILE);
+    if (!Orthanc::DicomMap::ParseDicomMetaInformation(headerTags, reinterpret_cast<const char*>(dicom.data), dicom.size))
+    {
+      throw Orthanc::OrthancException(static_cast<Orthanc::ErrorCode>(OrthancPluginErrorCode_CorruptedFile));
+    }
+  }
 
-        unsigned int width = OrthancPluginGetImageWidth(OrthancContextManager::Get(), frame);
-        unsigned int height = OrthancPluginGetImageHeight(OrthancContextManager::Get(), frame);
+  // Retrieve the frame as Raw PixelData
+  OrthancPluginMemoryBuffer frame;
+  std::string url = "/instances/" + instanceId + "/frames/" + boost::lexical_cast<std::string>(frameIndex) + "/raw";
+  OrthancPluginErrorCode error = OrthancPluginRestApiGetAfterPlugins(OrthancContextManager::Get(), &frame, url.c_str());
 
-        sourceRgb48.AssignReadOnly(Orthanc::PixelFormat_RGB48,
-                                   width,
-                                   height,
-                                   OrthancPluginGetImagePitch(OrthancContextManager::Get(), frame),
-                                   OrthancPluginGetImageBuffer(OrthancContextManager::Get(), frame)
-                                   );
+  // Throw exception on error
+  if (error != OrthancPluginErrorCode_Success) {
+    throw Orthanc::OrthancException(static_cast<Orthanc::ErrorCode>(error));
+  }
 
-        Orthanc::ImageBuffer* destBuffer = new Orthanc::ImageBuffer(Orthanc::PixelFormat_RGB24,
-                                                                    width,
-                                                                    height,
-                                                                    false);
+  // Store the frame inside
+  std::auto_ptr<IImageContainer> data(new CompressedImageContainer(frame));
 
-        destBuffer->GetWriteableAccessor(destRgb24);
-        ConvertRGB48ToRGB24(destRgb24, sourceRgb48);
+  return std::auto_ptr<Image>(new Image(instanceId, frameIndex, data, headerTags, dicomTags));
+}
 
-        std::auto_ptr<RawImageContainer> data(new RawImageContainer(destBuffer));
+std::auto_ptr<Image> ImageRepository::_DecodeFrameFromOrthanc(const std::string& instanceId, uint32_t frameIndex, const Json::Value& dicomTags, unsigned int maxWidthHeight) const
+{
+  BENCH(GET_FRAME_FROM_DICOM_TOTAL);
+  std::auto_ptr<Image> image;
 
-        image.reset(new Image(instanceId, frameIndex, data, dicomTags));
-      }
-      else
-      {
-        std::auto_ptr<RawImageContainer> data(new RawImageContainer(frame));
+  //boost::lock_guard<boost::mutex> guard(mutex_); // check what happens if only one thread asks for frame at a time
 
-        image.reset(new Image(instanceId, frameIndex, data, dicomTags));
-      }
+  // Retrieve dicom file
+  OrthancPluginMemoryBuffer dicom;
+  {
+    BENCH(GET_FRAME_FROM_DICOM__GET_DICOM_FILE);
+    _dicomRepository->getDicomFile(instanceId, dicom);
+  }
+  // Clean dicom file (at scope end)
+  DicomRepository::ScopedDecref autoDecref(_dicomRepository, instanceId, dicom);
+  // @note dicom tags could be gathered from DICOM instance in this case
+
+  // Downscaled output: decode only the required resolution when the codec allows it
+  if (maxWidthHeight > 0) {
+    image = _DecodeReducedFrameFromOrthanc(instanceId, frameIndex, dicomTags, dicom, maxWidthHeight);
+    if (image.get() != NULL) {
+      return image;
     }
   }
 
-  if (policy != NULL) {
-    image->ApplyProcessing(policy);
+  OrthancPluginImage* frame = NULL;
+  {
+    BENCH(GET_FRAME_FROM_DICOM__DECODE_DICOM_IMAGE);
+    // Retrieve frame from dicom file
+     frame = OrthancPluginDecodeDicomImage(OrthancContextManager::Get(),
+                                                              reinterpret_cast<const void*>(dicom.data), dicom.size, frameIndex);
+  }
+
+  // Throw exception if frame couldn't be decoded
+  if (frame == NULL) {
+    throw Orthanc::OrthancException(static_cast<Orthanc::ErrorCode>(OrthancPluginErrorCode_IncompatibleImageFormat));
+  }
+
+  {// Store the frame inside a container
+    OrthancPluginPixelFormat pixelFormat = OrthancPluginGetImagePixelFormat(OrthancContextManager::Get(), frame);
+
+    // if the image is RGB48, convert it to RGB24 asap
+    if (pixelFormat == OrthancPluginPixelFormat_RGB48) {
+      Orthanc::ImageAccessor sourceRgb48;
+      Orthanc::ImageAccessor destRgb24;
+
+      unsigned int width = OrthancPluginGetImageWidth(OrthancContextManager::Get(), frame);
+      unsigned int height = OrthancPluginGetImageHeight(OrthancContextManager::Get(), frame);
+
+      sourceRgb48.AssignReadOnly(Orthanc::PixelFormat_RGB48,
+                                 width,
+                                 height,
+                                 OrthancPluginGetImagePitch(OrthancContextManager::Get(), frame),
+                                 OrthancPluginGetImageBuffer(OrthancContextManager::Get(), frame)
+                                 );
+
+      Orthanc::ImageBuffer* destBuffer = new Orthanc::ImageBuffer(Orthanc::PixelFormat_RGB24,
+                                                                  width,
+                                                                  height,
+                                                                  false);
+
+      destBuffer->GetWriteableAccessor(destRgb24);
+      PixelKernels::ConvertRGB48ToRGB24(destRgb24, sourceRgb48);
+
+      std::auto_ptr<RawImageContainer> data(new RawImageContainer(destBuffer));
+
+      image.reset(new Image(instanceId, frameIndex, data, dicomTags));
+    }
+    else
+    {
+      std::auto_ptr<RawImageContainer> data(new RawImageContainer(frame));
+
+      image.reset(new Image(instanceId, frameIndex, data, dicomTags));
+    }
   }
 
   return image;
 }
 
+std::auto_ptr<Image> ImageRepository::_DecodeReducedFrameFromOrthanc(const std::string& instanceId, uint32_t frameIndex, const Json::Value& dicomTags, const OrthancPluginMemoryBuffer& dicom, unsigned int maxWidthHeight) const
+{
+  // Neither the Orthanc SDK nor the GDCM decode callback accept a target size,
+  // so the frames whose codec supports a reduced resolution decode are
+  // decoded here, from their compressed PixelData. Only baseline JPEG is
+  // supported (DCT scaling); other transfer syntaxes use the regular decoder.
+  std::string transferSyntax;
+  {
+    Orthanc::DicomMap headerTags;
+    if (!Orthanc::DicomMap::ParseDicomMetaInformation(headerTags, reinterpret_cast<const char*>(dicom.data), dicom.size))
+    {
+      return std::auto_ptr<Image>(NULL);
+    }
+
+    const Orthanc::DicomValue* tag = headerTags.TestAndGetValue(0x0002, 0x0010);
+    if (tag == NULL || tag->IsNull() || tag->IsBinary())
+    {
+      return std::auto_ptr<Image>(NULL);
+    }
+    transferSyntax = Orthanc::Toolbox::StripSpaces(tag->GetContent());
+  }
+
+  if (transferSyntax != "1.2.840.10008.1.2.4.50" && // JPEG baseline (process 1)
+      transferSyntax != "1.2.840.10008.1.2.4.51")   // JPEG extended (process 2 & 4), 8bit only
+  {
+    return std::auto_ptr<Image>(NULL);
+  }
+
+  BENCH(GET_FRAME_FROM_DICOM__DECODE_REDUCED_DICOM_IMAGE);
+
+  // Retrieve the compressed frame: from the DICOM file thanks to the frame
+  // offset index of the instance, or from Orthanc if there is no index (in
+  // which case Orthanc parses the whole file again)
+  std::string indexedFrame, indexedTransferSyntax;
+  ScopedOrthancPluginMemoryBuffer frame(OrthancContextManager::Get());
+  const void* compressed = NULL;
+  size_t compressedSize = 0;
+
+  if (_dicomRepository->getDicomFrame(indexedFrame, indexedTransferSyntax, instanceId, frameIndex)) {
+    compressed = indexedFrame.empty() ? NULL : indexedFrame.c_str();
+    compressedSize = indexedFrame.size();
+  }
+  else {
+    std::string url = "/instances/" + instanceId + "/frames/" + boost::lexical_cast<std::string>(frameIndex) + "/raw";
+    if (OrthancPluginRestApiGetAfterPlugins(OrthancContextManager::Get(), frame.getPtr(), url.c_str()) != OrthancPluginErrorCode_Success) {
+      return std::auto_ptr<Image>(NULL);
+    }
+
+    compressed = frame.getData();
+    compressedSize = frame.getSize();
+  }
+
+  std::auto_ptr<Orthanc::ImageBuffer> pixels;
+  try
+  {
+    pixels = ScaledJpegDecoder::Decode(compressed, compressedSize, maxWidthHeight);
+  }
+  catch (Orthanc::OrthancException&)
+  {
+    // stream not supported by libjpeg, let the regular decoder handle it
+    OrthancPluginLogInfo(OrthancContextManager::Get(), ("Cannot decode frame at a reduced resolution: " + instanceId).c_str());
+    return std::auto_ptr<Image>(NULL);
+  }
+
+  if (pixels.get() == NULL) {
+    return std::auto_ptr<Image>(NULL);
+  }
+
+  std::auto_ptr<RawImageContainer> data(new RawImageContainer(pixels.release()));
+  return std::auto_ptr<Image>(new Image(instanceId, frameIndex, data, dicomTags));
+}
+
 std::auto_ptr<Image> ImageRepository::_GetProcessedImageFromCache(const std::string &attachmentNumber, const std::string& instanceId, uint32_t frameIndex) const {
   // if not found - create
   // if found - retrieve
@@ -2,7 +2,9 @@
 #define IMAGE_REPOSITORY_H
 
 #include <string>
+#include <vector>
 #include <boost/thread/mutex.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
 #include <orthanc/OrthancCPlugin.h>
 
 #include "../Instance/DicomRepository.h"
@@ -25,6 +27,20 @@ public:
 
   // gives memory ownership
   std::auto_ptr<Image> GetImage(const std::string& instanceId, uint32_t frameIndex, IImageProcessingPolicy* policy, bool enableCache) const;
+
+  // gives memory ownership
+  // Produces the image of each policy (`images[i]` is processed by
+  // `policies[i]`) while decoding the frame only once. Does not use the
+  // persistent image cache.
+  void GetImages(boost::ptr_vector<Image>& images, const std::string& instanceId, uint32_t frameIndex, const std::vector<IImageProcessingPolicy*>& policies) const;
+
+  // gives memory ownership
+  // Same as above for several frames of the instance (`images[i]` is the
+  // frame `frameIndexes[i]` processed by `policies[i]`, the policies of the
+  // same frame being consecutive): the dicom file is loaded once for all
+  // the frames and each frame is decoded once. The images of a frame that
+  // cannot be produced are NULL, the other frames are still produced.
+  void GetImages(boost::ptr_vector<boost::nullable<Image> >& images, const std::string& instanceId, const std::vector<uint32_t>& frameIndexes, const std::vector<IImageProcessingPolicy*>& policies) const;
   void CleanImageCache(const std::string& instanceId, uint32_t frameIndex, IImageProcessingPolicy* policy) const;
 
   void invalidateInstance(const std::string& instanceId);
@@ -40,6 +56,10 @@ private:
   mutable boost::mutex mutex_;
 
   std::auto_ptr<Image> _LoadImageFromOrthanc(const std::string& instanceId, uint32_t frameIndex, IImageProcessingPolicy* policy) const; // Factory method
+  void _GetFrameImages(boost::ptr_vector<Image>& images, const std::string& instanceId, uint32_t frameIndex, const Json::Value& dicomTags, const std::vector<IImageProcessingPolicy*>& policies) const; // appends the images of the frame
+  std::auto_ptr<Image> _LoadPixelDataFromOrthanc(const std::string& instanceId, uint32_t frameIndex, const Json::Value& dicomTags) const; // compressed frame, as stored in the dicom file
+  std::auto_ptr<Image> _DecodeFrameFromOrthanc(const std::string& instanceId, uint32_t frameIndex, const Json::Value& dicomTags, unsigned int maxWidthHeight) const; // raw pixels, not processed yet (reduced resolution if maxWidthHeight > 0 and the codec allows it)
+  std::auto_ptr<Image> _DecodeReducedFrameFromOrthanc(const std::string& instanceId, uint32_t frameIndex, const Json::Value& dicomTags, const OrthancPluginMemoryBuffer& dicom, unsigned int maxWidthHeight) const; // Return 0 when the frame can't be decoded at a reduced resolution
   void _CacheProcessedImage(const std::string &attachmentNumber, const Image* image) const;
   std::auto_ptr<Image> _GetProcessedImageFromCache(const std::string &attachmentNumber, const std::string& instanceId, uint32_t frameIndex) const; // Return 0 when no cache found
 };
@@ -0,0 +1,323 @@
+#include "PixelKernels.h"
+#include "PixelKernelsRows.h"
+
+#include <Images/ImageProcessing.h>
+#include <OrthancException.h>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#  define PIXEL_KERNELS_CPUID_MSVC 1
+#  include <intrin.h>
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define PIXEL_KERNELS_CPUID_GCC 1
+#  include <cpuid.h>
+#endif
+
+using namespace PixelKernels;
+using namespace PixelKernels::Internals;
+
+namespace
+{
+  void ChangeDynamicsUint16(uint8_t* target, const uint16_t* source, unsigned int count, float scale, float offset)
+  {
+    ChangeDynamicsRowScalar(target, source, count, scale, offset);
+  }
+
+  void ChangeDynamicsInt16(uint8_t* target, const int16_t* source, unsigned int count, float scale, float offset)
+  {
+    ChangeDynamicsRowScalar(target, source, count, scale, offset);
+  }
+
+  void MinMaxUint8(uint8_t& minValue, uint8_t& maxValue, const uint8_t* source, unsigned int count)
+  {
+    MinMaxRowScalar(minValue, maxValue, source, count);
+  }
+
+  void MinMaxUint16(uint16_t& minValue, uint16_t& maxValue, const uint16_t* source, unsigned int count)
+  {
+    MinMaxRowScalar(minValue, maxValue, source, count);
+  }
+
+  void MinMaxInt16(int16_t& minValue, int16_t& maxValue, const int16_t* source, unsigned int count)
+  {
+    MinMaxRowScalar(minValue, maxValue, source, count);
+  }
+
+  const RowKernels scalarRowKernels =
+  {
+    ChangeDynamicsUint16,
+    ChangeDynamicsInt16,
+    ConvertRGB48ToRGB24RowScalar,
+    MinMaxUint8,
+    MinMaxUint16,
+    MinMaxInt16,
+    InvertRowScalar
+  };
+
+  // registers = eax, ebx, ecx, edx; returns false if the leaf is not available
+  bool Cpuid(unsigned int leaf, unsigned int subleaf, unsigned int registers[4])
+  {
+#if defined(PIXEL_KERNELS_CPUID_MSVC)
+    int info[4];
+    __cpuid(info, 0);
+    if (static_cast<unsigned int>(info[0]) < leaf)
+    {
+      return false;
+    }
+    __cpuidex(info, static_cast<int>(leaf), static_cast<int>(subleaf));
+    for (int i = 0; i < 4; i++)
+    {
+      registers[i] = static_cast<unsigned int>(info[i]);
+    }
+    return true;
+#elif defined(PIXEL_KERNELS_CPUID_GCC)
+    if (__get_cpuid_max(0, NULL) < leaf)
+    {
+      return false;
+    }
+    __cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+    return true;
+#else
+    (void)leaf;
+    (void)subleaf;
+    (void)registers;
+    return false;
+#endif
+  }
+
+  // XCR0: the register states saved by the OS on context switches
+  uint64_t GetXCR0()
+  {
+#if defined(PIXEL_KERNELS_CPUID_MSVC)
+    return _xgetbv(0);
+#elif defined(PIXEL_KERNELS_CPUID_GCC)
+    unsigned int eax, edx;
+    __asm__ __volatile__ ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+    return (static_cast<uint64_t>(edx) << 32) | eax;
+#else
+    return 0;
+#endif
+  }
+
+  bool CpuHasSSE2()
+  {
+    unsigned int registers[4];
+    return Cpuid(1, 0, registers) && (registers[3] & (1u << 26)) != 0;
+  }
+
+  bool CpuHasAVX2()
+  {
+    unsigned int registers[4];
+    if (!Cpuid(1, 0, registers))
+    {
+      return false;
+    }
+
+    const unsigned int osxsave = 1u << 27;
+    const unsigned int avx = 1u << 28;
+    if ((registers[2] & osxsave) == 0 || (registers[2] & avx) == 0)
+    {
+      return false;
+    }
+
+    // the OS must save the SSE & AVX registers
+    if ((GetXCR0() & 0x6) != 0x6)
+    {
+      return false;
+    }
+
+    return Cpuid(7, 0, registers) && (registers[1] & (1u << 5)) != 0;
+  }
+
+  const RowKernels* GetRowKernels(InstructionSet instructionSet)
+  {
+    switch (instructionSet)
+    {
+    case InstructionSet_Scalar:
+      return &GetScalarRowKernels();
+    case InstructionSet_SSE2:
+      return CpuHasSSE2() ? GetSSE2RowKernels() : NULL;
+    case InstructionSet_AVX2:
+      return CpuHasAVX2() ? GetAVX2RowKernels() : NULL;
+    default:
+      return NULL;
+    }
+  }
+
+  InstructionSet instructionSet_ = InstructionSet_Scalar;
+  const RowKernels* rowKernels_ = &scalarRowKernels;
+
+  struct InstructionSetSelector
+  {
+    InstructionSetSelector()
+    {
+      if (IsSupported(InstructionSet_AVX2))
+      {
+        SetInstructionSet(InstructionSet_AVX2);
+      }
+      else if (IsSupported(InstructionSet_SSE2))
+      {
+        SetInstructionSet(InstructionSet_SSE2);
+      }
+    }
+  };
+
+  InstructionSetSelector instructionSetSelector_;
+
+  template <typename PixelType>
+  void GetMinMaxValue(int64_t& minValue,
+                      int64_t& maxValue,
+                      const Orthanc::ImageAccessor& image,
+                      void (*minMaxRow)(PixelType&, PixelType&, const PixelType*, unsigned int))
+  {
+    if (image.GetWidth() == 0 || image.GetHeight() == 0)
+    {
+      minValue = 0;
+      maxValue = 0;
+      return;
+    }
+
+    PixelType currentMin = *reinterpret_cast<const PixelType*>(image.GetConstRow(0));
+    PixelType currentMax = currentMin;
+
+    for (unsigned int y = 0; y < image.GetHeight(); y++)
+    {
+      minMaxRow(currentMin, currentMax, reinterpret_cast<const PixelType*>(image.GetConstRow(y)), image.GetWidth());
+    }
+
+    minValue = currentMin;
+    maxValue = currentMax;
+  }
+}
+
+const RowKernels& PixelKernels::Internals::GetScalarRowKernels()
+{
+  return scalarRowKernels;
+}
+
+bool PixelKernels::IsSupported(InstructionSet instructionSet)
+{
+  return GetRowKernels(instructionSet) != NULL;
+}
+
+InstructionSet PixelKernels::GetInstructionSet()
+{
+  return instructionSet_;
+}
+
+void PixelKernels::SetInstructionSet(InstructionSet instructionSet)
+{
+  const RowKernels* rowKernels = GetRowKernels(instructionSet);
+  if (rowKernels == NULL)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_NotImplemented);
+  }
+
+  instructionSet_ = instructionSet;
+  rowKernels_ = rowKernels;
+}
+
+const char* PixelKernels::ToString(InstructionSet instructionSet)
+{
+  switch (instructionSet)
+  {
+  case InstructionSet_Scalar:
+    return "Scalar";
+  case InstructionSet_SSE2:
+    return "SSE2";
+  case InstructionSet_AVX2:
+    return "AVX2";
+  default:
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+}
+
+void PixelKernels::ChangeDynamics(Orthanc::ImageAccessor& target,
+                                  const Orthanc::ImageAccessor& source,
+                                  float scale,
+                                  float offset)
+{
+  if (target.GetWidth() != source.GetWidth() ||
+      target.GetHeight() != source.GetHeight())
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_IncompatibleImageSize);
+  }
+
+  if (target.GetFormat() != Orthanc::PixelFormat_Grayscale8)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_IncompatibleImageFormat);
+  }
+
+  for (unsigned int y = 0; y < source.GetHeight(); y++)
+  {
+    uint8_t* targetRow = reinterpret_cast<uint8_t*>(target.GetRow(y));
+
+    switch (source.GetFormat())
+    {
+    case Orthanc::PixelFormat_Grayscale16:
+      rowKernels_->changeDynamicsUint16(targetRow, reinterpret_cast<const uint16_t*>(source.GetConstRow(y)), source.GetWidth(), scale, offset);
+      break;
+    case Orthanc::PixelFormat_SignedGrayscale16:
+      rowKernels_->changeDynamicsInt16(targetRow, reinterpret_cast<const int16_t*>(source.GetConstRow(y)), source.GetWidth(), scale, offset);
+      break;
+    default:
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_IncompatibleImageFormat);
+    }
+  }
+}
+
+void PixelKernels::ConvertRGB48ToRGB24(Orthanc::ImageAccessor& target,
+                                       const Orthanc::ImageAccessor& source)
+{
+  if (target.GetWidth() != source.GetWidth() ||
+      target.GetHeight() != source.GetHeight())
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_IncompatibleImageSize);
+  }
+
+  if (source.GetFormat() != Orthanc::PixelFormat_RGB48 ||
+      target.GetFormat() != Orthanc::PixelFormat_RGB24)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_IncompatibleImageFormat);
+  }
+
+  for (unsigned int y = 0; y < source.GetHeight(); y++)
+  {
+    rowKernels_->convertRGB48ToRGB24(reinterpret_cast<uint8_t*>(target.GetRow(y)),
+                                     reinterpret_cast<const uint16_t*>(source.GetConstRow(y)),
+                                     3 * source.GetWidth());
+  }
+}
+
+void PixelKernels::GetMinMaxIntegerValue(int64_t& minValue,
+                                         int64_t& maxValue,
+                                         const Orthanc::ImageAccessor& image)
+{
+  switch (image.GetFormat())
+  {
+  case Orthanc::PixelFormat_Grayscale8:
+    GetMinMaxValue<uint8_t>(minValue, maxValue, image, rowKernels_->minMaxUint8);
+    break;
+  case Orthanc::PixelFormat_Grayscale16:
+    GetMinMaxValue<uint16_t>(minValue, maxValue, image, rowKernels_->minMaxUint16);
+    break;
+  case Orthanc::PixelFormat_SignedGrayscale16:
+    GetMinMaxValue<int16_t>(minValue, maxValue, image, rowKernels_->minMaxInt16);
+    break;
+  default:
+    Orthanc::ImageProcessing::GetMinMaxIntegerValue(minValue, maxValue, image);
+  }
+}
+
+void PixelKernels::Invert(Orthanc::ImageAccessor& image)
+{
+  if (image.GetFormat() != Orthanc::PixelFormat_Grayscale8)
+  {
+    Orthanc::ImageProcessing::Invert(image);
+    return;
+  }
+
+  for (unsigned int y = 0; y < image.GetHeight(); y++)
+  {
+    rowKernels_->invertUint8(reinterpret_cast<uint8_t*>(image.GetRow(y)), image.GetWidth());
+  }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h> // for int64_t
+#include <Images/ImageAccessor.h>
+
+/** PixelKernels
+ *
+ * Pixel loops shared by the image processing policies. Each kernel has a
+ * scalar implementation plus SSE2 and AVX2 ones; the fastest instruction set
+ * supported by the CPU is selected (using CPUID) when the plugin is loaded.
+ * All the implementations produce exactly the same output.
+ *
+ * The images are processed row by row, so any pitch is supported.
+ */
+namespace PixelKernels
+{
+  enum InstructionSet
+  {
+    InstructionSet_Scalar,
+    InstructionSet_SSE2,
+    InstructionSet_AVX2
+  };
+
+  // Whether the instruction set has been compiled in and is supported by the CPU
+  bool IsSupported(InstructionSet instructionSet);
+
+  InstructionSet GetInstructionSet();
+
+  // Override the instruction set selected at startup (for tests & benchmarks).
+  // Not thread-safe: must not be called while images are being processed.
+  // Throws ErrorCode_NotImplemented if the instruction set is not supported.
+  void SetInstructionSet(InstructionSet instructionSet);
+
+  const char* ToString(InstructionSet instructionSet);
+
+  // target = clamp(round(scale * source + offset), 0, 255)
+  // source is Grayscale16 or SignedGrayscale16, target is Grayscale8.
+  void ChangeDynamics(Orthanc::ImageAccessor& target,
+                      const Orthanc::ImageAccessor& source,
+                      float scale,
+                      float offset);
+
+  // Keeps the 8 most significant bits of each channel.
+  void ConvertRGB48ToRGB24(Orthanc::ImageAccessor& target,
+                           const Orthanc::ImageAccessor& source);
+
+  // Same result as Orthanc::ImageProcessing::GetMinMaxIntegerValue (0/0 for
+  // empty images). Grayscale8, Grayscale16 & SignedGrayscale16 are
+  // vectorized; other formats are forwarded to Orthanc.
+  void GetMinMaxIntegerValue(int64_t& minValue,
+                             int64_t& maxValue,
+                             const Orthanc::ImageAccessor& image);
+
+  // Same result as Orthanc::ImageProcessing::Invert. Grayscale8 is
+  // vectorized; other formats are forwarded to Orthanc.
+  void Invert(Orthanc::ImageAccessor& image);
+}
@@ -0,0 +1,190 @@
+#include "PixelKernelsRows.h"
+
+#include <stddef.h> // for NULL
+
+// This file is compiled with AVX2 code generation enabled (see
+// WebViewerLibrary.cmake); its kernels are only called once CPUID has
+// confirmed that the CPU supports AVX2.
+#if defined(__AVX2__)
+#  include <immintrin.h>
+
+namespace
+{
+  // converts 8 int32 values to uint8 (in int32 lanes), exactly like ChangeDynamicsRowScalar
+  inline __m256i ChangeDynamics8(__m256i values, __m256 scale, __m256 offset)
+  {
+    // no FMA: the rounding must be the same as the scalar code
+    __m256 v = _mm256_add_ps(_mm256_mul_ps(scale, _mm256_cvtepi32_ps(values)), offset);
+    v = _mm256_min_ps(_mm256_max_ps(v, _mm256_setzero_ps()), _mm256_set1_ps(255.0f));
+    return _mm256_cvttps_epi32(_mm256_add_ps(v, _mm256_set1_ps(0.5f)));
+  }
+
+  inline void Store16(uint8_t* target, __m256i low, __m256i high)
+  {
+    // packs work within the 128 bits lanes: restore the order of the values
+    __m256i words = _mm256_permute4x64_epi64(_mm256_packs_epi32(low, high), 0xD8);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(target),
+                     _mm_packus_epi16(_mm256_castsi256_si128(words), _mm256_extracti128_si256(words, 1)));
+  }
+
+  void ChangeDynamicsUint16(uint8_t* target, const uint16_t* source, unsigned int count, float scale, float offset)
+  {
+    const __m256 vscale = _mm256_set1_ps(scale);
+    const __m256 voffset = _mm256_set1_ps(offset);
+
+    unsigned int x = 0;
+    for (; x + 16 <= count; x += 16)
+    {
+      __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + x));
+      __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + x + 8));
+      Store16(target + x,
+              ChangeDynamics8(_mm256_cvtepu16_epi32(low), vscale, voffset),
+              ChangeDynamics8(_mm256_cvtepu16_epi32(high), vscale, voffset));
+    }
+
+    ChangeDynamicsRowScalar(target + x, source + x, count - x, scale, offset);
+  }
+
+  void ChangeDynamicsInt16(uint8_t* target, const int16_t* source, unsigned int count, float scale, float offset)
+  {
+    const __m256 vscale = _mm256_set1_ps(scale);
+    const __m256 voffset = _mm256_set1_ps(offset);
+
+    unsigned int x = 0;
+    for (; x + 16 <= count; x += 16)
+    {
+      __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + x));
+      __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + x + 8));
+      Store16(target + x,
+              ChangeDynamics8(_mm256_cvtepi16_epi32(low), vscale, voffset),
+              ChangeDynamics8(_mm256_cvtepi16_epi32(high), vscale, voffset));
+    }
+
+    ChangeDynamicsRowScalar(target + x, source + x, count - x, scale, offset);
+  }
+
+  void ConvertRGB48ToRGB24(uint8_t* target, const uint16_t* source, unsigned int count)
+  {
+    unsigned int x = 0;
+    for (; x + 32 <= count; x += 32)
+    {
+      __m256i low = _mm256_srli_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + x)), 8);
+      __m256i high = _mm256_srli_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + x + 16)), 8);
+      __m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(low, high), 0xD8);
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(target + x), bytes);
+    }
+
+    ConvertRGB48ToRGB24RowScalar(target + x, source + x, count - x);
+  }
+
+  void MinMaxUint8(uint8_t& minValue, uint8_t& maxValue, const uint8_t* source, unsigned int count)
+  {
+    unsigned int x = 0;
+    if (count >= 32)
+    {
+      __m256i vmin = _mm256_set1_epi8(static_cast<char>(minValue));
+      __m256i vmax = _mm256_set1_epi8(static_cast<char>(maxValue));
+      for (; x + 32 <= count; x += 32)
+      {
+        __m256i values = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + x));
+        vmin = _mm256_min_epu8(vmin, values);
+        vmax = _mm256_max_epu8(vmax, values);
+      }
+
+      uint8_t lanes[32];
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), vmin);
+      MinMaxRowScalar(minValue, maxValue, lanes, 32);
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), vmax);
+      MinMaxRowScalar(minValue, maxValue, lanes, 32);
+    }
+
+    MinMaxRowScalar(minValue, maxValue, source + x, count - x);
+  }
+
+  void MinMaxUint16(uint16_t& minValue, uint16_t& maxValue, const uint16_t* source, unsigned int count)
+  {
+    unsigned int x = 0;
+    if (count >= 16)
+    {
+      __m256i vmin = _mm256_set1_epi16(static_cast<short>(minValue));
+      __m256i vmax = _mm256_set1_epi16(static_cast<short>(maxValue));
+      for (; x + 16 <= count; x += 16)
+      {
+        __m256i values = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + x));
+        vmin = _mm256_min_epu16(vmin, values);
+        vmax = _mm256_max_epu16(vmax, values);
+      }
+
+      uint16_t lanes[16];
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), vmin);
+      MinMaxRowScalar(minValue, maxValue, lanes, 16);
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), vmax);
+      MinMaxRowScalar(minValue, maxValue, lanes, 16);
+    }
+
+    MinMaxRowScalar(minValue, maxValue, source + x, count - x);
+  }
+
+  void MinMaxInt16(int16_t& minValue, int16_t& maxValue, const int16_t* source, unsigned int count)
+  {
+    unsigned int x = 0;
+    if (count >= 16)
+    {
+      __m256i vmin = _mm256_set1_epi16(minValue);
+      __m256i vmax = _mm256_set1_epi16(maxValue);
+      for (; x + 16 <= count; x += 16)
+      {
+        __m256i values = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + x));
+        vmin = _mm256_min_epi16(vmin, values);
+        vmax = _mm256_max_epi16(vmax, values);
+      }
+
+      int16_t lanes[16];
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), vmin);
+      MinMaxRowScalar(minValue, maxValue, lanes, 16);
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), vmax);
+      MinMaxRowScalar(minValue, maxValue, lanes, 16);
+    }
+
+    MinMaxRowScalar(minValue, maxValue, source + x, count - x);
+  }
+
+  void InvertUint8(uint8_t* row, unsigned int count)
+  {
+    const __m256i ones = _mm256_set1_epi8(static_cast<char>(0xff));
+
+    unsigned int x = 0;
+    for (; x + 32 <= count; x += 32)
+    {
+      __m256i* p = reinterpret_cast<__m256i*>(row + x);
+      _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), ones));
+    }
+
+    InvertRowScalar(row + x, count - x);
+  }
+
+  const PixelKernels::Internals::RowKernels avx2RowKernels =
+  {
+    ChangeDynamicsUint16,
+    ChangeDynamicsInt16,
+    ConvertRGB48ToRGB24,
+    MinMaxUint8,
+    MinMaxUint16,
+    MinMaxInt16,
+    InvertUint8
+  };
+}
+
+const PixelKernels::Internals::RowKernels* PixelKernels::Internals::GetAVX2RowKernels()
+{
+  return &avx2RowKernels;
+}
+
+#else
+
+const PixelKernels::Internals::RowKernels* PixelKernels::Internals::GetAVX2RowKernels()
+{
+  return NULL;
+}
+
+#endif
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stdint.h>
+
+// Internal header of PixelKernels: row-level kernels of each instruction set.
+//
+// @warning This header is included by PixelKernelsAVX2.cpp, which is
+// compiled with AVX2 code generation enabled. Everything defined here must
+// therefore have internal linkage (unnamed namespace), otherwise the linker
+// could pick the AVX2 build of an inline function for the scalar code path.
+// For the same reason, the SIMD translation units do not use the standard
+// library templates.
+
+namespace PixelKernels
+{
+  namespace Internals
+  {
+    struct RowKernels
+    {
+      void (*changeDynamicsUint16)(uint8_t* target, const uint16_t* source, unsigned int count, float scale, float offset);
+      void (*changeDynamicsInt16)(uint8_t* target, const int16_t* source, unsigned int count, float scale, float offset);
+      void (*convertRGB48ToRGB24)(uint8_t* target, const uint16_t* source, unsigned int count); // count = number of channel values
+      void (*minMaxUint8)(uint8_t& minValue, uint8_t& maxValue, const uint8_t* source, unsigned int count); // updates minValue & maxValue
+      void (*minMaxUint16)(uint16_t& minValue, uint16_t& maxValue, const uint16_t* source, unsigned int count);
+      void (*minMaxInt16)(int16_t& minValue, int16_t& maxValue, const int16_t* source, unsigned int count);
+      void (*invertUint8)(uint8_t* row, unsigned int count);
+    };
+
+    const RowKernels& GetScalarRowKernels();
+    const RowKernels* GetSSE2RowKernels();  // NULL if not built for this platform
+    const RowKernels* GetAVX2RowKernels();  // NULL if not built for this platform
+  }
+}
+
+namespace
+{
+  // Scalar reference implementations, also used by the SIMD kernels to
+  // process the end of the rows.
+
+  template <typename SourceType>
+  inline void ChangeDynamicsRowScalar(uint8_t* target, const SourceType* source, unsigned int count, float scale, float offset)
+  {
+    for (unsigned int x = 0; x < count; x++)
+    {
+      float v = (scale * static_cast<float>(source[x])) + offset;
+
+      if (v > 255.0f)
+      {
+        target[x] = 255;
+      }
+      else if (v < 0.0f)
+      {
+        target[x] = 0;
+      }
+      else
+      {
+        // v + 0.5 is positive: truncation is equivalent to std::floor
+        target[x] = static_cast<uint8_t>(v + 0.5f);
+      }
+    }
+  }
+
+  inline void ConvertRGB48ToRGB24RowScalar(uint8_t* target, const uint16_t* source, unsigned int count)
+  {
+    for (unsigned int x = 0; x < count; x++)
+    {
+      target[x] = static_cast<uint8_t>(source[x] >> 8);
+    }
+  }
+
+  template <typename PixelType>
+  inline void MinMaxRowScalar(PixelType& minValue, PixelType& maxValue, const PixelType* source, unsigned int count)
+  {
+    for (unsigned int x = 0; x < count; x++)
+    {
+      if (source[x] < minValue)
+      {
+        minValue = source[x];
+      }
+      if (source[x] > maxValue)
+      {
+        maxValue = source[x];
+      }
+    }
+  }
+
+  inline void InvertRowScalar(uint8_t* row, unsigned int count)
+  {
+    for (unsigned int x = 0; x < count; x++)
+    {
+      row[x] = 255 - row[x];
+    }
+  }
+}
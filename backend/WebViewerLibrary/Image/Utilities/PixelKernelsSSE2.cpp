@@ -0,0 +1,190 @@
+#include "PixelKernelsRows.h"
+
+#include <stddef.h> // for NULL
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define PIXEL_KERNELS_HAS_SSE2 1
+#  include <emmintrin.h>
+#endif
+
+#if PIXEL_KERNELS_HAS_SSE2 == 1
+
+namespace
+{
+  // converts 4 int32 values to uint8 (in int32 lanes), exactly like ChangeDynamicsRowScalar
+  inline __m128i ChangeDynamics4(__m128i values, __m128 scale, __m128 offset)
+  {
+    __m128 v = _mm_add_ps(_mm_mul_ps(scale, _mm_cvtepi32_ps(values)), offset);
+    v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(255.0f));
+    return _mm_cvttps_epi32(_mm_add_ps(v, _mm_set1_ps(0.5f)));
+  }
+
+  inline void Store8(uint8_t* target, __m128i low, __m128i high)
+  {
+    __m128i words = _mm_packs_epi32(low, high); // values are in [0, 255]
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(target), _mm_packus_epi16(words, words));
+  }
+
+  void ChangeDynamicsUint16(uint8_t* target, const uint16_t* source, unsigned int count, float scale, float offset)
+  {
+    const __m128 vscale = _mm_set1_ps(scale);
+    const __m128 voffset = _mm_set1_ps(offset);
+    const __m128i zero = _mm_setzero_si128();
+
+    unsigned int x = 0;
+    for (; x + 8 <= count; x += 8)
+    {
+      __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + x));
+      Store8(target + x,
+             ChangeDynamics4(_mm_unpacklo_epi16(values, zero), vscale, voffset),
+             ChangeDynamics4(_mm_unpackhi_epi16(values, zero), vscale, voffset));
+    }
+
+    ChangeDynamicsRowScalar(target + x, source + x, count - x, scale, offset);
+  }
+
+  void ChangeDynamicsInt16(uint8_t* target, const int16_t* source, unsigned int count, float scale, float offset)
+  {
+    const __m128 vscale = _mm_set1_ps(scale);
+    const __m128 voffset = _mm_set1_ps(offset);
+
+    unsigned int x = 0;
+    for (; x + 8 <= count; x += 8)
+    {
+      __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + x));
+      // sign extension: move each value to the upper half of an int32 and shift it back
+      Store8(target + x,
+             ChangeDynamics4(_mm_srai_epi32(_mm_unpacklo_epi16(values, values), 16), vscale, voffset),
+             ChangeDynamics4(_mm_srai_epi32(_mm_unpackhi_epi16(values, values), 16), vscale, voffset));
+    }
+
+    ChangeDynamicsRowScalar(target + x, source + x, count - x, scale, offset);
+  }
+
+  void ConvertRGB48ToRGB24(uint8_t* target, const uint16_t* source, unsigned int count)
+  {
+    unsigned int x = 0;
+    for (; x + 16 <= count; x += 16)
+    {
+      __m128i low = _mm_srli_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + x)), 8);
+      __m128i high = _mm_srli_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + x + 8)), 8);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(target + x), _mm_packus_epi16(low, high));
+    }
+
+    ConvertRGB48ToRGB24RowScalar(target + x, source + x, count - x);
+  }
+
+  void MinMaxUint8(uint8_t& minValue, uint8_t& maxValue, const uint8_t* source, unsigned int count)
+  {
+    unsigned int x = 0;
+    if (count >= 16)
+    {
+      __m128i vmin = _mm_set1_epi8(static_cast<char>(minValue));
+      __m128i vmax = _mm_set1_epi8(static_cast<char>(maxValue));
+      for (; x + 16 <= count; x += 16)
+      {
+        __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + x));
+        vmin = _mm_min_epu8(vmin, values);
+        vmax = _mm_max_epu8(vmax, values);
+      }
+
+      uint8_t lanes[16];
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), vmin);
+      MinMaxRowScalar(minValue, maxValue, lanes, 16);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), vmax);
+      MinMaxRowScalar(minValue, maxValue, lanes, 16);
+    }
+
+    MinMaxRowScalar(minValue, maxValue, source + x, count - x);
+  }
+
+  void MinMaxInt16(int16_t& minValue, int16_t& maxValue, const int16_t* source, unsigned int count)
+  {
+    unsigned int x = 0;
+    if (count >= 8)
+    {
+      __m128i vmin = _mm_set1_epi16(minValue);
+      __m128i vmax = _mm_set1_epi16(maxValue);
+      for (; x + 8 <= count; x += 8)
+      {
+        __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + x));
+        vmin = _mm_min_epi16(vmin, values);
+        vmax = _mm_max_epi16(vmax, values);
+      }
+
+      int16_t lanes[8];
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), vmin);
+      MinMaxRowScalar(minValue, maxValue, lanes, 8);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), vmax);
+      MinMaxRowScalar(minValue, maxValue, lanes, 8);
+    }
+
+    MinMaxRowScalar(minValue, maxValue, source + x, count - x);
+  }
+
+  void MinMaxUint16(uint16_t& minValue, uint16_t& maxValue, const uint16_t* source, unsigned int count)
+  {
+    // SSE2 has no unsigned 16 bits min/max: flipping the sign bit maps the
+    // unsigned order to the signed one
+    unsigned int x = 0;
+    if (count >= 8)
+    {
+      const __m128i signBit = _mm_set1_epi16(static_cast<short>(0x8000));
+      __m128i vmin = _mm_xor_si128(_mm_set1_epi16(static_cast<short>(minValue)), signBit);
+      __m128i vmax = _mm_xor_si128(_mm_set1_epi16(static_cast<short>(maxValue)), signBit);
+      for (; x + 8 <= count; x += 8)
+      {
+        __m128i values = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + x)), signBit);
+        vmin = _mm_min_epi16(vmin, values);
+        vmax = _mm_max_epi16(vmax, values);
+      }
+
+      uint16_t lanes[8];
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), _mm_xor_si128(vmin, signBit));
+      MinMaxRowScalar(minValue, maxValue, lanes, 8);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), _mm_xor_si128(vmax, signBit));
+      MinMaxRowScalar(minValue, maxValue, lanes, 8);
+    }
+
+    MinMaxRowScalar(minValue, maxValue, source + x, count - x);
+  }
+
+  void InvertUint8(uint8_t* row, unsigned int count)
+  {
+    const __m128i ones = _mm_set1_epi8(static_cast<char>(0xff));
+
+    unsigned int x = 0;
+    for (; x + 16 <= count; x += 16)
+    {
+      __m128i* p = reinterpret_cast<__m128i*>(row + x);
+      _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), ones));
+    }
+
+    InvertRowScalar(row + x, count - x);
+  }
+
+  const PixelKernels::Internals::RowKernels sse2RowKernels =
+  {
+    ChangeDynamicsUint16,
+    ChangeDynamicsInt16,
+    ConvertRGB48ToRGB24,
+    MinMaxUint8,
+    MinMaxUint16,
+    MinMaxInt16,
+    InvertUint8
+  };
+}
+
+const PixelKernels::Internals::RowKernels* PixelKernels::Internals::GetSSE2RowKernels()
+{
+  return &sse2RowKernels;
+}
+
+#else
+
+const PixelKernels::Internals::RowKernels* PixelKernels::Internals::GetSSE2RowKernels()
+{
+  return NULL;
+}
+
+#endif
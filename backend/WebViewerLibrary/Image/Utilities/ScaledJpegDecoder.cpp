@@ -0,0 +1,156 @@
+#include "ScaledJpegDecoder.h"
+
+#include <stdio.h> // jpeglib.h requires FILE
+#include <setjmp.h>
+#include <jpeglib.h>
+#include <OrthancException.h>
+#include "../../BenchmarkHelper.h"
+
+namespace
+{
+  enum DecodingStatus
+  {
+    DecodingStatus_Decoded,
+    DecodingStatus_NotReducible,
+    DecodingStatus_Corrupted
+  };
+
+  struct Decoder
+  {
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr         errorManager;
+    jmp_buf                       jumpBuffer;
+  };
+
+  void ErrorExit(j_common_ptr cinfo)
+  {
+    // return to the setjmp() of _decode (libjpeg can't return from this callback)
+    Decoder* decoder = reinterpret_cast<Decoder*>(cinfo->client_data);
+    longjmp(decoder->jumpBuffer, 1);
+  }
+
+  void OutputMessage(j_common_ptr /*cinfo*/)
+  {
+    // corrupted streams are reported to the caller, don't write to stderr
+  }
+
+  JSAMPROW _getRow(Orthanc::ImageBuffer& image, unsigned int y)
+  {
+    Orthanc::ImageAccessor accessor;
+    image.GetWriteableAccessor(accessor);
+    return reinterpret_cast<JSAMPROW>(accessor.GetRow(y));
+  }
+
+  // @warning no local variable with a destructor in here: longjmp() would skip it
+  DecodingStatus _decode(Decoder& decoder, const void* jpeg, size_t size, unsigned int maxWidthHeight, std::auto_ptr<Orthanc::ImageBuffer>& image)
+  {
+    struct jpeg_decompress_struct& cinfo = decoder.cinfo;
+
+    if (setjmp(decoder.jumpBuffer))
+    {
+      return DecodingStatus_Corrupted;
+    }
+
+    jpeg_mem_src(&cinfo, const_cast<unsigned char*>(reinterpret_cast<const unsigned char*>(jpeg)), static_cast<unsigned long>(size));
+    jpeg_read_header(&cinfo, TRUE);
+
+    Orthanc::PixelFormat format;
+    if (cinfo.data_precision != 8)
+    {
+      return DecodingStatus_NotReducible;
+    }
+    else if (cinfo.num_components == 1)
+    {
+      cinfo.out_color_space = JCS_GRAYSCALE;
+      format = Orthanc::PixelFormat_Grayscale8;
+    }
+    else if (cinfo.num_components == 3)
+    {
+      cinfo.out_color_space = JCS_RGB; // same conversion as the Orthanc decoder
+      format = Orthanc::PixelFormat_RGB24;
+    }
+    else
+    {
+      return DecodingStatus_NotReducible;
+    }
+
+    unsigned int scaleDenominator = ScaledJpegDecoder::GetScaleDenominator(cinfo.image_width, cinfo.image_height, maxWidthHeight);
+    if (scaleDenominator == 1)
+    {
+      return DecodingStatus_NotReducible;
+    }
+
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = scaleDenominator;
+    jpeg_start_decompress(&cinfo);
+
+    image.reset(new Orthanc::ImageBuffer(format, cinfo.output_width, cinfo.output_height, true));
+
+    while (cinfo.output_scanline < cinfo.output_height)
+    {
+      JSAMPROW row = _getRow(*image, cinfo.output_scanline);
+      jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    return DecodingStatus_Decoded;
+  }
+}
+
+unsigned int ScaledJpegDecoder::GetScaleDenominator(unsigned int width, unsigned int height, unsigned int maxWidthHeight)
+{
+  if (maxWidthHeight == 0)
+  {
+    return 1;
+  }
+
+  unsigned int largestSide = (width > height ? width : height);
+
+  // libjpeg rounds the scaled size up
+  for (unsigned int denominator = 8; denominator > 1; denominator /= 2)
+  {
+    if ((largestSide + denominator - 1) / denominator >= maxWidthHeight)
+    {
+      return denominator;
+    }
+  }
+
+  return 1;
+}
+
+std::auto_ptr<Orthanc::ImageBuffer> ScaledJpegDecoder::Decode(const void* jpeg, size_t size, unsigned int maxWidthHeight)
+{
+  BENCH(DECODE_SCALED_JPEG);
+
+  Decoder decoder;
+  decoder.cinfo.err = jpeg_std_error(&decoder.errorManager);
+  decoder.errorManager.error_exit = ErrorExit;
+  decoder.errorManager.output_message = OutputMessage;
+  jpeg_create_decompress(&decoder.cinfo);
+  decoder.cinfo.client_data = &decoder;
+
+  std::auto_ptr<Orthanc::ImageBuffer> image;
+  DecodingStatus status;
+
+  try
+  {
+    status = _decode(decoder, jpeg, size, maxWidthHeight, image);
+  }
+  catch (...)
+  {
+    jpeg_destroy_decompress(&decoder.cinfo);
+    throw;
+  }
+
+  jpeg_destroy_decompress(&decoder.cinfo);
+
+  switch (status)
+  {
+  case DecodingStatus_Decoded:
+    return image;
+  case DecodingStatus_NotReducible:
+    return std::auto_ptr<Orthanc::ImageBuffer>(NULL);
+  default:
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+  }
+}
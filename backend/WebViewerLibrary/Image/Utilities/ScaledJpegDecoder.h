@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stddef.h> // for size_t
+#include <memory>
+#include <Images/ImageBuffer.h>
+
+/** ScaledJpegDecoder
+ *
+ * Decodes a baseline JPEG stream (ie. the PixelData of the 1.2.840.10008.1.2.4.50
+ * transfer syntax) at a reduced resolution, using the DCT scaling of libjpeg
+ * (1/2, 1/4 or 1/8). Only the low frequencies of each block are decoded, which
+ * makes thumbnails of large images much cheaper than a full decode followed by
+ * a resize.
+ *
+ */
+namespace ScaledJpegDecoder
+{
+  // Smallest scale (2, 4 or 8) keeping the largest side of the image >= maxWidthHeight,
+  // 1 if the image can't be reduced.
+  unsigned int GetScaleDenominator(unsigned int width, unsigned int height, unsigned int maxWidthHeight);
+
+  // Returns a Grayscale8 or RGB24 image whose largest side is >= maxWidthHeight,
+  // or NULL if the stream can't be decoded at a reduced resolution (scale of 1,
+  // other than 8bit precision, unsupported number of components). The caller
+  // should then use the regular decoder.
+  // Throws ErrorCode_BadFileFormat if the stream is corrupted.
+  std::auto_ptr<Orthanc::ImageBuffer> Decode(const void* jpeg, size_t size, unsigned int maxWidthHeight);
+}
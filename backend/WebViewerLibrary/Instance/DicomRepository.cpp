@@ -1,90 +1,422 @@
 #include "DicomRepository.h"
 
-#include <boost/thread/lock_guard.hpp> 
+#include <boost/thread/lock_guard.hpp>
 #include <boost/foreach.hpp>
+#include <boost/make_shared.hpp>
+#include <assert.h>
+#include <fstream>
+#include <json/writer.h>
 #include "../BenchmarkHelper.h" // for BENCH(*)
 #include "../OrthancContextManager.h" // for context_ global
 #include "../ViewerToolbox.h" // for OrthancPlugins::get*FromOrthanc && OrthancPluginImage
+#include "../Image/Utilities/ScopedBuffers.h" // for ScopedOrthancPluginMemoryBuffer
+#include "FrameOffsetIndex.h"
 #include <OrthancException.h> // for throws
+#include <Toolbox.h> // for Orthanc::Toolbox::StripSpaces
 
 namespace
 {
 void _loadDICOM(OrthancPluginMemoryBuffer& dicomOutput, const std::string& instanceId);
+std::string _getStoragePath(const std::string& storageDirectory, const std::string& uuid);
+
+std::string frameIndexMetadataId = "9996";
 }
 
-void DicomRepository::invalidateDicomFile(const std::string instanceId)
+DicomRepository::DicomRepository()
+  : _cacheSize(0),
+    _maxCacheSize(DEFAULT_MAX_CACHE_SIZE),
+    _frameIndexEnabled(false),
+    _frameIndexInMetadataEnabled(false)
+{
+}
+
+void DicomRepository::enableFrameIndex(bool enable, const std::string& orthancStorageDirectory)
 {
   boost::lock_guard<boost::mutex> guard(_dicomFilesMutex);
 
-  for (std::deque<DicomFile>::iterator it = _dicomFiles.begin(); it != _dicomFiles.end(); it++)
+  _frameIndexEnabled = enable;
+  _orthancStorageDirectory = orthancStorageDirectory;
+  _frameIndexes.clear();
+  _frameIndexLookup.clear();
+}
+
+void DicomRepository::enableFrameIndexInMetadata(bool enable)
+{
+  _frameIndexInMetadataEnabled = enable;
+}
+
+void DicomRepository::setMaxCacheSize(uint64_t maxSize)
+{
+  boost::lock_guard<boost::mutex> guard(_dicomFilesMutex);
+
+  _maxCacheSize = maxSize;
+  _makeRoom();
+}
+
+void DicomRepository::invalidateDicomFile(const std::string& instanceId)
+{
+  boost::lock_guard<boost::mutex> guard(_dicomFilesMutex);
+
+  Index::iterator found = _index.find(instanceId);
+  if (found != _index.end())
+  {
+    _uncache(found->second);
+  }
+
+  FrameIndexLookup::iterator frameIndex = _frameIndexLookup.find(instanceId);
+  if (frameIndex != _frameIndexLookup.end())
+  {
+    _frameIndexes.erase(frameIndex->second);
+    _frameIndexLookup.erase(frameIndex);
+  }
+}
+
+bool DicomRepository::getDicomFrame(std::string& frame, std::string& transferSyntax, const std::string& instanceId, uint32_t frameIndex) const
+{
+  if (!_frameIndexEnabled)
+  {
+    return false;
+  }
+
+  FrameIndex index;
+  _getFrameIndex(index, instanceId);
+
+  if (index.offsets.get() == NULL || frameIndex >= index.offsets->GetFramesCount())
+  {
+    return false;
+  }
+
+  BENCH(GET_DICOM_FRAME);
+
+  if (!index.storagePath.empty())
+  {
+    // ranged read in the file of the Orthanc storage
+    std::ifstream file(index.storagePath.c_str(), std::ios::in | std::ios::binary);
+    if (file.seekg(0, std::ios::end) && static_cast<uint64_t>(file.tellg()) == index.offsets->GetFileSize()
+        && index.offsets->ReadFrame(frame, file, frameIndex))
+    {
+      transferSyntax = index.offsets->GetTransferSyntax();
+      return true;
+    }
+
+    // the storage is not accessible from the plugin (storage area plugin, permissions, ...)
+    _disableStorageReads(instanceId);
+  }
+
+  OrthancPluginMemoryBuffer dicom;
+  getDicomFile(instanceId, dicom);
+  ScopedDecref decref(this, instanceId, dicom);
+
+  if (dicom.size != index.offsets->GetFileSize())
+  {
+    // the file has been modified since the index has been built
+    _forgetFrameIndex(instanceId);
+    return false;
+  }
+
+  index.offsets->ExtractFrame(frame, dicom.data, dicom.size, frameIndex);
+  transferSyntax = index.offsets->GetTransferSyntax();
+  return true;
+}
+
+void DicomRepository::_getFrameIndex(FrameIndex& frameIndex, const std::string& instanceId) const
+{
   {
-    if (it->instanceId == instanceId)
+    boost::lock_guard<boost::mutex> guard(_dicomFilesMutex);
+
+    FrameIndexLookup::iterator found = _frameIndexLookup.find(instanceId);
+    if (found != _frameIndexLookup.end())
     {
-      OrthancPluginFreeMemoryBuffer(OrthancContextManager::Get(), &(it->dicomFileBuffer));
-      _dicomFiles.erase(it);
+      _frameIndexes.splice(_frameIndexes.begin(), _frameIndexes, found->second);
+      frameIndex = *(found->second);
       return;
     }
   }
+
+  // build the index outside of the mutex (two threads may build the same index,
+  // which is harmless)
+  OrthancPluginContext* context = OrthancContextManager::Get();
+  frameIndex.instanceId = instanceId;
+  frameIndex.storagePath.clear();
+  frameIndex.offsets.reset();
+
+  Json::Value attachmentInfo;
+  std::string isCompressed;
+  if (!OrthancPlugins::GetJsonFromOrthanc(attachmentInfo, context, "/instances/" + instanceId + "/attachments/dicom/info") ||
+      !attachmentInfo.isMember("Uuid") || !attachmentInfo.isMember("UncompressedSize") ||
+      !OrthancPlugins::GetStringFromOrthanc(isCompressed, context, "/instances/" + instanceId + "/attachments/dicom/is-compressed"))
+  {
+    return; // not cached: the instance may not exist (yet)
+  }
+
+  const uint64_t fileSize = attachmentInfo["UncompressedSize"].asUInt64();
+  std::string metadataUrl = "/instances/" + instanceId + "/metadata/" + frameIndexMetadataId;
+
+  std::auto_ptr<FrameOffsetIndex> offsets(new FrameOffsetIndex);
+  Json::Value storedIndex;
+  if (!_frameIndexInMetadataEnabled ||
+      !OrthancPlugins::GetJsonFromOrthanc(storedIndex, context, metadataUrl) ||
+      !offsets->Unserialize(storedIndex) ||
+      offsets->GetFileSize() != fileSize)
+  {
+    OrthancPluginMemoryBuffer dicom;
+    getDicomFile(instanceId, dicom);
+    ScopedDecref decref(this, instanceId, dicom);
+
+    if (!offsets->Build(dicom.data, dicom.size))
+    {
+      offsets.reset();
+    }
+    else if (_frameIndexInMetadataEnabled)
+    {
+      Json::Value serializedIndex;
+      offsets->Serialize(serializedIndex);
+      Json::FastWriter fastWriter;
+      std::string content = fastWriter.write(serializedIndex);
+      ScopedOrthancPluginMemoryBuffer buffer(context);
+
+      // as for the instance info, a failure only means the index is rebuilt next time
+      OrthancPluginRestApiPutAfterPlugins(context, buffer.getPtr(), metadataUrl.c_str(), content.c_str(), content.size());
+    }
+  }
+
+  frameIndex.offsets.reset(offsets.release());
+  if (Orthanc::Toolbox::StripSpaces(isCompressed) == "0")
+  {
+    frameIndex.storagePath = _getStoragePath(_orthancStorageDirectory, attachmentInfo["Uuid"].asString());
+  }
+
+  {
+    boost::lock_guard<boost::mutex> guard(_dicomFilesMutex);
+
+    if (_frameIndexLookup.find(instanceId) == _frameIndexLookup.end())
+    {
+      _frameIndexes.push_front(frameIndex);
+      _frameIndexLookup[instanceId] = _frameIndexes.begin();
+
+      while (_frameIndexes.size() > MAX_FRAME_INDEXES)
+      {
+        _frameIndexLookup.erase(_frameIndexes.back().instanceId);
+        _frameIndexes.pop_back();
+      }
+    }
+  }
 }
 
-void DicomRepository::getDicomFile(const std::string instanceId, OrthancPluginMemoryBuffer& dicomFileBuffer) const
+void DicomRepository::_disableStorageReads(const std::string& instanceId) const
 {
   boost::lock_guard<boost::mutex> guard(_dicomFilesMutex);
 
-  // Retrieve dicom file if cached
-  BOOST_FOREACH(DicomFile& dicomFile, _dicomFiles)
+  FrameIndexLookup::iterator found = _frameIndexLookup.find(instanceId);
+  if (found != _frameIndexLookup.end())
   {
-    if (dicomFile.instanceId == instanceId)
+    found->second->storagePath.clear();
+  }
+}
+
+void DicomRepository::_forgetFrameIndex(const std::string& instanceId) const
+{
+  boost::lock_guard<boost::mutex> guard(_dicomFilesMutex);
+
+  FrameIndexLookup::iterator found = _frameIndexLookup.find(instanceId);
+  if (found != _frameIndexLookup.end())
+  {
+    _frameIndexes.erase(found->second);
+    _frameIndexLookup.erase(found);
+  }
+}
+
+void DicomRepository::getDicomFile(const std::string& instanceId, OrthancPluginMemoryBuffer& dicomFileBuffer) const
+{
+  DicomFilePtr dicomFile;
+  std::auto_ptr<boost::promise<void> > loading;
+
+  {
+    boost::lock_guard<boost::mutex> guard(_dicomFilesMutex);
+
+    Index::iterator found = _index.find(instanceId);
+    if (found != _index.end())
     {
-      dicomFileBuffer = dicomFile.dicomFileBuffer;
-      dicomFile.refCount++;
-      return;
+      // Retrieve dicom file if cached (or being loaded by another thread)
+      dicomFile = *(found->second);
+      dicomFile->refCount++;
+      _dicomFiles.splice(_dicomFiles.begin(), _dicomFiles, found->second);
+    }
+    else
+    {
+      // Register the file before loading it so that other threads requesting
+      // the same instance wait for this load instead of starting their own
+      loading.reset(new boost::promise<void>);
+      dicomFile = boost::make_shared<DicomFile>();
+      dicomFile->instanceId = instanceId;
+      dicomFile->refCount = 1;
+      dicomFile->loaded = boost::shared_future<void>(loading->get_future());
+      _dicomFiles.push_front(dicomFile);
+      _index[instanceId] = _dicomFiles.begin();
     }
   }
 
-  //load the dicom file now (the dicomFilesMutex is still locked, this will prevent other threads to request the loading as well)
-  if (_dicomFiles.size() > 3) //remove the oldest file that is not used
+  if (loading.get() != NULL)
   {
-    for (std::deque<DicomFile>::iterator it = _dicomFiles.begin(); it != _dicomFiles.end(); it++)
+    // load the dicom file now (the dicomFilesMutex is released, other instances can be accessed meanwhile)
+    OrthancPluginMemoryBuffer loadedBuffer;
+    try
+    {
+      _loadDICOM(loadedBuffer, instanceId);
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      {
+        boost::lock_guard<boost::mutex> guard(_dicomFilesMutex);
+        if (dicomFile->isCached)
+        {
+          _uncache(_index[instanceId]);
+        }
+        _decref(dicomFile);
+      }
+      loading->set_exception(boost::copy_exception(e));
+      throw;
+    }
+    catch (...)
+    {
+      {
+        boost::lock_guard<boost::mutex> guard(_dicomFilesMutex);
+        if (dicomFile->isCached)
+        {
+          _uncache(_index[instanceId]);
+        }
+        _decref(dicomFile);
+      }
+      loading->set_exception(boost::current_exception());
+      throw;
+    }
+
     {
-      if (it->instanceId != instanceId && it->refCount == 0)
+      boost::lock_guard<boost::mutex> guard(_dicomFilesMutex);
+      dicomFile->dicomFileBuffer = loadedBuffer;
+      if (dicomFile->isCached)
       {
-        OrthancPluginFreeMemoryBuffer(OrthancContextManager::Get(), &(it->dicomFileBuffer));
-        _dicomFiles.erase(it);
-        break;
+        dicomFile->size = dicomFile->dicomFileBuffer.size;
+        _cacheSize += dicomFile->size;
+        _makeRoom();
       }
     }
+    loading->set_value();
+  }
+  else
+  {
+    try
+    {
+      dicomFile->loaded.get(); // waits for the loading thread, rethrows its error if any
+    }
+    catch (...)
+    {
+      boost::lock_guard<boost::mutex> guard(_dicomFilesMutex);
+      _decref(dicomFile);
+      throw;
+    }
   }
 
-  _loadDICOM(dicomFileBuffer, instanceId);
-  DicomFile dicomFile;
-  dicomFile.refCount = 1;
-  dicomFile.instanceId = instanceId;
-  dicomFile.dicomFileBuffer = dicomFileBuffer;
-  _dicomFiles.push_back(dicomFile);
+  dicomFileBuffer = dicomFile->dicomFileBuffer;
 }
 
-void DicomRepository::decrefDicomFile(const std::string instanceId) const
+void DicomRepository::decrefDicomFile(const std::string& instanceId, const OrthancPluginMemoryBuffer& dicomFileBuffer) const
 {
   boost::lock_guard<boost::mutex> guard(_dicomFilesMutex);
 
-  BOOST_FOREACH(DicomFile& dicomFile, _dicomFiles)
+  Index::iterator found = _index.find(instanceId);
+  if (found != _index.end() && (*found->second)->dicomFileBuffer.data == dicomFileBuffer.data)
+  {
+    _decref(*(found->second));
+    return;
+  }
+
+  // the file has been invalidated or evicted while it was in use
+  BOOST_FOREACH(const DicomFilePtr& dicomFile, _detachedFiles)
   {
-    if (dicomFile.instanceId == instanceId)
+    if (dicomFile->dicomFileBuffer.data == dicomFileBuffer.data)
     {
-      assert(dicomFile.refCount >= 1);
-      dicomFile.refCount--;
+      _decref(DicomFilePtr(dicomFile)); // copy: _decref may remove it from _detachedFiles
       return;
     }
   }
   assert(false); //it means we did not find the file
 }
 
+void DicomRepository::_decref(const DicomFilePtr& dicomFile) const
+{
+  assert(dicomFile->refCount >= 1);
+  dicomFile->refCount--;
+
+  if (dicomFile->refCount > 0)
+  {
+    return;
+  }
+
+  if (dicomFile->isCached)
+  {
+    _makeRoom(); // the file may now be evicted
+  }
+  else
+  {
+    _detachedFiles.remove(dicomFile);
+    if (dicomFile->dicomFileBuffer.data != NULL)
+    {
+      OrthancPluginFreeMemoryBuffer(OrthancContextManager::Get(), &(dicomFile->dicomFileBuffer));
+    }
+  }
+}
+
+void DicomRepository::_uncache(Recency::iterator position) const
+{
+  DicomFilePtr dicomFile = *position;
+
+  _index.erase(dicomFile->instanceId);
+  _dicomFiles.erase(position);
+  _cacheSize -= dicomFile->size;
+  dicomFile->isCached = false;
+
+  if (dicomFile->refCount > 0)
+  {
+    // still in use (or being loaded), freed by the last _decref
+    _detachedFiles.push_back(dicomFile);
+  }
+  else if (dicomFile->dicomFileBuffer.data != NULL)
+  {
+    OrthancPluginFreeMemoryBuffer(OrthancContextManager::Get(), &(dicomFile->dicomFileBuffer));
+  }
+}
+
+void DicomRepository::_makeRoom() const
+{
+  // evict the least recently used files that are not in use
+  Recency::iterator it = _dicomFiles.end();
+  while (_cacheSize > _maxCacheSize && it != _dicomFiles.begin())
+  {
+    --it;
+    if ((*it)->refCount == 0)
+    {
+      Recency::iterator victim = it++;
+      _uncache(victim);
+    }
+  }
+}
+
 DicomRepository::~DicomRepository()
 {
-  for (std::deque<DicomFile>::iterator it = _dicomFiles.begin(); it != _dicomFiles.end(); it++)
+  BOOST_FOREACH(const DicomFilePtr& dicomFile, _dicomFiles)
+  {
+    if (dicomFile->dicomFileBuffer.data != NULL)
+    {
+      OrthancPluginFreeMemoryBuffer(OrthancContextManager::Get(), &(dicomFile->dicomFileBuffer));
+    }
+  }
+  BOOST_FOREACH(const DicomFilePtr& dicomFile, _detachedFiles)
   {
-    OrthancPluginFreeMemoryBuffer(OrthancContextManager::Get(), &(it->dicomFileBuffer));
+    if (dicomFile->dicomFileBuffer.data != NULL)
+    {
+      OrthancPluginFreeMemoryBuffer(OrthancContextManager::Get(), &(dicomFile->dicomFileBuffer));
+    }
   }
 }
 
@@ -101,4 +433,16 @@ void _loadDICOM(OrthancPluginMemoryBuffer& dicomOutput, const std::string& insta
   }
   BENCH_LOG(DICOM_SIZE, dicomOutput.size);
 }
+
+// Path of an attachment in the filesystem storage of Orthanc (see Orthanc's FilesystemStorage)
+std::string _getStoragePath(const std::string& storageDirectory, const std::string& uuid)
+{
+  if (storageDirectory.empty() || uuid.size() != 36 ||
+      uuid.find_first_not_of("0123456789abcdefABCDEF-") != std::string::npos)
+  {
+    return "";
+  }
+
+  return storageDirectory + "/" + uuid.substr(0, 2) + "/" + uuid.substr(2, 2) + "/" + uuid;
+}
 }
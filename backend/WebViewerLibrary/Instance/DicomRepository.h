@@ -1,11 +1,17 @@
 #pragma once
 
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/future.hpp>
 #include <boost/noncopyable.hpp>
-#include <deque>
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+#include <list>
 #include <string>
+#include <stdint.h>
 #include <orthanc/OrthancCPlugin.h>
 
+class FrameOffsetIndex;
+
 /** DicomRepository [@Repository]
  *
  * Retrieve a Dicom file from an instance uid.
@@ -16,44 +22,119 @@
  *   Note the cache is stateful and thus is not compatible with the Osimis cloud load-balancer
  *   stateless requirements !
  *
+ * The cache is keyed by instance id and bounded by a byte budget.  Files are
+ * loaded from Orthanc outside of the cache mutex so that a miss on one instance
+ * never blocks the threads accessing other instances.  Concurrent requests for
+ * an instance that is being loaded wait for the first load to complete instead
+ * of loading the file twice.  Files that are currently in use (refCount > 0) are
+ * never evicted; the budget may therefore be temporarily exceeded.
+ *
+ * @Responsibility Serve the raw PixelData of a single frame
+ *   A `FrameOffsetIndex` is kept for the recently accessed instances (and
+ *   optionally persisted in the metadata of the instance).  When the
+ *   attachment is stored uncompressed in the filesystem storage of Orthanc,
+ *   only the bytes of the frame are read from the file; otherwise the frame is
+ *   copied from the cached DICOM file.  In both cases, Orthanc does not have to
+ *   parse the whole file again for each frame.
+ *
  */
 class DicomRepository : public boost::noncopyable {
 public:
   class ScopedDecref
   {
-    DicomRepository* repository_;
+    const DicomRepository* repository_;
     const std::string& instanceId_;
+    const OrthancPluginMemoryBuffer& buffer_;
   public:
-    ScopedDecref(DicomRepository* repository, const std::string& instanceId)
+    ScopedDecref(const DicomRepository* repository, const std::string& instanceId, const OrthancPluginMemoryBuffer& buffer)
       : repository_(repository),
-        instanceId_(instanceId)
+        instanceId_(instanceId),
+        buffer_(buffer)
     {
     }
 
     ~ScopedDecref()
     {
-      repository_->decrefDicomFile(instanceId_);
+      repository_->decrefDicomFile(instanceId_, buffer_);
     }
   };
 
+  static const uint64_t DEFAULT_MAX_CACHE_SIZE = 256 * 1024 * 1024;
+  static const size_t MAX_FRAME_INDEXES = 1000;
+
 private:
 
   struct DicomFile
   {
     std::string                     instanceId;
     OrthancPluginMemoryBuffer       dicomFileBuffer;
+    uint64_t                        size;      // accounted in _cacheSize once loaded
     int                             refCount;
+    bool                            isCached;  // false once evicted/invalidated while still in use
+    boost::shared_future<void>      loaded;
+
+    DicomFile()
+      : size(0),
+        refCount(0),
+        isCached(true)
+    {
+      dicomFileBuffer.data = NULL;
+      dicomFileBuffer.size = 0;
+    }
+  };
+
+  typedef boost::shared_ptr<DicomFile>                             DicomFilePtr;
+  typedef std::list<DicomFilePtr>                                  Recency;  // front = most recently used
+  typedef boost::unordered_map<std::string, Recency::iterator>     Index;
+
+  struct FrameIndex
+  {
+    std::string                                 instanceId;
+    boost::shared_ptr<const FrameOffsetIndex>   offsets;      // NULL if the layout of the file is not supported
+    std::string                                 storagePath;  // empty if the file can't be read from the storage directly
   };
 
+  typedef std::list<FrameIndex>                                              FrameIndexRecency;  // front = most recently used
+  typedef boost::unordered_map<std::string, FrameIndexRecency::iterator>     FrameIndexLookup;
+
 public:
-  void getDicomFile(const std::string instanceId, OrthancPluginMemoryBuffer& buffer) const; // throws Orthanc::ErrorCode_UnknownResource
-//  void increfDicomFile(const std::string instanceId);
-  void decrefDicomFile(const std::string instanceId) const;
-  void invalidateDicomFile(const std::string instanceId);
-//  void addDicomFile(const std::string instanceId, OrthancPluginMemoryBuffer& buffer);
+  DicomRepository();
+
+  void getDicomFile(const std::string& instanceId, OrthancPluginMemoryBuffer& buffer) const; // throws Orthanc::ErrorCode_UnknownResource
+  void decrefDicomFile(const std::string& instanceId, const OrthancPluginMemoryBuffer& buffer) const;
+  void invalidateDicomFile(const std::string& instanceId);
+
+  // Retrieves the PixelData of a frame (ie. the content of /instances/{id}/frames/{n}/raw).
+  // Returns false if the frame index is disabled or if the file layout is not
+  // supported; the caller should then ask Orthanc for the frame.
+  bool getDicomFrame(std::string& frame, std::string& transferSyntax, const std::string& instanceId, uint32_t frameIndex) const;
+
+  void setMaxCacheSize(uint64_t maxSize);
+  void enableFrameIndex(bool enable, const std::string& orthancStorageDirectory);
+  void enableFrameIndexInMetadata(bool enable);
+
   ~DicomRepository();
 
 private:
-  mutable std::deque<DicomFile> _dicomFiles; //keep a few of the last dicomFile in memory to avoid reloading them many times when requesting different frames or different image quality
-  mutable boost::mutex          _dicomFilesMutex; //to prevent multiple threads modifying the _dicomFiles
+  // these methods require _dicomFilesMutex to be locked
+  void _makeRoom() const;
+  void _uncache(Recency::iterator position) const;
+  void _decref(const DicomFilePtr& dicomFile) const;
+
+  // these methods lock _dicomFilesMutex themselves
+  void _getFrameIndex(FrameIndex& frameIndex, const std::string& instanceId) const;
+  void _disableStorageReads(const std::string& instanceId) const;
+  void _forgetFrameIndex(const std::string& instanceId) const;
+
+  mutable Recency               _dicomFiles; // keep the last dicomFile in memory to avoid reloading them many times when requesting different frames or different image quality
+  mutable Index                 _index;
+  mutable Recency               _detachedFiles; // files removed from the cache while still in use
+  mutable uint64_t              _cacheSize;  // bytes held by the loaded files of _dicomFiles
+  uint64_t                      _maxCacheSize;
+  mutable FrameIndexRecency     _frameIndexes;
+  mutable FrameIndexLookup      _frameIndexLookup;
+  bool                          _frameIndexEnabled;
+  bool                          _frameIndexInMetadataEnabled;
+  std::string                   _orthancStorageDirectory;
+  mutable boost::mutex          _dicomFilesMutex; // only protects the containers (including the frame indexes); never held during I/O
 };
@@ -0,0 +1,536 @@
+#include "FrameOffsetIndex.h"
+
+#include <string.h> // for memcmp, memcpy
+#include <algorithm> // for std::max
+#include <stdlib.h> // for strtol
+#include <boost/foreach.hpp>
+#include <OrthancException.h>
+#include <Toolbox.h> // for StripSpaces
+#include "../BenchmarkHelper.h"
+
+namespace
+{
+  const int FRAME_OFFSET_INDEX_VERSION = 1;
+  const uint32_t UNDEFINED_LENGTH = 0xFFFFFFFF;
+  const unsigned int MAX_SEQUENCE_DEPTH = 64;
+
+  struct Element
+  {
+    uint16_t  group;
+    uint16_t  element;
+    char      vr[2];
+    uint32_t  length;
+    size_t    valueOffset;
+
+    bool Is(uint16_t g, uint16_t e) const
+    {
+      return group == g && element == e;
+    }
+
+    bool HasVR(const char* v) const
+    {
+      return vr[0] == v[0] && vr[1] == v[1];
+    }
+  };
+
+  // Minimal little endian DICOM parser: only walks the data elements to
+  // locate the PixelData, their values are not decoded.
+  // Throws ErrorCode_BadFileFormat if the file is truncated or malformed.
+  class DatasetReader
+  {
+    const uint8_t*  data_;
+    size_t          size_;
+
+  public:
+    DatasetReader(const void* data, size_t size)
+      : data_(reinterpret_cast<const uint8_t*>(data)),
+        size_(size)
+    {
+    }
+
+    void Check(size_t position, uint64_t length) const
+    {
+      if (position > size_ || length > size_ - position)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+      }
+    }
+
+    uint16_t ReadUInt16(size_t position) const
+    {
+      Check(position, 2);
+      return static_cast<uint16_t>(data_[position] | (data_[position + 1] << 8));
+    }
+
+    uint32_t ReadUInt32(size_t position) const
+    {
+      Check(position, 4);
+      return (static_cast<uint32_t>(data_[position]) |
+              (static_cast<uint32_t>(data_[position + 1]) << 8) |
+              (static_cast<uint32_t>(data_[position + 2]) << 16) |
+              (static_cast<uint32_t>(data_[position + 3]) << 24));
+    }
+
+    std::string ReadString(const Element& element) const
+    {
+      Check(element.valueOffset, element.length);
+      std::string value(reinterpret_cast<const char*>(data_ + element.valueOffset), element.length);
+
+      // remove the padding (space or NULL)
+      while (!value.empty() && value[value.size() - 1] == '\0')
+      {
+        value.resize(value.size() - 1);
+      }
+      return Orthanc::Toolbox::StripSpaces(value);
+    }
+
+    bool IsPart10() const
+    {
+      return size_ >= 132 && memcmp(data_ + 128, "DICM", 4) == 0;
+    }
+
+    void ReadElementHeader(Element& element, size_t position, bool explicitVR) const
+    {
+      element.group = ReadUInt16(position);
+      element.element = ReadUInt16(position + 2);
+      element.vr[0] = element.vr[1] = 0;
+
+      if (element.group == 0xFFFE || !explicitVR)
+      {
+        // items and delimiters never have a VR
+        element.length = ReadUInt32(position + 4);
+        element.valueOffset = position + 8;
+        return;
+      }
+
+      Check(position + 4, 2);
+      element.vr[0] = static_cast<char>(data_[position + 4]);
+      element.vr[1] = static_cast<char>(data_[position + 5]);
+
+      static const char* longVRs[] = { "OB", "OD", "OF", "OL", "OV", "OW", "SQ", "SV", "UC", "UN", "UR", "UT", "UV" };
+      for (size_t i = 0; i < sizeof(longVRs) / sizeof(longVRs[0]); i++)
+      {
+        if (element.HasVR(longVRs[i]))
+        {
+          element.length = ReadUInt32(position + 8);
+          element.valueOffset = position + 12;
+          return;
+        }
+      }
+
+      element.length = ReadUInt16(position + 6);
+      element.valueOffset = position + 8;
+    }
+
+    // Returns the position following the element
+    size_t SkipElement(const Element& element, bool explicitVR, unsigned int depth) const
+    {
+      if (element.length != UNDEFINED_LENGTH)
+      {
+        Check(element.valueOffset, element.length);
+        return element.valueOffset + element.length;
+      }
+
+      // Sequence of items. The items of an UN element are encoded in implicit VR.
+      return SkipItems(element.valueOffset, explicitVR && !element.HasVR("UN"), depth + 1);
+    }
+
+  private:
+    size_t SkipItems(size_t position, bool explicitVR, unsigned int depth) const
+    {
+      if (depth > MAX_SEQUENCE_DEPTH)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+      }
+
+      for (;;)
+      {
+        Element item;
+        ReadElementHeader(item, position, explicitVR);
+
+        if (item.Is(0xFFFE, 0xE0DD))  // Sequence Delimitation Item
+        {
+          return item.valueOffset;
+        }
+        else if (!item.Is(0xFFFE, 0xE000))
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+        }
+        else if (item.length != UNDEFINED_LENGTH)
+        {
+          Check(item.valueOffset, item.length);
+          position = item.valueOffset + item.length;
+        }
+        else
+        {
+          // walk the item dataset up to the Item Delimitation Item
+          position = item.valueOffset;
+          for (;;)
+          {
+            Element element;
+            ReadElementHeader(element, position, explicitVR);
+            if (element.Is(0xFFFE, 0xE00D))
+            {
+              position = element.valueOffset;
+              break;
+            }
+            position = SkipElement(element, explicitVR, depth);
+          }
+        }
+      }
+    }
+  };
+}
+
+FrameOffsetIndex::FrameOffsetIndex()
+  : fileSize_(0),
+    pixelDataOffset_(0)
+{
+}
+
+bool FrameOffsetIndex::Build(const void* dicom, size_t size)
+{
+  BENCH(BUILD_FRAME_OFFSET_INDEX);
+
+  transferSyntax_.clear();
+  segments_.clear();
+  frames_.clear();
+  fileSize_ = size;
+  pixelDataOffset_ = 0;
+
+  DatasetReader reader(dicom, size);
+  if (!reader.IsPart10())
+  {
+    return false;
+  }
+
+  try
+  {
+    // File Meta Information (always in explicit VR little endian)
+    size_t position = 132;
+    while (position + 4 <= size && reader.ReadUInt16(position) == 0x0002)
+    {
+      Element element;
+      reader.ReadElementHeader(element, position, true);
+      if (element.Is(0x0002, 0x0010))
+      {
+        transferSyntax_ = reader.ReadString(element);
+      }
+      position = reader.SkipElement(element, true, 0);
+    }
+
+    if (transferSyntax_.empty() ||
+        transferSyntax_ == "1.2.840.10008.1.2.2" ||     // Explicit VR Big Endian
+        transferSyntax_ == "1.2.840.10008.1.2.1.99")    // Deflated Explicit VR Little Endian
+    {
+      return false;
+    }
+
+    bool explicitVR = (transferSyntax_ != "1.2.840.10008.1.2");
+
+    // Dataset, up to the PixelData
+    uint32_t rows = 0, columns = 0, samplesPerPixel = 1, bitsAllocated = 0;
+    unsigned int framesCount = 1;
+
+    while (position < size)
+    {
+      Element element;
+      reader.ReadElementHeader(element, position, explicitVR);
+
+      if (element.Is(0x7FE0, 0x0010))
+      {
+        pixelDataOffset_ = element.valueOffset;
+
+        if (element.length == UNDEFINED_LENGTH)
+        {
+          // Encapsulated: the first item is the Basic Offset Table, followed by the fragments
+          Element offsetTable;
+          reader.ReadElementHeader(offsetTable, element.valueOffset, explicitVR);
+          if (!offsetTable.Is(0xFFFE, 0xE000) || offsetTable.length == UNDEFINED_LENGTH || offsetTable.length % 4 != 0)
+          {
+            return false;
+          }
+
+          std::vector<uint32_t> offsets;
+          for (uint32_t i = 0; i < offsetTable.length / 4; i++)
+          {
+            offsets.push_back(reader.ReadUInt32(offsetTable.valueOffset + 4 * i));
+          }
+
+          const size_t firstFragment = offsetTable.valueOffset + offsetTable.length;
+          std::vector<uint64_t> fragmentPositions;  // relative to the first fragment, as in the offset table
+          position = firstFragment;
+          for (;;)
+          {
+            Element fragment;
+            reader.ReadElementHeader(fragment, position, explicitVR);
+            if (fragment.Is(0xFFFE, 0xE0DD))
+            {
+              break;
+            }
+            if (!fragment.Is(0xFFFE, 0xE000) || fragment.length == UNDEFINED_LENGTH)
+            {
+              return false;
+            }
+            reader.Check(fragment.valueOffset, fragment.length);
+
+            Segment segment;
+            segment.offset = fragment.valueOffset;
+            segment.size = fragment.length;
+            segments_.push_back(segment);
+            fragmentPositions.push_back(position - firstFragment);
+
+            position = fragment.valueOffset + fragment.length;
+          }
+
+          if (segments_.empty())
+          {
+            return false;
+          }
+
+          if (!offsets.empty())
+          {
+            if (offsets.size() != framesCount)
+            {
+              return false;
+            }
+
+            size_t fragment = 0;
+            BOOST_FOREACH(uint32_t offset, offsets)
+            {
+              while (fragment < fragmentPositions.size() && fragmentPositions[fragment] < offset)
+              {
+                fragment++;
+              }
+              if (fragment == fragmentPositions.size() || fragmentPositions[fragment] != offset ||
+                  (!frames_.empty() && frames_.back() == fragment))
+              {
+                return false; // the offset table does not match the fragments
+              }
+              frames_.push_back(fragment);
+            }
+          }
+          else if (segments_.size() == framesCount)
+          {
+            for (size_t i = 0; i < segments_.size(); i++)
+            {
+              frames_.push_back(i);
+            }
+          }
+          else if (framesCount == 1)
+          {
+            frames_.push_back(0);
+          }
+          else
+          {
+            return false; // several fragments per frame without offset table
+          }
+
+          frames_.push_back(segments_.size());
+        }
+        else
+        {
+          // Native: the frames are contiguous
+          if (rows == 0 || columns == 0 || samplesPerPixel == 0 || bitsAllocated == 0 || bitsAllocated % 8 != 0)
+          {
+            return false;
+          }
+
+          uint64_t frameSize = static_cast<uint64_t>(rows) * columns * samplesPerPixel * (bitsAllocated / 8);
+          if (frameSize * framesCount > element.length)
+          {
+            return false;
+          }
+          reader.Check(element.valueOffset, element.length);
+
+          for (unsigned int i = 0; i < framesCount; i++)
+          {
+            Segment segment;
+            segment.offset = element.valueOffset + i * frameSize;
+            segment.size = frameSize;
+            segments_.push_back(segment);
+            frames_.push_back(i);
+          }
+          frames_.push_back(framesCount);
+        }
+
+        return true;
+      }
+
+      // Image Pixel module attributes required to split native pixel data in frames
+      if (element.group == 0x0028 && element.length != UNDEFINED_LENGTH)
+      {
+        switch (element.element)
+        {
+        case 0x0002:
+          samplesPerPixel = reader.ReadUInt16(element.valueOffset);
+          break;
+        case 0x0008:
+          framesCount = static_cast<unsigned int>(std::max(1L, strtol(reader.ReadString(element).c_str(), NULL, 10)));
+          break;
+        case 0x0010:
+          rows = reader.ReadUInt16(element.valueOffset);
+          break;
+        case 0x0011:
+          columns = reader.ReadUInt16(element.valueOffset);
+          break;
+        case 0x0100:
+          bitsAllocated = reader.ReadUInt16(element.valueOffset);
+          break;
+        default:
+          break;
+        }
+      }
+
+      position = reader.SkipElement(element, explicitVR, 0);
+    }
+
+    return false; // no PixelData
+  }
+  catch (Orthanc::OrthancException&)
+  {
+    segments_.clear();
+    frames_.clear();
+    return false;
+  }
+}
+
+void FrameOffsetIndex::Serialize(Json::Value& target) const
+{
+  target = Json::objectValue;
+  target["Version"] = FRAME_OFFSET_INDEX_VERSION;
+  target["TransferSyntax"] = transferSyntax_;
+  target["FileSize"] = static_cast<Json::UInt64>(fileSize_);
+  target["PixelDataOffset"] = static_cast<Json::UInt64>(pixelDataOffset_);
+
+  // [offset0, size0, offset1, size1, ...]
+  Json::Value segments = Json::arrayValue;
+  BOOST_FOREACH(const Segment& segment, segments_)
+  {
+    segments.append(static_cast<Json::UInt64>(segment.offset));
+    segments.append(static_cast<Json::UInt64>(segment.size));
+  }
+  target["Segments"] = segments;
+
+  Json::Value frames = Json::arrayValue;
+  BOOST_FOREACH(size_t frame, frames_)
+  {
+    frames.append(static_cast<Json::UInt64>(frame));
+  }
+  target["Frames"] = frames;
+}
+
+bool FrameOffsetIndex::Unserialize(const Json::Value& source)
+{
+  if (source.type() != Json::objectValue ||
+      !source.isMember("Version") || !source["Version"].isInt() || source["Version"].asInt() != FRAME_OFFSET_INDEX_VERSION ||
+      !source.isMember("TransferSyntax") || !source["TransferSyntax"].isString() ||
+      !source.isMember("FileSize") || !source["FileSize"].isIntegral() ||
+      !source.isMember("PixelDataOffset") || !source["PixelDataOffset"].isIntegral() ||
+      !source.isMember("Segments") || !source["Segments"].isArray() || source["Segments"].size() % 2 != 0 ||
+      !source.isMember("Frames") || !source["Frames"].isArray() || source["Frames"].size() < 2)
+  {
+    return false;
+  }
+
+  std::vector<Segment> segments;
+  const Json::Value& jsonSegments = source["Segments"];
+  for (Json::ArrayIndex i = 0; i < jsonSegments.size(); i += 2)
+  {
+    if (!jsonSegments[i].isIntegral() || !jsonSegments[i + 1].isIntegral())
+    {
+      return false;
+    }
+    Segment segment;
+    segment.offset = jsonSegments[i].asUInt64();
+    segment.size = jsonSegments[i + 1].asUInt64();
+    segments.push_back(segment);
+  }
+
+  std::vector<size_t> frames;
+  const Json::Value& jsonFrames = source["Frames"];
+  for (Json::ArrayIndex i = 0; i < jsonFrames.size(); i++)
+  {
+    if (!jsonFrames[i].isIntegral() ||
+        jsonFrames[i].asUInt64() > segments.size() ||
+        (!frames.empty() && jsonFrames[i].asUInt64() <= frames.back()))
+    {
+      return false;
+    }
+    frames.push_back(static_cast<size_t>(jsonFrames[i].asUInt64()));
+  }
+
+  if (frames.front() != 0 || frames.back() != segments.size())
+  {
+    return false;
+  }
+
+  transferSyntax_ = source["TransferSyntax"].asString();
+  fileSize_ = source["FileSize"].asUInt64();
+  pixelDataOffset_ = source["PixelDataOffset"].asUInt64();
+  segments_.swap(segments);
+  frames_.swap(frames);
+  return true;
+}
+
+uint64_t FrameOffsetIndex::_getFrameSize(unsigned int frameIndex) const
+{
+  if (frameIndex >= GetFramesCount())
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+
+  uint64_t frameSize = 0;
+  for (size_t i = frames_[frameIndex]; i < frames_[frameIndex + 1]; i++)
+  {
+    if (segments_[i].offset > fileSize_ || segments_[i].size > fileSize_ - segments_[i].offset)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile);
+    }
+    frameSize += segments_[i].size;
+  }
+
+  return frameSize;
+}
+
+void FrameOffsetIndex::ExtractFrame(std::string& frame, const void* dicom, size_t size, unsigned int frameIndex) const
+{
+  if (size != fileSize_)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile);
+  }
+
+  frame.resize(static_cast<size_t>(_getFrameSize(frameIndex)));
+
+  size_t position = 0;
+  for (size_t i = frames_[frameIndex]; i < frames_[frameIndex + 1]; i++)
+  {
+    if (segments_[i].size > 0)
+    {
+      memcpy(&frame[position], reinterpret_cast<const char*>(dicom) + segments_[i].offset, static_cast<size_t>(segments_[i].size));
+      position += static_cast<size_t>(segments_[i].size);
+    }
+  }
+}
+
+bool FrameOffsetIndex::ReadFrame(std::string& frame, std::istream& file, unsigned int frameIndex) const
+{
+  frame.resize(static_cast<size_t>(_getFrameSize(frameIndex)));
+
+  size_t position = 0;
+  for (size_t i = frames_[frameIndex]; i < frames_[frameIndex + 1]; i++)
+  {
+    if (segments_[i].size > 0)
+    {
+      file.seekg(static_cast<std::streamoff>(segments_[i].offset));
+      file.read(&frame[position], static_cast<std::streamsize>(segments_[i].size));
+      if (!file)
+      {
+        return false;
+      }
+      position += static_cast<size_t>(segments_[i].size);
+    }
+  }
+
+  return true;
+}
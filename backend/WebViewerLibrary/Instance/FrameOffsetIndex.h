@@ -0,0 +1,79 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <istream>
+#include <stdint.h>
+#include <stddef.h>
+#include <json/value.h>
+
+/** FrameOffsetIndex [@Entity]
+ *
+ * Position of the PixelData of each frame within a DICOM file, so a frame
+ * can be served without parsing the file again (or even without reading the
+ * whole file, see `DicomRepository::getDicomFrame`).
+ *
+ * A frame is made of one or more segments of the file: the fragments of the
+ * frame for encapsulated transfer syntaxes (Basic Offset Table, one fragment
+ * per frame, or all the fragments for single frame instances), a single
+ * segment for native transfer syntaxes.  The content of a frame is the
+ * concatenation of its segments, ie. the content of
+ * `/instances/{id}/frames/{n}/raw`.
+ *
+ */
+class FrameOffsetIndex
+{
+public:
+  struct Segment
+  {
+    uint64_t offset;
+    uint64_t size;
+  };
+
+  FrameOffsetIndex();
+
+  // Returns false if the layout of the file is not supported (big endian or
+  // deflated transfer syntax, fragments without offset table in multiframe
+  // instances, bits allocated not multiple of 8, ...).
+  bool Build(const void* dicom, size_t size);
+
+  void Serialize(Json::Value& target) const;
+  bool Unserialize(const Json::Value& source); // false if invalid or from another version
+
+  const std::string& GetTransferSyntax() const
+  {
+    return transferSyntax_;
+  }
+
+  uint64_t GetFileSize() const
+  {
+    return fileSize_;
+  }
+
+  uint64_t GetPixelDataOffset() const
+  {
+    return pixelDataOffset_;
+  }
+
+  unsigned int GetFramesCount() const
+  {
+    return frames_.empty() ? 0 : static_cast<unsigned int>(frames_.size() - 1);
+  }
+
+  // Copies the frame from the DICOM file loaded in memory.
+  // Throws ErrorCode_ParameterOutOfRange or ErrorCode_CorruptedFile.
+  void ExtractFrame(std::string& frame, const void* dicom, size_t size, unsigned int frameIndex) const;
+
+  // Reads the frame from the DICOM file (ranged reads); returns false if the
+  // file can't be read.
+  bool ReadFrame(std::string& frame, std::istream& file, unsigned int frameIndex) const;
+
+private:
+  uint64_t _getFrameSize(unsigned int frameIndex) const;
+
+  std::string           transferSyntax_;
+  uint64_t              fileSize_;
+  uint64_t              pixelDataOffset_;
+  std::vector<Segment>  segments_;  // in file order
+  std::vector<size_t>   frames_;    // index of the first segment of each frame, plus segments_.size()
+};
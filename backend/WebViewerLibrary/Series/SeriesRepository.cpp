@@ -118,7 +118,7 @@ std::auto_ptr<Series> SeriesRepository::GenerateSeriesInfo(const std::string& se
   _dicomRepository->getDicomFile(middleInstanceId, dicom);
 
   // Clean middle instance's dicom file (at scope end)
-  DicomRepository::ScopedDecref autoDecref(_dicomRepository, middleInstanceId);
+  DicomRepository::ScopedDecref autoDecref(_dicomRepository, middleInstanceId, dicom);
 
   // Get middle instance's tags (the DICOM meta-informations)
   Orthanc::DicomMap dicomMapToFillTags1;
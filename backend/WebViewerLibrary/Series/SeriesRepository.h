@@ -29,6 +29,7 @@ public:
   // @throws Orthanc::OrthancException(OrthancPluginErrorCode_InexistentItem)
   std::auto_ptr<Series> GetSeries(const std::string& seriesId, bool getInstanceTags = true);
   void EnableCachingInMetadata(bool enable);
+  bool IsCachingInMetadataEnabled() const { return _cachingInMetadataEnabled; }
 
 private:
 
@@ -24,8 +24,11 @@
 #include "ViewerToolbox.h"
 
 #include <boost/regex.hpp>
+#include <boost/foreach.hpp>
+#include <OrthancException.h>
 
 #include "Series/SeriesHelpers.h"
+#include "Series/SeriesRepository.h"
 
 namespace OrthancPlugins
 {
@@ -62,6 +65,24 @@ namespace OrthancPlugins
       result["Slices"].append(slice);
     }
 
+    // The qualities of the series, for the prefetch policy.  When the series
+    // information is cached in the metadata, it is generated here for the
+    // series route too (ie. when a study is opened, see
+    // ViewerPrefetchPolicy::ApplyStudy()).
+    result["AvailableQualities"] = Json::arrayValue;
+    try
+    {
+      std::auto_ptr<Series> info = seriesRepository_->GetSeries(seriesId, seriesRepository_->IsCachingInMetadataEnabled());
+      BOOST_FOREACH(ImageQuality quality, info->GetOrderedImageQualities())
+      {
+        result["AvailableQualities"].append(quality.toString());
+      }
+    }
+    catch (Orthanc::OrthancException&)
+    {
+      // not an image series (ie. SR), there is nothing to prefetch
+    }
+
     content = result.toStyledString();
 
     return true;
@@ -26,6 +26,8 @@
 
 #include <orthanc/OrthancCPlugin.h>
 
+class SeriesRepository;
+
 namespace OrthancPlugins
 {
   class SeriesInformationAdapter : public ICacheFactory
@@ -33,12 +35,15 @@ namespace OrthancPlugins
   private:
     OrthancPluginContext* context_;
     CacheScheduler&       cache_;
+    SeriesRepository*     seriesRepository_;
 
   public:
     SeriesInformationAdapter(OrthancPluginContext* context,
-                             CacheScheduler&       cache) : 
+                             CacheScheduler&       cache,
+                             SeriesRepository*     seriesRepository) : 
       context_(context),
-      cache_(cache)
+      cache_(cache),
+      seriesRepository_(seriesRepository)
     {
     }
 
@@ -0,0 +1,317 @@
+#include "BackgroundGovernor.h"
+
+#include <algorithm>
+#include <vector>
+
+#if defined(_WIN32)
+#  include <windows.h>
+#elif defined(__linux__)
+#  include <sys/resource.h>
+#  include <sys/syscall.h>
+#  include <unistd.h>
+#endif
+
+namespace OrthancPlugins
+{
+  const size_t BackgroundGovernor::MAX_LATENCY_SAMPLES;
+  const unsigned int BackgroundGovernor::INTERACTIVE_MAX_JOBS;
+
+  // "nice" value of the background threads (the interactive requests run at 0)
+  static const int BACKGROUND_NICENESS = 10;
+
+  static uint64_t GetNativeThreadId()
+  {
+#if defined(_WIN32)
+    return static_cast<uint64_t>(::GetCurrentThreadId());
+#elif defined(__linux__)
+    return static_cast<uint64_t>(syscall(SYS_gettid));
+#else
+    return 0;
+#endif
+  }
+
+
+  // Can be called from any thread of the process.  On Linux, the niceness is
+  // a property of each thread, and lowering it back requires the right to
+  // do so (CAP_SYS_NICE or RLIMIT_NICE): it is left unchanged otherwise.
+  static void SetNativeThreadPriority(uint64_t threadId,
+                                      bool background)
+  {
+#if defined(_WIN32)
+    HANDLE thread = OpenThread(THREAD_SET_INFORMATION, FALSE, static_cast<DWORD>(threadId));
+    if (thread != NULL)
+    {
+      ::SetThreadPriority(thread, background ? THREAD_PRIORITY_BELOW_NORMAL : THREAD_PRIORITY_NORMAL);
+      CloseHandle(thread);
+    }
+#elif defined(__linux__)
+    setpriority(PRIO_PROCESS, static_cast<id_t>(threadId), background ? BACKGROUND_NICENESS : 0);
+#endif
+  }
+
+
+  // the governors are owned by their CacheScheduler, not by the threads
+  static void DontDelete(BackgroundGovernor*)
+  {
+  }
+
+  static void DontDeleteJob(BackgroundGovernor::BackgroundJob*)
+  {
+  }
+
+  boost::thread_specific_ptr<BackgroundGovernor>  BackgroundGovernor::current_(DontDelete);
+  boost::thread_specific_ptr<BackgroundGovernor::BackgroundJob>  BackgroundGovernor::currentJob_(DontDeleteJob);
+
+
+  BackgroundGovernor::BackgroundJob::BackgroundJob(BackgroundGovernor& governor) :
+    governor_(governor),
+    acquired_(false),
+    threadId_(GetNativeThreadId()),
+    awaited_(false)
+  {
+    boost::mutex::scoped_lock lock(governor_.mutex_);
+
+    while (!governor_.stopped_ &&
+           governor_.runningJobs_ >= governor_.GetAllowedJobs())
+    {
+      governor_.changed_.wait(lock);
+    }
+
+    if (!governor_.stopped_)
+    {
+      governor_.runningJobs_++;
+      acquired_ = true;
+      currentJob_.reset(this);
+    }
+  }
+
+
+  BackgroundGovernor::BackgroundJob::~BackgroundJob()
+  {
+    if (acquired_)
+    {
+      currentJob_.reset(NULL);
+
+      {
+        boost::mutex::scoped_lock lock(governor_.mutex_);
+        governor_.runningJobs_--;
+
+        if (awaited_)
+        {
+          // the thread runs other jobs afterwards
+          SetNativeThreadPriority(threadId_, true);
+        }
+      }
+
+      governor_.changed_.notify_all();
+    }
+  }
+
+
+  void BackgroundGovernor::BackgroundJob::SignalAwaited()
+  {
+    if (governor_.IsBackgroundThread())
+    {
+      // ie. a factory waiting for an item computed by another prefetcher
+      return;
+    }
+
+    {
+      boost::mutex::scoped_lock lock(governor_.mutex_);
+      if (awaited_)
+      {
+        return;
+      }
+
+      awaited_ = true;
+      SetNativeThreadPriority(threadId_, false);
+    }
+
+    // the job might be waiting for its turn in YieldToInteractive()
+    governor_.changed_.notify_all();
+  }
+
+
+  BackgroundGovernor::InteractiveScope::InteractiveScope(BackgroundGovernor& governor) :
+    governor_(governor),
+    counted_(!governor.IsBackgroundThread())  // ie. a factory calling the cache from a prefetcher
+  {
+    if (counted_)
+    {
+      boost::mutex::scoped_lock lock(governor_.mutex_);
+      governor_.interactive_++;
+    }
+  }
+
+
+  BackgroundGovernor::InteractiveScope::~InteractiveScope()
+  {
+    if (counted_)
+    {
+      {
+        boost::mutex::scoped_lock lock(governor_.mutex_);
+        governor_.interactive_--;
+      }
+
+      governor_.changed_.notify_all();
+    }
+  }
+
+
+  BackgroundGovernor::BackgroundGovernor(unsigned int maxJobs) :
+    maxJobs_(std::max(maxJobs, 1u)),
+    runningJobs_(0),
+    interactive_(0),
+    stopped_(false),
+    interactiveRequests_(0),
+    interactiveRequestsUnderLoad_(0)
+  {
+  }
+
+
+  void BackgroundGovernor::SetMaxJobs(unsigned int maxJobs)
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      maxJobs_ = std::max(maxJobs, 1u);
+    }
+
+    changed_.notify_all();
+  }
+
+
+  void BackgroundGovernor::Stop()
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      stopped_ = true;
+    }
+
+    changed_.notify_all();
+  }
+
+
+  void BackgroundGovernor::RegisterBackgroundThread()
+  {
+    current_.reset(this);
+    SetNativeThreadPriority(GetNativeThreadId(), true);
+  }
+
+
+  bool BackgroundGovernor::IsBackgroundThread() const
+  {
+    return current_.get() == this;
+  }
+
+
+  BackgroundGovernor::BackgroundJob* BackgroundGovernor::GetCurrentJob()
+  {
+    return currentJob_.get();
+  }
+
+
+  unsigned int BackgroundGovernor::GetAllowedJobs() const
+  {
+    return (interactive_ > 0 ?
+            std::min(maxJobs_, INTERACTIVE_MAX_JOBS) :
+            maxJobs_);
+  }
+
+
+  bool BackgroundGovernor::HasRunningJobs()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return runningJobs_ > 0;
+  }
+
+
+  void BackgroundGovernor::YieldToInteractive()
+  {
+    BackgroundGovernor* governor = current_.get();
+    BackgroundJob* job = currentJob_.get();
+    if (governor == NULL ||
+        job == NULL)
+    {
+      return;
+    }
+
+    {
+      boost::mutex::scoped_lock lock(governor->mutex_);
+      if (job->awaited_ ||
+          governor->runningJobs_ <= governor->GetAllowedJobs())
+      {
+        return;
+      }
+
+      // the slot is given back until it is this job's turn again, or until
+      // an interactive request waits for it
+      governor->runningJobs_--;
+      governor->changed_.notify_all();
+
+      while (!governor->stopped_ &&
+             !job->awaited_ &&
+             governor->runningJobs_ >= governor->GetAllowedJobs())
+      {
+        governor->changed_.wait(lock);
+      }
+
+      // the job finishes anyway if the governor has been stopped, its slot
+      // is released by ~BackgroundJob()
+      governor->runningJobs_++;
+    }
+  }
+
+
+  void BackgroundGovernor::RecordInteractiveLatency(double milliseconds,
+                                                    bool underLoad)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    LatencySamples& samples = (underLoad ? latenciesUnderLoad_ : latencies_);
+    samples.push_back(milliseconds);
+    if (samples.size() > MAX_LATENCY_SAMPLES)
+    {
+      samples.pop_front();
+    }
+
+    interactiveRequests_++;
+    if (underLoad)
+    {
+      interactiveRequestsUnderLoad_++;
+    }
+  }
+
+
+  double BackgroundGovernor::ComputePercentile(const LatencySamples& samples,
+                                               double percentile)
+  {
+    if (samples.empty())
+    {
+      return 0;
+    }
+
+    std::vector<double> sorted(samples.begin(), samples.end());
+    size_t rank = static_cast<size_t>(percentile * static_cast<double>(sorted.size() - 1) + 0.5);
+    std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+    return sorted[rank];
+  }
+
+
+  void BackgroundGovernor::GetStatistics(Statistics& target)
+  {
+    LatencySamples latencies, latenciesUnderLoad;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      target.runningJobs = runningJobs_;
+      target.maxJobs = maxJobs_;
+      target.interactiveRequests = interactiveRequests_;
+      target.interactiveRequestsUnderLoad = interactiveRequestsUnderLoad_;
+      latencies = latencies_;
+      latenciesUnderLoad = latenciesUnderLoad_;
+    }
+
+    target.interactiveP99LatencyMs = ComputePercentile(latencies, 0.99);
+    target.interactiveP99LatencyUnderLoadMs = ComputePercentile(latenciesUnderLoad, 0.99);
+  }
+}
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <deque>
+#include <stdint.h>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/tss.hpp>
+
+namespace OrthancPlugins
+{
+  /** BackgroundGovernor
+   *
+   * Shares the CPU between the interactive requests (ie. an image displayed
+   * by a viewer) and the background work of the short term cache (prefetch
+   * and precompute of the new instances):
+   *  - at most "maxJobs" background jobs run at once, whatever the number of
+   *    prefetcher threads of each bundle,
+   *  - while an interactive request is computing an item, the background
+   *    work is throttled to INTERACTIVE_MAX_JOBS job(s): no other job starts
+   *    and the jobs in excess pause between two frames (see
+   *    YieldToInteractive()).  The prefetching is slowed down, never
+   *    suspended, so that it still progresses under steady viewing,
+   *  - the background threads run at a lower OS priority,
+   *  - a job computing an item that an interactive request waits for (see
+   *    SignalAwaited()) does not give way anymore, and its thread gets the
+   *    normal priority back until the end of the job.
+   *
+   * This is the only place where the background work gives way to the
+   * interactive requests: the prefetch queues don't suspend themselves.
+   *
+   * The latency of the interactive requests is recorded separately whether
+   * background jobs were running or not, to measure the cost of the
+   * background work.
+   *
+   * Thread-safe.
+   *
+   */
+  class BackgroundGovernor : public boost::noncopyable
+  {
+  public:
+    struct Statistics
+    {
+      uint32_t  runningJobs;
+      uint32_t  maxJobs;
+      uint64_t  interactiveRequests;             // all the recorded requests
+      uint64_t  interactiveRequestsUnderLoad;    // requests received while background jobs were running
+      double    interactiveP99LatencyMs;         // over the last samples, without background jobs (0 if none)
+      double    interactiveP99LatencyUnderLoadMs;  // over the last samples, with background jobs (0 if none)
+    };
+
+    // Waits for the right to run a background job, released on destruction
+    class BackgroundJob : public boost::noncopyable
+    {
+    private:
+      BackgroundGovernor&  governor_;
+      bool                 acquired_;
+      uint64_t             threadId_;  // native identifier of the thread running the job
+      bool                 awaited_;   // protected by the mutex of the governor
+
+      friend class BackgroundGovernor;
+
+    public:
+      explicit BackgroundJob(BackgroundGovernor& governor);
+
+      ~BackgroundJob();
+
+      // false if the governor has been stopped
+      bool IsAcquired() const
+      {
+        return acquired_;
+      }
+
+      // Called by an interactive request (from its own thread) that waits
+      // for an item computed by this job, while the job is running.  Does
+      // nothing if the caller is a background thread.
+      void SignalAwaited();
+    };
+
+    // Marks an interactive request as computing an item
+    class InteractiveScope : public boost::noncopyable
+    {
+    private:
+      BackgroundGovernor&  governor_;
+      bool                 counted_;
+
+    public:
+      explicit InteractiveScope(BackgroundGovernor& governor);
+
+      ~InteractiveScope();
+    };
+
+    // number of background jobs that keep running while interactive
+    // requests are computing items
+    static const unsigned int INTERACTIVE_MAX_JOBS = 1;
+
+  private:
+    // the percentiles are computed over the last MAX_LATENCY_SAMPLES requests
+    static const size_t MAX_LATENCY_SAMPLES = 1000;
+
+    typedef std::deque<double>  LatencySamples;  // in milliseconds
+
+    boost::mutex               mutex_;
+    boost::condition_variable  changed_;
+    unsigned int               maxJobs_;
+    unsigned int               runningJobs_;
+    unsigned int               interactive_;
+    bool                       stopped_;
+    uint64_t                   interactiveRequests_;
+    uint64_t                   interactiveRequestsUnderLoad_;
+    LatencySamples             latencies_;
+    LatencySamples             latenciesUnderLoad_;
+
+    // the governor of the current thread, if it is a background thread
+    static boost::thread_specific_ptr<BackgroundGovernor>  current_;
+
+    // the job run by the current thread, if any
+    static boost::thread_specific_ptr<BackgroundJob>  currentJob_;
+
+    // the number of jobs allowed to run (requires mutex_ to be locked)
+    unsigned int GetAllowedJobs() const;
+
+    static double ComputePercentile(const LatencySamples& samples,
+                                    double percentile);
+
+  public:
+    explicit BackgroundGovernor(unsigned int maxJobs);
+
+    void SetMaxJobs(unsigned int maxJobs);
+
+    // Wakes up the waiting threads, no background job is started anymore
+    void Stop();
+
+    // Called once by each background thread when it starts
+    void RegisterBackgroundThread();
+
+    bool IsBackgroundThread() const;
+
+    bool HasRunningJobs();
+
+    // Called by the background jobs between two units of work (e.g. the
+    // frames of an instance): while interactive requests are being
+    // computed, the jobs in excess of INTERACTIVE_MAX_JOBS give their slot
+    // back and wait for their turn.  Does nothing outside of the background
+    // jobs, nor in an awaited job.
+    static void YieldToInteractive();
+
+    // The job run by the current thread, NULL if none
+    static BackgroundJob* GetCurrentJob();
+
+    // "underLoad" tells whether background jobs were running when the
+    // request has been received (see HasRunningJobs())
+    void RecordInteractiveLatency(double milliseconds,
+                                  bool underLoad);
+
+    void GetStatistics(Statistics& target);
+  };
+}
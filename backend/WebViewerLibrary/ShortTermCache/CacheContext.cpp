@@ -1,7 +1,27 @@
 #include "CacheContext.h"
 #include "Series/SeriesRepository.h"
 #include <OrthancException.h>
+#include <Toolbox.h>
+#include <algorithm>
 #include <boost/foreach.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+// While a series is being received (ie. C-STORE of a CT), its information is
+// invalidated and its new instances are prefetched once no instance has been
+// received for SERIES_DEBOUNCE_MS, or at most every SERIES_MAX_DELAY_MS.  Its
+// information is also invalidated as soon as its first new instance arrives,
+// so that the previous one is never served after this instance.
+static const long SERIES_DEBOUNCE_MS = 2000;
+static const long SERIES_MAX_DELAY_MS = 10000;
+
+// The frames of a multi-frame instance are precomputed by jobs of at most
+// INGEST_FRAMES_PER_JOB frames, so that a cine neither holds a prefetcher for
+// minutes nor all its images in memory at once.  The dicom file stays in the
+// cache of the DicomRepository between these jobs.
+static const unsigned int INGEST_FRAMES_PER_JOB = 16;
+
+// A new pack file is started once the current one reaches this size
+static const uint64_t PACK_FILE_SIZE = 64 * 1024 * 1024;
 
 CacheContext::CacheContext(const std::string& path,
                            OrthancPluginContext* pluginContext,
@@ -36,11 +56,78 @@ CacheContext::~CacheContext()
 
   scheduler_.reset(NULL);
   cacheManager_.reset(NULL);
+  packStorage_.reset(NULL);
+  sharedDirectory_.reset(NULL);
+}
+
+
+void CacheContext::EnablePackFiles(const std::string& path)
+{
+  packStorage_.reset(new OrthancPlugins::PackStorage(path, PACK_FILE_SIZE));
+  GetScheduler().SetPackStorage(packStorage_.get());
+}
+
+
+void CacheContext::EnableSharedDirectory(const std::string& path,
+                                         uint64_t maxSize)
+{
+  sharedDirectory_.reset(new OrthancPlugins::SharedCacheDirectory(path, maxSize));
+
+  // the series information is invalidated by the node that receives the
+  // instances, it is not shared
+  GetScheduler().SetSharedDirectory(CacheBundle_DecodedImage, sharedDirectory_.get());
+
+  OrthancPluginLogWarning(pluginContext_, ("Web viewer: the decoded images are shared with the other nodes in " + path).c_str());
+}
+
+
+void CacheContext::HandleNewSeriesInstances(const std::string& seriesId,
+                                            const NewInstances& instances)
+{
+  // when receiving new instances, we must also invalidate their parent series
+  logger_->LogCacheDebugInfo("newInstancesThread: invalidating series " + seriesId + " (" +
+                             boost::lexical_cast<std::string>(instances.size()) + " new instances)");
+  GetScheduler().Invalidate(OrthancPlugins::CacheBundle_SeriesInformation, seriesId);
+
+  // also start pre-computing all the frames of the instances, at all the qualities
+  if (prefetchOnInstanceStored_)
+  {
+    try {
+      std::auto_ptr<Series> series = seriesRepository_->GetSeries(seriesId);  // TODO: clarify difference between series cache and series repository (there's clearly a lot of redundancy there !)
+
+      std::vector<ImageQuality::EImageQuality> qualitiesToPrefetch = series->GetOrderedImageQualities();
+      size_t framesCount = 0;
+
+      for (NewInstances::const_iterator instance = instances.begin(); instance != instances.end(); ++instance) {
+        for (unsigned int firstFrame = 0; firstFrame < instance->second; firstFrame += INGEST_FRAMES_PER_JOB) {
+          std::vector<std::string> itemsToPrefetch;
+          for (unsigned int frame = firstFrame; frame < instance->second && frame < firstFrame + INGEST_FRAMES_PER_JOB; frame++) {
+            BOOST_FOREACH(ImageQuality quality, qualitiesToPrefetch) {
+              itemsToPrefetch.push_back(instance->first + "/" + boost::lexical_cast<std::string>(frame) + "/" + quality.toProcessingPolicytString());
+            }
+          }
+          GetScheduler().Precompute(OrthancPlugins::CacheBundle_DecodedImage, itemsToPrefetch); // single job: the file is loaded once and each frame decoded once for all qualities
+        }
+
+        framesCount += instance->second;
+      }
+
+      OrthancPluginLogInfo(pluginContext_, ("Web viewer: precomputing " + boost::lexical_cast<std::string>(framesCount) + " frames of " +
+                                            boost::lexical_cast<std::string>(instances.size()) + " new instances of series " + seriesId).c_str());
+    } catch (Orthanc::OrthancException& ex) {
+      OrthancPluginLogWarning(pluginContext_, (std::string("Exception while trying to prefetch instances: ") + ex.What()).c_str());
+    } catch (...) {
+      OrthancPluginLogError(pluginContext_, (std::string("Unexpected exception while trying to prefetch instances")).c_str());
+    }
+  }
 }
 
 
 void CacheContext::NewInstancesThread(CacheContext* that)
 {
+  // the new instances by series, until the series is stable
+  PendingSeriesMap pendingSeries;
+
   while (!that->stop_)
   {
     try {
@@ -56,34 +143,74 @@ void CacheContext::NewInstancesThread(CacheContext* that)
         that->logger_->LogCacheDebugInfo("newInstancesThread: invalidating instance " + instanceId);
         that->GetScheduler().Invalidate(OrthancPlugins::CacheBundle_DecodedImage, instanceId);
 
-        // when receiving a new instance, we must also invalidate the parent series of the instance
         std::string uri = "/instances/" + std::string(instanceId);
         Json::Value instance;
         if (OrthancPlugins::GetJsonFromOrthanc(instance, that->pluginContext_, uri))
         {
-          std::string seriesId = instance["ParentSeries"].asString();
-          that->logger_->LogCacheDebugInfo("newInstancesThread: invalidating series " + seriesId);
-          that->GetScheduler().Invalidate(OrthancPlugins::CacheBundle_SeriesInformation, seriesId);
+          boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+
+          PendingSeriesMap::iterator found = pendingSeries.find(instance["ParentSeries"].asString());
+          if (found == pendingSeries.end())
+          {
+            found = pendingSeries.insert(std::make_pair(instance["ParentSeries"].asString(), PendingSeries())).first;
+            found->second.firstReceived = now;
 
-          // also start pre-computing the images for the instance
-          if (that->prefetchOnInstanceStored_)
+            that->logger_->LogCacheDebugInfo("newInstancesThread: invalidating series " + found->first);
+            that->GetScheduler().Invalidate(OrthancPlugins::CacheBundle_SeriesInformation, found->first);
+          }
+
+          // the frames count is a main dicom tag of the instances
+          unsigned int framesCount = 1;
+          if (instance["MainDicomTags"].isMember("NumberOfFrames"))
           {
-            try {
-              std::auto_ptr<Series> series = that->seriesRepository_->GetSeries(seriesId);  // TODO: clarify difference between series cache and series repository (there's clearly a lot of redundancy there !)
-
-              std::vector<ImageQuality::EImageQuality> qualitiesToPrefetch = series->GetOrderedImageQualities();
-              BOOST_FOREACH(ImageQuality quality, qualitiesToPrefetch) {
-                that->GetScheduler().Prefetch(OrthancPlugins::CacheBundle_DecodedImage, instanceId + "/0/" + quality.toProcessingPolicytString()); // TODO: for multi-frame images, we should prefetch all frames and not onlyt the first one !
-              }
-            } catch (Orthanc::OrthancException& ex) {
-              OrthancPluginLogWarning(that->pluginContext_, (std::string("Exception while trying to prefetch instances: ") + ex.What()).c_str());
-            } catch (...) {
-              OrthancPluginLogError(that->pluginContext_, (std::string("Unexpected exception while trying to prefetch instances")).c_str());
+            try
+            {
+              framesCount = std::max(1u, boost::lexical_cast<unsigned int>(Orthanc::Toolbox::StripSpaces(instance["MainDicomTags"]["NumberOfFrames"].asString())));
+            }
+            catch (boost::bad_lexical_cast&)
+            {
             }
           }
+
+          found->second.instances.push_back(std::make_pair(instanceId, framesCount));
+          found->second.lastReceived = now;
         }
         that->logger_->LogCacheDebugInfo("newInstancesThread: done handling " + instanceId);
       }
+
+      // handle the series that are stable (or that have been received for too long)
+      boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+      for (PendingSeriesMap::iterator it = pendingSeries.begin(); it != pendingSeries.end(); )
+      {
+        if (now - it->second.lastReceived >= boost::posix_time::milliseconds(SERIES_DEBOUNCE_MS) ||
+            now - it->second.firstReceived >= boost::posix_time::milliseconds(SERIES_MAX_DELAY_MS))
+        {
+          std::string seriesId = it->first;
+          NewInstances instances;
+          instances.swap(it->second.instances);
+          pendingSeries.erase(it++);
+
+          that->HandleNewSeriesInstances(seriesId, instances);
+        }
+        else
+        {
+          ++it;
+        }
+      }
+    } catch (Orthanc::OrthancException& ex) {
+      OrthancPluginLogWarning(that->pluginContext_, (std::string("Exception in newInstanceThread: ") + ex.What()).c_str());
+    } catch (...) {
+      OrthancPluginLogError(that->pluginContext_, (std::string("Unexpected exception in newInstanceThread")).c_str());
+    }
+  }
+
+  // Orthanc is stopping: the information of the pending series might have
+  // been computed again with only a part of their new instances, it must
+  // not be served after the restart (their precomputing is dropped)
+  for (PendingSeriesMap::const_iterator it = pendingSeries.begin(); it != pendingSeries.end(); ++it)
+  {
+    try {
+      that->GetScheduler().Invalidate(OrthancPlugins::CacheBundle_SeriesInformation, it->first);
     } catch (Orthanc::OrthancException& ex) {
       OrthancPluginLogWarning(that->pluginContext_, (std::string("Exception in newInstanceThread: ") + ex.What()).c_str());
     } catch (...) {
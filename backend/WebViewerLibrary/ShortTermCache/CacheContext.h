@@ -2,6 +2,9 @@
 
 #include <boost/thread.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <map>
+#include <vector>
 
 #include <IDynamicObject.h>
 #include <SystemToolbox.h>
@@ -11,6 +14,8 @@
 
 #include "CacheManager.h"
 #include "CacheScheduler.h"
+#include "SharedCacheDirectory.h"
+#include "PackStorage.h"
 #include "json/json.h"
 #include "ViewerToolbox.h"
 
@@ -23,6 +28,11 @@ enum CacheBundle
   CacheBundle_SeriesInformation = 3
 };
 
+// Version of the format of the cached items of each bundle, to change when
+// this format changes: only the items of this bundle are then dropped
+static const char* const CACHE_DECODED_IMAGE_VERSION = "1";
+static const char* const CACHE_SERIES_INFORMATION_VERSION = "1";
+
 class CacheLogger
 {
   bool debugLogsEnabled_;
@@ -56,10 +66,24 @@ private:
     }
   };
 
+  typedef std::vector<std::pair<std::string, unsigned int> >  NewInstances;  // instance, frames count
+
+  // the instances received for a series, handled once the series is stable
+  struct PendingSeries
+  {
+    NewInstances              instances;
+    boost::posix_time::ptime  firstReceived;
+    boost::posix_time::ptime  lastReceived;
+  };
+
+  typedef std::map<std::string, PendingSeries>  PendingSeriesMap;
+
   OrthancPluginContext* pluginContext_;
   Orthanc::FilesystemStorage  storage_;
   Orthanc::SQLite::Connection  db_;
 
+  std::auto_ptr<OrthancPlugins::SharedCacheDirectory>  sharedDirectory_;
+  std::auto_ptr<OrthancPlugins::PackStorage>  packStorage_;
   std::auto_ptr<OrthancPlugins::CacheManager>  cacheManager_;
   std::auto_ptr<OrthancPlugins::CacheScheduler>  scheduler_;
   std::auto_ptr<CacheLogger> logger_;
@@ -73,6 +97,11 @@ private:
 
   static void NewInstancesThread(CacheContext* cache);
 
+  // invalidates the series information and precomputes all the frames of
+  // the new instances
+  void HandleNewSeriesInstances(const std::string& seriesId,
+                                const NewInstances& instances);
+
 public:
 
   CacheContext(const std::string& path,
@@ -82,6 +111,15 @@ public:
                SeriesRepository* seriesRepository);
   ~CacheContext();
 
+  // Shares the decoded images with the other Orthanc nodes that use the
+  // same directory (maxSize in bytes)
+  void EnableSharedDirectory(const std::string& path,
+                             uint64_t maxSize);
+
+  // Stores the cached files in large append-only pack files, in this
+  // directory, instead of one file per item
+  void EnablePackFiles(const std::string& path);
+
   OrthancPlugins::CacheScheduler& GetScheduler()
   {
     return *scheduler_;
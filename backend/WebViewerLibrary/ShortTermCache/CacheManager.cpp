@@ -20,11 +20,19 @@
 
 
 #include "CacheManager.h"
+#include "FrequencySketch.h"
+#include "PackStorage.h"
+#include "SharedCacheDirectory.h"
 
 #include <Toolbox.h>
+#include <OrthancException.h>
 #include <SQLite/Transaction.h>
 
 #include <boost/lexical_cast.hpp>
+#include <algorithm>
+#include <list>
+#include <set>
+#include <vector>
 
 
 namespace OrthancPlugins
@@ -106,6 +114,13 @@ namespace OrthancPlugins
       return maxSpace_;
     }
 
+    BundleQuota Scale(uint64_t percentage) const
+    {
+      // 0 (no limit) stays 0
+      return BundleQuota(static_cast<uint32_t>(static_cast<uint64_t>(maxCount_) * percentage / 100),
+                         maxSpace_ / 100 * percentage);
+    }
+
     bool IsSatisfied(const Bundle& bundle) const
     {
       if (maxCount_ != 0 &&
@@ -125,8 +140,106 @@ namespace OrthancPlugins
   };
 
 
+  // The LRU order is kept in memory: reading an item only moves it to the
+  // back of its bundle's recency list.  The new order is persisted lazily, by
+  // batches of RECENCY_FLUSH_SIZE updates of the "seq" column.  The insertions
+  // and deletions are still written synchronously, so that a crash only loses
+  // the latest recency information, never an entry.
+  static const size_t RECENCY_FLUSH_SIZE = 256;
+
+  // Segmented LRU: the speculative items (prefetch, precompute of the new
+  // instances) enter the probationary segment and are only moved to the
+  // protected segment once they are actually read.  The probationary
+  // segment is evicted first, so that scanning a large study cannot evict
+  // the images that are really viewed.  The protected segment is limited to
+  // PROTECTED_SHARE percent of the quota, its least recently used items are
+  // moved back to the probationary segment.
+  static const uint64_t PROTECTED_SHARE = 80;
+
+  // The files of the evicted items are removed by the maintenance thread of
+  // the CacheScheduler (see TakeRemovedFiles()), by batches, outside of the
+  // cache lock.  If this thread does not keep up, the files in excess are
+  // recorded in the CacheStaleFiles table, as those of the cleared bundles
+  // (see RemoveStaleFiles()): the eviction never removes files itself.
+  static const size_t MAX_PENDING_REMOVALS = 4096;
+
+  // The evicted items are only listed for the CacheScheduler (see
+  // TakeEvictedItems()), the oldest ones are forgotten if it does not keep up
+  static const size_t MAX_EVICTED_ITEMS = 16384;
+
+  // The eviction in a bundle that is not loaded yet reads its next entries
+  // by batches of LOAD_BATCH_SIZE rows
+  static const size_t LOAD_BATCH_SIZE = 1000;
+
+  // ReclaimSpace() evicts the items of the bundles that exceed
+  // HIGH_WATERMARK percent of their quota, down to LOW_WATERMARK percent,
+  // so that the store path seldom has to make room by itself
+  static const uint64_t HIGH_WATERMARK = 95;
+  static const uint64_t LOW_WATERMARK = 90;
+
+  // Counters per row of the frequency sketch (4 rows of 1 byte counters)
+  static const size_t FREQUENCY_SKETCH_WIDTH = 65536;
+
+
+  namespace
+  {
+    // An entry moved by CacheManager::CompactPackFiles()
+    struct PackMove
+    {
+      int64_t      seq;
+      int          bundle;
+      std::string  item;
+      std::string  previous;
+      std::string  uuid;     // empty if the entry cannot be read anymore
+      uint64_t     size;
+    };
+  }
+
   struct CacheManager::PImpl
   {
+    struct Entry
+    {
+      std::string  item;
+      std::string  uuid;
+      uint64_t     size;
+      int64_t      seq;           // position in the LRU order
+      int64_t      persistedSeq;  // "seq" of the row in the database
+      bool         isProtected;   // segment of the entry (not persisted)
+    };
+
+    typedef std::list<Entry>                            Recency;  // front = least recently used
+    typedef std::map<std::string, Recency::iterator>    Items;
+
+    // The entries of the bundles are read from the database after the
+    // startup, by increasing "seq" (see CacheManager::LoadEntries()).  Until
+    // a bundle is loaded, its index holds the entries up to "loadedSeq" and
+    // those used since the startup: the other entries are looked up in the
+    // database when they are accessed, and the eviction reads the next
+    // entries when it reaches "loadedSeq".
+    struct BundleEntries
+    {
+      Recency   probation;
+      Recency   protection;
+      Items     items;
+      uint32_t  protectedCount;
+      uint64_t  protectedSpace;
+      uint64_t  space;
+      bool      loaded;
+      int64_t   loadedSeq;
+
+      BundleEntries() : protectedCount(0), protectedSpace(0), space(0), loaded(true), loadedSeq(0)
+      {
+      }
+
+      Recency& GetSegment(const Entry& entry)
+      {
+        return entry.isProtected ? protection : probation;
+      }
+    };
+
+    typedef std::map<int, BundleEntries>          Entries;
+    typedef std::pair<int, std::string>           Touched;  // bundle, item
+
     OrthancPluginContext* context_;
     Orthanc::SQLite::Connection& db_;
     Orthanc::FilesystemStorage& storage_;
@@ -136,14 +249,294 @@ namespace OrthancPlugins
     BundleQuota  defaultQuota_;
     BundleQuotas  quotas_;
 
+    Entries  entries_;
+    std::vector<Touched>  touched_;  // entries whose "seq" is not persisted yet
+    int64_t  maxSeq_;
+
+    FrequencySketch  frequencies_;   // admission of the speculative items
+    uint64_t  promotedItems_;
+    uint64_t  rejectedItems_;
+
+    SharedCacheDirectory*  shared_;   // NULL if the files are private to this node
+    std::set<int>  sharedBundles_;
+    uint64_t  sharedHits_;
+
+    PackStorage*  packs_;   // NULL if each item has its own file
+
+    std::vector<std::string>  pendingRemovals_;  // files of the evicted items
+    std::vector<Touched>  evictedItems_;  // since the last TakeEvictedItems()
+    std::map<int, std::string>  versions_;  // format of the items of each bundle
+    uint64_t  reclaimedItems_;
+
     PImpl(OrthancPluginContext* context,
           Orthanc::SQLite::Connection& db,
           Orthanc::FilesystemStorage& storage) :
       context_(context),
       db_(db), 
       storage_(storage), 
-      sanityCheck_(false)
+      sanityCheck_(false),
+      maxSeq_(0),
+      frequencies_(FREQUENCY_SKETCH_WIDTH),
+      promotedItems_(0),
+      rejectedItems_(0),
+      shared_(NULL),
+      sharedHits_(0),
+      packs_(NULL),
+      reclaimedItems_(0)
+    {
+    }
+
+    bool IsShared(int bundle) const
+    {
+      return (shared_ != NULL &&
+              sharedBundles_.find(bundle) != sharedBundles_.end());
+    }
+
+    void RemoveFile(const std::string& uuid) const
+    {
+      // The files of the shared directory might be used by other nodes:
+      // they are only removed by SharedCacheDirectory::Cleanup(), or
+      // when their item is invalidated.  The space of the pack files is
+      // reclaimed by CompactPackFiles().
+      if (PackStorage::IsPackName(uuid))
+      {
+        if (packs_ != NULL)
+        {
+          packs_->Release(uuid);
+        }
+      }
+      else if (!SharedCacheDirectory::IsSharedName(uuid))
+      {
+        storage_.Remove(uuid, Orthanc::FileContentType_Unknown);
+      }
+    }
+
+    void ScheduleRemoval(const std::string& uuid)
+    {
+      if (pendingRemovals_.size() < MAX_PENDING_REMOVALS)
+      {
+        pendingRemovals_.push_back(uuid);
+      }
+      else
+      {
+        Orthanc::SQLite::Statement s(db_, SQLITE_FROM_HERE, "INSERT INTO CacheStaleFiles(fileUuid) VALUES(?)");
+        s.BindString(0, uuid);
+        s.Run();
+      }
+    }
+
+    // Removes an entry that has been evicted to make room in its bundle
+    void Evict(int bundle,
+               const std::string& item)
+    {
+      if (evictedItems_.size() >= MAX_EVICTED_ITEMS)
+      {
+        evictedItems_.erase(evictedItems_.begin());
+      }
+
+      evictedItems_.push_back(std::make_pair(bundle, item));
+      Remove(bundle, item);
+    }
+
+    BundleEntries& GetEntries(int bundle)
+    {
+      Entries::iterator entries = entries_.find(bundle);
+      if (entries != entries_.end())
+      {
+        return entries->second;
+      }
+
+      Bundles::const_iterator header = bundles_.find(bundle);
+
+      BundleEntries& target = entries_[bundle];
+      target.loaded = (header == bundles_.end() ||
+                       header->second.GetCount() == 0);
+      return target;
+    }
+
+    // Inserts an entry at its "seq" position in its segment, that is at the
+    // most recently used end for the new entries
+    void Insert(BundleEntries& entries,
+                const Entry& entry)
+    {
+      Recency& segment = entries.GetSegment(entry);
+
+      Recency::iterator position = segment.end();
+      while (position != segment.begin())
+      {
+        Recency::iterator previous = position;
+        --previous;
+        if (previous->seq <= entry.seq)
+        {
+          break;
+        }
+
+        position = previous;
+      }
+
+      entries.items[entry.item] = segment.insert(position, entry);
+      entries.space += entry.size;
+
+      if (entry.isProtected)
+      {
+        entries.protectedCount++;
+        entries.protectedSpace += entry.size;
+      }
+    }
+
+    // Reads the next entries of a bundle that is not loaded yet.  The
+    // segments are not persisted: the entries are read as protected, the
+    // protected segment is then limited by LimitProtectedSegment().
+    void LoadNext(int bundle,
+                  BundleEntries& entries,
+                  size_t maxCount)
+    {
+      Orthanc::SQLite::Statement s(db_, SQLITE_FROM_HERE, "SELECT seq, item, fileUuid, fileSize FROM Cache WHERE bundle=? AND seq>? ORDER BY seq LIMIT ?");
+      s.BindInt(0, bundle);
+      s.BindInt64(1, entries.loadedSeq);
+      s.BindInt64(2, maxCount);
+
+      size_t count = 0;
+      while (s.Step())
+      {
+        count++;
+        entries.loadedSeq = s.ColumnInt64(0);
+
+        // the entries that are already indexed have been used since the
+        // startup: their position in memory is more recent
+        if (entries.items.find(s.ColumnString(1)) == entries.items.end())
+        {
+          Insert(entries, MakeEntry(s.ColumnString(1), s.ColumnString(2), s.ColumnInt64(3), s.ColumnInt64(0), true));
+        }
+      }
+
+      if (count < maxCount)
+      {
+        entries.loaded = true;
+      }
+    }
+
+    // Reads the entries of a bundle that is not loaded yet until its least
+    // recently used protected entry is known
+    void LoadOldest(int bundle,
+                    BundleEntries& entries)
+    {
+      while (!entries.loaded &&
+             (entries.protection.empty() ||
+              entries.protection.front().seq > entries.loadedSeq))
+      {
+        LoadNext(bundle, entries, LOAD_BATCH_SIZE);
+      }
+    }
+
+    Items::iterator Lookup(int bundle,
+                           BundleEntries& entries,
+                           const std::string& item)
+    {
+      Items::iterator found = entries.items.find(item);
+      if (found != entries.items.end() ||
+          entries.loaded)
+      {
+        return found;
+      }
+
+      // not read yet, or not cached
+      Orthanc::SQLite::Statement s(db_, SQLITE_FROM_HERE, "SELECT seq, fileUuid, fileSize FROM Cache WHERE bundle=? AND item=?");
+      s.BindInt(0, bundle);
+      s.BindString(1, item);
+      if (!s.Step())
+      {
+        return entries.items.end();
+      }
+
+      Insert(entries, MakeEntry(item, s.ColumnString(1), s.ColumnInt64(2), s.ColumnInt64(0), true));
+      return entries.items.find(item);
+    }
+
+    Entry* Find(int bundle,
+                const std::string& item)
+    {
+      BundleEntries& entries = GetEntries(bundle);
+
+      Items::iterator found = Lookup(bundle, entries, item);
+      if (found == entries.items.end())
+      {
+        return NULL;
+      }
+
+      return &(*found->second);
+    }
+
+    static Entry MakeEntry(const std::string& item,
+                           const std::string& uuid,
+                           uint64_t size,
+                           int64_t seq,
+                           bool isProtected)
     {
+      Entry entry;
+      entry.item = item;
+      entry.uuid = uuid;
+      entry.size = size;
+      entry.seq = seq;
+      entry.persistedSeq = seq;
+      entry.isProtected = isProtected;
+      return entry;
+    }
+
+    void Append(int bundle,
+                const std::string& item,
+                const std::string& uuid,
+                uint64_t size,
+                int64_t seq,
+                bool isProtected)
+    {
+      Insert(GetEntries(bundle), MakeEntry(item, uuid, size, seq, isProtected));
+    }
+
+    void Remove(int bundle,
+                const std::string& item)
+    {
+      BundleEntries& entries = GetEntries(bundle);
+
+      Items::iterator found = entries.items.find(item);
+      if (found != entries.items.end())
+      {
+        if (found->second->isProtected)
+        {
+          entries.protectedCount--;
+          entries.protectedSpace -= found->second->size;
+        }
+
+        entries.space -= found->second->size;
+        entries.GetSegment(*found->second).erase(found->second);
+        entries.items.erase(found);
+      }
+    }
+
+    // Moves a probationary entry to the most recently used end of the
+    // protected segment
+    void Protect(BundleEntries& entries,
+                 Recency::iterator entry)
+    {
+      if (!entry->isProtected)
+      {
+        entries.protection.splice(entries.protection.end(), entries.probation, entry);
+        entry->isProtected = true;
+        entries.protectedCount++;
+        entries.protectedSpace += entry->size;
+        promotedItems_++;
+      }
+    }
+
+    // Moves the least recently used protected entry to the most recently
+    // used end of the probationary segment
+    void DemoteOldest(BundleEntries& entries)
+    {
+      Recency::iterator entry = entries.protection.begin();
+      entries.probation.splice(entries.probation.end(), entries.protection, entry);
+      entry->isProtected = false;
+      entries.protectedCount--;
+      entries.protectedSpace -= entry->size;
     }
   };
 
@@ -180,57 +573,191 @@ namespace OrthancPlugins
 
   void CacheManager::MakeRoom(Bundle& bundle,
                               std::list<std::string>& toRemove,
+                              std::list<std::string>& evictedItems,
                               int bundleIndex,
-                              const BundleQuota& quota)
+                              const BundleQuota& quota,
+                              const std::string* keptItem)
   {
     using namespace Orthanc;
 
-    toRemove.clear();
+    // Make room in the bundle, starting from the least recently used items
+    // of the probationary segment, then of the protected segment.  The
+    // in-memory index is only updated once the transaction is committed, by
+    // the caller (the evicted items are listed in "evictedItems").
+    PImpl::BundleEntries& entries = pimpl_->GetEntries(bundleIndex);
+    bool isProtected = false;
+    PImpl::Recency::const_iterator candidate = entries.probation.begin();
+    PImpl::Recency::const_iterator visited = entries.protection.end();  // last visited protected entry
 
-    // Make room in the bundle
     while (!quota.IsSatisfied(bundle))
     {
-      SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "SELECT seq, fileUuid, fileSize FROM Cache WHERE bundle=? ORDER BY seq");
-      s.BindInt(0, bundleIndex);
+      if (isProtected &&
+          !entries.loaded &&
+          (candidate == entries.protection.end() ||
+           candidate->seq > entries.loadedSeq))
+      {
+        // the older entries of a bundle that is not loaded yet are still in
+        // the database
+        pimpl_->LoadNext(bundleIndex, entries, LOAD_BATCH_SIZE);
+
+        if (visited == entries.protection.end())
+        {
+          candidate = entries.protection.begin();
+        }
+        else
+        {
+          candidate = visited;
+          ++candidate;
+        }
+
+        continue;
+      }
 
-      if (s.Step())
+      if (candidate == (isProtected ? entries.protection.end() : entries.probation.end()))
+      {
+        if (isProtected)
+        {
+          // Should never happen
+          throw std::runtime_error("Internal error");
+        }
+
+        isProtected = true;
+        candidate = entries.protection.begin();
+        continue;
+      }
+
+      if (keptItem == NULL ||
+          candidate->item != *keptItem)
       {
         SQLite::Statement t(pimpl_->db_, SQLITE_FROM_HERE, "DELETE FROM Cache WHERE seq=?");
-        t.BindInt64(0, s.ColumnInt64(0));
+        t.BindInt64(0, candidate->persistedSeq);
         t.Run();
 
-        toRemove.push_back(s.ColumnString(1));
-        bundle.Remove(s.ColumnInt64(2));
+        toRemove.push_back(candidate->uuid);
+        evictedItems.push_back(candidate->item);
+        bundle.Remove(candidate->size);
       }
-      else
+
+      if (isProtected)
       {
-        // Should never happen
-        throw std::runtime_error("Internal error");
+        visited = candidate;
+      }
+
+      ++candidate;
+    }
+  }
+
+
+
+  bool CacheManager::IsAdmitted(int bundleIndex,
+                                const std::string& item,
+                                uint64_t size,
+                                const BundleQuota& quota) const
+  {
+    // TinyLFU admission of the speculative items: they can always replace
+    // probationary items, but they only evict a protected item if they are
+    // accessed more frequently than it
+    Bundle bundle = GetBundle(bundleIndex);
+
+    const PImpl::Entry* previous = pimpl_->Find(bundleIndex, item);
+    if (previous != NULL)
+    {
+      bundle.Remove(previous->size);
+    }
+
+    bundle.Add(size);
+
+    PImpl::BundleEntries& entries = pimpl_->GetEntries(bundleIndex);
+
+    for (PImpl::Recency::const_iterator candidate = entries.probation.begin();
+         candidate != entries.probation.end() && !quota.IsSatisfied(bundle); ++candidate)
+    {
+      if (candidate->item != item)
+      {
+        bundle.Remove(candidate->size);
+      }
+    }
+
+    if (quota.IsSatisfied(bundle))
+    {
+      return true;
+    }
+
+    pimpl_->LoadOldest(bundleIndex, entries);
+
+    for (PImpl::Recency::const_iterator victim = entries.protection.begin();
+         victim != entries.protection.end(); ++victim)
+    {
+      if (victim->item != item)
+      {
+        return (pimpl_->frequencies_.Estimate(bundleIndex, item) >
+                pimpl_->frequencies_.Estimate(bundleIndex, victim->item));
       }
     }
+
+    return true;
+  }
+
+
+
+  void CacheManager::LimitProtectedSegment(int bundleIndex,
+                                           const BundleQuota& quota)
+  {
+    const uint64_t maxCount = static_cast<uint64_t>(quota.GetMaxCount()) * PROTECTED_SHARE / 100;
+    const uint64_t maxSpace = quota.GetMaxSpace() * PROTECTED_SHARE / 100;
+
+    PImpl::BundleEntries& target = pimpl_->GetEntries(bundleIndex);
+    if (!target.loaded)
+    {
+      // the protected segment is not fully known yet (see LoadEntries())
+      return;
+    }
+
+    while (!target.protection.empty() &&
+           ((quota.GetMaxCount() != 0 && target.protectedCount > maxCount) ||
+            (quota.GetMaxSpace() != 0 && target.protectedSpace > maxSpace)))
+    {
+      pimpl_->DemoteOldest(target);
+    }
   }
 
 
 
   void CacheManager::EnsureQuota(int bundleIndex,
                                  const BundleQuota& quota)
+  {
+    Evict(bundleIndex, quota);
+    LimitProtectedSegment(bundleIndex, quota);
+  }
+
+
+
+  void CacheManager::Evict(int bundleIndex,
+                           const BundleQuota& target)
   {
     using namespace Orthanc;
 
-    // Remove the cached files that exceed the quota
+    // Remove the cached files that exceed the target
     std::auto_ptr<SQLite::Transaction> transaction(new SQLite::Transaction(pimpl_->db_));
     transaction->Begin();
 
     Bundle bundle = GetBundle(bundleIndex);
 
-    std::list<std::string> toRemove;
-    MakeRoom(bundle, toRemove, bundleIndex, quota);
+    std::list<std::string> toRemove, evictedItems;
+    MakeRoom(bundle, toRemove, evictedItems, bundleIndex, target, NULL);
+    SaveBundle(bundleIndex, bundle);
 
     transaction->Commit();
     for (std::list<std::string>::const_iterator
            it = toRemove.begin(); it != toRemove.end(); it++)
     {
-      pimpl_->storage_.Remove(*it, Orthanc::FileContentType_Unknown);
+      pimpl_->ScheduleRemoval(*it);
+    }
+
+    for (std::list<std::string>::const_iterator
+           it = evictedItems.begin(); it != evictedItems.end(); it++)
+    {
+      pimpl_->Evict(bundleIndex, *it);
     }
 
     pimpl_->bundles_[bundleIndex] = bundle;
@@ -243,15 +770,98 @@ namespace OrthancPlugins
     using namespace Orthanc;
 
     pimpl_->bundles_.clear();
+    pimpl_->versions_.clear();
 
-    SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "SELECT bundle,COUNT(*),SUM(fileSize) FROM Cache GROUP BY bundle");
+    // a row per bundle, kept up to date by the transactions that change the
+    // Cache table
+    SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "SELECT bundle, count, size, version FROM CacheBundleHeaders");
     while (s.Step())
     {
       int index = s.ColumnInt(0);
       Bundle bundle(static_cast<uint32_t>(s.ColumnInt(1)),
                     static_cast<uint64_t>(s.ColumnInt64(2)));
       pimpl_->bundles_[index] = bundle;
+      pimpl_->versions_[index] = s.ColumnString(3);
+    }
+  }
+
+
+
+  void CacheManager::SaveBundle(int bundleIndex,
+                                const Bundle& bundle)
+  {
+    Orthanc::SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "INSERT OR REPLACE INTO CacheBundleHeaders VALUES(?, ?, ?, ?)");
+    s.BindInt(0, bundleIndex);
+    s.BindInt64(1, bundle.GetCount());
+    s.BindInt64(2, bundle.GetSpace());
+    s.BindString(3, pimpl_->versions_[bundleIndex]);
+    s.Run();
+  }
+
+
+
+  void CacheManager::ReadEntries()
+  {
+    using namespace Orthanc;
+
+    // The entries themselves are read in the background (see LoadEntries()),
+    // only the last "seq" is needed here
+    pimpl_->entries_.clear();
+    pimpl_->touched_.clear();
+    pimpl_->maxSeq_ = 0;
+
+    SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "SELECT MAX(seq) FROM Cache");
+    if (s.Step() &&
+        !s.ColumnIsNull(0))
+    {
+      pimpl_->maxSeq_ = s.ColumnInt64(0);
+    }
+  }
+
+
+
+  void CacheManager::FlushRecency()
+  {
+    using namespace Orthanc;
+
+    if (pimpl_->touched_.empty())
+    {
+      return;
+    }
+
+    // The new "seq" values are all above the persisted ones (they come from
+    // "maxSeq_"), so the updates cannot collide whatever their order
+    std::auto_ptr<SQLite::Transaction> transaction(new SQLite::Transaction(pimpl_->db_));
+    transaction->Begin();
+
+    std::vector<PImpl::Entry*> updated;
+    updated.reserve(pimpl_->touched_.size());
+
+    for (size_t i = 0; i < pimpl_->touched_.size(); i++)
+    {
+      PImpl::Entry* entry = pimpl_->Find(pimpl_->touched_[i].first, pimpl_->touched_[i].second);
+
+      // the entry might have been removed or updated twice in the meantime
+      if (entry != NULL &&
+          entry->seq != entry->persistedSeq)
+      {
+        SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "UPDATE Cache SET seq=? WHERE seq=?");
+        s.BindInt64(0, entry->seq);
+        s.BindInt64(1, entry->persistedSeq);
+        s.Run();
+
+        updated.push_back(entry);
+      }
+    }
+
+    transaction->Commit();
+
+    for (size_t i = 0; i < updated.size(); i++)
+    {
+      updated[i]->persistedSeq = updated[i]->seq;
     }
+
+    pimpl_->touched_.clear();
   }
 
 
@@ -277,6 +887,17 @@ namespace OrthancPlugins
                                  + " vs " + boost::lexical_cast<std::string>(s.ColumnInt(1)) + "/"
                                  + boost::lexical_cast<std::string>(s.ColumnInt64(2)));
       }
+
+      PImpl::BundleEntries& entries = pimpl_->GetEntries(s.ColumnInt(0));
+      while (!entries.loaded)
+      {
+        pimpl_->LoadNext(s.ColumnInt(0), entries, LOAD_BATCH_SIZE);
+      }
+
+      if (entries.items.size() != static_cast<size_t>(s.ColumnInt(1)))
+      {
+        throw std::runtime_error("SANITY ERROR in cache: the in-memory LRU index is out of sync");
+      }
     }
   }
 
@@ -289,6 +910,22 @@ namespace OrthancPlugins
   {
     Open();
     ReadBundleStatistics();
+    ReadEntries();
+  }
+
+
+  CacheManager::~CacheManager()
+  {
+    try
+    {
+      FlushRecency();
+    }
+    catch (...)
+    {
+      // only the latest recency information is lost
+    }
+
+    RemoveFiles(pimpl_->pendingRemovals_);
   }
 
 
@@ -313,6 +950,29 @@ namespace OrthancPlugins
       pimpl_->db_.Execute("CREATE INDEX CacheIndex ON Cache(bundle, item);");
     }
 
+    // The entries of a pack file, for its compaction
+    pimpl_->db_.Execute("CREATE INDEX IF NOT EXISTS CacheFiles ON Cache(fileUuid);");
+
+    if (!pimpl_->db_.DoesTableExist("CacheBundleHeaders"))
+    {
+      // The statistics of the bundles are read from this table at startup.
+      // Computed once from the entries of the caches created by the previous
+      // versions of the plugin: in the same transaction as the creation of
+      // the table, so that an interrupted upgrade is done again.
+      std::auto_ptr<Orthanc::SQLite::Transaction> transaction(new Orthanc::SQLite::Transaction(pimpl_->db_));
+      transaction->Begin();
+      pimpl_->db_.Execute("CREATE TABLE CacheBundleHeaders(bundle INTEGER PRIMARY KEY, count INTEGER, size INTEGER, version TEXT);");
+      pimpl_->db_.Execute("INSERT INTO CacheBundleHeaders SELECT bundle, COUNT(*), SUM(fileSize), '' FROM Cache GROUP BY bundle;");
+      transaction->Commit();
+    }
+
+    if (!pimpl_->db_.DoesTableExist("CacheStaleFiles"))
+    {
+      // The files of the cleared bundles, removed in the background (see
+      // RemoveStaleFiles())
+      pimpl_->db_.Execute("CREATE TABLE CacheStaleFiles(id INTEGER PRIMARY KEY, fileUuid TEXT);");
+    }
+
     if (!pimpl_->db_.DoesTableExist("CacheProperties"))
     {
       pimpl_->db_.Execute("CREATE TABLE CacheProperties(property INTEGER PRIMARY KEY, value TEXT);");
@@ -328,88 +988,238 @@ namespace OrthancPlugins
 
   void CacheManager::Store(int bundleIndex,
                            const std::string& item,
-                           const std::string& content)
+                           const std::string& content,
+                           bool speculative)
   {
     SanityCheck();
 
     const BundleQuota quota = GetBundleQuota(bundleIndex);
 
-    if (quota.GetMaxSpace() > 0 &&
-        content.size() > quota.GetMaxSpace())
+    if (!IsStored(bundleIndex, item, content.size(), speculative, quota))
     {
-      // Cannot store such a large instance into the cache, forget about it
       return;
     }
 
-    using namespace Orthanc;
-
-    std::auto_ptr<SQLite::Transaction> transaction(new SQLite::Transaction(pimpl_->db_));
-    transaction->Begin();
-
-    Bundle bundle = GetBundle(bundleIndex);
-
-    std::list<std::string>  toRemove;
-    bundle.Add(content.size());
-    MakeRoom(bundle, toRemove, bundleIndex, quota);
-
     // Store the cached content on the disk
-    const char* data = content.size() ? &content[0] : NULL;
-    std::string uuid = Toolbox::GenerateUuid();
-    pimpl_->storage_.Create(uuid, data, content.size(), Orthanc::FileContentType_Unknown);
-
-    bool ok = true;
-
-    // Remove the previous cached value. This might happen if the same
-    // item is accessed very quickly twice: Another factory could have
-    // been cached a value before the check for existence in Access().
+    std::string uuid;
+    if (pimpl_->IsShared(bundleIndex))
     {
-      SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "SELECT seq, fileUuid, fileSize FROM Cache WHERE bundle=? AND item=?");
-      s.BindInt(0, bundleIndex);
-      s.BindString(1, item);
-      if (s.Step())
-      {
-        SQLite::Statement t(pimpl_->db_, SQLITE_FROM_HERE, "DELETE FROM Cache WHERE seq=?");
-        t.BindInt64(0, s.ColumnInt64(0));
-        t.Run();
+      uuid = pimpl_->shared_->Write(bundleIndex, item, content);
+    }
+    else if (pimpl_->packs_ != NULL)
+    {
+      uuid = pimpl_->packs_->Append(content);
+    }
+    else
+    {
+      const char* data = content.size() ? &content[0] : NULL;
+      uuid = Orthanc::Toolbox::GenerateUuid();
+      pimpl_->storage_.Create(uuid, data, content.size(), Orthanc::FileContentType_Unknown);
+    }
 
-        toRemove.push_back(s.ColumnString(1));
-        bundle.Remove(s.ColumnInt64(2));
-      }
+    // the items that are not speculative are being read
+    if (!AddEntry(bundleIndex, item, uuid, content.size(), !speculative, quota))
+    {
+      // Error: Remove the stored file
+      pimpl_->ScheduleRemoval(uuid);
     }
 
-    if (ok)
+    SanityCheck();
+  }
+
+
+
+  void CacheManager::StoreSharedFile(int bundle,
+                                     const std::string& item,
+                                     const std::string& name,
+                                     uint64_t size,
+                                     bool speculative)
+  {
+    SanityCheck();
+
+    const BundleQuota quota = GetBundleQuota(bundle);
+
+    // the file stays in the shared directory if it is not indexed, the other
+    // nodes can still use it
+    if (IsStored(bundle, item, size, speculative, quota))
     {
-      SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "INSERT INTO Cache VALUES(NULL, ?, ?, ?, ?)");
-      s.BindInt(0, bundleIndex);
-      s.BindString(1, item);
-      s.BindString(2, uuid);
-      s.BindInt64(3, content.size());
+      AddEntry(bundle, item, name, size, !speculative, quota);
+    }
+
+    SanityCheck();
+  }
+
+
+
+  bool CacheManager::IsStored(int bundleIndex,
+                              const std::string& item,
+                              uint64_t size,
+                              bool speculative,
+                              const BundleQuota& quota)
+  {
+    if (quota.GetMaxSpace() > 0 &&
+        size > quota.GetMaxSpace())
+    {
+      // Cannot store such a large instance into the cache, forget about it
+      return false;
+    }
+
+    pimpl_->frequencies_.Increment(bundleIndex, item);
+
+    if (speculative &&
+        !IsAdmitted(bundleIndex, item, size, quota))
+    {
+      // Would evict items that are read more often
+      pimpl_->rejectedItems_++;
+      return false;
+    }
+
+    return true;
+  }
+
+
+
+  bool CacheManager::AddEntry(int bundleIndex,
+                              const std::string& item,
+                              const std::string& uuid,
+                              uint64_t size,
+                              bool isProtected,
+                              const BundleQuota& quota)
+  {
+    using namespace Orthanc;
+
+    std::auto_ptr<SQLite::Transaction> transaction(new SQLite::Transaction(pimpl_->db_));
+    transaction->Begin();
+
+    Bundle bundle = GetBundle(bundleIndex);
 
-      if (!s.Run())
+    std::list<std::string>  toRemove, evictedItems;
+
+    // Remove the previous cached value. This might happen if the same
+    // item is accessed very quickly twice: Another factory could have
+    // been cached a value before the check for existence in Access().
+    const PImpl::Entry* previous = pimpl_->Find(bundleIndex, item);
+    if (previous != NULL)
+    {
+      SQLite::Statement t(pimpl_->db_, SQLITE_FROM_HERE, "DELETE FROM Cache WHERE seq=?");
+      t.BindInt64(0, previous->persistedSeq);
+      t.Run();
+
+      if (previous->uuid != uuid)  // the shared files are overwritten
       {
-        ok = false;
+        toRemove.push_back(previous->uuid);
       }
+
+      evictedItems.push_back(item);
+      bundle.Remove(previous->size);
+    }
+
+    bundle.Add(size);
+    MakeRoom(bundle, toRemove, evictedItems, bundleIndex, quota, &item);
+
+    int64_t seq = pimpl_->maxSeq_ + 1;
+
+    bool ok;
+    {
+      SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "INSERT INTO Cache VALUES(?, ?, ?, ?, ?)");
+      s.BindInt64(0, seq);
+      s.BindInt(1, bundleIndex);
+      s.BindString(2, item);
+      s.BindString(3, uuid);
+      s.BindInt64(4, size);
+      ok = s.Run();
     }
 
     if (!ok)
     {
-      // Error: Remove the stored file
-      pimpl_->storage_.Remove(uuid, Orthanc::FileContentType_Unknown);
+      return false;
     }
-    else
+
+    SaveBundle(bundleIndex, bundle);
+    transaction->Commit();
+
+    pimpl_->bundles_[bundleIndex] = bundle;
+    pimpl_->maxSeq_ = seq;
+
+    for (std::list<std::string>::const_iterator
+           it = toRemove.begin(); it != toRemove.end(); it++)
     {
-      transaction->Commit();
+      pimpl_->ScheduleRemoval(*it);
+    }
 
-      pimpl_->bundles_[bundleIndex] = bundle;
-    
-      for (std::list<std::string>::const_iterator
-             it = toRemove.begin(); it != toRemove.end(); it++)
+    for (std::list<std::string>::const_iterator
+           it = evictedItems.begin(); it != evictedItems.end(); it++)
+    {
+      if (*it == item)
       {
-        pimpl_->storage_.Remove(*it, Orthanc::FileContentType_Unknown);
+        pimpl_->Remove(bundleIndex, item);  // replaced, not evicted
+      }
+      else
+      {
+        pimpl_->Evict(bundleIndex, *it);
       }
     }
 
-    SanityCheck();
+    pimpl_->Append(bundleIndex, item, uuid, size, seq, isProtected);
+    LimitProtectedSegment(bundleIndex, quota);
+
+    return true;
+  }
+
+
+
+  bool CacheManager::LookupSharedFile(std::string& name,
+                                      uint64_t& size,
+                                      int bundle,
+                                      const std::string& item) const
+  {
+    return (pimpl_->IsShared(bundle) &&
+            pimpl_->shared_->Lookup(name, size, bundle, item));
+  }
+
+
+
+  bool CacheManager::WriteSharedFile(std::string& name,
+                                     int bundle,
+                                     const std::string& item,
+                                     const std::string& content) const
+  {
+    if (pimpl_->IsShared(bundle))
+    {
+      name = pimpl_->shared_->Write(bundle, item, content);
+      return true;
+    }
+    else
+    {
+      return false;
+    }
+  }
+
+
+
+  bool CacheManager::IndexSharedFile(int bundle,
+                                     const std::string& item,
+                                     const std::string& name,
+                                     uint64_t size)
+  {
+    const BundleQuota quota = GetBundleQuota(bundle);
+    if (quota.GetMaxSpace() > 0 &&
+        size > quota.GetMaxSpace())
+    {
+      return false;
+    }
+
+    // The file has been written by another node (or before a restart): it
+    // is added to the index of this node, as an item that is read
+    pimpl_->frequencies_.Increment(bundle, item);
+
+    if (!AddEntry(bundle, item, name, size, true, quota))
+    {
+      return false;
+    }
+
+    pimpl_->sharedHits_++;
+    return true;
   }
 
 
@@ -419,78 +1229,426 @@ namespace OrthancPlugins
                                    int bundle,
                                    const std::string& item)
   {
-    using namespace Orthanc;
+    if (LocateInIndex(uuid, size, bundle, item))
+    {
+      return true;
+    }
+
+    std::string name;
+    uint64_t fileSize;
+    if (LookupSharedFile(name, fileSize, bundle, item) &&
+        IndexSharedFile(bundle, item, name, fileSize))
+    {
+      uuid = name;
+      size = fileSize;
+      return true;
+    }
+    else
+    {
+      return false;
+    }
+  }
+
+
+
+  bool CacheManager::LocateInIndex(std::string& uuid,
+                                   uint64_t& size,
+                                   int bundle,
+                                   const std::string& item)
+  {
     SanityCheck();
 
-    std::auto_ptr<SQLite::Transaction> transaction(new SQLite::Transaction(pimpl_->db_));
-    transaction->Begin();
+    PImpl::BundleEntries& entries = pimpl_->GetEntries(bundle);
 
-    SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "SELECT seq, fileUuid, fileSize FROM Cache WHERE bundle=? AND item=?");
-    s.BindInt(0, bundle);
-    s.BindString(1, item);
-    if (!s.Step())
+    PImpl::Items::iterator found = pimpl_->Lookup(bundle, entries, item);
+    if (found == entries.items.end())
     {
       return false;
     }
 
-    int64_t seq = s.ColumnInt64(0);
-    uuid = s.ColumnString(1);
-    size = s.ColumnInt64(2);
+    pimpl_->frequencies_.Increment(bundle, item);
 
-    // Touch the cache to fulfill the LRU scheme.
-    SQLite::Statement t(pimpl_->db_, SQLITE_FROM_HERE, "DELETE FROM Cache WHERE seq=?");
-    t.BindInt64(0, seq);
-    if (t.Run())
+    // Touch the cache to fulfill the LRU scheme: the new position is only
+    // written to the database by FlushRecency().  A probationary entry that
+    // is read is promoted to the protected segment.
+    if (found->second->isProtected)
     {
-      SQLite::Statement u(pimpl_->db_, SQLITE_FROM_HERE, "INSERT INTO Cache VALUES(NULL, ?, ?, ?, ?)");
-      u.BindInt(0, bundle);
-      u.BindString(1, item);
-      u.BindString(2, uuid);
-      u.BindInt64(3, size);
-      if (u.Run())
-      {
-        // Everything was OK. Commit the changes to the cache.
-        transaction->Commit();
-        return true;
-      }
+      entries.protection.splice(entries.protection.end(),
+                                entries.protection, found->second);
+    }
+    else
+    {
+      pimpl_->Protect(entries, found->second);
+      LimitProtectedSegment(bundle, GetBundleQuota(bundle));
     }
 
-    return false;
+    PImpl::Entry& entry = *found->second;
+    uuid = entry.uuid;
+    size = entry.size;
+
+    if (entry.seq == entry.persistedSeq)
+    {
+      pimpl_->touched_.push_back(std::make_pair(bundle, item));
+    }
+
+    pimpl_->maxSeq_++;
+    entry.seq = pimpl_->maxSeq_;
+
+    if (pimpl_->touched_.size() >= RECENCY_FLUSH_SIZE)
+    {
+      FlushRecency();
+    }
+
+    return true;
   }
 
 
   bool CacheManager::IsCached(int bundle,
-                              const std::string& item)
+                              const std::string& item) const
   {
-    std::string uuid;
+    std::string name;
     uint64_t size;
-    return LocateInCache(uuid, size, bundle, item);
+    return (IsIndexed(bundle, item) ||
+            LookupSharedFile(name, size, bundle, item));
   }
 
 
-  bool CacheManager::Access(std::string& content,
-                            int bundle,
-                            const std::string& item)
+  bool CacheManager::IsIndexed(int bundle,
+                               const std::string& item) const
   {
-    std::string uuid;
-    uint64_t size;
-    if (!LocateInCache(uuid, size, bundle, item))
+    // not an access: neither the LRU order nor the segment is changed
+    return pimpl_->Find(bundle, item) != NULL;
+  }
+
+
+  void CacheManager::SetSharedDirectory(int bundle,
+                                        SharedCacheDirectory* directory)
+  {
+    if (pimpl_->shared_ != NULL &&
+        pimpl_->shared_ != directory)
+    {
+      // a single shared directory for all the bundles
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+
+    pimpl_->shared_ = directory;
+    pimpl_->sharedBundles_.insert(bundle);
+
+    std::map<int, std::string>::const_iterator version = pimpl_->versions_.find(bundle);
+    if (version != pimpl_->versions_.end())
+    {
+      directory->SetBundleVersion(bundle, version->second);
+    }
+  }
+
+
+  void CacheManager::SetPackStorage(PackStorage* packs)
+  {
+    if (pimpl_->packs_ != NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+
+    // the space of the existing segments that is not used by the index is
+    // reclaimed by the compaction.  The entries of the cleared bundles are
+    // still used until RemoveStaleFiles() releases them.
+    std::string first, last;
+    PackStorage::GetNameRange(first, last);
+
+    {
+      Orthanc::SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "SELECT fileUuid FROM Cache WHERE fileUuid>=? AND fileUuid<?");
+      s.BindString(0, first);
+      s.BindString(1, last);
+      while (s.Step())
+      {
+        packs->RegisterEntry(s.ColumnString(0));
+      }
+    }
+
+    {
+      Orthanc::SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "SELECT fileUuid FROM CacheStaleFiles");
+      while (s.Step())
+      {
+        if (PackStorage::IsPackName(s.ColumnString(0)))
+        {
+          packs->RegisterEntry(s.ColumnString(0));
+        }
+      }
+    }
+
+    pimpl_->packs_ = packs;
+  }
+
+
+  bool CacheManager::CompactPackFiles(uint64_t maxSize)
+  {
+    using namespace Orthanc;
+
+    std::string first, last;
+    if (pimpl_->packs_ == NULL ||
+        !pimpl_->packs_->SelectSegmentToCompact(first, last))
     {
       return false;
     }
 
-    bool ok;
+    std::vector<PackMove> moves;
+
+    {
+      uint64_t selected = 0;
+      SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "SELECT seq, bundle, item, fileUuid, fileSize FROM Cache WHERE fileUuid>? AND fileUuid<?");
+      s.BindString(0, first);
+      s.BindString(1, last);
+      while (selected < maxSize && s.Step())
+      {
+        PackMove move;
+        move.seq = s.ColumnInt64(0);
+        move.bundle = s.ColumnInt(1);
+        move.item = s.ColumnString(2);
+        move.previous = s.ColumnString(3);
+        move.size = static_cast<uint64_t>(s.ColumnInt64(4));
+        moves.push_back(move);
+        selected += move.size;
+      }
+    }
+
+    if (moves.empty())
+    {
+      return false;
+    }
+
+    // the bundles of the entries that cannot be read anymore
+    Bundles lost = pimpl_->bundles_;
+
+    std::auto_ptr<SQLite::Transaction> transaction(new SQLite::Transaction(pimpl_->db_));
+    transaction->Begin();
+
+    try
+    {
+      for (size_t i = 0; i < moves.size(); i++)
+      {
+        std::string content;
+        if (pimpl_->packs_->Read(content, moves[i].previous) &&
+            content.size() == moves[i].size)
+        {
+          moves[i].uuid = pimpl_->packs_->Append(content);
+
+          SQLite::Statement t(pimpl_->db_, SQLITE_FROM_HERE, "UPDATE Cache SET fileUuid=? WHERE seq=?");
+          t.BindString(0, moves[i].uuid);
+          t.BindInt64(1, moves[i].seq);
+          t.Run();
+        }
+        else
+        {
+          SQLite::Statement t(pimpl_->db_, SQLITE_FROM_HERE, "DELETE FROM Cache WHERE seq=?");
+          t.BindInt64(0, moves[i].seq);
+          t.Run();
+
+          lost[moves[i].bundle].Remove(moves[i].size);
+          SaveBundle(moves[i].bundle, lost[moves[i].bundle]);
+        }
+      }
+
+      transaction->Commit();
+    }
+    catch (...)
+    {
+      // the copies are not indexed
+      for (size_t i = 0; i < moves.size(); i++)
+      {
+        pimpl_->packs_->Release(moves[i].uuid);
+      }
+
+      throw;
+    }
+
+    for (size_t i = 0; i < moves.size(); i++)
+    {
+      if (moves[i].uuid.empty())
+      {
+        pimpl_->Remove(moves[i].bundle, moves[i].item);
+      }
+      else
+      {
+        PImpl::Entry* entry = pimpl_->Find(moves[i].bundle, moves[i].item);
+        if (entry != NULL)
+        {
+          entry->uuid = moves[i].uuid;
+        }
+      }
+
+      pimpl_->packs_->Release(moves[i].previous);
+    }
+
+    pimpl_->bundles_ = lost;
+    return true;
+  }
+
+
+  bool CacheManager::ReclaimSpace()
+  {
+    bool reclaimed = false;
+
+    for (Bundles::const_iterator it = pimpl_->bundles_.begin();
+         it != pimpl_->bundles_.end(); ++it)
+    {
+      const BundleQuota& quota = GetBundleQuota(it->first);
+      if (!quota.Scale(HIGH_WATERMARK).IsSatisfied(it->second))
+      {
+        const uint32_t count = it->second.GetCount();
+        Evict(it->first, quota.Scale(LOW_WATERMARK));
+        pimpl_->reclaimedItems_ += count - GetBundle(it->first).GetCount();
+        reclaimed = true;
+      }
+    }
+
+    return reclaimed;
+  }
+
+
+  void CacheManager::TakeRemovedFiles(std::vector<std::string>& files)
+  {
+    files.clear();
+    files.swap(pimpl_->pendingRemovals_);
+  }
+
+
+  void CacheManager::TakeEvictedItems(std::vector<std::pair<int, std::string> >& items)
+  {
+    items.clear();
+    items.swap(pimpl_->evictedItems_);
+  }
+
+
+  void CacheManager::RemoveFiles(const std::vector<std::string>& files) const
+  {
+    for (size_t i = 0; i < files.size(); i++)
+    {
+      try
+      {
+        pimpl_->RemoveFile(files[i]);
+      }
+      catch (...)
+      {
+        // already removed
+      }
+    }
+  }
+
+
+  void CacheManager::SignalRead(int bundle,
+                                const std::string& item)
+  {
+    PImpl::BundleEntries& entries = pimpl_->GetEntries(bundle);
+
+    PImpl::Items::iterator found = pimpl_->Lookup(bundle, entries, item);
+    if (found != entries.items.end() &&
+        !found->second->isProtected)
+    {
+      pimpl_->frequencies_.Increment(bundle, item);
+      pimpl_->Protect(entries, found->second);
+      LimitProtectedSegment(bundle, GetBundleQuota(bundle));
+    }
+  }
+
+
+  void CacheManager::GetStatistics(Statistics& target) const
+  {
+    target.probationCount = 0;
+    target.probationSize = 0;
+    target.protectedCount = 0;
+    target.protectedSize = 0;
+
+    for (Bundles::const_iterator it = pimpl_->bundles_.begin();
+         it != pimpl_->bundles_.end(); ++it)
+    {
+      // The entries that are not read yet will be read as protected (see
+      // PImpl::LoadNext())
+      uint32_t probationCount = 0;
+      uint64_t probationSpace = 0;
+
+      PImpl::Entries::const_iterator entries = pimpl_->entries_.find(it->first);
+      if (entries != pimpl_->entries_.end())
+      {
+        probationCount = static_cast<uint32_t>(entries->second.items.size()) - entries->second.protectedCount;
+        probationSpace = entries->second.space - entries->second.protectedSpace;
+      }
+
+      target.probationCount += probationCount;
+      target.probationSize += probationSpace;
+      target.protectedCount += it->second.GetCount() - probationCount;
+      target.protectedSize += it->second.GetSpace() - probationSpace;
+    }
+
+    target.promotedItems = pimpl_->promotedItems_;
+    target.rejectedItems = pimpl_->rejectedItems_;
+    target.sharedHits = pimpl_->sharedHits_;
+    target.reclaimedItems = pimpl_->reclaimedItems_;
+    target.pendingRemovals = static_cast<uint32_t>(pimpl_->pendingRemovals_.size());
+
+    if (pimpl_->packs_ != NULL)
+    {
+      PackStorage::Statistics packs;
+      pimpl_->packs_->GetStatistics(packs);
+      target.packFiles = packs.segments;
+      target.packFilesSize = packs.size;
+      target.packFilesDeadSize = packs.deadSize;
+    }
+    else
+    {
+      target.packFiles = 0;
+      target.packFilesSize = 0;
+      target.packFilesDeadSize = 0;
+    }
+  }
+
+
+  bool CacheManager::ReadCachedFile(std::string& content,
+                                    const std::string& uuid,
+                                    uint64_t size) const
+  {
+    if (SharedCacheDirectory::IsSharedName(uuid))
+    {
+      // false if another node has removed or replaced the file
+      return (pimpl_->shared_ != NULL &&
+              pimpl_->shared_->Read(content, uuid, size));
+    }
+
+    if (PackStorage::IsPackName(uuid))
+    {
+      // false if the entry has been moved by a compaction in the meantime
+      return (pimpl_->packs_ != NULL &&
+              pimpl_->packs_->Read(content, uuid) &&
+              content.size() == size);
+    }
+
     try
     {
       pimpl_->storage_.Read(content, uuid, Orthanc::FileContentType_Unknown);
-      ok = (content.size() == size);
+      return (content.size() == size);
+    }
+    catch (Orthanc::OrthancException&)
+    {
+      return false;  // the file does not exist anymore
     }
     catch (std::runtime_error&)
     {
-      ok = false;
+      return false;
     }
+  }
+
 
-    if (ok)
+  bool CacheManager::Access(std::string& content,
+                            int bundle,
+                            const std::string& item)
+  {
+    std::string uuid;
+    uint64_t size;
+    if (!LocateInCache(uuid, size, bundle, item))
+    {
+      return false;
+    }
+
+    if (ReadCachedFile(content, uuid, size))
     {
       return true;
     }
@@ -512,25 +1670,65 @@ namespace OrthancPlugins
 
     Bundle bundle = GetBundle(bundleIndex);
 
-    SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "SELECT seq, fileUuid, fileSize FROM Cache WHERE bundle=? AND item LIKE ?");
-    s.BindInt(0, bundleIndex);
-    s.BindString(1, itemPrefix + "%%");  // add a '%' after because we want to search on a prefix
-    while (s.Step())
+    std::list<std::string> invalidatedItems;
+
+    PImpl::BundleEntries& entries = pimpl_->GetEntries(bundleIndex);
+    if (!entries.loaded)
     {
-      int64_t seq = s.ColumnInt64(0);
-      const std::string uuid = s.ColumnString(1);
-      uint64_t expectedSize = s.ColumnInt64(2);
-      bundle.Remove(expectedSize);
+      // the matching entries of a bundle that is not loaded yet are read from
+      // the index of the database
+      std::vector<std::string> matching;
 
-      SQLite::Statement t(pimpl_->db_, SQLITE_FROM_HERE, "DELETE FROM Cache WHERE seq=?");
-      t.BindInt64(0, seq);
-      if (t.Run())
       {
-        pimpl_->bundles_[bundleIndex] = bundle;
-        pimpl_->storage_.Remove(uuid, Orthanc::FileContentType_Unknown);
+        SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "SELECT item FROM Cache WHERE bundle=? AND item>=? ORDER BY item");
+        s.BindInt(0, bundleIndex);
+        s.BindString(1, itemPrefix);
+        while (s.Step() &&
+               s.ColumnString(0).compare(0, itemPrefix.size(), itemPrefix) == 0)
+        {
+          matching.push_back(s.ColumnString(0));
+        }
+      }
+
+      for (size_t i = 0; i < matching.size(); i++)
+      {
+        pimpl_->Lookup(bundleIndex, entries, matching[i]);
       }
     }
+
+    // The items are sorted in the in-memory index: the items starting with
+    // the prefix are contiguous, the invalidation does not scan the bundle
+    for (PImpl::Items::const_iterator it = entries.items.lower_bound(itemPrefix);
+         it != entries.items.end() &&
+           it->first.compare(0, itemPrefix.size(), itemPrefix) == 0; ++it)
+    {
+      const PImpl::Entry& entry = *it->second;
+
+      SQLite::Statement t(pimpl_->db_, SQLITE_FROM_HERE, "DELETE FROM Cache WHERE seq=?");
+      t.BindInt64(0, entry.persistedSeq);
+      t.Run();
+
+      bundle.Remove(entry.size);
+      invalidatedItems.push_back(entry.item);
+    }
+
+    SaveBundle(bundleIndex, bundle);
     transaction->Commit();
+
+    pimpl_->bundles_[bundleIndex] = bundle;
+
+    if (pimpl_->IsShared(bundleIndex))
+    {
+      // also the files written by the other nodes
+      pimpl_->shared_->Invalidate(bundleIndex, itemPrefix);
+    }
+
+    for (std::list<std::string>::const_iterator
+           it = invalidatedItems.begin(); it != invalidatedItems.end(); it++)
+    {
+      pimpl_->ScheduleRemoval(pimpl_->Find(bundleIndex, *it)->uuid);
+      pimpl_->Remove(bundleIndex, *it);
+    }
   }
 
 
@@ -556,10 +1754,15 @@ namespace OrthancPlugins
 
     pimpl_->defaultQuota_ = BundleQuota(maxCount, maxSpace);
 
-    SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "SELECT DISTINCT bundle FROM Cache");
-    while (s.Step())
+    std::vector<int> bundles;
+    for (Bundles::const_iterator it = pimpl_->bundles_.begin(); it != pimpl_->bundles_.end(); ++it)
+    {
+      bundles.push_back(it->first);
+    }
+
+    for (size_t i = 0; i < bundles.size(); i++)
     {
-      EnsureQuota(s.ColumnInt(0), pimpl_->defaultQuota_);
+      EnsureQuota(bundles[i], pimpl_->defaultQuota_);
     }
 
     SanityCheck();
@@ -571,16 +1774,20 @@ namespace OrthancPlugins
     using namespace Orthanc;
     SanityCheck();
 
-    SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "SELECT fileUuid FROM Cache");
-    while (s.Step())
-    {
-      pimpl_->storage_.Remove(s.ColumnString(0), Orthanc::FileContentType_Unknown);
-    }  
+    // The files are removed in the background: clearing a large cache only
+    // moves its index to the CacheStaleFiles table
+    std::auto_ptr<SQLite::Transaction> transaction(new SQLite::Transaction(pimpl_->db_));
+    transaction->Begin();
 
-    SQLite::Statement t(pimpl_->db_, SQLITE_FROM_HERE, "DELETE FROM Cache");
-    t.Run();
+    pimpl_->db_.Execute("INSERT INTO CacheStaleFiles(fileUuid) SELECT fileUuid FROM Cache;");
+    pimpl_->db_.Execute("DELETE FROM Cache;");
+    pimpl_->db_.Execute("UPDATE CacheBundleHeaders SET count=0, size=0;");
+
+    transaction->Commit();
 
     ReadBundleStatistics();
+    pimpl_->entries_.clear();
+    pimpl_->frequencies_.Clear();
     SanityCheck();
   }
 
@@ -591,22 +1798,115 @@ namespace OrthancPlugins
     using namespace Orthanc;
     SanityCheck();
 
-    SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "SELECT fileUuid FROM Cache WHERE bundle=?");
-    s.BindInt(0, bundle);
-    while (s.Step())
+    std::auto_ptr<SQLite::Transaction> transaction(new SQLite::Transaction(pimpl_->db_));
+    transaction->Begin();
+
     {
-      pimpl_->storage_.Remove(s.ColumnString(0), Orthanc::FileContentType_Unknown);
-    }  
+      SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "INSERT INTO CacheStaleFiles(fileUuid) SELECT fileUuid FROM Cache WHERE bundle=?");
+      s.BindInt(0, bundle);
+      s.Run();
+    }
 
-    SQLite::Statement t(pimpl_->db_, SQLITE_FROM_HERE, "DELETE FROM Cache WHERE bundle=?");
-    t.BindInt(0, bundle);
-    t.Run();
+    {
+      SQLite::Statement t(pimpl_->db_, SQLITE_FROM_HERE, "DELETE FROM Cache WHERE bundle=?");
+      t.BindInt(0, bundle);
+      t.Run();
+    }
+
+    SaveBundle(bundle, Bundle());
+    transaction->Commit();
 
     ReadBundleStatistics();
+    pimpl_->entries_.erase(bundle);
     SanityCheck();
   }
 
 
+  void CacheManager::SetBundleVersion(int bundle,
+                                      const std::string& version)
+  {
+    std::map<int, std::string>::const_iterator found = pimpl_->versions_.find(bundle);
+
+    if (found != pimpl_->versions_.end() &&
+        !found->second.empty() &&
+        found->second != version)
+    {
+      // Only the items of this bundle are dropped
+      Clear(bundle);
+    }
+
+    // The items stored before the versions were recorded are kept
+    pimpl_->versions_[bundle] = version;
+    SaveBundle(bundle, GetBundle(bundle));
+
+    if (pimpl_->IsShared(bundle))
+    {
+      // the other nodes might not use the same version yet
+      pimpl_->shared_->SetBundleVersion(bundle, version);
+    }
+  }
+
+
+  bool CacheManager::RemoveStaleFiles(size_t maxCount)
+  {
+    using namespace Orthanc;
+
+    if (pimpl_->pendingRemovals_.size() >= MAX_PENDING_REMOVALS)
+    {
+      // the files would be recorded in the table again
+      return true;
+    }
+
+    maxCount = std::min(maxCount, MAX_PENDING_REMOVALS - pimpl_->pendingRemovals_.size());
+
+    int64_t last = -1;
+
+    {
+      SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "SELECT id, fileUuid FROM CacheStaleFiles ORDER BY id LIMIT ?");
+      s.BindInt64(0, maxCount);
+      while (s.Step())
+      {
+        last = s.ColumnInt64(0);
+        pimpl_->ScheduleRemoval(s.ColumnString(1));
+      }
+    }
+
+    if (last == -1)
+    {
+      return false;
+    }
+
+    SQLite::Statement t(pimpl_->db_, SQLITE_FROM_HERE, "DELETE FROM CacheStaleFiles WHERE id<=?");
+    t.BindInt64(0, last);
+    t.Run();
+
+    return true;
+  }
+
+
+  bool CacheManager::LoadEntries(size_t maxCount)
+  {
+    for (Bundles::const_iterator it = pimpl_->bundles_.begin();
+         it != pimpl_->bundles_.end(); ++it)
+    {
+      PImpl::BundleEntries& entries = pimpl_->GetEntries(it->first);
+      if (!entries.loaded)
+      {
+        pimpl_->LoadNext(it->first, entries, maxCount);
+
+        if (entries.loaded)
+        {
+          LimitProtectedSegment(it->first, GetBundleQuota(it->first));
+        }
+
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+
   void CacheManager::SetProperty(CacheProperty property,
                                  const std::string& value)
   {
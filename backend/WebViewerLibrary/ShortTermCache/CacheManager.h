@@ -26,6 +26,8 @@
 
 #include <orthanc/OrthancCPlugin.h>
 
+#include <vector>
+
 namespace OrthancPlugins
 {
   enum CacheProperty
@@ -35,8 +37,29 @@ namespace OrthancPlugins
   };
 
 
+  class SharedCacheDirectory;
+  class PackStorage;
+
+
   class CacheManager : public boost::noncopyable
   {
+  public:
+    struct Statistics
+    {
+      uint32_t  probationCount;   // speculative items that have not been read yet
+      uint64_t  probationSize;
+      uint32_t  protectedCount;   // items that have been read
+      uint64_t  protectedSize;
+      uint64_t  promotedItems;    // speculative items moved to the protected segment when read
+      uint64_t  rejectedItems;    // speculative items not stored to keep more frequently read items
+      uint64_t  sharedHits;       // items found in the shared directory, written by another node
+      uint64_t  reclaimedItems;   // items evicted in the background by ReclaimSpace()
+      uint32_t  pendingRemovals;  // files of the evicted items not removed yet
+      uint32_t  packFiles;        // segment files of the pack storage (0 if disabled)
+      uint64_t  packFilesSize;
+      uint64_t  packFilesDeadSize;  // evicted items, reclaimed by CompactPackFiles()
+    };
+
   private:
     struct PImpl;
     boost::shared_ptr<PImpl> pimpl_;
@@ -53,20 +76,54 @@ namespace OrthancPlugins
 
     void MakeRoom(Bundle& bundle,
                   std::list<std::string>& toRemove,
+                  std::list<std::string>& evictedItems,
                   int bundleIndex,
+                  const BundleQuota& quota,
+                  const std::string* keptItem);
+
+    // Counts a store of the item, returns false if it must not be stored
+    // (too large, or not admitted)
+    bool IsStored(int bundleIndex,
+                  const std::string& item,
+                  uint64_t size,
+                  bool speculative,
                   const BundleQuota& quota);
 
+    bool IsAdmitted(int bundleIndex,
+                    const std::string& item,
+                    uint64_t size,
+                    const BundleQuota& quota) const;
+
+    void LimitProtectedSegment(int bundleIndex,
+                               const BundleQuota& quota);
+
     void EnsureQuota(int bundleIndex,
                      const BundleQuota& quota);
 
+    // Only the least recently used items, the protected segment is unchanged
+    void Evict(int bundleIndex,
+               const BundleQuota& target);
+
+    // Indexes a file that has been written to the disk
+    bool AddEntry(int bundleIndex,
+                  const std::string& item,
+                  const std::string& uuid,
+                  uint64_t size,
+                  bool isProtected,
+                  const BundleQuota& quota);
+
     void ReadBundleStatistics();
 
-    void Open();
+    // Writes the statistics of a bundle to its header (within the
+    // transaction that changes its entries)
+    void SaveBundle(int bundleIndex,
+                    const Bundle& bundle);
 
-    bool LocateInCache(std::string& uuid,
-                       uint64_t& size,
-                       int bundle,
-                       const std::string& item);
+    void ReadEntries();
+
+    void FlushRecency();
+
+    void Open();
 
     void SanityCheck();  // Only for debug
 
@@ -76,14 +133,35 @@ namespace OrthancPlugins
                  Orthanc::SQLite::Connection& db,
                  Orthanc::FilesystemStorage& storage);
 
+    ~CacheManager();
+
     OrthancPluginContext* GetPluginContext() const;
 
     void SetSanityCheckEnabled(bool enabled);
 
+    // Only the index is cleared, the files are removed in the background
+    // (see RemoveStaleFiles())
     void Clear();
 
     void Clear(int bundle);
 
+    // Version of the format of the items of a bundle: if it differs from the
+    // version recorded by the previous run, the items of this bundle (and
+    // only these ones) are dropped.  The files of a shared bundle are in a
+    // directory of their version, see SharedCacheDirectory::SetBundleVersion().
+    void SetBundleVersion(int bundle,
+                          const std::string& version);
+
+    // Schedules the removal of "maxCount" files of the cleared bundles, or of
+    // the evicted items whose removal was not scheduled yet (see
+    // TakeRemovedFiles()).  Returns false if there is nothing left to remove.
+    bool RemoveStaleFiles(size_t maxCount);
+
+    // Reads the next "maxCount" entries of the index of a bundle that is not
+    // loaded yet.  Until then, the accesses to this bundle look up the
+    // database.  Returns false if all the bundles are loaded.
+    bool LoadEntries(size_t maxCount);
+
     void SetBundleQuota(int bundle,
                         uint32_t maxCount,
                         uint64_t maxSpace);
@@ -91,24 +169,129 @@ namespace OrthancPlugins
     void SetDefaultQuota(uint32_t maxCount,
                          uint64_t maxSpace);
 
+    // The files of this bundle are stored in a directory shared with other
+    // nodes (a single directory for all the bundles, not owned).  The index
+    // stays private to this node, the items written by the other nodes are
+    // added to it when they are accessed.  The quota of the bundle then only
+    // limits this index, the size of the directory is limited by the
+    // directory itself.
+    void SetSharedDirectory(int bundle,
+                            SharedCacheDirectory* directory);
+
+    // The files of the bundles that are not shared are appended to the
+    // segment files of this storage (not owned) instead of being written to
+    // individual files.  The existing files are still read, until they are
+    // evicted.
+    void SetPackStorage(PackStorage* packs);
+
+    // Moves the entries of the segment file that is the most worth compacting
+    // (at most "maxSize" bytes) to the active segment, and deletes the
+    // segments that are not used anymore.  Returns false if there is nothing
+    // to compact.
+    bool CompactPackFiles(uint64_t maxSize);
+
+    // Evicts the least recently used items of the bundles that are close to
+    // their quota, so that the next Store() do not have to.  Only the index
+    // is updated, see TakeRemovedFiles().  Returns false if there was
+    // nothing to evict.
+    bool ReclaimSpace();
+
+    // The files of the items that have been evicted or invalidated since the
+    // last call, to be removed with RemoveFiles().  The index only records
+    // them, so that the store path does not remove files.
+    void TakeRemovedFiles(std::vector<std::string>& files);
+
+    // The items (bundle, item) that have been evicted to make room since the
+    // last call.  The invalidated and replaced items are not listed.
+    void TakeEvictedItems(std::vector<std::pair<int, std::string> >& items);
+
+    // Does not use the index: can be called without the lock of the caller
+    void RemoveFiles(const std::vector<std::string>& files) const;
+
+    // Does not count as a read of the item
     bool IsCached(int bundle,
-                  const std::string& item);
+                  const std::string& item) const;
+
+    // Same as IsCached(), without looking for the files written by the
+    // other nodes in the shared directory
+    bool IsIndexed(int bundle,
+                   const std::string& item) const;
+
+    // Signals that an item has been read from another tier (ie. the
+    // in-memory cache): a speculative item is then protected from the
+    // eviction like the items read through Access()
+    void SignalRead(int bundle,
+                    const std::string& item);
 
     bool Access(std::string& content,
                 int bundle,
                 const std::string& item);
 
+    // Access() in two steps, so that the caller does not have to hold its
+    // lock while the file is read.  ReadCachedFile() returns false if the
+    // file has been removed in the meantime (ie. the item has been evicted).
+    bool LocateInCache(std::string& uuid,
+                       uint64_t& size,
+                       int bundle,
+                       const std::string& item);
+
+    // Same as LocateInCache(), without looking for the files written by the
+    // other nodes in the shared directory
+    bool LocateInIndex(std::string& uuid,
+                       uint64_t& size,
+                       int bundle,
+                       const std::string& item);
+
+    // The files of the shared directory are looked up and written without
+    // the index, so that the caller does not have to hold its lock during
+    // these I/O: LookupSharedFile() and WriteSharedFile() can be called
+    // without it (they return false if the bundle is not shared), then
+    // IndexSharedFile() and StoreSharedFile() update the index.
+    bool LookupSharedFile(std::string& name,
+                          uint64_t& size,
+                          int bundle,
+                          const std::string& item) const;
+
+    bool WriteSharedFile(std::string& name,
+                         int bundle,
+                         const std::string& item,
+                         const std::string& content) const;
+
+    // Adds a file found by LookupSharedFile() to the index, as an item that
+    // is read.  Returns false if it cannot be indexed.
+    bool IndexSharedFile(int bundle,
+                         const std::string& item,
+                         const std::string& name,
+                         uint64_t size);
+
+    // Same as Store(), for a file written by WriteSharedFile()
+    void StoreSharedFile(int bundle,
+                         const std::string& item,
+                         const std::string& name,
+                         uint64_t size,
+                         bool speculative);
+
+    bool ReadCachedFile(std::string& content,
+                        const std::string& uuid,
+                        uint64_t size) const;
+
     void Invalidate(int bundle,
                     const std::string& itemPrefix);
 
+    // The speculative items (prefetch, precompute) are stored in the
+    // probationary segment of the cache, which is evicted first, and are
+    // not stored if they would evict items that are read more frequently
     void Store(int bundle,
                const std::string& item,
-               const std::string& content);
+               const std::string& content,
+               bool speculative);
 
     void SetProperty(CacheProperty property,
                      const std::string& value);
 
     bool LookupProperty(std::string& target,
                         CacheProperty property);
+
+    void GetStatistics(Statistics& target) const;
   };
 }
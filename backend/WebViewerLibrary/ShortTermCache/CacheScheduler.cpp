@@ -25,10 +25,49 @@
 
 #include <OrthancException.h>
 #include <stdio.h>
+#include <assert.h>
+#include <algorithm>
+#include <set>
+#include <boost/foreach.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread/future.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/algorithm/string/predicate.hpp>
 #include "ShortTermCache/CacheContext.h"
 
 namespace OrthancPlugins
 {
+  // The items that a factory has failed to create are not tried again
+  // during this delay (in seconds), unless they are invalidated
+  static const unsigned int NEGATIVE_CACHE_TIME_TO_LIVE = 300;
+
+  // An invalidation on another node only removes the files of the shared
+  // directory: the in-memory tier and the remembered failures of the shared
+  // bundles are kept for this delay (in seconds) at most, so that this node
+  // does not serve an invalidated item for longer
+  static const unsigned int SHARED_ITEMS_TIME_TO_LIVE = 10;
+
+  // The maintenance thread evicts the items of the bundles that are close
+  // to their quota every RECLAIM_PERIOD_MS milliseconds, and looks for pack
+  // files to compact every COMPACTION_PERIOD_MS milliseconds.  The pack
+  // files are compacted by steps of COMPACTION_STEP_SIZE bytes, the cache is
+  // unlocked between two steps.
+  static const unsigned int RECLAIM_PERIOD_MS = 100;
+  static const unsigned int COMPACTION_PERIOD_MS = 1000;
+  static const uint64_t COMPACTION_STEP_SIZE = 4 * 1024 * 1024;
+
+  // Number of files of the cleared bundles removed at each period
+  static const size_t STALE_FILES_PER_PERIOD = 1024;
+
+  // The index of the cache is read in the background after the startup, by
+  // batches of ENTRIES_LOADED_PER_STEP rows, the cache is unlocked between
+  // two batches
+  static const size_t ENTRIES_LOADED_PER_STEP = 10000;
+
+  // Number of viewers whose opened study is remembered, to cancel its
+  // prefetching once they open another one
+  static const size_t MAX_OPENED_STUDIES = 256;
+
   class DynamicString : public Orthanc::IDynamicObject
   {
   private:
@@ -46,394 +85,2088 @@ namespace OrthancPlugins
   };
 
 
-  class CacheScheduler::PrefetchQueue : public boost::noncopyable
+  class CacheScheduler::PrefetchJob : public Orthanc::IDynamicObject
+  {
+  private:
+    std::string               group_;
+    std::vector<std::string>  items_;
+    bool                      ingest_;
+
+  public:
+    PrefetchJob(const std::string& group,
+                const std::vector<std::string>& items,
+                bool ingest) :
+      group_(group),
+      items_(items),
+      ingest_(ingest)
+    {
+    }
+
+    const std::string& GetGroup() const
+    {
+      return group_;
+    }
+
+    const std::vector<std::string>& GetItems() const
+    {
+      return items_;
+    }
+
+    // ie. the precompute of newly received instances (see CacheScheduler::Precompute())
+    bool IsIngest() const
+    {
+      return ingest_;
+    }
+  };
+
+
+  // An item being computed. The other threads requesting the same item wait
+  // for its completion instead of computing it again.
+  class CacheScheduler::Computation : public boost::noncopyable
+  {
+  public:
+    boost::promise<void>        promise;
+    boost::shared_future<void>  done;
+    unsigned int                waiters;    // protected by the mutex of InFlightComputations
+    bool                        available;  // false if the computation has been abandoned
+    bool                        success;
+    std::string                 content;
+    BackgroundGovernor::BackgroundJob*  job;  // computing the item, NULL if not a background job
+
+    Computation() :
+      waiters(0),
+      available(false),
+      success(false),
+      job(BackgroundGovernor::GetCurrentJob())
+    {
+      done = boost::shared_future<void>(promise.get_future());
+    }
+  };
+
+  class CacheScheduler::InFlightComputations : public boost::noncopyable
   {
   private:
-    boost::mutex                 mutex_;
-    Orthanc::SharedMessageQueue  queue_;
-    std::set<std::string>        content_;
+    typedef std::pair<int, std::string>          Key;
+    typedef std::map<Key, ComputationPtr>        Computations;
+
+    boost::mutex   mutex_;
+    Computations   computations_;
+    Statistics     statistics_;
+
+    // The computation is removed from the table before it is signaled, so a
+    // thread that does not find it anymore will find its content in the cache.
+    ComputationPtr Remove(int bundle,
+                          const std::string& item,
+                          bool& hasWaiters)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Computations::iterator found = computations_.find(Key(bundle, item));
+      assert(found != computations_.end());
+
+      ComputationPtr computation = found->second;
+      computations_.erase(found);
+      hasWaiters = (computation->waiters > 0);
+      return computation;
+    }
 
   public:
-    PrefetchQueue(size_t maxSize) : queue_(maxSize)
+    InFlightComputations()
     {
-      queue_.SetLifoPolicy();
+      statistics_.coalescedAccesses = 0;
+      statistics_.coalescedPrefetches = 0;
     }
 
-    void Enqueue(const std::string& item)
+    // Returns true if the caller must compute the item (and then call
+    // Complete(), Abandon() or Fail()). Otherwise, another thread is
+    // computing the item and "computation" is this pending computation.
+    bool Start(ComputationPtr& computation,
+               int bundle,
+               const std::string& item,
+               bool isPrefetch)
     {
       boost::mutex::scoped_lock lock(mutex_);
 
-      if (content_.find(item) != content_.end())
+      Computations::iterator found = computations_.find(Key(bundle, item));
+      if (found != computations_.end())
       {
-        // This cache index is already pending in the queue
-        return;
+        computation = found->second;
+        if (isPrefetch)
+        {
+          statistics_.coalescedPrefetches++;
+        }
+        else
+        {
+          computation->waiters++;
+          statistics_.coalescedAccesses++;
+
+          // the job is still running, as the computation is in the table
+          if (computation->job != NULL)
+          {
+            computation->job->SignalAwaited();
+          }
+        }
+        return false;
       }
 
-      content_.insert(item);
-      queue_.Enqueue(new DynamicString(item));
+      computation = boost::make_shared<Computation>();
+      computations_[Key(bundle, item)] = computation;
+      return true;
     }
 
-    DynamicString* Dequeue(int32_t msTimeout)
+    void Complete(int bundle,
+                  const std::string& item,
+                  bool success,
+                  const std::string& content)
     {
-      std::auto_ptr<Orthanc::IDynamicObject> message(queue_.Dequeue(msTimeout));
-      if (message.get() == NULL)
+      bool hasWaiters;
+      ComputationPtr computation = Remove(bundle, item, hasWaiters);
+
+      computation->available = true;
+      computation->success = success;
+      if (hasWaiters)
       {
-        return NULL;
+        computation->content = content;
       }
+      computation->promise.set_value();
+    }
+
+    // The waiting threads compute the item themselves
+    void Abandon(int bundle,
+                 const std::string& item)
+    {
+      bool hasWaiters;
+      ComputationPtr computation = Remove(bundle, item, hasWaiters);
+      computation->promise.set_value();
+    }
+
+    // The waiting threads get the same error
+    void Fail(int bundle,
+              const std::string& item,
+              boost::exception_ptr error)
+    {
+      bool hasWaiters;
+      ComputationPtr computation = Remove(bundle, item, hasWaiters);
+      computation->promise.set_exception(error);
+    }
+
+    void GetStatistics(Statistics& target)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      target.coalescedAccesses = statistics_.coalescedAccesses;
+      target.coalescedPrefetches = statistics_.coalescedPrefetches;
+    }
+  };
+
+
+  // The items of a prefetch job that are computed by this job; abandons the
+  // items that have not been completed (failure, invalidation, exception)
+  class CacheScheduler::PendingComputations : public boost::noncopyable
+  {
+  private:
+    InFlightComputations&  inFlight_;
+    int                    bundle_;
+    std::set<std::string>  items_;
 
-      const DynamicString& index = dynamic_cast<const DynamicString&>(*message);
+  public:
+    PendingComputations(InFlightComputations& inFlight,
+                        int bundle) :
+      inFlight_(inFlight),
+      bundle_(bundle)
+    {
+    }
 
+    ~PendingComputations()
+    {
+      BOOST_FOREACH(const std::string& item, items_)
       {
-        boost::mutex::scoped_lock lock(mutex_);
-        content_.erase(index.GetValue());
+        inFlight_.Abandon(bundle_, item);
+      }
+    }
+
+    // Returns false if another thread is already computing this item
+    bool Start(const std::string& item)
+    {
+      ComputationPtr computation;
+      if (inFlight_.Start(computation, bundle_, item, true))
+      {
+        items_.insert(item);
+        return true;
       }
+      return false;
+    }
 
-      return dynamic_cast<DynamicString*>(message.release());
+    void Complete(const std::string& item,
+                  const std::string& content)
+    {
+      if (items_.erase(item) > 0)
+      {
+        inFlight_.Complete(bundle_, item, true, content);
+      }
     }
   };
 
 
-  class CacheScheduler::Prefetcher : public boost::noncopyable
+  // Runs the prefetch policy in a background thread: the request threads
+  // only enqueue their access events (hits and misses) and return.  The
+  // events are coalesced (one per item) and, when the policy can't keep up
+  // (ie. fast scrolling), the oldest ones are dropped since the latest
+  // viewer positions matter most.  The opening of a study is an event too.
+  class CacheScheduler::PolicyStage : public boost::noncopyable
   {
   private:
-    int             bundleIndex_;
-    ICacheFactory&  factory_;
-    CacheManager&   cacheManager_;
-    CacheLogger*    cacheLogger_;
-    boost::mutex&   cacheMutex_;
-    PrefetchQueue&  queue_;
+    static const size_t MAX_PENDING_EVENTS = 64;
 
-    bool            done_;
-    boost::thread   thread_;
-    boost::mutex    invalidatedMutex_;
-    bool            invalidated_;
-    std::string     prefetching_;
+    struct Event
+    {
+      bool            isStudy;  // if true, "item" is an opened study whose series are "series"
+      int             bundle;
+      std::string     item;
+      std::string     content;  // only if the policy needs it
+      PrefetchAccess  access;
+      std::vector<std::string>  series;
+
+      Event() :
+        isStudy(false),
+        bundle(0)
+      {
+      }
+    };
+
+    CacheScheduler&            scheduler_;
+    boost::mutex               mutex_;
+    boost::condition_variable  available_;
+    std::list<Event>           events_;  // the oldest first
+    bool                       stopped_;
+    boost::thread              thread_;
+
+    // Appends a new event, coalesced with the pending event of the same item
+    // (requires mutex_ to be locked)
+    void Push(bool isStudy,
+              int bundle,
+              const std::string& item)
+    {
+      for (std::list<Event>::iterator it = events_.begin(); it != events_.end(); ++it)
+      {
+        if (it->isStudy == isStudy &&
+            it->bundle == bundle &&
+            it->item == item)
+        {
+          // the coalesced event now comes last
+          events_.erase(it);
+          break;
+        }
+      }
 
-    static void Worker(Prefetcher* that)
+      if (events_.size() >= MAX_PENDING_EVENTS)
+      {
+        events_.pop_front();
+      }
+
+      events_.push_back(Event());
+      events_.back().isStudy = isStudy;
+      events_.back().item = item;
+    }
+
+    static void Worker(PolicyStage* that)
     {
-      while (!(that->done_))
+      for (;;)
       {
-        std::auto_ptr<DynamicString> prefetch(that->queue_.Dequeue(500));
+        Event event;
+
+        {
+          boost::mutex::scoped_lock lock(that->mutex_);
+          while (!that->stopped_ && that->events_.empty())
+          {
+            that->available_.wait(lock);
+          }
+
+          if (that->stopped_)
+          {
+            return;
+          }
+
+          event.isStudy = that->events_.front().isStudy;
+          event.bundle = that->events_.front().bundle;
+          event.item.swap(that->events_.front().item);
+          event.content.swap(that->events_.front().content);
+          event.access = that->events_.front().access;
+          event.series.swap(that->events_.front().series);
+          that->events_.pop_front();
+        }
 
         try
         {
-          if (prefetch.get() != NULL)
+          if (event.isStudy)
           {
-            that->cacheLogger_->LogCacheDebugInfo(std::string("dequeued prefetching ") + prefetch->GetValue());
-            {
-              boost::mutex::scoped_lock lock(that->invalidatedMutex_);
-              that->invalidated_ = false;
-              that->prefetching_ = prefetch->GetValue();
-            }
+            that->scheduler_.ApplyStudyPolicy(event.item, event.series, event.access.client);
+          }
+          else
+          {
+            that->scheduler_.ApplyPrefetchPolicy(event.bundle, event.item, event.content, event.access);
+          }
+        }
+        catch (Orthanc::OrthancException& e)
+        {
+          that->scheduler_.cacheLogger_->LogCacheDebugInfo(std::string("error while applying the prefetch policy to ") + event.item + ": " + e.What());
+        }
+        catch (...)
+        {
+          OrthancPluginLogError(that->scheduler_.cacheManager_.GetPluginContext(),
+                                "Unhandled native exception while applying the prefetch policy of the Web viewer");
+        }
+      }
+    }
 
-            {
-              boost::mutex::scoped_lock lock(that->cacheMutex_);
-              if (that->cacheManager_.IsCached(that->bundleIndex_, prefetch->GetValue()))
-              {
-                // This item is already cached
-                continue;
-              }
-            }
+  public:
+    explicit PolicyStage(CacheScheduler& scheduler) :
+      scheduler_(scheduler),
+      stopped_(false)
+    {
+      thread_ = boost::thread(Worker, this);
+    }
 
-            std::string content;
+    ~PolicyStage()
+    {
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        stopped_ = true;
+      }
 
-            try
-            {
-              that->cacheLogger_->LogCacheDebugInfo(std::string("prefetching ") + prefetch->GetValue());
+      available_.notify_all();
 
-              if (!that->factory_.Create(content, prefetch->GetValue()))
-              {
-                that->cacheLogger_->LogCacheDebugInfo(std::string("could not prefetch ") + prefetch->GetValue());
+      if (thread_.joinable())
+      {
+        thread_.join();
+      }
+    }
 
-                // The factory cannot generate this item
-                continue;
-              }
-            }
-            catch (...)
-            {
-              // Exception
-              continue;
-            }
+    void EnqueueStudy(const std::string& study,
+                      const std::vector<std::string>& series,
+                      const PrefetchAccess& access)
+    {
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        Push(true, 0, study);
+        events_.back().series = series;
+        events_.back().access = access;
+      }
 
-            {
-              boost::mutex::scoped_lock lock(that->invalidatedMutex_);
-              if (that->invalidated_)
-              {
-                // This item has been invalidated
-                continue;
-              }
-              
-              {
-                boost::mutex::scoped_lock lock2(that->cacheMutex_);
-                that->cacheManager_.Store(that->bundleIndex_, prefetch->GetValue(), content);
-                that->cacheLogger_->LogCacheDebugInfo(std::string("stored ") + prefetch->GetValue());
-              }
-            }
-          }
-        }
-        catch (std::bad_alloc&)
+      available_.notify_one();
+    }
+
+    bool IsWorkerThread() const
+    {
+      return boost::this_thread::get_id() == thread_.get_id();
+    }
+
+    void Enqueue(int bundle,
+                 const std::string& item,
+                 const std::string* content,
+                 const PrefetchAccess& access)
+    {
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        Push(false, bundle, item);
+        events_.back().bundle = bundle;
+        events_.back().item = item;
+        events_.back().access = access;
+        if (content != NULL)
         {
-          OrthancPluginLogError(that->cacheManager_.GetPluginContext(),
-                                "Not enough memory for the prefetcher of the Web viewer to work");
+          events_.back().content = *content;
         }
-        catch (...)
+      }
+
+      available_.notify_one();
+    }
+  };
+
+
+  // The items stored by the prefetchers that have not been accessed yet, to
+  // measure the usefulness of the read-ahead: a prefetched item is "used"
+  // when it is accessed, "wasted" when it is invalidated or evicted from the
+  // cache before.  Only the MAX_UNUSED_ITEMS last prefetched items are
+  // tracked, the older ones are forgotten without being counted.
+  class CacheScheduler::PrefetchUsage : public boost::noncopyable
+  {
+  private:
+    static const size_t MAX_UNUSED_ITEMS = 16384;
+
+    typedef std::pair<int, std::string>       Key;
+    typedef std::list<Key>                    Recency;  // the oldest first
+    typedef std::map<Key, Recency::iterator>  Unused;
+
+    boost::mutex  mutex_;
+    Recency       recency_;
+    Unused        unused_;
+    uint64_t      prefetched_;
+    uint64_t      used_;
+    uint64_t      wasted_;
+
+    // requires mutex_ to be locked
+    void Remove(Unused::iterator item)
+    {
+      recency_.erase(item->second);
+      unused_.erase(item);
+    }
+
+  public:
+    PrefetchUsage() :
+      prefetched_(0),
+      used_(0),
+      wasted_(0)
+    {
+    }
+
+    void AddPrefetched(int bundle,
+                       const std::string& item)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Key key(bundle, item);
+      if (unused_.find(key) != unused_.end())
+      {
+        return;
+      }
+
+      prefetched_++;
+      recency_.push_back(key);
+      unused_[key] = --recency_.end();
+
+      if (unused_.size() > MAX_UNUSED_ITEMS)
+      {
+        Remove(unused_.find(recency_.front()));
+      }
+    }
+
+    // Returns true if this is the first access to a prefetched item
+    bool SignalAccess(int bundle,
+                      const std::string& item)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Unused::iterator found = unused_.find(Key(bundle, item));
+      if (found != unused_.end())
+      {
+        Remove(found);
+        used_++;
+        return true;
+      }
+      else
+      {
+        return false;
+      }
+    }
+
+    void SignalInvalidated(int bundle,
+                           const std::string& itemPrefix)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Unused::iterator it = unused_.lower_bound(Key(bundle, itemPrefix));
+      while (it != unused_.end() &&
+             it->first.first == bundle &&
+             boost::starts_with(it->first.second, itemPrefix))
+      {
+        Remove(it++);
+        wasted_++;
+      }
+    }
+
+    void SignalEvicted(int bundle,
+                       const std::string& item)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Unused::iterator found = unused_.find(Key(bundle, item));
+      if (found != unused_.end())
+      {
+        Remove(found);
+        wasted_++;
+      }
+    }
+
+    void GetStatistics(Statistics& target)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      target.prefetchedItems = prefetched_;
+      target.usedPrefetchedItems = used_;
+      target.wastedPrefetchedItems = wasted_;
+    }
+  };
+
+
+  // Records the duration of an access by a request thread (see
+  // BackgroundGovernor::RecordInteractiveLatency())
+  class CacheScheduler::InteractiveLatency : public boost::noncopyable
+  {
+  private:
+    BackgroundGovernor&       governor_;
+    bool                      recorded_;  // false for the accesses of the factories run by the prefetchers
+    bool                      underLoad_;
+    boost::posix_time::ptime  start_;
+
+  public:
+    explicit InteractiveLatency(BackgroundGovernor& governor) :
+      governor_(governor),
+      recorded_(!governor.IsBackgroundThread()),
+      underLoad_(recorded_ && governor.HasRunningJobs()),
+      start_(boost::posix_time::microsec_clock::universal_time())
+    {
+    }
+
+    ~InteractiveLatency()
+    {
+      if (recorded_)
+      {
+        boost::posix_time::time_duration duration = boost::posix_time::microsec_clock::universal_time() - start_;
+        governor_.RecordInteractiveLatency(duration.total_microseconds() / 1000.0, underLoad_);
+      }
+    }
+  };
+
+
+  // The pending prefetch jobs of a bundle, run in this order:
+  //  1. the jobs of the most recently viewed series first, then the jobs that
+  //     are not related to a viewed series (ie. new instances),
+  //  2. the closest slices to the viewed one first,
+  //  3. the lowest quality first,
+  //  4. the most recently enqueued first (as the former LIFO queue).
+  // The jobs of a series are ranked again each time the viewer position
+  // changes in this series.  The workers are woken up on enqueue; the share
+  // of the CPU they use is governed by the BackgroundGovernor.
+  class CacheScheduler::PrefetchQueue : public boost::noncopyable
+  {
+  private:
+    // only the MAX_VIEWED_SERIES most recently viewed series are tracked, the
+    // jobs of the older ones are canceled (ie. the study has been closed)
+    static const size_t MAX_VIEWED_SERIES = 16;
+
+    // weight of the last job in the average duration of the jobs
+    static const double JOB_DURATION_SMOOTHING;
+
+    struct Rank
+    {
+      uint64_t      seriesGeneration;  // the higher first (0 = not viewed)
+      unsigned int  distance;
+      unsigned int  quality;
+      uint64_t      sequence;          // the higher first
+
+      bool operator< (const Rank& other) const
+      {
+        if (seriesGeneration != other.seriesGeneration)
+          return seriesGeneration > other.seriesGeneration;
+        if (distance != other.distance)
+          return distance < other.distance;
+        if (quality != other.quality)
+          return quality < other.quality;
+        return sequence > other.sequence;
+      }
+    };
+
+    struct Job
+    {
+      std::vector<std::string>  items;
+      PrefetchPriority          priority;
+      Rank                      rank;
+      bool                      ingest;
+    };
+
+    struct ViewedSeries
+    {
+      unsigned int  position;
+      uint64_t      generation;
+    };
+
+    typedef std::map<std::string, Job>                  Jobs;     // by prefetch group
+    typedef std::set<std::pair<Rank, std::string> >     Ranking;  // the next job first
+    typedef std::map<std::string, ViewedSeries>         ViewedSeriesMap;
+
+    boost::mutex               mutex_;
+    boost::condition_variable  changed_;
+    size_t                     maxSize_;
+    Jobs                       jobs_;
+    Ranking                    ranking_;
+    ViewedSeriesMap            viewedSeries_;
+    uint64_t                   generation_;
+    uint64_t                   sequence_;
+    bool                       stopped_;
+    double                     jobDuration_;  // in seconds, exponential moving average (0 = no job yet)
+    uint64_t                   ingestProcessedItems_;
+    uint64_t                   ingestDroppedItems_;
+
+    // these methods require mutex_ to be locked
+    Rank ComputeRank(const PrefetchPriority& priority,
+                     uint64_t sequence) const
+    {
+      Rank rank;
+      rank.seriesGeneration = 0;
+      rank.distance = 0;
+      rank.quality = priority.quality;
+      rank.sequence = sequence;
+
+      ViewedSeriesMap::const_iterator series = viewedSeries_.find(priority.series);
+      if (series != viewedSeries_.end())
+      {
+        rank.seriesGeneration = series->second.generation;
+        rank.distance = (priority.position > series->second.position ?
+                         priority.position - series->second.position :
+                         series->second.position - priority.position);
+      }
+      else
+      {
+        // ie. the display order of the series of an opened study
+        rank.distance = priority.position;
+      }
+
+      return rank;
+    }
+
+    void Remove(Jobs::iterator job)
+    {
+      ranking_.erase(std::make_pair(job->second.rank, job->first));
+      jobs_.erase(job);
+    }
+
+    void CancelSeries(const std::string& series)
+    {
+      for (Jobs::iterator it = jobs_.begin(); it != jobs_.end(); )
+      {
+        if (it->second.priority.series == series)
+        {
+          Remove(it++);
+        }
+        else
+        {
+          ++it;
+        }
+      }
+    }
+
+  public:
+    PrefetchQueue(size_t maxSize) :
+      maxSize_(maxSize),
+      generation_(0),
+      sequence_(0),
+      stopped_(false),
+      jobDuration_(0),
+      ingestProcessedItems_(0),
+      ingestDroppedItems_(0)
+    {
+    }
+
+    void Enqueue(const std::string& group,
+                 const std::vector<std::string>& items,
+                 const PrefetchPriority& priority,
+                 bool ingest)
+    {
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        Jobs::iterator found = jobs_.find(group);
+        if (found != jobs_.end())
+        {
+          // This prefetch group is already pending in the queue: update its
+          // priority and add the missing items
+          Job job = found->second;
+          Remove(found);
+
+          BOOST_FOREACH(const std::string& item, items)
+          {
+            if (std::find(job.items.begin(), job.items.end(), item) == job.items.end())
+            {
+              job.items.push_back(item);
+            }
+          }
+
+          job.priority = priority;
+          job.ingest = job.ingest || ingest;
+          found = jobs_.insert(std::make_pair(group, job)).first;
+        }
+        else
+        {
+          Job job;
+          job.items = items;
+          job.priority = priority;
+          job.ingest = ingest;
+          found = jobs_.insert(std::make_pair(group, job)).first;
+        }
+
+        found->second.rank = ComputeRank(priority, ++sequence_);
+        ranking_.insert(std::make_pair(found->second.rank, group));
+
+        if (maxSize_ != 0 &&
+            jobs_.size() > maxSize_)
+        {
+          // drop the job with the lowest priority
+          Jobs::iterator dropped = jobs_.find(ranking_.rbegin()->second);
+          if (dropped->second.ingest)
+          {
+            ingestDroppedItems_ += dropped->second.items.size();
+          }
+
+          Remove(dropped);
+        }
+      }
+
+      changed_.notify_one();
+    }
+
+    // Ranks again the jobs of the series by their distance to "position"
+    void SetViewerPosition(const std::string& series,
+                           unsigned int position)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      ViewedSeries& viewed = viewedSeries_[series];
+      viewed.position = position;
+      viewed.generation = ++generation_;
+
+      if (viewedSeries_.size() > MAX_VIEWED_SERIES)
+      {
+        ViewedSeriesMap::iterator oldest = viewedSeries_.begin();
+        for (ViewedSeriesMap::iterator it = viewedSeries_.begin(); it != viewedSeries_.end(); ++it)
+        {
+          if (it->second.generation < oldest->second.generation)
+          {
+            oldest = it;
+          }
+        }
+
+        CancelSeries(oldest->first);
+        viewedSeries_.erase(oldest);
+      }
+
+      for (Jobs::iterator it = jobs_.begin(); it != jobs_.end(); ++it)
+      {
+        if (it->second.priority.series == series)
+        {
+          ranking_.erase(std::make_pair(it->second.rank, it->first));
+          it->second.rank = ComputeRank(it->second.priority, it->second.rank.sequence);
+          ranking_.insert(std::make_pair(it->second.rank, it->first));
+        }
+      }
+    }
+
+    void Cancel(const std::string& series)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      CancelSeries(series);
+      viewedSeries_.erase(series);
+    }
+
+    // Wakes up the workers, Dequeue() returns NULL from now on
+    void Stop()
+    {
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        stopped_ = true;
+      }
+
+      changed_.notify_all();
+    }
+
+    // Called by the workers after the computation of a job, with its
+    // duration per prefetch group (ie. per slice, an ingest job computes
+    // the groups of several frames at once)
+    void RecordJobDuration(double seconds)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      if (jobDuration_ == 0)
+      {
+        jobDuration_ = seconds;
+      }
+      else
+      {
+        jobDuration_ += JOB_DURATION_SMOOTHING * (seconds - jobDuration_);
+      }
+    }
+
+    // Returns false if no job has been computed yet
+    bool GetJobDuration(double& seconds)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      seconds = jobDuration_;
+      return jobDuration_ != 0;
+    }
+
+    // Called by the workers once they are done with an ingest job, whether
+    // its items have been computed, were already cached or failed
+    void RecordIngestProcessed(size_t items)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      ingestProcessedItems_ += items;
+    }
+
+    // Adds the backlog and the progress of the ingest jobs
+    void GetIngestStatistics(Statistics& target)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      for (Jobs::const_iterator it = jobs_.begin(); it != jobs_.end(); ++it)
+      {
+        if (it->second.ingest)
+        {
+          target.ingestPendingItems += it->second.items.size();
+        }
+      }
+
+      target.ingestProcessedItems += ingestProcessedItems_;
+      target.ingestDroppedItems += ingestDroppedItems_;
+    }
+
+    // Waits for the next job, returns NULL if the queue has been stopped
+    PrefetchJob* Dequeue()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      while (!stopped_ &&
+             ranking_.empty())
+      {
+        changed_.wait(lock);
+      }
+
+      if (stopped_)
+      {
+        return NULL;
+      }
+
+      Jobs::iterator next = jobs_.find(ranking_.begin()->second);
+      std::auto_ptr<PrefetchJob> job(new PrefetchJob(next->first, next->second.items, next->second.ingest));
+      Remove(next);
+
+      return job.release();
+    }
+  };
+
+
+  const double CacheScheduler::PrefetchQueue::JOB_DURATION_SMOOTHING = 0.2;
+
+
+  class CacheScheduler::Prefetcher : public boost::noncopyable
+  {
+  private:
+    // Records the progress of an ingest job when the worker is done with it
+    class ScopedIngestRecord : public boost::noncopyable
+    {
+    private:
+      PrefetchQueue&      queue_;
+      const PrefetchJob&  job_;
+
+    public:
+      ScopedIngestRecord(PrefetchQueue& queue,
+                         const PrefetchJob& job) :
+        queue_(queue),
+        job_(job)
+      {
+      }
+
+      ~ScopedIngestRecord()
+      {
+        if (job_.IsIngest())
+        {
+          queue_.RecordIngestProcessed(job_.GetItems().size());
+        }
+      }
+    };
+
+    CacheScheduler& scheduler_;
+    BackgroundGovernor&  governor_;
+    int             bundleIndex_;
+    ICacheFactory&  factory_;
+    CacheManager&   cacheManager_;
+    CacheLogger*    cacheLogger_;
+    boost::mutex&   cacheMutex_;
+    PrefetchQueue&  queue_;
+    InFlightComputations&  inFlight_;
+    MemoryCache&    memoryCache_;
+    NegativeCache&  negativeCache_;
+    PrefetchUsage&  usage_;
+
+    boost::thread   thread_;
+    boost::mutex    invalidatedMutex_;
+    bool            invalidated_;
+    std::string     prefetching_;
+
+    // Remembers the items of the job that could not be created (see
+    // NegativeCache), unless they have been invalidated meanwhile
+    void StoreFailures(const std::vector<std::string>& items,
+                       const std::map<std::string, std::string>& created,
+                       Orthanc::ErrorCode error)
+    {
+      boost::mutex::scoped_lock lock(invalidatedMutex_);
+      if (!invalidated_)
+      {
+        BOOST_FOREACH(const std::string& item, items)
+        {
+          if (created.find(item) == created.end())
+          {
+            negativeCache_.Store(bundleIndex_, item, error);
+          }
+        }
+      }
+    }
+
+    static void Worker(Prefetcher* that)
+    {
+      that->governor_.RegisterBackgroundThread();
+
+      for (;;)
+      {
+        std::auto_ptr<PrefetchJob> prefetch(that->queue_.Dequeue());
+        if (prefetch.get() == NULL)
+        {
+          // the queue has been stopped
+          return;
+        }
+
+        // only the share of the CPU given to the background work is used (the
+        // slot is not held while waiting for a job, the prefetchers of the
+        // other bundles could never run otherwise)
+        BackgroundGovernor::BackgroundJob slot(that->governor_);
+        if (!slot.IsAcquired())
+        {
+          // the scheduler is being destroyed
+          return;
+        }
+
+        ScopedIngestRecord ingestRecord(that->queue_, *prefetch);
+
+        try
+        {
+          if (prefetch.get() != NULL)
+          {
+            that->cacheLogger_->LogCacheDebugInfo(std::string("dequeued prefetching ") + prefetch->GetGroup());
+            {
+              boost::mutex::scoped_lock lock(that->invalidatedMutex_);
+              that->invalidated_ = false;
+              that->prefetching_ = prefetch->GetGroup();
+            }
+
+            // before the content is computed (see IPrefetchPolicy::GetContentVersion())
+            uint64_t contentVersion = that->scheduler_.GetContentVersion(that->bundleIndex_);
+
+            std::vector<std::string> toCreate;
+            PendingComputations computations(that->inFlight_, that->bundleIndex_);
+
+            {
+              boost::mutex::scoped_lock lock(that->cacheMutex_);
+              BOOST_FOREACH(const std::string& item, prefetch->GetItems())
+              {
+                Orthanc::ErrorCode error;
+                if (!that->memoryCache_.IsCached(that->bundleIndex_, item) &&
+                    !that->cacheManager_.IsIndexed(that->bundleIndex_, item) &&
+                    !that->negativeCache_.Lookup(error, that->bundleIndex_, item))  // has failed recently
+                {
+                  toCreate.push_back(item);
+                }
+              }
+            }
+
+            {
+              // Skip the items written by another node (looked up without
+              // cacheMutex_, they are indexed when they are accessed)
+              std::vector<std::string> notShared;
+              BOOST_FOREACH(const std::string& item, toCreate)
+              {
+                std::string name;
+                uint64_t size;
+                if (!that->cacheManager_.LookupSharedFile(name, size, that->bundleIndex_, item))
+                {
+                  notShared.push_back(item);
+                }
+              }
+              toCreate.swap(notShared);
+            }
+
+            {
+              // Skip the items that are being computed by another thread
+              std::vector<std::string> notInFlight;
+              BOOST_FOREACH(const std::string& item, toCreate)
+              {
+                if (computations.Start(item))
+                {
+                  notInFlight.push_back(item);
+                }
+                else
+                {
+                  that->cacheLogger_->LogCacheDebugInfo(std::string("already being computed ") + item);
+                }
+              }
+              toCreate.swap(notInFlight);
+            }
+
+            if (toCreate.empty())
+            {
+              // These items are already cached (or being computed)
+              continue;
+            }
+
+            std::map<std::string, std::string> contents;
+
+            try
+            {
+              that->cacheLogger_->LogCacheDebugInfo(std::string("prefetching ") + prefetch->GetGroup());
+
+              boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+              if (toCreate.size() == 1)
+              {
+                std::string& content = contents[toCreate.front()];
+                if (!that->factory_.Create(content, toCreate.front()))
+                {
+                  contents.clear();
+                }
+              }
+              else
+              {
+                that->factory_.CreateMany(contents, toCreate);
+              }
+
+              // The factory cannot generate the missing items
+              that->StoreFailures(toCreate, contents, Orthanc::ErrorCode_Success);
+
+              if (contents.empty())
+              {
+                that->cacheLogger_->LogCacheDebugInfo(std::string("could not prefetch ") + prefetch->GetGroup());
+                continue;
+              }
+
+              std::set<std::string> groups;
+              BOOST_FOREACH(const std::string& item, toCreate)
+              {
+                groups.insert(that->factory_.GetPrefetchGroup(item));
+              }
+
+              that->queue_.RecordJobDuration((boost::posix_time::microsec_clock::universal_time() - start).total_microseconds() /
+                                             1000000.0 / static_cast<double>(groups.size()));
+            }
+            catch (Orthanc::OrthancException& e)
+            {
+              that->StoreFailures(toCreate, contents, e.GetErrorCode());
+              continue;
+            }
+            catch (...)
+            {
+              // Exception
+              continue;
+            }
+
+            {
+              boost::mutex::scoped_lock lock(that->invalidatedMutex_);
+              if (that->invalidated_)
+              {
+                // These items have been invalidated
+                continue;
+              }
+              
+              for (std::map<std::string, std::string>::const_iterator
+                     it = contents.begin(); it != contents.end(); ++it)
+              {
+                that->scheduler_.StoreInCache(that->bundleIndex_, it->first, it->second, true /* speculative */);
+                that->cacheLogger_->LogCacheDebugInfo(std::string("stored ") + it->first);
+              }
+
+              // still under invalidatedMutex_: an invalidation either comes
+              // before (and the items are not stored) or after (and removes
+              // them from both tiers), see CacheScheduler::Invalidate()
+              for (std::map<std::string, std::string>::const_iterator
+                     it = contents.begin(); it != contents.end(); ++it)
+              {
+                that->memoryCache_.Store(that->bundleIndex_, it->first, it->second);
+                that->usage_.AddPrefetched(that->bundleIndex_, it->first);
+              }
+            }
+
+            for (std::map<std::string, std::string>::const_iterator
+                   it = contents.begin(); it != contents.end(); ++it)
+            {
+              computations.Complete(it->first, it->second);
+            }
+
+            for (std::map<std::string, std::string>::const_iterator
+                   it = contents.begin(); it != contents.end(); ++it)
+            {
+              that->scheduler_.NotifyPrefetched(that->bundleIndex_, it->first, it->second, contentVersion);
+            }
+          }
+        }
+        catch (std::bad_alloc&)
+        {
+          OrthancPluginLogError(that->cacheManager_.GetPluginContext(),
+                                "Not enough memory for the prefetcher of the Web viewer to work");
+        }
+        catch (...)
+        {
+          OrthancPluginLogError(that->cacheManager_.GetPluginContext(),
+                                "Unhandled native exception inside the prefetcher of the Web viewer");
+        }
+      }
+    }
+
+
+  public:
+    Prefetcher(CacheScheduler& scheduler,
+               BackgroundGovernor& governor,
+               int             bundleIndex,
+               ICacheFactory&  factory,
+               CacheManager&   cacheManager,
+               CacheLogger*    cacheLogger,
+               boost::mutex&   cacheMutex,
+               PrefetchQueue&  queue,
+               InFlightComputations&  inFlight,
+               MemoryCache&    memoryCache,
+               NegativeCache&  negativeCache,
+               PrefetchUsage&  usage) :
+      scheduler_(scheduler),
+      governor_(governor),
+      bundleIndex_(bundleIndex),
+      factory_(factory),
+      cacheManager_(cacheManager),
+      cacheMutex_(cacheMutex),
+      cacheLogger_(cacheLogger),
+      queue_(queue),
+      inFlight_(inFlight),
+      memoryCache_(memoryCache),
+      negativeCache_(negativeCache),
+      usage_(usage)
+    {
+      thread_ = boost::thread(Worker, this);
+    }
+
+    // the queue must be stopped first
+    ~Prefetcher()
+    {
+      if (thread_.joinable())
+      {
+        thread_.join();
+      }
+    }
+
+    void SignalInvalidated(const std::string& item)
+    {
+      boost::mutex::scoped_lock lock(invalidatedMutex_);
+
+      // items are invalidated by prefix (e.g. all the frames of an instance)
+      if (boost::starts_with(prefetching_, item))
+      {
+        invalidated_ = true;
+      }
+    }
+  };
+
+
+
+  class CacheScheduler::BundleScheduler
+  {
+  private:
+    std::auto_ptr<ICacheFactory>   factory_;
+    PrefetchQueue                  queue_;
+    std::vector<Prefetcher*>       prefetchers_;
+
+  public:
+    BundleScheduler(CacheScheduler& scheduler,
+                    BackgroundGovernor& governor,
+                    int bundleIndex,
+                    ICacheFactory* factory,
+                    CacheManager&   cacheManager,
+                    CacheLogger* cacheLogger,
+                    boost::mutex&   cacheMutex,
+                    InFlightComputations& inFlight,
+                    MemoryCache& memoryCache,
+                    NegativeCache& negativeCache,
+                    PrefetchUsage& usage,
+                    size_t numThreads,
+                    size_t queueSize) :
+      factory_(factory),
+      queue_(queueSize)
+    {
+      prefetchers_.resize(numThreads, NULL);
+
+      for (size_t i = 0; i < numThreads; i++)
+      {
+        prefetchers_[i] = new Prefetcher(scheduler, governor, bundleIndex, *factory_, cacheManager, cacheLogger, cacheMutex, queue_, inFlight, memoryCache, negativeCache, usage);
+      }
+    }
+
+    ~BundleScheduler()
+    {
+      Stop();
+    }
+
+    // Joins the prefetchers, the factory can still be used by Access()
+    void Stop()
+    {
+      queue_.Stop();
+
+      for (size_t i = 0; i < prefetchers_.size(); i++)
+      {
+        if (prefetchers_[i] != NULL)
+        {
+          delete prefetchers_[i];
+          prefetchers_[i] = NULL;
+        }
+      }
+    }
+
+    void Invalidate(const std::string& item)
+    {
+      for (size_t i = 0; i < prefetchers_.size(); i++)
+      {
+        if (prefetchers_[i] != NULL)  // not stopped
+        {
+          prefetchers_[i]->SignalInvalidated(item);
+        }
+      }
+      factory_->Invalidate(item);
+    }
+
+    void Prefetch(const std::string& item)
+    {
+      queue_.Enqueue(factory_->GetPrefetchGroup(item), std::vector<std::string>(1, item), PrefetchPriority(), false);
+    }
+
+    void Prefetch(const std::string& group,
+                  const std::vector<std::string>& items,
+                  const PrefetchPriority& priority,
+                  bool ingest = false)
+    {
+      queue_.Enqueue(group, items, priority, ingest);
+    }
+
+    PrefetchQueue& GetQueue()
+    {
+      return queue_;
+    }
+
+    size_t GetThreadsCount() const
+    {
+      return prefetchers_.size();
+    }
+
+    bool CallFactory(std::string& content,
+                     const std::string& item)
+    {
+      content.clear();
+      return factory_->Create(content, item);
+    }
+
+    ICacheFactory& GetFactory()
+    {
+      return *factory_;
+    }
+  };
+
+
+
+  CacheScheduler::BundleScheduler&  CacheScheduler::GetBundleScheduler(unsigned int bundleIndex)
+  {
+    boost::mutex::scoped_lock lock(factoryMutex_);
+
+    BundleSchedulers::iterator it = bundles_.find(bundleIndex);
+    if (it == bundles_.end())
+    {
+      // No factory associated with this bundle
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    return *(it->second);
+  }
+
+
+  
+  // Runs the maintenance of the disk tier in a background thread (eviction
+  // below the quotas, removal of the evicted files, compaction of the pack
+  // files), so that the request threads only update the index.  The work is
+  // done by small steps, each one holding the cache lock.
+  class CacheScheduler::MaintenanceStage : public boost::noncopyable
+  {
+  private:
+    CacheScheduler&            scheduler_;
+    boost::mutex               mutex_;
+    boost::condition_variable  stopping_;
+    bool                       stopped_;
+    boost::thread              thread_;
+
+    // Returns false if the stage has been stopped during the wait
+    bool Wait(unsigned int milliseconds)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      boost::system_time timeout = boost::get_system_time() + boost::posix_time::milliseconds(milliseconds);
+      while (!stopped_)
+      {
+        if (!stopping_.timed_wait(lock, timeout))
+        {
+          break;
+        }
+      }
+
+      return !stopped_;
+    }
+
+    bool IsStopped()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return stopped_;
+    }
+
+    static void Worker(MaintenanceStage* that)
+    {
+      that->scheduler_.governor_.RegisterBackgroundThread();
+
+      unsigned int ticks = 0;
+
+      while (that->Wait(RECLAIM_PERIOD_MS))
+      {
+        try
+        {
+          while (!that->IsStopped() &&
+                 that->scheduler_.LoadCacheEntries())
+          {
+          }
+
+          that->scheduler_.ReclaimSpace();
+
+          ticks++;
+          if (ticks * RECLAIM_PERIOD_MS >= COMPACTION_PERIOD_MS)
+          {
+            ticks = 0;
+
+            // until there is nothing left to do, the steps are run one after
+            // the other (the interactive requests go first, see the governor)
+            while (!that->IsStopped() &&
+                   that->scheduler_.CompactPackFiles())
+            {
+              that->scheduler_.ReclaimSpace();
+            }
+          }
+        }
+        catch (Orthanc::OrthancException& e)
+        {
+          that->scheduler_.cacheLogger_->LogCacheDebugInfo(std::string("error in the maintenance of the cache: ") + e.What());
+        }
+        catch (...)
+        {
+          OrthancPluginLogError(that->scheduler_.cacheManager_.GetPluginContext(),
+                                "Unhandled native exception in the maintenance of the cache of the Web viewer");
+        }
+      }
+    }
+
+  public:
+    explicit MaintenanceStage(CacheScheduler& scheduler) :
+      scheduler_(scheduler),
+      stopped_(false)
+    {
+      thread_ = boost::thread(Worker, this);
+    }
+
+    ~MaintenanceStage()
+    {
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        stopped_ = true;
+      }
+
+      stopping_.notify_all();
+
+      if (thread_.joinable())
+      {
+        thread_.join();
+      }
+    }
+  };
+
+
+  CacheScheduler::CacheScheduler(CacheManager& cacheManager,
+                                 CacheLogger* cacheLogger,
+                                 unsigned int maxPrefetchSize) :
+    maxPrefetchSize_(maxPrefetchSize),
+    cacheManager_(cacheManager),
+    cacheLogger_(cacheLogger),
+    inFlight_(new InFlightComputations),
+    usage_(new PrefetchUsage),
+    memoryCache_(0),
+    negativeCache_(NEGATIVE_CACHE_TIME_TO_LIVE),
+    governor_(std::max(boost::thread::hardware_concurrency() / 2, 1u)),
+    diskHits_(0),
+    misses_(0)
+  {
+    policyStage_.reset(new PolicyStage(*this));
+    maintenanceStage_.reset(new MaintenanceStage(*this));
+  }
+
+
+  CacheScheduler::~CacheScheduler()
+  {
+    // wakes up the prefetchers waiting for their turn
+    governor_.Stop();
+
+    // the prefetchers notify the policy of the items they have computed, so
+    // they are joined before it is stopped (the policy still uses the
+    // factories of the bundle schedulers, that are deleted last)
+    for (BundleSchedulers::iterator it = bundles_.begin(); 
+         it != bundles_.end(); it++)
+    {
+      it->second->Stop();
+    }
+
+    policyStage_.reset(NULL);
+
+    // after the governor, that might make it wait for its turn
+    maintenanceStage_.reset(NULL);
+
+    for (BundleSchedulers::iterator it = bundles_.begin(); 
+         it != bundles_.end(); it++)
+    {
+      delete it->second;
+    }
+  }
+
+
+  void CacheScheduler::Register(int bundle, 
+                                ICacheFactory* factory /* takes ownership */,
+                                size_t  numThreads)
+  {
+    boost::mutex::scoped_lock lock(factoryMutex_);
+
+    BundleSchedulers::iterator it = bundles_.find(bundle);
+    if (it != bundles_.end())
+    {
+      // This bundle is already registered
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+
+    bundles_[bundle] = new BundleScheduler(*this, governor_, bundle, factory, cacheManager_, cacheLogger_, cacheMutex_, *inFlight_, memoryCache_, negativeCache_, *usage_, numThreads, maxPrefetchSize_);
+  }
+
+
+  void CacheScheduler::SetMaxBackgroundJobs(unsigned int count)
+  {
+    governor_.SetMaxJobs(count);
+  }
+
+
+  void CacheScheduler::SetQuota(int bundle,
+                                uint32_t maxCount,
+                                uint64_t maxSpace)
+  {
+    boost::mutex::scoped_lock lock(cacheMutex_);
+    cacheManager_.SetBundleQuota(bundle, maxCount, maxSpace);
+  }
+
+
+  void CacheScheduler::SetSharedDirectory(int bundle,
+                                          SharedCacheDirectory* directory)
+  {
+    {
+      boost::mutex::scoped_lock lock(cacheMutex_);
+      cacheManager_.SetSharedDirectory(bundle, directory);
+    }
+
+    memoryCache_.SetTimeToLive(bundle, SHARED_ITEMS_TIME_TO_LIVE);
+    negativeCache_.SetTimeToLive(bundle, SHARED_ITEMS_TIME_TO_LIVE);
+  }
+
+
+  void CacheScheduler::SetBundleVersion(int bundle,
+                                        const std::string& version)
+  {
+    boost::mutex::scoped_lock lock(cacheMutex_);
+    cacheManager_.SetBundleVersion(bundle, version);
+  }
+
+
+  void CacheScheduler::SetPackStorage(PackStorage* packs)
+  {
+    boost::mutex::scoped_lock lock(cacheMutex_);
+    cacheManager_.SetPackStorage(packs);
+  }
+
+
+  void CacheScheduler::ReclaimSpace()
+  {
+    std::vector<std::string> files;
+    std::vector<std::pair<int, std::string> > evicted;
+
+    {
+      boost::mutex::scoped_lock lock(cacheMutex_);
+      cacheManager_.ReclaimSpace();
+      cacheManager_.RemoveStaleFiles(STALE_FILES_PER_PERIOD);
+      cacheManager_.TakeRemovedFiles(files);
+      cacheManager_.TakeEvictedItems(evicted);
+    }
+
+    // the request threads are not blocked by the file system
+    cacheManager_.RemoveFiles(files);
+
+    for (size_t i = 0; i < evicted.size(); i++)
+    {
+      // an item evicted from the disk can still be read from the memory
+      if (!memoryCache_.IsCached(evicted[i].first, evicted[i].second))
+      {
+        usage_->SignalEvicted(evicted[i].first, evicted[i].second);
+      }
+    }
+  }
+
+
+  bool CacheScheduler::CompactPackFiles()
+  {
+    BackgroundGovernor::BackgroundJob slot(governor_);
+    if (!slot.IsAcquired())
+    {
+      // the scheduler is being destroyed
+      return false;
+    }
+
+    boost::mutex::scoped_lock lock(cacheMutex_);
+    return cacheManager_.CompactPackFiles(COMPACTION_STEP_SIZE);
+  }
+
+
+  bool CacheScheduler::LoadCacheEntries()
+  {
+    boost::mutex::scoped_lock lock(cacheMutex_);
+    return cacheManager_.LoadEntries(ENTRIES_LOADED_PER_STEP);
+  }
+
+
+  void CacheScheduler::SetMemoryCacheSize(uint64_t maxSize)
+  {
+    memoryCache_.SetMaxSize(maxSize);
+  }
+
+
+  void CacheScheduler::Invalidate(int bundle,
+                                  const std::string& item)
+  {
+    // the prefetchers are told first: the items they are about to store are
+    // either dropped or removed from the tiers just below
+    GetBundleScheduler(bundle).Invalidate(item);
+
+    memoryCache_.Invalidate(bundle, item);
+    negativeCache_.Invalidate(bundle, item);
+
+    {
+      boost::mutex::scoped_lock lock(cacheMutex_);
+      cacheManager_.Invalidate(bundle, item);
+    }
+
+    usage_->SignalInvalidated(bundle, item);
+
+    PolicyPtr policy = GetPolicy();
+    if (policy.get() != NULL)
+    {
+      policy->Invalidate(bundle, item);
+    }
+  }
+
+
+  CacheScheduler::PolicyPtr CacheScheduler::GetPolicy()
+  {
+    boost::mutex::scoped_lock lock(policyMutex_);
+    return policy_;
+  }
+
+
+  uint64_t CacheScheduler::GetContentVersion(int bundle)
+  {
+    PolicyPtr policy = GetPolicy();
+    if (policy.get() != NULL &&
+        policy->IsContentNeeded(bundle))
+    {
+      return policy->GetContentVersion(bundle);
+    }
+    else
+    {
+      return 0;
+    }
+  }
+
+
+  void CacheScheduler::NotifyAccess(int bundle,
+                                    const std::string& item,
+                                    const std::string& content,
+                                    bool computed,
+                                    const std::string& client,
+                                    uint64_t contentVersion)
+  {
+    if (!computed &&
+        policyStage_->IsWorkerThread())
+    {
+      // the policy itself reads the cache (ie. the series information): these
+      // are not viewer accesses.  Its misses are still notified, so that the
+      // policy is applied to the newly computed series.
+      return;
+    }
+
+    PolicyPtr policy = GetPolicy();
+    if (policy.get() != NULL)
+    {
+      policyStage_->Enqueue(bundle, item, policy->IsContentNeeded(bundle) ? &content : NULL,
+                            PrefetchAccess(client, boost::posix_time::microsec_clock::universal_time(), false, contentVersion));
+    }
+  }
+
+
+  void CacheScheduler::NotifyPrefetched(int bundle,
+                                        const std::string& item,
+                                        const std::string& content,
+                                        uint64_t contentVersion)
+  {
+    PolicyPtr policy = GetPolicy();
+    if (policy.get() != NULL &&
+        policy->IsPrefetchNotified(bundle))
+    {
+      policyStage_->Enqueue(bundle, item, policy->IsContentNeeded(bundle) ? &content : NULL,
+                            PrefetchAccess(std::string(), boost::posix_time::microsec_clock::universal_time(), true, contentVersion));
+    }
+  }
+
+
+  void CacheScheduler::ApplyPrefetchPolicy(int bundle,
+                                           const std::string& item,
+                                           const std::string& content,
+                                           const PrefetchAccess& access)
+  {
+    // only called by the thread of the policy stage
+    PolicyPtr policy = GetPolicy();
+
+    if (policy.get() != NULL)
+    {
+      std::list<PrefetchRequest> toPrefetch;
+      policy->Apply(toPrefetch, *this, CacheIndex(bundle, item), content, access);
+      EnqueuePrefetch(toPrefetch);
+    }
+  }
+
+
+  void CacheScheduler::CloseFormerStudy(const std::string& client,
+                                        const std::string& study,
+                                        const std::vector<std::string>& series)
+  {
+    // only called by the thread of the policy stage
+    if (client.empty())
+    {
+      return;  // the viewers can't be told apart
+    }
+
+    OpenedStudies::iterator found = openedStudies_.find(client);
+    if (found == openedStudies_.end())
+    {
+      if (openedStudies_.size() >= MAX_OPENED_STUDIES)
+      {
+        openedStudies_.erase(openedStudies_.begin());
+      }
+
+      found = openedStudies_.insert(std::make_pair(client, OpenedStudy())).first;
+    }
+    else if (found->second.study != study)
+    {
+      BOOST_FOREACH(const std::string& former, found->second.series)
+      {
+        if (std::find(series.begin(), series.end(), former) == series.end())
         {
-          OrthancPluginLogError(that->cacheManager_.GetPluginContext(),
-                                "Unhandled native exception inside the prefetcher of the Web viewer");
+          CancelPrefetch(former);
         }
       }
     }
 
+    found->second.study = study;
+    found->second.series = series;
+  }
 
-  public:
-    Prefetcher(int             bundleIndex,
-               ICacheFactory&  factory,
-               CacheManager&   cacheManager,
-               CacheLogger*    cacheLogger,
-               boost::mutex&   cacheMutex,
-               PrefetchQueue&  queue) :
-      bundleIndex_(bundleIndex),
-      factory_(factory),
-      cacheManager_(cacheManager),
-      cacheMutex_(cacheMutex),
-      cacheLogger_(cacheLogger),
-      queue_(queue)
+
+  void CacheScheduler::ApplyStudyPolicy(const std::string& study,
+                                        const std::vector<std::string>& series,
+                                        const std::string& client)
+  {
+    // only called by the thread of the policy stage
+    CloseFormerStudy(client, study, series);
+
+    PolicyPtr policy = GetPolicy();
+
+    if (policy.get() != NULL)
     {
-      done_ = false;
-      thread_ = boost::thread(Worker, this);
+      std::list<PrefetchRequest> toPrefetch;
+      policy->ApplyStudy(toPrefetch, *this, study, series);
+      EnqueuePrefetch(toPrefetch);
     }
+  }
 
-    ~Prefetcher()
+
+  void CacheScheduler::EnqueuePrefetch(const std::list<PrefetchRequest>& toPrefetch)
+  {
+    // Gather the items of the same prefetch group into a single job, with
+    // the priority of the first item of the group and its best quality rank
+    typedef std::pair<int, std::string>  GroupIndex;
+    std::list<GroupIndex>  groups;
+    std::map<GroupIndex, std::vector<std::string> >  groupItems;
+    std::map<GroupIndex, PrefetchPriority>  groupPriorities;
+
+    for (std::list<PrefetchRequest>::const_iterator
+           it = toPrefetch.begin(); it != toPrefetch.end(); ++it)
     {
-      done_ = true;
-      if (thread_.joinable())
+      const CacheIndex& index = it->GetIndex();
+      GroupIndex group(index.GetBundle(), GetBundleScheduler(index.GetBundle()).GetFactory().GetPrefetchGroup(index.GetItem()));
+
+      std::vector<std::string>& items = groupItems[group];
+      if (items.empty())
       {
-        thread_.join();
+        groups.push_back(group);
+        groupPriorities[group] = it->GetPriority();
+      }
+      else if (it->GetPriority().quality < groupPriorities[group].quality)
+      {
+        groupPriorities[group].quality = it->GetPriority().quality;
       }
-    }
-
-    void SignalInvalidated(const std::string& item)
-    {
-      boost::mutex::scoped_lock lock(invalidatedMutex_);
 
-      if (prefetching_ == item)
+      if (std::find(items.begin(), items.end(), index.GetItem()) == items.end())
       {
-        invalidated_ = true;
+        items.push_back(index.GetItem());
       }
     }
-  };
 
+    for (std::list<GroupIndex>::const_iterator
+           it = groups.begin(); it != groups.end(); ++it)
+    {
+      cacheLogger_->LogCacheDebugInfo(std::string("enqueuing prefetch ") + it->second);
+      GetBundleScheduler(it->first).Prefetch(it->second, groupItems[*it], groupPriorities[*it]);
+    }
+  }
 
 
-  class CacheScheduler::BundleScheduler
+  void CacheScheduler::SignalAccess(int bundle,
+                                    const std::string& item)
   {
-  private:
-    std::auto_ptr<ICacheFactory>   factory_;
-    PrefetchQueue                  queue_;
-    std::vector<Prefetcher*>       prefetchers_;
+    if (usage_->SignalAccess(bundle, item))
+    {
+      // The first read of a prefetched item is usually served by the
+      // in-memory tier: the disk tier is told that it is not speculative
+      // anymore
+      boost::mutex::scoped_lock lock(cacheMutex_);
+      cacheManager_.SignalRead(bundle, item);
+    }
+  }
 
-  public:
-    BundleScheduler(int bundleIndex,
-                    ICacheFactory* factory,
-                    CacheManager&   cacheManager,
-                    CacheLogger* cacheLogger,
-                    boost::mutex&   cacheMutex,
-                    size_t numThreads,
-                    size_t queueSize) :
-      factory_(factory),
-      queue_(queueSize)
+
+  bool CacheScheduler::Access(std::string& content,
+                              int bundle,
+                              const std::string& item,
+                              const std::string& client)
+  {
+    InteractiveLatency latency(governor_);
+
+    // before the content is read, for the policy to detect the invalidations
+    // that happen until it processes the access
+    uint64_t contentVersion = GetContentVersion(bundle);
+
+    for (;;)
     {
-      prefetchers_.resize(numThreads, NULL);
+      if (memoryCache_.Access(content, bundle, item))
+      {
+        cacheLogger_->LogCacheDebugInfo(std::string("found in memory ") + item);
+        SignalAccess(bundle, item);
+        NotifyAccess(bundle, item, content, false, client, contentVersion);
+        return true;
+      }
+
+      // Only the lookup in the index of the CacheManager is done with
+      // cacheMutex_ locked, the file is read without blocking the other
+      // threads.  If the file has been evicted in the meantime, this is
+      // handled as a miss.
+      std::string uuid;
+      uint64_t size;
+      bool existing = (LocateInCache(uuid, size, bundle, item) &&
+                       cacheManager_.ReadCachedFile(content, uuid, size));
+
+      // The items that the factory has failed to create recently are not
+      // created again
+      Orthanc::ErrorCode error = Orthanc::ErrorCode_Success;
+      bool failed = (!existing &&
+                     negativeCache_.Lookup(error, bundle, item));
 
-      for (size_t i = 0; i < numThreads; i++)
       {
-        prefetchers_[i] = new Prefetcher(bundleIndex, *factory_, cacheManager, cacheLogger, cacheMutex, queue_);
+        boost::mutex::scoped_lock lock(statisticsMutex_);
+        if (existing)
+        {
+          diskHits_++;
+        }
+        else if (!failed)
+        {
+          misses_++;
+        }
       }
-    }
 
-    ~BundleScheduler()
-    {
-      for (size_t i = 0; i < prefetchers_.size(); i++)
+      if (failed)
       {
-        if (prefetchers_[i] != NULL)
-          delete prefetchers_[i];
+        cacheLogger_->LogCacheDebugInfo(std::string("has failed recently ") + item);
+        if (error == Orthanc::ErrorCode_Success)
+        {
+          return false;
+        }
+        else
+        {
+          throw Orthanc::OrthancException(error);
+        }
       }
-    }
 
-    void Invalidate(const std::string& item)
-    {
-      for (size_t i = 0; i < prefetchers_.size(); i++)
+      if (existing)
       {
-        prefetchers_[i]->SignalInvalidated(item);
+        cacheLogger_->LogCacheDebugInfo(std::string("found ") + item);
+        memoryCache_.Store(bundle, item, content);
+        usage_->SignalAccess(bundle, item);  // already promoted by LocateInCache()
+        NotifyAccess(bundle, item, content, false, client, contentVersion);
+        return true;
       }
-      factory_->Invalidate(item);
+
+      ComputationPtr computation;
+      if (inFlight_->Start(computation, bundle, item, false))
+      {
+        break;
+      }
+
+      // Another thread is computing this item: wait for its result
+      cacheLogger_->LogCacheDebugInfo(std::string("item being computed, waiting for ") + item);
+
+      {
+        // The background jobs are throttled as for a miss, except the one
+        // computing this item (see InFlightComputations::Start())
+        BackgroundGovernor::InteractiveScope interactive(governor_);
+        computation->done.get();  // rethrows the error of the computation, if any
+      }
+
+      if (computation->available)
+      {
+        content = computation->content;
+        if (computation->success)
+        {
+          // possibly a late prefetch
+          SignalAccess(bundle, item);
+          NotifyAccess(bundle, item, content, false, client, contentVersion);
+        }
+        return computation->success;
+      }
+
+      // The computation has been abandoned (e.g. invalidated prefetch): try again
     }
 
-    void Prefetch(const std::string& item)
+    cacheLogger_->LogCacheDebugInfo(std::string("item not found, creating ") + item);
+
+    bool success;
+    try
     {
-      queue_.Enqueue(item);
+      // The interactive misses run ahead of the speculative prefetching (see
+      // BackgroundGovernor)
+      BackgroundGovernor::InteractiveScope interactive(governor_);
+
+      success = GetBundleScheduler(bundle).CallFactory(content, item);
     }
+    catch (Orthanc::OrthancException& e)
+    {
+      negativeCache_.Store(bundle, item, e.GetErrorCode());  // if permanent
 
-    bool CallFactory(std::string& content,
-                     const std::string& item)
+      inFlight_->Fail(bundle, item, boost::copy_exception(e));
+      throw;
+    }
+    catch (...)
     {
-      content.clear();
-      return factory_->Create(content, item);
+      inFlight_->Fail(bundle, item, boost::current_exception());
+      throw;
     }
 
-    ICacheFactory& GetFactory()
+    if (success)
     {
-      return *factory_;
+      // Only the failures of the factory are remembered: the content is
+      // returned even if it cannot be cached
+      try
+      {
+        StoreInCache(bundle, item, content, false);
+        memoryCache_.Store(bundle, item, content);
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        OrthancPluginLogError(cacheManager_.GetPluginContext(),
+                              (std::string("Cannot store an item in the short term cache of the Web viewer: ") + e.What()).c_str());
+      }
     }
-  };
 
+    inFlight_->Complete(bundle, item, success, content);
 
-
-  CacheScheduler::BundleScheduler&  CacheScheduler::GetBundleScheduler(unsigned int bundleIndex)
-  {
-    boost::mutex::scoped_lock lock(factoryMutex_);
-
-    BundleSchedulers::iterator it = bundles_.find(bundleIndex);
-    if (it == bundles_.end())
+    if (!success)
     {
-      // No factory associated with this bundle
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+      // This item cannot be generated by the factory
+      negativeCache_.Store(bundle, item, Orthanc::ErrorCode_Success);
+      return false;
     }
 
-    return *(it->second);
+    NotifyAccess(bundle, item, content, true, client, contentVersion);
+
+    return true;
   }
 
 
-  
-  CacheScheduler::CacheScheduler(CacheManager& cacheManager,
-                                 CacheLogger* cacheLogger,
-                                 unsigned int maxPrefetchSize) :
-    maxPrefetchSize_(maxPrefetchSize),
-    cacheManager_(cacheManager),
-    cacheLogger_(cacheLogger),
-    policy_(NULL)
+  bool CacheScheduler::Lookup(std::string& content,
+                              int bundle,
+                              const std::string& item)
   {
+    if (memoryCache_.Access(content, bundle, item))
+    {
+      return true;
+    }
+
+    std::string uuid;
+    uint64_t size;
+    return (LocateInCache(uuid, size, bundle, item) &&
+            cacheManager_.ReadCachedFile(content, uuid, size));
   }
 
 
-  CacheScheduler::~CacheScheduler()
+  bool CacheScheduler::LocateInCache(std::string& uuid,
+                                     uint64_t& size,
+                                     int bundle,
+                                     const std::string& item)
   {
-    for (BundleSchedulers::iterator it = bundles_.begin(); 
-         it != bundles_.end(); it++)
     {
-      delete it->second;
+      boost::mutex::scoped_lock lock(cacheMutex_);
+      if (cacheManager_.LocateInIndex(uuid, size, bundle, item))
+      {
+        return true;
+      }
+    }
+
+    // written by another node?
+    std::string name;
+    uint64_t fileSize;
+    if (!cacheManager_.LookupSharedFile(name, fileSize, bundle, item))
+    {
+      return false;
+    }
+
+    boost::mutex::scoped_lock lock(cacheMutex_);
+    if (cacheManager_.IndexSharedFile(bundle, item, name, fileSize))
+    {
+      uuid = name;
+      size = fileSize;
+      return true;
+    }
+    else
+    {
+      return false;
     }
   }
 
 
-  void CacheScheduler::Register(int bundle, 
-                                ICacheFactory* factory /* takes ownership */,
-                                size_t  numThreads)
+  void CacheScheduler::StoreInCache(int bundle,
+                                    const std::string& item,
+                                    const std::string& content,
+                                    bool speculative)
   {
-    boost::mutex::scoped_lock lock(factoryMutex_);
-
-    BundleSchedulers::iterator it = bundles_.find(bundle);
-    if (it != bundles_.end())
+    std::string name;
+    if (cacheManager_.WriteSharedFile(name, bundle, item, content))
     {
-      // This bundle is already registered
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+      boost::mutex::scoped_lock lock(cacheMutex_);
+      cacheManager_.StoreSharedFile(bundle, item, name, content.size(), speculative);
+    }
+    else
+    {
+      boost::mutex::scoped_lock lock(cacheMutex_);
+      cacheManager_.Store(bundle, item, content, speculative);
     }
-
-    bundles_[bundle] = new BundleScheduler(bundle, factory, cacheManager_, cacheLogger_, cacheMutex_, numThreads, maxPrefetchSize_);
   }
 
 
-  void CacheScheduler::SetQuota(int bundle,
-                                uint32_t maxCount,
-                                uint64_t maxSpace)
+  void CacheScheduler::Prefetch(int bundle,
+                                const std::string& item)
   {
-    boost::mutex::scoped_lock lock(cacheMutex_);
-    cacheManager_.SetBundleQuota(bundle, maxCount, maxSpace);
+    cacheLogger_->LogCacheDebugInfo(std::string("enqueuing prefetch ") + item);
+    GetBundleScheduler(bundle).Prefetch(item);
   }
 
 
-  void CacheScheduler::Invalidate(int bundle,
-                                  const std::string& item)
+  void CacheScheduler::Prefetch(int bundle,
+                                const std::vector<std::string>& items)
   {
+    if (items.empty())
     {
-      boost::mutex::scoped_lock lock(cacheMutex_);
-      cacheManager_.Invalidate(bundle, item);
+      return;
     }
 
-    GetBundleScheduler(bundle).Invalidate(item);
+    BundleScheduler& scheduler = GetBundleScheduler(bundle);
+    std::string group = scheduler.GetFactory().GetPrefetchGroup(items.front());
+
+    cacheLogger_->LogCacheDebugInfo(std::string("enqueuing prefetch ") + group);
+    scheduler.Prefetch(group, items, PrefetchPriority());
   }
 
 
-  void CacheScheduler::ApplyPrefetchPolicy(int bundle,
-                                           const std::string& item,
-                                           const std::string& content)
+  void CacheScheduler::Precompute(int bundle,
+                                  const std::vector<std::string>& items)
   {
-    boost::recursive_mutex::scoped_lock lock(policyMutex_);
-
-    if (policy_.get() != NULL)
+    if (items.empty())
     {
-      std::list<CacheIndex> toPrefetch;
+      return;
+    }
 
-      {
-        policy_->Apply(toPrefetch, *this, CacheIndex(bundle, item), content);
-      }
+    BundleScheduler& scheduler = GetBundleScheduler(bundle);
+    std::string group = scheduler.GetFactory().GetPrefetchGroup(items.front());
 
-      for (std::list<CacheIndex>::const_reverse_iterator
-             it = toPrefetch.rbegin(); it != toPrefetch.rend(); ++it)
-      {
-        Prefetch(it->GetBundle(), it->GetItem());
-      }
-    }
+    cacheLogger_->LogCacheDebugInfo(std::string("enqueuing precompute ") + group);
+    scheduler.Prefetch(group, items, PrefetchPriority(), true);
   }
 
 
-  bool CacheScheduler::Access(std::string& content,
-                              int bundle,
-                              const std::string& item)
+  void CacheScheduler::SetViewerPosition(const std::string& series,
+                                         unsigned int position)
   {
-    bool existing;
-
-    {
-      boost::mutex::scoped_lock lock(cacheMutex_);
-      existing = cacheManager_.Access(content, bundle, item);
-    }
+    boost::mutex::scoped_lock lock(factoryMutex_);
 
-    if (existing)
+    for (BundleSchedulers::iterator it = bundles_.begin(); 
+         it != bundles_.end(); it++)
     {
-      cacheLogger_->LogCacheDebugInfo(std::string("found ") + item);
-//      ApplyPrefetchPolicy(bundle, item, content);
-      return true;
+      it->second->GetQueue().SetViewerPosition(series, position);
     }
+  }
 
-    cacheLogger_->LogCacheDebugInfo(std::string("item not found, creating ") + item);
-    if (!GetBundleScheduler(bundle).CallFactory(content, item))
-    {
-      // This item cannot be generated by the factory
-      return false;
-    }
 
-    {
-      boost::mutex::scoped_lock lock(cacheMutex_);
-      cacheManager_.Store(bundle, item, content);
-    }
+  bool CacheScheduler::GetPrefetchJobDuration(double& seconds,
+                                              size_t& threadsCount,
+                                              int bundle)
+  {
+    BundleScheduler& scheduler = GetBundleScheduler(bundle);
+    threadsCount = scheduler.GetThreadsCount();
+    return scheduler.GetQueue().GetJobDuration(seconds);
+  }
 
-    ApplyPrefetchPolicy(bundle, item, content);
 
-    return true;
+  void CacheScheduler::NotifyStudyOpened(const std::string& study,
+                                         const std::vector<std::string>& series,
+                                         const std::string& client)
+  {
+    cacheLogger_->LogCacheDebugInfo(std::string("study opened ") + study);
+    policyStage_->EnqueueStudy(study, series, PrefetchAccess(client, boost::posix_time::microsec_clock::universal_time()));
   }
 
 
-  void CacheScheduler::Prefetch(int bundle,
-                                const std::string& item)
+  void CacheScheduler::CancelPrefetch(const std::string& series)
   {
-    cacheLogger_->LogCacheDebugInfo(std::string("enqueuing prefetch ") + item);
-    GetBundleScheduler(bundle).Prefetch(item);
+    cacheLogger_->LogCacheDebugInfo(std::string("canceling the prefetching of series ") + series);
+
+    boost::mutex::scoped_lock lock(factoryMutex_);
+
+    for (BundleSchedulers::iterator it = bundles_.begin(); 
+         it != bundles_.end(); it++)
+    {
+      it->second->GetQueue().Cancel(series);
+    }
   }
 
 
   void CacheScheduler::RegisterPolicy(IPrefetchPolicy* policy)
   {
-    boost::recursive_mutex::scoped_lock lock(policyMutex_);
+    boost::mutex::scoped_lock lock(policyMutex_);
     policy_.reset(policy);
   }
 
@@ -460,8 +2193,48 @@ namespace OrthancPlugins
   }
 
 
+  void CacheScheduler::GetStatistics(Statistics& target)
+  {
+    MemoryCache::Statistics memory;
+    memoryCache_.GetStatistics(memory);
+    target.memoryHits = memory.hits;
+    target.memorySize = memory.size;
+    target.memoryCount = memory.count;
+
+    {
+      boost::mutex::scoped_lock lock(statisticsMutex_);
+      target.diskHits = diskHits_;
+      target.misses = misses_;
+    }
+
+    inFlight_->GetStatistics(target);
+    usage_->GetStatistics(target);
+
+    {
+      boost::mutex::scoped_lock lock(cacheMutex_);
+      cacheManager_.GetStatistics(target.segments);
+    }
+    negativeCache_.GetStatistics(target.negative);
+    governor_.GetStatistics(target.background);
+
+    target.ingestPendingItems = 0;
+    target.ingestProcessedItems = 0;
+    target.ingestDroppedItems = 0;
+
+    boost::mutex::scoped_lock lock(factoryMutex_);
+    for (BundleSchedulers::iterator it = bundles_.begin(); 
+         it != bundles_.end(); it++)
+    {
+      it->second->GetQueue().GetIngestStatistics(target);
+    }
+  }
+
+
   void CacheScheduler::Clear()
   {
+    memoryCache_.Clear();
+    negativeCache_.Clear();
+
     boost::mutex::scoped_lock lock(cacheMutex_);
     return cacheManager_.Clear();
   }
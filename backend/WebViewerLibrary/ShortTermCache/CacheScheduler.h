@@ -22,11 +22,15 @@
 #pragma once
 
 #include "CacheManager.h"
+#include "MemoryCache.h"
 #include "ICacheFactory.h"
 #include "IPrefetchPolicy.h"
+#include "BackgroundGovernor.h"
+#include "NegativeCache.h"
 #include <MultiThreading/SharedMessageQueue.h>
 
 #include <boost/thread.hpp>
+#include <boost/shared_ptr.hpp>
 #include <stdio.h>
 
 class CacheLogger;
@@ -35,28 +39,144 @@ namespace OrthancPlugins
 {
   class CacheScheduler : public boost::noncopyable
   {
+  public:
+    struct Statistics
+    {
+      uint64_t  memoryHits;           // accesses served by the in-memory tier
+      uint64_t  diskHits;             // accesses served by the CacheManager (SQLite + files)
+      uint64_t  misses;               // accesses not found in any tier (computed, or coalesced with a computation)
+      uint64_t  memorySize;           // bytes held by the in-memory tier
+      uint32_t  memoryCount;          // items held by the in-memory tier
+      uint64_t  coalescedAccesses;    // accesses that waited for the computation of another thread
+      uint64_t  coalescedPrefetches;  // prefetched items skipped because another thread was computing them
+      uint64_t  prefetchedItems;        // items computed by the prefetchers
+      uint64_t  usedPrefetchedItems;    // prefetched items that have then been accessed
+      uint64_t  wastedPrefetchedItems;  // prefetched items invalidated or evicted from the disk before any access
+      uint64_t  ingestPendingItems;     // items of the new instances waiting to be precomputed (backlog)
+      uint64_t  ingestProcessedItems;   // items of the new instances that have been precomputed
+      uint64_t  ingestDroppedItems;     // items of the new instances dropped from the full prefetch queue
+      BackgroundGovernor::Statistics  background;  // CPU share of the background work, interactive latency
+      NegativeCache::Statistics       negative;    // accesses to the items that the factories have failed to create
+      CacheManager::Statistics        segments;    // probationary (speculative) and protected items of the disk tier
+    };
+
   private:
     class Prefetcher;
+    class PrefetchJob;
     class PrefetchQueue;
     class BundleScheduler;
+    class Computation;
+    class InFlightComputations;
+    class PendingComputations;
+    class InteractiveLatency;
+    class PolicyStage;
+    class PrefetchUsage;
+    class MaintenanceStage;
+
+    typedef boost::shared_ptr<Computation>   ComputationPtr;
+    typedef boost::shared_ptr<IPrefetchPolicy>  PolicyPtr;
 
     typedef std::map<int, BundleScheduler*>  BundleSchedulers;
 
+    // The study opened by a viewer, and its series
+    struct OpenedStudy
+    {
+      std::string               study;
+      std::vector<std::string>  series;
+    };
+
+    typedef std::map<std::string, OpenedStudy>  OpenedStudies;  // by client
+
     size_t                          maxPrefetchSize_;
     boost::mutex                    cacheMutex_;
     boost::mutex                    factoryMutex_;
-    boost::recursive_mutex          policyMutex_;
+    boost::mutex                    statisticsMutex_;
+    boost::mutex                    policyMutex_;
     CacheManager&                   cacheManager_;
     CacheLogger*                    cacheLogger_;
-    std::auto_ptr<IPrefetchPolicy>  policy_;
+    PolicyPtr                       policy_;         // protected by policyMutex_, applied by policyStage_
     BundleSchedulers                bundles_;
+    std::auto_ptr<InFlightComputations>  inFlight_;  // items being computed, by the request threads or the prefetchers
+    std::auto_ptr<PrefetchUsage>    usage_;
+    MemoryCache                     memoryCache_;    // in front of cacheManager_, sharded, has its own mutexes
+    NegativeCache                   negativeCache_;  // the failures of the factories, has its own mutex
+    BackgroundGovernor              governor_;       // shared by the prefetchers of all the bundles
+    uint64_t                        diskHits_;       // protected by statisticsMutex_
+    uint64_t                        misses_;         // protected by statisticsMutex_
+    std::auto_ptr<PolicyStage>      policyStage_;
+    OpenedStudies                   openedStudies_;  // only used by the policy stage
+    std::auto_ptr<MaintenanceStage> maintenanceStage_;
+
+    PolicyPtr GetPolicy();
+
+    // Same as CacheManager::LocateInCache() and Store(): cacheMutex_ is only
+    // locked to update the index, not while the files of the shared
+    // directory are looked up or written
+    bool LocateInCache(std::string& uuid,
+                       uint64_t& size,
+                       int bundle,
+                       const std::string& item);
+
+    void StoreInCache(int bundle,
+                      const std::string& item,
+                      const std::string& content,
+                      bool speculative);
+
+    // Records the access to an item found in memory or computed by another
+    // thread, and promotes it in the disk tier if it has been prefetched
+    void SignalAccess(int bundle,
+                      const std::string& item);
+
+    // See IPrefetchPolicy::GetContentVersion(), read before the content of
+    // an item is read or computed
+    uint64_t GetContentVersion(int bundle);
+
+    // Enqueues the access in the policy stage, that calls ApplyPrefetchPolicy()
+    void NotifyAccess(int bundle,
+                      const std::string& item,
+                      const std::string& content,
+                      bool computed,
+                      const std::string& client,
+                      uint64_t contentVersion);
+
+    // Enqueues the items computed by a prefetcher in the policy stage, if
+    // the policy is interested in them (see IPrefetchPolicy::IsPrefetchNotified())
+    void NotifyPrefetched(int bundle,
+                          const std::string& item,
+                          const std::string& content,
+                          uint64_t contentVersion);
 
     void ApplyPrefetchPolicy(int bundle,
                              const std::string& item,
-                             const std::string& content);
+                             const std::string& content,
+                             const PrefetchAccess& access);
+
+    void ApplyStudyPolicy(const std::string& study,
+                          const std::vector<std::string>& series,
+                          const std::string& client);
+
+    // The viewer has opened another study: the prefetching of the series of
+    // its former study is canceled, except for the series of the new one
+    void CloseFormerStudy(const std::string& client,
+                          const std::string& study,
+                          const std::vector<std::string>& series);
+
+    void EnqueuePrefetch(const std::list<PrefetchRequest>& toPrefetch);
 
     BundleScheduler&  GetBundleScheduler(unsigned int bundleIndex);
 
+    // One step of the compaction of the pack files, as a background job
+    bool CompactPackFiles();
+
+    // Reads a batch of the index of the cache after the startup (see
+    // CacheManager::LoadEntries()).  Returns false once it is fully loaded.
+    bool LoadCacheEntries();
+
+    // Evicts the items of the bundles that are close to their quota, then
+    // removes the files of the evicted items (and some files of the cleared
+    // bundles) outside of the cache lock
+    void ReclaimSpace();
+
   public:
     CacheScheduler(CacheManager& cacheManager,
                    CacheLogger* cacheLogger,
@@ -72,18 +192,82 @@ namespace OrthancPlugins
                   uint32_t maxCount,
                   uint64_t maxSpace);
 
+    // See CacheManager::SetSharedDirectory() (does not take ownership).  The
+    // items of this bundle expire quickly from the in-memory tier and the
+    // failures are remembered for a short time only, as they can be
+    // invalidated by other nodes.
+    void SetSharedDirectory(int bundle,
+                            SharedCacheDirectory* directory);
+
+    // See CacheManager::SetBundleVersion()
+    void SetBundleVersion(int bundle,
+                          const std::string& version);
+
+    // See CacheManager::SetPackStorage() (does not take ownership).  The
+    // pack files are compacted by the maintenance thread.
+    void SetPackStorage(PackStorage* packs);
+
+    // Number of prefetch jobs that run at once, all the bundles together
+    // (ie. the share of the cores given to the background work)
+    void SetMaxBackgroundJobs(unsigned int count);
+
+    // Budget of the in-memory tier, shared by all the bundles (0 to disable it)
+    void SetMemoryCacheSize(uint64_t maxSize);
+
     void RegisterPolicy(IPrefetchPolicy* policy /* takes ownership */);
 
     void Invalidate(int bundle,
                     const std::string& item);
 
+    // "client" identifies the viewer (see BaseController::_GetClientKey()),
+    // for the prefetch policy to follow the scrolling of each viewer
     bool Access(std::string& content,
+                int bundle,
+                const std::string& item,
+                const std::string& client = std::string());
+
+    // Reads the item if it is cached, without computing it nor applying the
+    // prefetch policy
+    bool Lookup(std::string& content,
                 int bundle,
                 const std::string& item);
 
     void Prefetch(int bundle,
                   const std::string& item);
 
+    // Prefetch several items of the same prefetch group in a single job
+    // (see ICacheFactory::GetPrefetchGroup())
+    void Prefetch(int bundle,
+                  const std::vector<std::string>& items);
+
+    // Same as above for the items of newly received instances (e.g. all the
+    // frames of an instance): the job is accounted in the ingest backlog and
+    // progress (see Statistics)
+    void Precompute(int bundle,
+                    const std::vector<std::string>& items);
+
+    // The prefetch jobs of the most recently viewed series run first, the
+    // closest to the viewed slice first (see PrefetchPriority)
+    void SetViewerPosition(const std::string& series,
+                           unsigned int position);
+
+    // Average duration of the prefetch jobs of the bundle (ie. the decoding
+    // of all the qualities of a frame), returns false if none has run yet
+    bool GetPrefetchJobDuration(double& seconds,
+                                size_t& threadsCount,
+                                int bundle);
+
+    // Applies the prefetch policy to a study opened in the viewer, whose
+    // series are given in their display order (see StudyController).  A
+    // viewer opening another study has closed its former one, whose
+    // prefetching is canceled (see CancelPrefetch()).
+    void NotifyStudyOpened(const std::string& study,
+                           const std::vector<std::string>& series,
+                           const std::string& client = std::string());
+
+    // Removes the pending prefetch jobs of the series (ie. the study is closed)
+    void CancelPrefetch(const std::string& series);
+
     ICacheFactory& GetFactory(int bundle);
 
     void SetProperty(CacheProperty property,
@@ -92,6 +276,8 @@ namespace OrthancPlugins
     bool LookupProperty(std::string& target,
                         CacheProperty property);
 
+    void GetStatistics(Statistics& target);
+
     void Clear();
   };
 }
@@ -0,0 +1,84 @@
+#include "CacheStatisticsController.h"
+
+#include <json/value.h>
+
+#include "../OrthancContextManager.h"
+#include "CacheContext.h"
+
+CacheContext* CacheStatisticsController::cacheContext_ = NULL;
+
+CacheStatisticsController::CacheStatisticsController(OrthancPluginRestOutput* response, const std::string& url, const OrthancPluginHttpRequest* request)
+  : BaseController(response, url, request)
+{
+}
+
+void CacheStatisticsController::Inject(CacheContext* cacheContext) {
+  cacheContext_ = cacheContext;
+}
+
+int CacheStatisticsController::_ParseURLPostFix(const std::string& urlPostfix) {
+  // There is no additional parameter to parse
+  if (!urlPostfix.empty()) {
+    return this->_AnswerError(404);
+  }
+  return 200;
+}
+
+int CacheStatisticsController::_ProcessRequest()
+{
+  if (this->request_->method != OrthancPluginHttpMethod_Get || cacheContext_ == NULL) {
+    return this->_AnswerError(404);
+  }
+
+  OrthancPlugins::CacheScheduler::Statistics statistics;
+  cacheContext_->GetScheduler().GetStatistics(statistics);
+
+  Json::Value answer;
+  answer["Memory"]["Hits"] = static_cast<Json::UInt64>(statistics.memoryHits);
+  answer["Memory"]["Size"] = static_cast<Json::UInt64>(statistics.memorySize);
+  answer["Memory"]["Count"] = statistics.memoryCount;
+  answer["Disk"]["Hits"] = static_cast<Json::UInt64>(statistics.diskHits);
+  answer["Disk"]["ProbationCount"] = statistics.segments.probationCount;
+  answer["Disk"]["ProbationSize"] = static_cast<Json::UInt64>(statistics.segments.probationSize);
+  answer["Disk"]["ProtectedCount"] = statistics.segments.protectedCount;
+  answer["Disk"]["ProtectedSize"] = static_cast<Json::UInt64>(statistics.segments.protectedSize);
+  answer["Disk"]["PromotedItems"] = static_cast<Json::UInt64>(statistics.segments.promotedItems);
+  answer["Disk"]["RejectedItems"] = static_cast<Json::UInt64>(statistics.segments.rejectedItems);
+  answer["Disk"]["SharedHits"] = static_cast<Json::UInt64>(statistics.segments.sharedHits);
+  answer["Disk"]["ReclaimedItems"] = static_cast<Json::UInt64>(statistics.segments.reclaimedItems);
+  answer["Disk"]["PendingRemovals"] = statistics.segments.pendingRemovals;
+  answer["Disk"]["PackFiles"] = statistics.segments.packFiles;
+  answer["Disk"]["PackFilesSize"] = static_cast<Json::UInt64>(statistics.segments.packFilesSize);
+  answer["Disk"]["PackFilesReclaimableSize"] = static_cast<Json::UInt64>(statistics.segments.packFilesDeadSize);
+  answer["Misses"] = static_cast<Json::UInt64>(statistics.misses);
+  answer["Failures"]["Hits"] = static_cast<Json::UInt64>(statistics.negative.hits);
+  answer["Failures"]["Count"] = statistics.negative.count;
+  answer["CoalescedAccesses"] = static_cast<Json::UInt64>(statistics.coalescedAccesses);
+  answer["CoalescedPrefetches"] = static_cast<Json::UInt64>(statistics.coalescedPrefetches);
+
+  uint64_t accesses = statistics.memoryHits + statistics.diskHits + statistics.misses;
+  answer["HitRate"] = (accesses == 0 ? 0.0 :
+                       static_cast<double>(statistics.memoryHits + statistics.diskHits) / static_cast<double>(accesses));
+
+  // the prefetched items that are neither used nor wasted (evicted or
+  // invalidated before any access) are still in the cache, or too old to be
+  // tracked
+  answer["Prefetch"]["Items"] = static_cast<Json::UInt64>(statistics.prefetchedItems);
+  answer["Prefetch"]["UsedItems"] = static_cast<Json::UInt64>(statistics.usedPrefetchedItems);
+  answer["Prefetch"]["WastedItems"] = static_cast<Json::UInt64>(statistics.wastedPrefetchedItems);
+
+  // precompute of the frames of the newly received instances
+  answer["Ingest"]["PendingItems"] = static_cast<Json::UInt64>(statistics.ingestPendingItems);
+  answer["Ingest"]["ProcessedItems"] = static_cast<Json::UInt64>(statistics.ingestProcessedItems);
+  answer["Ingest"]["DroppedItems"] = static_cast<Json::UInt64>(statistics.ingestDroppedItems);
+
+  // cost of the background work for the viewers
+  answer["Background"]["RunningJobs"] = statistics.background.runningJobs;
+  answer["Background"]["MaxJobs"] = statistics.background.maxJobs;
+  answer["Interactive"]["Requests"] = static_cast<Json::UInt64>(statistics.background.interactiveRequests);
+  answer["Interactive"]["RequestsUnderBackgroundLoad"] = static_cast<Json::UInt64>(statistics.background.interactiveRequestsUnderLoad);
+  answer["Interactive"]["P99LatencyMs"] = statistics.background.interactiveP99LatencyMs;
+  answer["Interactive"]["P99LatencyUnderBackgroundLoadMs"] = statistics.background.interactiveP99LatencyUnderLoadMs;
+
+  return this->_AnswerBuffer(answer);
+}
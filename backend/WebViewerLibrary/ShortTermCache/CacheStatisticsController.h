@@ -0,0 +1,38 @@
+#pragma once
+
+/**
+ * The `CacheStatisticsController` controller exposes the statistics of the
+ * short term cache (hits per tier, misses, remembered failures, coalesced
+ * computations, hit rate, probationary and protected items of the disk
+ * tier, items evicted in the background and files waiting to be removed,
+ * size of the pack files and their space to reclaim, used and wasted
+ * (evicted or invalidated before any access) prefetched items, backlog and progress of the
+ * precompute of the new instances, p99 latency of the requests with and
+ * without background work), to tune its size and the prefetching.
+ *
+ * Route: GET `/osimis-viewer/cache/statistics` (404 if the short term cache
+ * is disabled).
+ */
+
+#include "../BaseController.h"
+
+class CacheContext;
+
+class CacheStatisticsController : public BaseController {
+private:
+  /**
+   * @rationale
+   * We can't do it without static since Orthanc API doesn't allow us to pass
+   * attributes when processing REST request.
+   */
+  static CacheContext* cacheContext_;
+
+protected:
+  virtual int _ParseURLPostFix(const std::string& urlPostfix);
+  virtual int _ProcessRequest();
+
+public:
+  CacheStatisticsController(OrthancPluginRestOutput* response, const std::string& url, const OrthancPluginHttpRequest* request);
+
+  static void Inject(CacheContext* cacheContext); // does NOT take ownership
+};
@@ -0,0 +1,116 @@
+#include "FrequencySketch.h"
+
+#include <algorithm>
+#include <boost/functional/hash.hpp>
+
+namespace OrthancPlugins
+{
+  const unsigned int FrequencySketch::DEPTH;
+  const uint8_t FrequencySketch::MAX_FREQUENCY;
+
+  // the counters are halved after SAMPLE_FACTOR * width increments
+  static const uint64_t SAMPLE_FACTOR = 10;
+
+
+  FrequencySketch::FrequencySketch(size_t width) :
+    additions_(0)
+  {
+    size_t rounded = 1;
+    while (rounded < width)
+    {
+      rounded <<= 1;
+    }
+
+    counters_.resize(DEPTH * rounded, 0);
+    mask_ = rounded - 1;
+    sampleSize_ = SAMPLE_FACTOR * rounded;
+  }
+
+
+  size_t FrequencySketch::Hash(int bundle,
+                               const std::string& item)
+  {
+    size_t hash = boost::hash<std::string>()(item);
+    boost::hash_combine(hash, bundle);
+    return hash;
+  }
+
+
+  size_t FrequencySketch::GetIndex(size_t hash,
+                                   unsigned int row) const
+  {
+    // double hashing: each row uses a different combination of the two
+    // halves of the hash
+    size_t h1 = hash;
+    size_t h2 = (hash >> 16) | 1;
+    return row * (mask_ + 1) + ((h1 + row * h2 * 0x9E3779B9u) & mask_);
+  }
+
+
+  void FrequencySketch::Increment(int bundle,
+                                  const std::string& item)
+  {
+    size_t hash = Hash(bundle, item);
+
+    // conservative update: only the smallest counters are incremented, which
+    // reduces the overestimation due to the collisions
+    unsigned int minimum = MAX_FREQUENCY;
+    for (unsigned int row = 0; row < DEPTH; row++)
+    {
+      minimum = std::min(minimum, static_cast<unsigned int>(counters_[GetIndex(hash, row)]));
+    }
+
+    if (minimum == MAX_FREQUENCY)
+    {
+      return;
+    }
+
+    for (unsigned int row = 0; row < DEPTH; row++)
+    {
+      uint8_t& counter = counters_[GetIndex(hash, row)];
+      if (counter == minimum)
+      {
+        counter++;
+      }
+    }
+
+    additions_++;
+    if (additions_ >= sampleSize_)
+    {
+      Age();
+    }
+  }
+
+
+  unsigned int FrequencySketch::Estimate(int bundle,
+                                         const std::string& item) const
+  {
+    size_t hash = Hash(bundle, item);
+
+    unsigned int minimum = MAX_FREQUENCY;
+    for (unsigned int row = 0; row < DEPTH; row++)
+    {
+      minimum = std::min(minimum, static_cast<unsigned int>(counters_[GetIndex(hash, row)]));
+    }
+
+    return minimum;
+  }
+
+
+  void FrequencySketch::Age()
+  {
+    for (size_t i = 0; i < counters_.size(); i++)
+    {
+      counters_[i] >>= 1;
+    }
+
+    additions_ /= 2;
+  }
+
+
+  void FrequencySketch::Clear()
+  {
+    std::fill(counters_.begin(), counters_.end(), 0);
+    additions_ = 0;
+  }
+}
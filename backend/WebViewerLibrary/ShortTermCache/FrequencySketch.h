@@ -0,0 +1,54 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <boost/noncopyable.hpp>
+
+namespace OrthancPlugins
+{
+  /** FrequencySketch
+   *
+   * Approximate access frequency of the items of the cache (count-min sketch
+   * as in TinyLFU, with 1 byte counters saturated at 15 like its 4-bit
+   * counters).  The counters are halved after a
+   * number of accesses proportional to the size of the sketch, so that the
+   * items that were popular a long time ago are forgotten.
+   *
+   * The estimates can only be too high (collisions), never too low.
+   *
+   * Not thread-safe.
+   *
+   */
+  class FrequencySketch : public boost::noncopyable
+  {
+  private:
+    static const unsigned int DEPTH = 4;
+    static const uint8_t      MAX_FREQUENCY = 15;
+
+    std::vector<uint8_t>  counters_;  // DEPTH rows of "width" counters
+    size_t                mask_;      // width - 1, the width being a power of 2
+    uint64_t              additions_;
+    uint64_t              sampleSize_;
+
+    size_t GetIndex(size_t hash,
+                    unsigned int row) const;
+
+    static size_t Hash(int bundle,
+                       const std::string& item);
+
+    void Age();
+
+  public:
+    // "width" is the number of counters per row, rounded up to a power of 2
+    explicit FrequencySketch(size_t width);
+
+    void Increment(int bundle,
+                   const std::string& item);
+
+    unsigned int Estimate(int bundle,
+                          const std::string& item) const;
+
+    void Clear();
+  };
+}
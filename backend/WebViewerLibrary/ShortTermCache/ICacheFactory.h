@@ -22,7 +22,10 @@
 #pragma once
 
 #include <string>
+#include <map>
+#include <vector>
 #include <boost/noncopyable.hpp>
+#include <boost/foreach.hpp>
 
 
 namespace OrthancPlugins
@@ -40,5 +43,32 @@ namespace OrthancPlugins
                         const std::string& key) = 0;
 
     virtual void Invalidate(const std::string& item) = 0;
+
+    // Items that share the same prefetch group are prefetched together
+    // in a single job, using "CreateMany()".  By default, each item is
+    // its own group.
+    virtual std::string GetPrefetchGroup(const std::string& item)
+    {
+      return item;
+    }
+
+    // Creates the items of a prefetch job at once (the items of the same
+    // prefetch group, or a batch given to CacheScheduler::Precompute()).
+    // Factories that can share work between these items (e.g. decode a
+    // frame only once for all its qualities) should override this
+    // method.  "contents" only receives the items that could be created.
+    // WARNING: No mutual exclusion is enforced either.
+    virtual void CreateMany(std::map<std::string, std::string>& contents,
+                            const std::vector<std::string>& keys)
+    {
+      BOOST_FOREACH(const std::string& key, keys)
+      {
+        std::string content;
+        if (Create(content, key))
+        {
+          contents[key].swap(content);
+        }
+      }
+    }
   };
 }
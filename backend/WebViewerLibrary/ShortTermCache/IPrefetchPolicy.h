@@ -22,14 +22,46 @@
 #pragma once
 
 #include "CacheIndex.h"
+#include "PrefetchRequest.h"
 
 #include <boost/noncopyable.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
 #include <list>
+#include <stdint.h>
+#include <string>
+#include <vector>
 
 namespace OrthancPlugins
 {
   class CacheScheduler;
 
+  // The access that triggered the prefetch policy
+  struct PrefetchAccess
+  {
+    std::string               client;      // identifies the viewer (empty if unknown)
+    boost::posix_time::ptime  time;        // when the item was requested
+    bool                      prefetched;  // computed by a prefetcher, not requested by a viewer
+    uint64_t                  contentVersion;  // see IPrefetchPolicy::GetContentVersion()
+
+    PrefetchAccess() :
+      prefetched(false),
+      contentVersion(0)
+    {
+    }
+
+    PrefetchAccess(const std::string& client,
+                   const boost::posix_time::ptime& time,
+                   bool prefetched = false,
+                   uint64_t contentVersion = 0) :
+      client(client),
+      time(time),
+      prefetched(prefetched),
+      contentVersion(contentVersion)
+    {
+    }
+  };
+
+
   class IPrefetchPolicy : public boost::noncopyable
   {
   public:
@@ -37,11 +69,60 @@ namespace OrthancPlugins
     {
     }
 
-    // Mutual exclusion is enforced when calling this method.
-    // "toPrefetch" must be listed from top-priority to low-priority.
-    virtual void Apply(std::list<CacheIndex>& toPrefetch,
+    // Whether Apply() uses the content of the accessed items of this bundle
+    // (otherwise it is not copied).  Called by the request threads, without
+    // mutual exclusion.
+    virtual bool IsContentNeeded(int bundle) const
+    {
+      return true;
+    }
+
+    // Whether Apply() is also called when the prefetchers compute an item
+    // of this bundle (with PrefetchAccess::prefetched).  Same as above.
+    virtual bool IsPrefetchNotified(int bundle) const
+    {
+      return false;
+    }
+
+    // Called by the request threads and the prefetchers before the content
+    // of an item of this bundle is read or computed, if the content is
+    // needed: the value is given back to Apply() (PrefetchAccess::
+    // contentVersion), for the policies that derive a state from the
+    // content to tell whether it has been invalidated in the meantime.  No
+    // mutual exclusion either.
+    virtual uint64_t GetContentVersion(int bundle)
+    {
+      return 0;
+    }
+
+    // Called when items are invalidated in the cache (see
+    // CacheScheduler::Invalidate()), for the policies that keep a state
+    // derived from the cached content.  No mutual exclusion either.
+    virtual void Invalidate(int bundle,
+                            const std::string& itemPrefix)
+    {
+    }
+
+    // Called by a single background thread, after the item has been
+    // accessed (hit or miss).  The items of "toPrefetch" are run in the
+    // order of their priority; the policy may also update the viewer
+    // position in the scheduler (see CacheScheduler::SetViewerPosition()).
+    // The events may be processed late: "access" tells when and by whom the
+    // item was requested.
+    virtual void Apply(std::list<PrefetchRequest>& toPrefetch,
                        CacheScheduler& cache,
                        const CacheIndex& index,
-                       const std::string& content) = 0;
+                       const std::string& content,
+                       const PrefetchAccess& access) = 0;
+
+    // Called by the same background thread when a study is opened in the
+    // viewer (see CacheScheduler::NotifyStudyOpened()), with its series in
+    // their display order
+    virtual void ApplyStudy(std::list<PrefetchRequest>& toPrefetch,
+                            CacheScheduler& cache,
+                            const std::string& study,
+                            const std::vector<std::string>& series)
+    {
+    }
   };
 }
@@ -0,0 +1,292 @@
+#include "MemoryCache.h"
+
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+namespace OrthancPlugins
+{
+  const size_t MemoryCache::DEFAULT_SHARDS_COUNT;
+
+
+  MemoryCache::MemoryCache(uint64_t maxSize,
+                           size_t shardsCount) :
+    size_(0),
+    maxSize_(maxSize),
+    sequence_(0)
+  {
+    if (shardsCount == 0)
+    {
+      shardsCount = 1;
+    }
+
+    shards_.resize(shardsCount, NULL);
+    for (size_t i = 0; i < shardsCount; i++)
+    {
+      shards_[i] = new Shard;
+    }
+  }
+
+
+  MemoryCache::~MemoryCache()
+  {
+    for (size_t i = 0; i < shards_.size(); i++)
+    {
+      delete shards_[i];
+    }
+  }
+
+
+  MemoryCache::Shard& MemoryCache::GetShard(const Key& key)
+  {
+    size_t hash = boost::hash<std::string>()(key.second);
+    boost::hash_combine(hash, key.first);
+    return *shards_[hash % shards_.size()];
+  }
+
+
+  uint64_t MemoryCache::NextSequence()
+  {
+    return ++sequence_;
+  }
+
+
+  void MemoryCache::SetMaxSize(uint64_t maxSize)
+  {
+    {
+      boost::mutex::scoped_lock lock(sizeMutex_);
+      maxSize_ = maxSize;
+    }
+
+    MakeRoom();
+  }
+
+
+  void MemoryCache::SetTimeToLive(int bundle,
+                                  unsigned int seconds)
+  {
+    boost::mutex::scoped_lock lock(sizeMutex_);
+    timesToLive_[bundle] = boost::posix_time::seconds(seconds);
+  }
+
+
+  bool MemoryCache::Access(std::string& content,
+                           int bundle,
+                           const std::string& item)
+  {
+    Key key(bundle, item);
+    Shard& shard = GetShard(key);
+
+    boost::mutex::scoped_lock lock(shard.mutex);
+
+    Index::iterator found = shard.index.find(key);
+    if (found == shard.index.end() ||
+        IsExpired(shard, found))
+    {
+      shard.misses++;
+      return false;
+    }
+
+    shard.recency.splice(shard.recency.begin(), shard.recency, found->second);
+    found->second->sequence = NextSequence();
+    content = found->second->content;
+    shard.hits++;
+    return true;
+  }
+
+
+  bool MemoryCache::IsCached(int bundle,
+                             const std::string& item)
+  {
+    Key key(bundle, item);
+    Shard& shard = GetShard(key);
+
+    boost::mutex::scoped_lock lock(shard.mutex);
+
+    Index::iterator found = shard.index.find(key);
+    return (found != shard.index.end() &&
+            !IsExpired(shard, found));
+  }
+
+
+  void MemoryCache::Store(int bundle,
+                          const std::string& item,
+                          const std::string& content)
+  {
+    boost::posix_time::ptime expiration;
+
+    {
+      boost::mutex::scoped_lock lock(sizeMutex_);
+      if (content.size() > maxSize_)
+      {
+        // also when the tier is disabled
+        return;
+      }
+
+      TimesToLive::const_iterator timeToLive = timesToLive_.find(bundle);
+      if (timeToLive != timesToLive_.end())
+      {
+        expiration = boost::posix_time::microsec_clock::universal_time() + timeToLive->second;
+      }
+    }
+
+    Key key(bundle, item);
+    Shard& shard = GetShard(key);
+
+    {
+      boost::mutex::scoped_lock lock(shard.mutex);
+
+      Index::iterator found = shard.index.find(key);
+      if (found != shard.index.end())
+      {
+        Remove(shard, found);
+      }
+
+      shard.recency.push_front(Entry());
+      shard.recency.front().key = key;
+      shard.recency.front().content = content;
+      shard.recency.front().expiration = expiration;
+      shard.index[key] = shard.recency.begin();
+      shard.recency.front().sequence = NextSequence();
+
+      boost::mutex::scoped_lock sizeLock(sizeMutex_);
+      size_ += content.size();
+    }
+
+    MakeRoom();
+  }
+
+
+  void MemoryCache::Invalidate(int bundle,
+                               const std::string& itemPrefix)
+  {
+    // the items sharing a prefix are spread over all the shards
+    for (size_t i = 0; i < shards_.size(); i++)
+    {
+      Shard& shard = *shards_[i];
+      boost::mutex::scoped_lock lock(shard.mutex);
+
+      Index::iterator it = shard.index.lower_bound(Key(bundle, itemPrefix));
+      while (it != shard.index.end() &&
+             it->first.first == bundle &&
+             boost::starts_with(it->first.second, itemPrefix))
+      {
+        Remove(shard, it++);
+      }
+    }
+  }
+
+
+  void MemoryCache::Clear()
+  {
+    for (size_t i = 0; i < shards_.size(); i++)
+    {
+      Shard& shard = *shards_[i];
+      boost::mutex::scoped_lock lock(shard.mutex);
+
+      while (!shard.index.empty())
+      {
+        Remove(shard, shard.index.begin());
+      }
+    }
+  }
+
+
+  void MemoryCache::GetStatistics(Statistics& target)
+  {
+    target.hits = 0;
+    target.misses = 0;
+    target.count = 0;
+
+    for (size_t i = 0; i < shards_.size(); i++)
+    {
+      Shard& shard = *shards_[i];
+      boost::mutex::scoped_lock lock(shard.mutex);
+
+      target.hits += shard.hits;
+      target.misses += shard.misses;
+      target.count += static_cast<uint32_t>(shard.index.size());
+    }
+
+    boost::mutex::scoped_lock lock(sizeMutex_);
+    target.size = size_;
+  }
+
+
+  void MemoryCache::Remove(Shard& shard,
+                           Index::iterator position)
+  {
+    {
+      boost::mutex::scoped_lock lock(sizeMutex_);
+      size_ -= position->second->content.size();
+    }
+
+    shard.recency.erase(position->second);
+    shard.index.erase(position);
+  }
+
+
+  bool MemoryCache::IsExpired(Shard& shard,
+                              Index::iterator position)
+  {
+    const boost::posix_time::ptime& expiration = position->second->expiration;
+
+    if (!expiration.is_not_a_date_time() &&
+        boost::posix_time::microsec_clock::universal_time() >= expiration)
+    {
+      Remove(shard, position);
+      return true;
+    }
+    else
+    {
+      return false;
+    }
+  }
+
+
+  void MemoryCache::MakeRoom()
+  {
+    for (;;)
+    {
+      {
+        boost::mutex::scoped_lock lock(sizeMutex_);
+        if (size_ <= maxSize_)
+        {
+          return;
+        }
+      }
+
+      // the least recently used item of all the shards
+      Shard* victim = NULL;
+      uint64_t victimSequence = 0;
+
+      for (size_t i = 0; i < shards_.size(); i++)
+      {
+        Shard& shard = *shards_[i];
+        boost::mutex::scoped_lock lock(shard.mutex);
+
+        if (!shard.recency.empty() &&
+            (victim == NULL ||
+             shard.recency.back().sequence < victimSequence))
+        {
+          victim = &shard;
+          victimSequence = shard.recency.back().sequence;
+        }
+      }
+
+      if (victim == NULL)
+      {
+        return;
+      }
+
+      boost::mutex::scoped_lock lock(victim->mutex);
+
+      // unless it has been accessed or removed in the meantime (look again)
+      if (!victim->recency.empty() &&
+          victim->recency.back().sequence == victimSequence)
+      {
+        Remove(*victim, victim->index.find(victim->recency.back().key));
+      }
+    }
+  }
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <boost/noncopyable.hpp>
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+namespace OrthancPlugins
+{
+  /** MemoryCache
+   *
+   * In-memory tier of the short term cache, in front of the CacheManager
+   * (SQLite index + files).  Keeps the most recently used items within a byte
+   * budget, so the hot working set (ie. the study being read) is served
+   * without any SQLite transaction nor file read.
+   *
+   * Thread-safe.  A budget of 0 disables the tier.
+   *
+   * The items are partitioned in shards (by bundle and item hash), each with
+   * its own mutex and LRU list, so that the accesses to different items
+   * (almost) never contend.  The byte budget is global, and so is the LRU
+   * order: each access stamps the item with a global sequence number (an
+   * atomic counter, so that the hits do not share any mutex), and
+   * when the budget is exceeded, the item with the smallest one among the
+   * least recently used items of the shards is evicted.
+   *
+   * The items of a bundle can also expire (see SetTimeToLive()), ie. when
+   * they can be invalidated by another node.
+   *
+   */
+  class MemoryCache : public boost::noncopyable
+  {
+  public:
+    static const size_t DEFAULT_SHARDS_COUNT = 32;
+
+    struct Statistics
+    {
+      uint64_t  hits;
+      uint64_t  misses;
+      uint64_t  size;   // bytes
+      uint32_t  count;
+    };
+
+  private:
+    typedef std::pair<int, std::string>  Key;  // bundle, item
+
+    struct Entry
+    {
+      Key          key;
+      std::string  content;
+      uint64_t     sequence;  // of the last access, same order as the recency list of the shard
+      boost::posix_time::ptime  expiration;  // not_a_date_time if the item does not expire
+    };
+
+    typedef std::map<int, boost::posix_time::time_duration>  TimesToLive;
+
+    typedef std::list<Entry>                            Recency;  // front = most recently used
+    typedef std::map<Key, Recency::iterator>            Index;    // ordered, for the invalidation by prefix
+
+    struct Shard
+    {
+      boost::mutex  mutex;
+      Recency       recency;
+      Index         index;
+      uint64_t      hits;
+      uint64_t      misses;
+
+      Shard() : hits(0), misses(0)
+      {
+      }
+    };
+
+    std::vector<Shard*>  shards_;
+    boost::mutex         sizeMutex_;   // locked after the mutex of a shard, never before
+    uint64_t             size_;
+    uint64_t             maxSize_;
+    boost::atomic<uint64_t>  sequence_;
+    TimesToLive          timesToLive_;  // protected by sizeMutex_
+
+    Shard& GetShard(const Key& key);
+
+    uint64_t NextSequence();
+
+    // requires the mutex of the shard to be locked
+    void Remove(Shard& shard,
+                Index::iterator position);
+
+    // requires the mutex of the shard to be locked, removes the item if it
+    // has expired
+    bool IsExpired(Shard& shard,
+                   Index::iterator position);
+
+    // requires no mutex to be locked
+    void MakeRoom();
+
+  public:
+    explicit MemoryCache(uint64_t maxSize,
+                         size_t shardsCount = DEFAULT_SHARDS_COUNT);
+
+    ~MemoryCache();
+
+    void SetMaxSize(uint64_t maxSize);
+
+    // The items of this bundle stored from now on are forgotten after this
+    // delay, even if they are accessed
+    void SetTimeToLive(int bundle,
+                       unsigned int seconds);
+
+    bool Access(std::string& content,
+                int bundle,
+                const std::string& item);
+
+    bool IsCached(int bundle,
+                  const std::string& item);
+
+    void Store(int bundle,
+               const std::string& item,
+               const std::string& content);
+
+    // item is a prefix, as for CacheManager::Invalidate()
+    void Invalidate(int bundle,
+                    const std::string& itemPrefix);
+
+    void Clear();
+
+    void GetStatistics(Statistics& target);
+  };
+}
@@ -0,0 +1,146 @@
+#include "NegativeCache.h"
+
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+namespace OrthancPlugins
+{
+  const size_t NegativeCache::MAX_FAILURES;
+
+
+  NegativeCache::NegativeCache(unsigned int timeToLiveSeconds) :
+    timeToLive_(boost::posix_time::seconds(timeToLiveSeconds)),
+    hits_(0)
+  {
+  }
+
+
+  void NegativeCache::SetTimeToLive(int bundle,
+                                    unsigned int seconds)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    bundlesTimeToLive_[bundle] = boost::posix_time::seconds(seconds);
+  }
+
+
+  void NegativeCache::Remove(Failures::iterator failure)
+  {
+    order_.erase(failure->second.position);
+    failures_.erase(failure);
+  }
+
+
+  bool NegativeCache::Lookup(Orthanc::ErrorCode& error,
+                             int bundle,
+                             const std::string& item)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Failures::iterator found = failures_.find(Key(bundle, item));
+    if (found == failures_.end())
+    {
+      return false;
+    }
+
+    if (boost::posix_time::microsec_clock::universal_time() >= found->second.expiration)
+    {
+      // this failure is forgotten, the item can be tried again
+      Remove(found);
+      return false;
+    }
+
+    error = found->second.error;
+    hits_++;
+    return true;
+  }
+
+
+  bool NegativeCache::IsPermanentFailure(Orthanc::ErrorCode error)
+  {
+    switch (error)
+    {
+      case Orthanc::ErrorCode_Success:
+      case Orthanc::ErrorCode_BadFileFormat:
+      case Orthanc::ErrorCode_CorruptedFile:
+      case Orthanc::ErrorCode_NotImplemented:
+      case Orthanc::ErrorCode_IncompatibleImageFormat:
+      case Orthanc::ErrorCode_IncompatibleImageSize:
+      case Orthanc::ErrorCode_ParameterOutOfRange:
+      case Orthanc::ErrorCode_CannotOrderSlices:
+        return true;
+
+      default:
+        return false;
+    }
+  }
+
+
+  void NegativeCache::Store(int bundle,
+                            const std::string& item,
+                            Orthanc::ErrorCode error)
+  {
+    if (!IsPermanentFailure(error))
+    {
+      return;
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Key key(bundle, item);
+
+    Failures::iterator found = failures_.find(key);
+    if (found == failures_.end())
+    {
+      Failure failure;
+      failure.position = order_.insert(order_.end(), key);
+      found = failures_.insert(std::make_pair(key, failure)).first;
+    }
+    else
+    {
+      // failed again: this is now the most recent failure
+      order_.splice(order_.end(), order_, found->second.position);
+    }
+
+    TimesToLive::const_iterator timeToLive = bundlesTimeToLive_.find(bundle);
+
+    found->second.error = error;
+    found->second.expiration = (boost::posix_time::microsec_clock::universal_time() +
+                                (timeToLive == bundlesTimeToLive_.end() ? timeToLive_ : timeToLive->second));
+
+    while (failures_.size() > MAX_FAILURES)
+    {
+      Remove(failures_.find(order_.front()));
+    }
+  }
+
+
+  void NegativeCache::Invalidate(int bundle,
+                                 const std::string& itemPrefix)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Failures::iterator it = failures_.lower_bound(Key(bundle, itemPrefix));
+    while (it != failures_.end() &&
+           it->first.first == bundle &&
+           boost::starts_with(it->first.second, itemPrefix))
+    {
+      Remove(it++);
+    }
+  }
+
+
+  void NegativeCache::Clear()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    failures_.clear();
+    order_.clear();
+  }
+
+
+  void NegativeCache::GetStatistics(Statistics& target)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    target.hits = hits_;
+    target.count = static_cast<uint32_t>(failures_.size());
+  }
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <list>
+#include <map>
+#include <string>
+#include <stdint.h>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <Enumerations.h>
+
+namespace OrthancPlugins
+{
+  /** NegativeCache
+   *
+   * Items that a factory could not produce (e.g. the images of a SR or SEG
+   * series, unsupported transfer syntaxes, corrupted files), so that the next
+   * accesses and prefetches fail without loading and decoding the DICOM file
+   * again.  Only the failures that happen again at each attempt are
+   * remembered (see IsPermanentFailure()), not the ones due to the state of
+   * the server (timeout, database, storage...).  They are forgotten after a
+   * delay (the item can be invalidated by another node), when the item is
+   * invalidated, or when there are too many of them.
+   *
+   * Thread-safe.
+   *
+   */
+  class NegativeCache : public boost::noncopyable
+  {
+  public:
+    struct Statistics
+    {
+      uint64_t  hits;
+      uint32_t  count;
+    };
+
+  private:
+    // the oldest failures are forgotten first
+    static const size_t MAX_FAILURES = 10000;
+
+    typedef std::pair<int, std::string>  Key;  // bundle, item
+    typedef std::list<Key>               Order;  // front = oldest failure
+
+    struct Failure
+    {
+      Orthanc::ErrorCode        error;       // ErrorCode_Success if the factory returned false
+      boost::posix_time::ptime  expiration;
+      Order::iterator           position;
+    };
+
+    typedef std::map<Key, Failure>      Failures;  // ordered, for the invalidation by prefix
+    typedef std::map<int, boost::posix_time::time_duration>  TimesToLive;
+
+    boost::mutex                     mutex_;
+    Failures                         failures_;
+    Order                            order_;
+    boost::posix_time::time_duration timeToLive_;
+    TimesToLive                      bundlesTimeToLive_;  // overrides timeToLive_
+    uint64_t                         hits_;
+
+    // requires mutex_ to be locked
+    void Remove(Failures::iterator failure);
+
+  public:
+    explicit NegativeCache(unsigned int timeToLiveSeconds);
+
+    // The failures of this bundle stored from now on are forgotten after
+    // this delay instead
+    void SetTimeToLive(int bundle,
+                       unsigned int seconds);
+
+    // Returns true if the item has failed recently, "error" being the
+    // error of the factory (ErrorCode_Success if it returned false)
+    bool Lookup(Orthanc::ErrorCode& error,
+                int bundle,
+                const std::string& item);
+
+    // Does nothing if the failure is not permanent
+    void Store(int bundle,
+               const std::string& item,
+               Orthanc::ErrorCode error);
+
+    // The errors due to the item itself (its file, its format), that the
+    // factory raises at each attempt.  ErrorCode_Success stands for a
+    // factory that returned false.
+    static bool IsPermanentFailure(Orthanc::ErrorCode error);
+
+    // item is a prefix, as for CacheManager::Invalidate()
+    void Invalidate(int bundle,
+                    const std::string& itemPrefix);
+
+    void Clear();
+
+    void GetStatistics(Statistics& target);
+  };
+}
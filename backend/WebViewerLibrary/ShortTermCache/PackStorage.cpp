@@ -0,0 +1,403 @@
+#include "PackStorage.h"
+
+#include <OrthancException.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+
+#if !defined(_WIN32)
+#  include <errno.h>
+#  include <fcntl.h>
+#  include <unistd.h>
+#endif
+
+namespace OrthancPlugins
+{
+  static const char* const PACK_NAME_PREFIX = "pack:";
+  static const char* const SEGMENT_EXTENSION = ".pack";
+
+  // A segment is compacted once at least DEAD_PERCENTAGE percent of its
+  // content has been released
+  static const uint64_t DEAD_PERCENTAGE = 50;
+
+
+  static std::string FormatSegment(uint32_t segment)
+  {
+    char buffer[16];
+    sprintf(buffer, "%08u", segment);
+    return buffer;
+  }
+
+
+  // Read-only handle on a segment, shared by the readers so that a segment
+  // can be deleted while it is being read
+  class PackStorage::Reader : public boost::noncopyable
+  {
+  private:
+#if defined(_WIN32)
+    boost::filesystem::path  path_;
+#else
+    int                      fd_;
+#endif
+
+  public:
+    explicit Reader(const boost::filesystem::path& path)
+    {
+#if defined(_WIN32)
+      path_ = path;
+#else
+      fd_ = open(path.string().c_str(), O_RDONLY);
+      if (fd_ < 0)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentFile);
+      }
+#endif
+    }
+
+    ~Reader()
+    {
+#if !defined(_WIN32)
+      close(fd_);
+#endif
+    }
+
+    bool Read(std::string& content,
+              uint64_t offset,
+              uint64_t size) const
+    {
+      content.resize(static_cast<size_t>(size));
+      if (size == 0)
+      {
+        return true;
+      }
+
+#if defined(_WIN32)
+      boost::filesystem::ifstream f(path_, std::ios::binary);
+      f.seekg(static_cast<std::streamoff>(offset));
+      f.read(&content[0], static_cast<std::streamsize>(size));
+      return (f.good() &&
+              f.gcount() == static_cast<std::streamsize>(size));
+#else
+      size_t done = 0;
+      while (done < size)
+      {
+        ssize_t count = pread(fd_, &content[done], static_cast<size_t>(size) - done,
+                              static_cast<off_t>(offset + done));
+        if (count < 0 && errno == EINTR)
+        {
+          continue;
+        }
+        else if (count <= 0)
+        {
+          return false;
+        }
+
+        done += static_cast<size_t>(count);
+      }
+
+      return true;
+#endif
+    }
+  };
+
+
+  PackStorage::PackStorage(const std::string& root,
+                           uint64_t segmentSize) :
+    root_(root),
+    segmentSize_(segmentSize),
+    active_(0)
+  {
+    boost::filesystem::create_directories(root_);
+
+    // the existing segments are only read: the tail of the last one may be
+    // an entry that was being written when Orthanc stopped
+    boost::system::error_code error;
+    for (boost::filesystem::directory_iterator it(root_, error), end;
+         !error && it != end; it.increment(error))
+    {
+      if (it->path().extension() != SEGMENT_EXTENSION)
+      {
+        continue;
+      }
+
+      uint32_t segment;
+      try
+      {
+        segment = boost::lexical_cast<uint32_t>(it->path().stem().string());
+      }
+      catch (boost::bad_lexical_cast&)
+      {
+        continue;
+      }
+
+      boost::system::error_code fileError;
+      segments_[segment].size = boost::filesystem::file_size(it->path(), fileError);
+      active_ = std::max(active_, segment);
+    }
+  }
+
+
+  boost::filesystem::path PackStorage::GetPath(uint32_t segment) const
+  {
+    return root_ / (FormatSegment(segment) + SEGMENT_EXTENSION);
+  }
+
+
+  bool PackStorage::IsPackName(const std::string& name)
+  {
+    return boost::starts_with(name, PACK_NAME_PREFIX);
+  }
+
+
+  void PackStorage::GetNameRange(std::string& first,
+                                 std::string& last)
+  {
+    first = PACK_NAME_PREFIX;
+    last = first;
+    last[last.size() - 1]++;
+  }
+
+
+  bool PackStorage::ParseName(uint32_t& segment,
+                              uint64_t& offset,
+                              uint64_t& size,
+                              const std::string& name)
+  {
+    // "pack:segment/offset/size"
+    if (!IsPackName(name))
+    {
+      return false;
+    }
+
+    size_t start = std::string(PACK_NAME_PREFIX).size();
+    size_t first = name.find('/', start);
+    size_t second = (first == std::string::npos ? first : name.find('/', first + 1));
+    if (second == std::string::npos)
+    {
+      return false;
+    }
+
+    try
+    {
+      segment = boost::lexical_cast<uint32_t>(name.substr(start, first - start));
+      offset = boost::lexical_cast<uint64_t>(name.substr(first + 1, second - first - 1));
+      size = boost::lexical_cast<uint64_t>(name.substr(second + 1));
+      return true;
+    }
+    catch (boost::bad_lexical_cast&)
+    {
+      return false;
+    }
+  }
+
+
+  void PackStorage::OpenNextSegment()
+  {
+    if (writer_.is_open())
+    {
+      writer_.close();
+    }
+
+    active_++;
+    segments_[active_] = Segment();
+
+    writer_.open(GetPath(active_), std::ios::binary | std::ios::trunc);
+    if (!writer_.good())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile);
+    }
+  }
+
+
+  std::string PackStorage::Append(const std::string& content)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (!writer_.is_open() ||
+        segments_[active_].size >= segmentSize_)
+    {
+      OpenNextSegment();
+    }
+
+    Segment& segment = segments_[active_];
+    uint64_t offset = segment.size;
+
+    writer_.write(content.c_str(), content.size());
+    writer_.flush();   // visible to the readers
+
+    if (!writer_.good())
+    {
+      // the segment may end with a partial entry, start a new one
+      writer_.close();
+
+      boost::system::error_code error;
+      segment.size = boost::filesystem::file_size(GetPath(active_), error);
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile);
+    }
+
+    segment.size += content.size();
+    segment.liveSize += content.size();
+
+    return (PACK_NAME_PREFIX + FormatSegment(active_) + "/" +
+            boost::lexical_cast<std::string>(offset) + "/" +
+            boost::lexical_cast<std::string>(content.size()));
+  }
+
+
+  bool PackStorage::Read(std::string& content,
+                         const std::string& name) const
+  {
+    uint32_t segment;
+    uint64_t offset, size;
+    if (!ParseName(segment, offset, size, name))
+    {
+      return false;
+    }
+
+    ReaderPtr reader;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Segments::const_iterator found = segments_.find(segment);
+      if (found == segments_.end() ||
+          offset + size > found->second.size)
+      {
+        return false;  // compacted in the meantime
+      }
+
+      if (found->second.reader.get() == NULL)
+      {
+        try
+        {
+          found->second.reader.reset(new Reader(GetPath(segment)));
+        }
+        catch (Orthanc::OrthancException&)
+        {
+          return false;
+        }
+      }
+
+      reader = found->second.reader;
+    }
+
+    // outside of the lock, the other readers and the writer are not blocked
+    return reader->Read(content, offset, size);
+  }
+
+
+  void PackStorage::Release(const std::string& name)
+  {
+    uint32_t segment;
+    uint64_t offset, size;
+    if (!ParseName(segment, offset, size, name))
+    {
+      return;
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Segments::iterator found = segments_.find(segment);
+    if (found != segments_.end())
+    {
+      found->second.liveSize -= std::min(size, found->second.liveSize);
+    }
+  }
+
+
+  void PackStorage::RegisterEntry(const std::string& name)
+  {
+    uint32_t segment;
+    uint64_t offset, size;
+    if (!ParseName(segment, offset, size, name))
+    {
+      return;
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Segments::iterator found = segments_.find(segment);
+    if (found != segments_.end())
+    {
+      found->second.liveSize += size;
+    }
+  }
+
+
+  bool PackStorage::SelectSegmentToCompact(std::string& first,
+                                           std::string& last)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    uint32_t selected = 0;
+    uint64_t selectedDead = 0;
+
+    for (Segments::iterator it = segments_.begin(); it != segments_.end(); )
+    {
+      const Segment& segment = it->second;
+      uint64_t dead = segment.size - std::min(segment.size, segment.liveSize);
+
+      if (it->first == active_ &&
+          writer_.is_open())
+      {
+        ++it;
+      }
+      else if (segment.liveSize == 0)
+      {
+        // the readers that still hold the segment keep reading it (POSIX).
+        // On Windows, the deletion fails until they are done: try again at
+        // the next call.
+        boost::system::error_code error;
+        boost::filesystem::remove(GetPath(it->first), error);
+        if (error)
+        {
+          ++it;
+        }
+        else
+        {
+          segments_.erase(it++);
+        }
+      }
+      else
+      {
+        if (dead * 100 >= segment.size * DEAD_PERCENTAGE &&
+            dead > selectedDead)
+        {
+          selected = it->first;
+          selectedDead = dead;
+        }
+
+        ++it;
+      }
+    }
+
+    if (selectedDead == 0)
+    {
+      return false;
+    }
+
+    // the names of the segment are "pack:segment/...", '0' follows '/'
+    first = PACK_NAME_PREFIX + FormatSegment(selected) + "/";
+    last = PACK_NAME_PREFIX + FormatSegment(selected) + "0";
+    return true;
+  }
+
+
+  void PackStorage::GetStatistics(Statistics& target)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    target.segments = static_cast<uint32_t>(segments_.size());
+    target.size = 0;
+    target.deadSize = 0;
+
+    for (Segments::const_iterator it = segments_.begin(); it != segments_.end(); ++it)
+    {
+      target.size += it->second.size;
+      target.deadSize += it->second.size - std::min(it->second.size, it->second.liveSize);
+    }
+  }
+}
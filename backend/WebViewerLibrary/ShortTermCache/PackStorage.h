@@ -0,0 +1,113 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <stdint.h>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/filesystem/path.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace OrthancPlugins
+{
+  /** PackStorage
+   *
+   * Storage of the files of the short term cache in large append-only
+   * segment files, instead of one file per item (millions of small files
+   * for the low quality images).  The name of an entry (stored in the index
+   * of the CacheManager) is its location: segment, offset and size.
+   *  - storing an item appends it to the active segment,
+   *  - reading an item is a single positioned read,
+   *  - evicting an item only releases its space: the segments that are
+   *    mostly unused are compacted by the CacheManager (their entries are
+   *    moved to the active segment, see CompactPackFiles()), then deleted.
+   *
+   * The segments are never rewritten: a reader that is given the location
+   * of an entry either reads it or fails because the segment has been
+   * deleted in the meantime.
+   *
+   * Thread-safe.
+   *
+   */
+  class PackStorage : public boost::noncopyable
+  {
+  public:
+    struct Statistics
+    {
+      uint32_t  segments;
+      uint64_t  size;       // all the segments
+      uint64_t  deadSize;   // released entries, reclaimed by the compaction
+    };
+
+  private:
+    class Reader;
+
+    typedef boost::shared_ptr<Reader>  ReaderPtr;
+
+    struct Segment
+    {
+      uint64_t   size;
+      uint64_t   liveSize;
+      mutable ReaderPtr  reader;   // opened on the first read
+
+      Segment() : size(0), liveSize(0)
+      {
+      }
+    };
+
+    typedef std::map<uint32_t, Segment>  Segments;
+
+    boost::filesystem::path     root_;
+    uint64_t                    segmentSize_;
+    mutable boost::mutex        mutex_;
+    Segments                    segments_;
+    uint32_t                    active_;
+    boost::filesystem::ofstream writer_;   // of the active segment
+
+    boost::filesystem::path GetPath(uint32_t segment) const;
+
+    static bool ParseName(uint32_t& segment,
+                          uint64_t& offset,
+                          uint64_t& size,
+                          const std::string& name);
+
+    // requires mutex_ to be locked
+    void OpenNextSegment();
+
+  public:
+    // The new segments are started once the active one reaches
+    // "segmentSize" bytes
+    PackStorage(const std::string& root,
+                uint64_t segmentSize);
+
+    static bool IsPackName(const std::string& name);
+
+    // The names of all the entries are between "first" and "last" (excluded)
+    static void GetNameRange(std::string& first,
+                             std::string& last);
+
+    // Returns the name of the new entry
+    std::string Append(const std::string& content);
+
+    // Returns false if the segment has been deleted in the meantime
+    bool Read(std::string& content,
+              const std::string& name) const;
+
+    // The entry is not used anymore (ie. evicted from the cache)
+    void Release(const std::string& name);
+
+    // The entries of the index (including the entries whose removal is
+    // pending), when the storage is opened: the space of the other entries
+    // of the existing segments is reclaimed
+    void RegisterEntry(const std::string& name);
+
+    // Deletes the segments that are not used anymore, then returns the
+    // segment that is the most worth compacting, if any, and the range of
+    // the names of its entries (first < name < last)
+    bool SelectSegmentToCompact(std::string& first,
+                                std::string& last);
+
+    void GetStatistics(Statistics& target);
+  };
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "CacheIndex.h"
+
+#include <string>
+
+namespace OrthancPlugins
+{
+  // Where a prefetched item stands relatively to what the user is viewing.
+  // The prefetch queue runs the items of the most recently viewed series
+  // first, the closest to the viewed slice first, then the lowest quality
+  // first (see CacheScheduler::SetViewerPosition()).  The items that are not
+  // related to a viewed series run last, by increasing position (ie. the
+  // display order of the series of an opened study).
+  struct PrefetchPriority
+  {
+    std::string   series;    // empty if the item is not related to a viewed series
+    unsigned int  position;  // index of the slice in the series (or rank of the item if "series" is empty)
+    unsigned int  quality;   // rank of the quality (0 = the first one displayed)
+
+    PrefetchPriority() :
+      position(0),
+      quality(0)
+    {
+    }
+
+    PrefetchPriority(const std::string& series,
+                     unsigned int position,
+                     unsigned int quality) :
+      series(series),
+      position(position),
+      quality(quality)
+    {
+    }
+  };
+
+
+  class PrefetchRequest
+  {
+  private:
+    CacheIndex        index_;
+    PrefetchPriority  priority_;
+
+  public:
+    PrefetchRequest(const CacheIndex& index,
+                    const PrefetchPriority& priority) :
+      index_(index),
+      priority_(priority)
+    {
+    }
+
+    const CacheIndex& GetIndex() const
+    {
+      return index_;
+    }
+
+    const PrefetchPriority& GetPriority() const
+    {
+      return priority_;
+    }
+  };
+}
@@ -0,0 +1,103 @@
+#include "ScrollTracker.h"
+
+namespace OrthancPlugins
+{
+  const size_t ScrollTracker::MAX_VIEWERS;
+  const size_t ScrollTracker::MAX_SAMPLES;
+
+  // a viewer that stays longer on a slice starts a new scrolling gesture
+  static const long GESTURE_PAUSE_MS = 500;
+
+
+  void ScrollTracker::RemoveOldestViewer()
+  {
+    Viewers::iterator oldest = viewers_.end();
+    for (Viewers::iterator it = viewers_.begin(); it != viewers_.end(); ++it)
+    {
+      if (oldest == viewers_.end() ||
+          it->second.empty() ||
+          (!oldest->second.empty() &&
+           it->second.back().time < oldest->second.back().time))
+      {
+        oldest = it;
+      }
+    }
+
+    if (oldest != viewers_.end())
+    {
+      viewers_.erase(oldest);
+    }
+  }
+
+
+  double ScrollTracker::Update(const std::string& series,
+                               const std::string& client,
+                               unsigned int position,
+                               const boost::posix_time::ptime& time)
+  {
+    ViewerKey key(series, client);
+
+    Viewers::iterator viewer = viewers_.find(key);
+    if (viewer == viewers_.end())
+    {
+      if (viewers_.size() >= MAX_VIEWERS)
+      {
+        RemoveOldestViewer();
+      }
+
+      viewer = viewers_.insert(std::make_pair(key, std::deque<Sample>())).first;
+    }
+
+    std::deque<Sample>& samples = viewer->second;
+
+    if (!samples.empty() &&
+        time > samples.back().time + boost::posix_time::milliseconds(GESTURE_PAUSE_MS))
+    {
+      samples.clear();
+    }
+
+    // the other qualities of the same slice (and the late events) don't move
+    // the viewer
+    if (samples.empty() ||
+        (samples.back().position != position &&
+         time >= samples.back().time))
+    {
+      Sample sample;
+      sample.position = position;
+      sample.time = time;
+      samples.push_back(sample);
+
+      if (samples.size() > MAX_SAMPLES)
+      {
+        samples.pop_front();
+      }
+    }
+
+    if (samples.size() < 2)
+    {
+      return 0;
+    }
+
+    double seconds = (samples.back().time - samples.front().time).total_microseconds() / 1000000.0;
+    if (seconds <= 0)
+    {
+      // the slices have been requested at once (ie. images batch): the
+      // direction is known, not the velocity
+      seconds = 0.001;
+    }
+
+    return (static_cast<double>(samples.back().position) -
+            static_cast<double>(samples.front().position)) / seconds;
+  }
+
+
+  void ScrollTracker::Forget(const std::string& series)
+  {
+    Viewers::iterator it = viewers_.lower_bound(ViewerKey(series, std::string()));
+    while (it != viewers_.end() &&
+           it->first.first == series)
+    {
+      viewers_.erase(it++);
+    }
+  }
+}
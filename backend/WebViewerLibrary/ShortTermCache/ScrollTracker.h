@@ -0,0 +1,56 @@
+#pragma once
+
+#include <deque>
+#include <map>
+#include <string>
+#include <boost/noncopyable.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+namespace OrthancPlugins
+{
+  /** ScrollTracker
+   *
+   * Recent positions viewed in each series by each viewer (ie. browser),
+   * for the ViewerPrefetchPolicy to estimate the scrolling velocity and
+   * direction.  The viewers of a series are told apart by a client key
+   * (see BaseController::_GetClientKey()), since two users scrolling the
+   * same series in opposite directions would otherwise cancel each other.
+   *
+   * Not thread-safe: used by the policy stage of the CacheScheduler only.
+   *
+   */
+  class ScrollTracker : public boost::noncopyable
+  {
+  private:
+    // only the viewers that accessed an image the most recently are tracked
+    static const size_t MAX_VIEWERS = 256;
+
+    // the velocity is estimated over the last samples of the current
+    // scrolling gesture
+    static const size_t MAX_SAMPLES = 8;
+
+    struct Sample
+    {
+      unsigned int              position;
+      boost::posix_time::ptime  time;
+    };
+
+    typedef std::pair<std::string, std::string>   ViewerKey;  // series, client
+    typedef std::map<ViewerKey, std::deque<Sample> >  Viewers;  // the oldest sample first
+
+    Viewers  viewers_;
+
+    void RemoveOldestViewer();
+
+  public:
+    // Records the access of a viewer to a slice of the series and returns
+    // its scrolling velocity, in slices per second (negative when scrolling
+    // towards the first slice, 0 if the viewer is not scrolling)
+    double Update(const std::string& series,
+                  const std::string& client,
+                  unsigned int position,
+                  const boost::posix_time::ptime& time);
+
+    void Forget(const std::string& series);
+  };
+}
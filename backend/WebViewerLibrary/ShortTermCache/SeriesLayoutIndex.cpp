@@ -0,0 +1,220 @@
+#include "SeriesLayoutIndex.h"
+
+#include <json/reader.h>
+#include <json/value.h>
+
+namespace OrthancPlugins
+{
+  const size_t SeriesLayoutIndex::MAX_LAYOUTS;
+
+
+  SeriesLayoutIndex::Layout::Layout(const std::string& seriesId,
+                                    const std::vector<std::string>& slices,
+                                    const std::vector<ImageQuality::EImageQuality>& qualities) :
+    seriesId_(seriesId),
+    slices_(slices),
+    qualities_(qualities)
+  {
+    for (size_t i = 0; i < slices_.size(); i++)
+    {
+      // keep the first position if a slice is listed twice, as the former linear lookup
+      positions_.insert(std::make_pair(slices_[i], static_cast<unsigned int>(i)));
+    }
+  }
+
+
+  bool SeriesLayoutIndex::Layout::LookupPosition(unsigned int& position,
+                                                 const std::string& slice) const
+  {
+    Positions::const_iterator found = positions_.find(slice);
+    if (found == positions_.end())
+    {
+      return false;
+    }
+
+    position = found->second;
+    return true;
+  }
+
+
+  SeriesLayoutIndex::SeriesLayoutIndex() :
+    version_(0)
+  {
+  }
+
+
+  uint64_t SeriesLayoutIndex::GetVersion()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return version_;
+  }
+
+
+  SeriesLayoutIndex::LayoutPtr SeriesLayoutIndex::Find(const std::string& seriesId)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Layouts::iterator found = layouts_.find(seriesId);
+    if (found == layouts_.end())
+    {
+      return LayoutPtr();
+    }
+
+    recency_.splice(recency_.begin(), recency_, found->second);
+    return *found->second;
+  }
+
+
+  bool SeriesLayoutIndex::LookupSeries(std::string& seriesId,
+                                       const std::string& instanceId)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Instances::const_iterator found = instances_.find(instanceId);
+    if (found == instances_.end())
+    {
+      return false;
+    }
+
+    seriesId = found->second;
+    return true;
+  }
+
+
+  bool SeriesLayoutIndex::ParseSlices(std::vector<std::string>& slices,
+                                      const Json::Value& seriesJson)
+  {
+    if (!seriesJson.isMember("Slices") ||
+        seriesJson["Slices"].type() != Json::arrayValue)
+    {
+      return false;
+    }
+
+    const Json::Value& jsonSlices = seriesJson["Slices"];
+    slices.reserve(jsonSlices.size());
+    for (Json::Value::ArrayIndex i = 0; i < jsonSlices.size(); i++)
+    {
+      slices.push_back(jsonSlices[i].asString());
+    }
+
+    return true;
+  }
+
+
+  SeriesLayoutIndex::LayoutPtr SeriesLayoutIndex::Store(const std::string& seriesId,
+                                                        const std::string& seriesContent,
+                                                        uint64_t version)
+  {
+    Json::Value json;
+    Json::Reader reader;
+    std::vector<std::string> slices;
+    if (!reader.parse(seriesContent, json) ||
+        !ParseSlices(slices, json) ||
+        !json.isMember("AvailableQualities") ||
+        json["AvailableQualities"].type() != Json::arrayValue)
+    {
+      return LayoutPtr();
+    }
+
+    // in their order of display
+    const Json::Value& jsonQualities = json["AvailableQualities"];
+    std::vector<ImageQuality::EImageQuality> qualities;
+    for (Json::Value::ArrayIndex i = 0; i < jsonQualities.size(); i++)
+    {
+      qualities.push_back(ImageQuality::fromString(jsonQualities[i].asString()));
+    }
+
+    return Index(LayoutPtr(new Layout(seriesId, slices, qualities)), version);
+  }
+
+
+  SeriesLayoutIndex::LayoutPtr SeriesLayoutIndex::Store(const std::string& seriesId,
+                                                        const std::string& seriesContent,
+                                                        const std::vector<ImageQuality::EImageQuality>& qualities,
+                                                        uint64_t version)
+  {
+    Json::Value json;
+    Json::Reader reader;
+    std::vector<std::string> slices;
+    if (!reader.parse(seriesContent, json) ||
+        !ParseSlices(slices, json))
+    {
+      return LayoutPtr();
+    }
+
+    return Index(LayoutPtr(new Layout(seriesId, slices, qualities)), version);
+  }
+
+
+  SeriesLayoutIndex::LayoutPtr SeriesLayoutIndex::Index(LayoutPtr layout,
+                                                        uint64_t version)
+  {
+    const std::string& seriesId = layout->GetSeriesId();
+    const std::vector<std::string>& slices = layout->GetSlices();
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (version != version_)
+    {
+      // the series information might have been invalidated meanwhile, use
+      // this layout once without indexing it
+      return layout;
+    }
+
+    Layouts::iterator previous = layouts_.find(seriesId);
+    if (previous != layouts_.end())
+    {
+      Remove(previous);
+    }
+
+    recency_.push_front(layout);
+    layouts_[seriesId] = recency_.begin();
+
+    for (size_t i = 0; i < slices.size(); i++)
+    {
+      // "<instance_id>/<frame_index>"
+      instances_[slices[i].substr(0, slices[i].find('/'))] = seriesId;
+    }
+
+    while (layouts_.size() > MAX_LAYOUTS)
+    {
+      Remove(layouts_.find(recency_.back()->GetSeriesId()));
+    }
+
+    return layout;
+  }
+
+
+  void SeriesLayoutIndex::Invalidate(const std::string& seriesId)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    version_++;
+
+    Layouts::iterator found = layouts_.find(seriesId);
+    if (found != layouts_.end())
+    {
+      Remove(found);
+    }
+  }
+
+
+  void SeriesLayoutIndex::Remove(Layouts::iterator layout)
+  {
+    const std::vector<std::string>& slices = (*layout->second)->GetSlices();
+    const std::string& seriesId = layout->first;
+
+    for (size_t i = 0; i < slices.size(); i++)
+    {
+      Instances::iterator instance = instances_.find(slices[i].substr(0, slices[i].find('/')));
+      if (instance != instances_.end() &&
+          instance->second == seriesId)
+      {
+        instances_.erase(instance);
+      }
+    }
+
+    recency_.erase(layout->second);
+    layouts_.erase(layout);
+  }
+}
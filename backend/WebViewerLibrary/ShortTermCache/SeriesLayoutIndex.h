@@ -0,0 +1,124 @@
+#pragma once
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/unordered_map.hpp>
+
+#include "Image/AvailableQuality/ImageQuality.h"
+
+namespace Json
+{
+  class Value;
+}
+
+namespace OrthancPlugins
+{
+  /** SeriesLayoutIndex
+   *
+   * Parsed layout of the series, for the ViewerPrefetchPolicy: the ordered
+   * slices ("<instance_id>/<frame_index>"), the position of each slice and
+   * the available qualities.  A layout is built once per version of the
+   * series information and dropped when the series is invalidated, so that
+   * the prefetch decisions neither parse the series json nor call the REST
+   * API on each image access.
+   *
+   * Thread-safe.
+   *
+   */
+  class SeriesLayoutIndex : public boost::noncopyable
+  {
+  public:
+    class Layout : public boost::noncopyable
+    {
+    private:
+      typedef boost::unordered_map<std::string, unsigned int>  Positions;
+
+      std::string                                seriesId_;
+      std::vector<std::string>                   slices_;
+      Positions                                  positions_;
+      std::vector<ImageQuality::EImageQuality>   qualities_;  // ordered
+
+    public:
+      Layout(const std::string& seriesId,
+             const std::vector<std::string>& slices,
+             const std::vector<ImageQuality::EImageQuality>& qualities);
+
+      const std::string& GetSeriesId() const
+      {
+        return seriesId_;
+      }
+
+      const std::vector<std::string>& GetSlices() const
+      {
+        return slices_;
+      }
+
+      const std::vector<ImageQuality::EImageQuality>& GetQualities() const
+      {
+        return qualities_;
+      }
+
+      bool LookupPosition(unsigned int& position,
+                          const std::string& slice) const;
+    };
+
+    typedef boost::shared_ptr<const Layout>  LayoutPtr;
+
+  private:
+    // the layouts of the least recently used series are dropped
+    static const size_t MAX_LAYOUTS = 100;
+
+    typedef std::list<LayoutPtr>                          Recency;    // front = most recently used
+    typedef std::map<std::string, Recency::iterator>      Layouts;    // by series
+    typedef boost::unordered_map<std::string, std::string>  Instances;  // instance -> series
+
+    boost::mutex  mutex_;
+    Recency       recency_;
+    Layouts       layouts_;
+    Instances     instances_;
+    uint64_t      version_;  // incremented at each invalidation
+
+    static bool ParseSlices(std::vector<std::string>& slices,
+                            const Json::Value& seriesJson);
+
+    LayoutPtr Index(LayoutPtr layout,
+                    uint64_t version);
+
+    // these methods require mutex_ to be locked
+    void Remove(Layouts::iterator layout);
+
+  public:
+    SeriesLayoutIndex();
+
+    // Current version of the index, to give to Store()
+    uint64_t GetVersion();
+
+    LayoutPtr Find(const std::string& seriesId);
+
+    bool LookupSeries(std::string& seriesId,
+                      const std::string& instanceId);
+
+    // Parses the series information (see SeriesInformationAdapter).  The
+    // layout is not indexed if a series has been invalidated since
+    // "version" was read: the content might be obsolete.  Returns NULL if
+    // the content can't be parsed, or if it has no qualities (stored by a
+    // former version of the plugin).
+    LayoutPtr Store(const std::string& seriesId,
+                    const std::string& seriesContent,
+                    uint64_t version);
+
+    // Same as above, the qualities being given
+    LayoutPtr Store(const std::string& seriesId,
+                    const std::string& seriesContent,
+                    const std::vector<ImageQuality::EImageQuality>& qualities,
+                    uint64_t version);
+
+    void Invalidate(const std::string& seriesId);
+  };
+}
@@ -0,0 +1,395 @@
+#include "SharedCacheDirectory.h"
+
+#include <Toolbox.h>
+#include <OrthancException.h>
+
+#include <algorithm>
+#include <ctime>
+#include <vector>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/interprocess/sync/file_lock.hpp>
+#include <boost/interprocess/sync/scoped_lock.hpp>
+#include <boost/lexical_cast.hpp>
+
+namespace OrthancPlugins
+{
+  static const char* const SHARED_NAME_PREFIX = "shared:";
+  static const char* const LOCK_FILE = "cleanup.lock";
+  static const char* const TEMPORARY_EXTENSION = ".tmp";
+
+  // A node looks for files to remove each time it has written
+  // 1/CLEANUP_FRACTION of the maximum size, and removes files until the
+  // directory is back to CLEANUP_TARGET percent of its maximum size
+  static const uint64_t CLEANUP_FRACTION = 20;
+  static const uint64_t CLEANUP_TARGET = 90;
+
+  // The modification time of the files is only updated once per
+  // TOUCH_INTERVAL_SECONDS, to limit the writes to the shared directory
+  static const std::time_t TOUCH_INTERVAL_SECONDS = 60;
+
+  // The temporary files of a node that crashed while writing are removed
+  // after this delay
+  static const std::time_t STALE_TEMPORARY_SECONDS = 3600;
+
+
+  namespace
+  {
+    struct CachedFile
+    {
+      std::time_t              time;
+      uint64_t                 size;
+      boost::filesystem::path  path;
+
+      bool operator< (const CachedFile& other) const
+      {
+        return time < other.time;
+      }
+    };
+  }
+
+
+  SharedCacheDirectory::SharedCacheDirectory(const std::string& root,
+                                             uint64_t maxSize) :
+    root_(root),
+    maxSize_(maxSize),
+    writtenSinceCleanup_(0),
+    cleaning_(false)
+  {
+    boost::filesystem::create_directories(root_);
+
+    // the lock file must exist before it can be locked
+    boost::filesystem::ofstream lockFile(root_ / LOCK_FILE, std::ios::app);
+  }
+
+
+  SharedCacheDirectory::~SharedCacheDirectory()
+  {
+    if (cleanupThread_.joinable())
+    {
+      cleanupThread_.join();
+    }
+  }
+
+
+  void SharedCacheDirectory::CleanupThread(SharedCacheDirectory* that)
+  {
+    try
+    {
+      that->Cleanup();
+    }
+    catch (...)
+    {
+      // the next cleanup will try again
+    }
+
+    boost::mutex::scoped_lock lock(that->mutex_);
+    that->cleaning_ = false;
+  }
+
+
+  std::string SharedCacheDirectory::Hash(const std::string& value)
+  {
+    std::string hash;
+    Orthanc::Toolbox::ComputeSHA1(hash, value);
+    return hash;
+  }
+
+
+  void SharedCacheDirectory::SetBundleVersion(int bundle,
+                                              const std::string& version)
+  {
+    std::string directory = boost::lexical_cast<std::string>(bundle);
+    if (!version.empty())
+    {
+      directory += "-" + Hash(version).substr(0, 8);
+    }
+
+    bundleDirectories_[bundle] = directory;
+  }
+
+
+  std::string SharedCacheDirectory::GetBundleDirectory(int bundle) const
+  {
+    std::map<int, std::string>::const_iterator found = bundleDirectories_.find(bundle);
+    if (found == bundleDirectories_.end())
+    {
+      return boost::lexical_cast<std::string>(bundle);
+    }
+    else
+    {
+      return found->second;
+    }
+  }
+
+
+  std::string SharedCacheDirectory::GetGroupDirectory(int bundle,
+                                                      const std::string& item) const
+  {
+    // the items of an instance (or of a series) are in the same directory,
+    // so that they can be invalidated without listing the whole cache
+    std::string group = Hash(item.substr(0, item.find('/')));
+    return GetBundleDirectory(bundle) + "/" + group.substr(0, 2) + "/" + group;
+  }
+
+
+  std::string SharedCacheDirectory::GetName(int bundle,
+                                            const std::string& item) const
+  {
+    return SHARED_NAME_PREFIX + GetGroupDirectory(bundle, item) + "/" + Hash(item);
+  }
+
+
+  boost::filesystem::path SharedCacheDirectory::GetPath(const std::string& name) const
+  {
+    return root_ / name.substr(std::string(SHARED_NAME_PREFIX).size());
+  }
+
+
+  bool SharedCacheDirectory::IsSharedName(const std::string& name)
+  {
+    return boost::starts_with(name, SHARED_NAME_PREFIX);
+  }
+
+
+  bool SharedCacheDirectory::ReadHeader(std::string& item,
+                                        const boost::filesystem::path& path)
+  {
+    boost::filesystem::ifstream f(path, std::ios::binary);
+    return (f.good() &&
+            std::getline(f, item));
+  }
+
+
+  std::string SharedCacheDirectory::Write(int bundle,
+                                          const std::string& item,
+                                          const std::string& content)
+  {
+    const std::string name = GetName(bundle, item);
+    boost::filesystem::path path = GetPath(name);
+    boost::filesystem::path temporary(path.string() + "." + Orthanc::Toolbox::GenerateUuid() + TEMPORARY_EXTENSION);
+
+    boost::system::error_code error;
+    boost::filesystem::create_directories(path.parent_path(), error);
+
+    bool written;
+
+    {
+      boost::filesystem::ofstream f(temporary, std::ios::binary | std::ios::trunc);
+      f << item << '\n';
+      f.write(content.c_str(), content.size());
+      f.close();
+      written = !f.fail();
+    }
+
+    if (written)
+    {
+      // atomic, the other nodes either read the previous file or this one
+      boost::filesystem::rename(temporary, path, error);
+    }
+
+    if (!written || error)
+    {
+      boost::system::error_code ignored;
+      boost::filesystem::remove(temporary, ignored);
+
+      // on Windows, the file cannot be replaced while another node reads it:
+      // it has been written by another node in the meantime, keep it
+      if (!written ||
+          !boost::filesystem::exists(path, ignored))
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile);
+      }
+    }
+
+    {
+      // the directory is listed by another thread, not to block the caller
+      boost::mutex::scoped_lock lock(mutex_);
+      writtenSinceCleanup_ += content.size();
+      if (maxSize_ != 0 &&
+          writtenSinceCleanup_ >= maxSize_ / CLEANUP_FRACTION &&
+          !cleaning_)
+      {
+        if (cleanupThread_.joinable())
+        {
+          cleanupThread_.join();  // already finished
+        }
+
+        writtenSinceCleanup_ = 0;
+        cleaning_ = true;
+        cleanupThread_ = boost::thread(CleanupThread, this);
+      }
+    }
+
+    return name;
+  }
+
+
+  bool SharedCacheDirectory::Lookup(std::string& name,
+                                    uint64_t& size,
+                                    int bundle,
+                                    const std::string& item) const
+  {
+    boost::filesystem::path path = GetPath(GetName(bundle, item));
+
+    boost::system::error_code error;
+    uint64_t fileSize = boost::filesystem::file_size(path, error);
+    if (error ||
+        fileSize < item.size() + 1)
+    {
+      return false;
+    }
+
+    name = GetName(bundle, item);
+    size = fileSize - item.size() - 1;  // without the header
+    return true;
+  }
+
+
+  bool SharedCacheDirectory::Read(std::string& content,
+                                  const std::string& name,
+                                  uint64_t size) const
+  {
+    boost::filesystem::path path = GetPath(name);
+
+    {
+      boost::filesystem::ifstream f(path, std::ios::binary);
+      std::string item;
+      if (!f.good() ||
+          !std::getline(f, item))
+      {
+        return false;  // removed by another node
+      }
+
+      content.resize(static_cast<size_t>(size));
+      if (size > 0)
+      {
+        f.read(&content[0], static_cast<std::streamsize>(size));
+      }
+
+      if ((size > 0 && f.gcount() != static_cast<std::streamsize>(size)) ||
+          f.peek() != std::char_traits<char>::eof())
+      {
+        return false;  // replaced by another node
+      }
+    }
+
+    // the least recently used files are removed first
+    boost::system::error_code error;
+    std::time_t now = std::time(NULL);
+    std::time_t modified = boost::filesystem::last_write_time(path, error);
+    if (!error &&
+        now - modified > TOUCH_INTERVAL_SECONDS)
+    {
+      boost::filesystem::last_write_time(path, now, error);
+    }
+
+    return true;
+  }
+
+
+  void SharedCacheDirectory::Invalidate(int bundle,
+                                        const std::string& itemPrefix)
+  {
+    boost::filesystem::path directory = root_ / GetGroupDirectory(bundle, itemPrefix);
+    boost::system::error_code error;
+
+    if (itemPrefix.find('/') == std::string::npos)
+    {
+      // all the items of the instance/series
+      boost::filesystem::remove_all(directory, error);
+      return;
+    }
+
+    std::vector<boost::filesystem::path> invalidated;
+
+    for (boost::filesystem::directory_iterator it(directory, error), end;
+         !error && it != end; it.increment(error))
+    {
+      std::string item;
+      if (it->path().extension() != TEMPORARY_EXTENSION &&
+          ReadHeader(item, it->path()) &&
+          boost::starts_with(item, itemPrefix))
+      {
+        invalidated.push_back(it->path());
+      }
+    }
+
+    for (size_t i = 0; i < invalidated.size(); i++)
+    {
+      boost::filesystem::remove(invalidated[i], error);
+    }
+  }
+
+
+  void SharedCacheDirectory::Cleanup()
+  {
+    if (maxSize_ == 0)
+    {
+      return;
+    }
+
+    boost::mutex::scoped_lock lock(cleanupMutex_);
+
+    boost::interprocess::file_lock fileLock((root_ / LOCK_FILE).string().c_str());
+    boost::interprocess::scoped_lock<boost::interprocess::file_lock> nodeLock(fileLock, boost::interprocess::try_to_lock);
+    if (!nodeLock.owns())
+    {
+      return;  // another node is cleaning the directory
+    }
+
+    std::vector<CachedFile> files;
+    uint64_t totalSize = 0;
+    std::time_t now = std::time(NULL);
+
+    boost::system::error_code error;
+    for (boost::filesystem::recursive_directory_iterator it(root_, error), end;
+         !error && it != end; it.increment(error))
+    {
+      boost::system::error_code fileError;
+      if (!boost::filesystem::is_regular_file(it->path(), fileError) ||
+          it->path().filename() == LOCK_FILE)
+      {
+        continue;
+      }
+
+      CachedFile file;
+      file.path = it->path();
+      file.time = boost::filesystem::last_write_time(file.path, fileError);
+      file.size = boost::filesystem::file_size(file.path, fileError);
+
+      if (fileError)
+      {
+        continue;  // removed in the meantime
+      }
+
+      if (file.path.extension() == TEMPORARY_EXTENSION)
+      {
+        if (now - file.time > STALE_TEMPORARY_SECONDS)
+        {
+          boost::filesystem::remove(file.path, fileError);
+        }
+        continue;
+      }
+
+      files.push_back(file);
+      totalSize += file.size;
+    }
+
+    if (totalSize <= maxSize_)
+    {
+      return;
+    }
+
+    std::sort(files.begin(), files.end());
+
+    const uint64_t target = maxSize_ / 100 * CLEANUP_TARGET;
+    for (size_t i = 0; i < files.size() && totalSize > target; i++)
+    {
+      boost::system::error_code fileError;
+      boost::filesystem::remove(files[i].path, fileError);
+      totalSize -= files[i].size;
+    }
+  }
+}
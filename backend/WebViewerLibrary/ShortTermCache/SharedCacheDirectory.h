@@ -0,0 +1,110 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <stdint.h>
+#include <boost/noncopyable.hpp>
+#include <boost/filesystem/path.hpp>
+#include <boost/thread.hpp>
+
+namespace OrthancPlugins
+{
+  /** SharedCacheDirectory
+   *
+   * Files of the short term cache shared by several Orthanc nodes (ie. behind
+   * a load balancer) through a common directory, so that an image decoded by
+   * a node is served by all the others.  Each node keeps its own SQLite index
+   * (see CacheManager), the directory itself has no index:
+   *  - the name of a file is derived from the key of its item (SHA-1 of the
+   *    item, in a directory named after the SHA-1 of the instance/series),
+   *    so that any node can find it,
+   *  - a file is written to a temporary file that is then renamed, the other
+   *    nodes never read a partial file,
+   *  - reading a file updates its modification time, the least recently used
+   *    files are removed by a single node at a time, under a file lock, once
+   *    the directory exceeds its maximum size.
+   *
+   * Each file starts with the item it contains, followed by a newline.  The
+   * files of a bundle are in a directory named after the version of its
+   * format (see SetBundleVersion()): the nodes only read the files of their
+   * version, the files of the former versions are removed by the cleanup.
+   *
+   * Thread-safe, and safe to use from several processes.
+   *
+   */
+  class SharedCacheDirectory : public boost::noncopyable
+  {
+  private:
+    boost::filesystem::path  root_;
+    uint64_t                 maxSize_;
+    boost::mutex             mutex_;
+    uint64_t                 writtenSinceCleanup_;  // protected by mutex_
+    bool                     cleaning_;             // protected by mutex_
+    boost::thread            cleanupThread_;        // protected by mutex_
+    boost::mutex             cleanupMutex_;         // the file locks are held by the whole process
+    std::map<int, std::string>  bundleDirectories_;  // only set before the directory is used
+
+    std::string GetBundleDirectory(int bundle) const;
+
+    static void CleanupThread(SharedCacheDirectory* that);
+
+    static std::string Hash(const std::string& value);
+
+    // relative to the root
+    std::string GetGroupDirectory(int bundle,
+                                  const std::string& item) const;
+
+    std::string GetName(int bundle,
+                        const std::string& item) const;
+
+    boost::filesystem::path GetPath(const std::string& name) const;
+
+    static bool ReadHeader(std::string& item,
+                           const boost::filesystem::path& path);
+
+  public:
+    // maxSize is in bytes, 0 means no limit
+    SharedCacheDirectory(const std::string& root,
+                         uint64_t maxSize);
+
+    ~SharedCacheDirectory();
+
+    static bool IsSharedName(const std::string& name);
+
+    // Version of the format of the files of a bundle (see
+    // CacheManager::SetBundleVersion()).  Must be called before the
+    // directory is used.
+    void SetBundleVersion(int bundle,
+                          const std::string& version);
+
+    // Writes the file of an item, returns its name (to be stored in the
+    // index of the CacheManager).  Starts a Cleanup() in the background
+    // once enough data has been written.
+    std::string Write(int bundle,
+                      const std::string& item,
+                      const std::string& content);
+
+    // Looks for a file written by any node, "size" being the size of its
+    // content
+    bool Lookup(std::string& name,
+                uint64_t& size,
+                int bundle,
+                const std::string& item) const;
+
+    // Returns false if the file does not exist anymore or does not have the
+    // expected size
+    bool Read(std::string& content,
+              const std::string& name,
+              uint64_t size) const;
+
+    // Removes the files of the items starting with "itemPrefix" (whatever
+    // the node that wrote them).  The prefix must contain the full
+    // instance/series identifier (ie. "{id}" or "{id}/0/").
+    void Invalidate(int bundle,
+                    const std::string& itemPrefix);
+
+    // Removes the least recently used files if the directory is too large.
+    // Does nothing if another node is already doing it.
+    void Cleanup();
+  };
+}
@@ -28,61 +28,232 @@
 #include <json/reader.h>
 #include "Image/ImageController.h"
 #include <algorithm>
+#include <cmath>
 #include "Series/SeriesRepository.h"
 
-static const Json::Value::ArrayIndex PREFETCH_FORWARD = 10;
-static const Json::Value::ArrayIndex PREFETCH_BACKWARD = 3;
+// The read-ahead window is sized for the prefetchers to decode the slices
+// before the viewer reaches them.  A still viewer gets the slices that can be
+// decoded within IDLE_PREFETCH_TIME (at most PREFETCH_FORWARD), a scrolling
+// viewer gets in addition the slices it will reach while they are decoded.
+static const unsigned int PREFETCH_FORWARD = 10;
+static const unsigned int MAX_PREFETCH_WINDOW = 100;
+static const double IDLE_PREFETCH_TIME = 1.0;     // seconds
+static const double PREFETCH_LATENCY = 0.2;       // seconds before the prefetch jobs start
+static const double DEFAULT_JOB_DURATION = 0.1;   // seconds, until a prefetch job has run
+static const double MIN_SCROLLING_VELOCITY = 1.0; // slices per second
+
+// bound of the series of the opened studies waiting for their information
+static const size_t MAX_STUDY_SERIES = 1000;
 
 
 namespace OrthancPlugins
 {
+  SeriesLayoutIndex::LayoutPtr ViewerPrefetchPolicy::BuildLayout(const std::string& seriesId,
+                                                                  const std::string& seriesContent,
+                                                                  uint64_t version)
+  {
+    SeriesLayoutIndex::LayoutPtr layout = layouts_.Store(seriesId, seriesContent, version);
+    if (layout.get() != NULL)
+    {
+      return layout;
+    }
+
+    // series information cached by a former version, without the qualities
+    std::auto_ptr<Series> series = seriesRepository_->GetSeries(seriesId, false);
+    return layouts_.Store(seriesId, seriesContent, series->GetOrderedImageQualities(), version);
+  }
+
+
+  SeriesLayoutIndex::LayoutPtr ViewerPrefetchPolicy::GetLayout(CacheScheduler& cache,
+                                                                const std::string& seriesId)
+  {
+    SeriesLayoutIndex::LayoutPtr layout = layouts_.Find(seriesId);
+    if (layout.get() != NULL)
+    {
+      return layout;
+    }
+
+    // first access to this version of the series
+    uint64_t version = layouts_.GetVersion();
+
+    std::string seriesContent;
+    if (!cache.Access(seriesContent, CacheBundle_SeriesInformation, seriesId))
+    {
+      return SeriesLayoutIndex::LayoutPtr();
+    }
+
+    return BuildLayout(seriesId, seriesContent, version);
+  }
+
+
+  void ViewerPrefetchPolicy::ComputeWindow(unsigned int& ahead,
+                                           unsigned int& behind,
+                                           CacheScheduler& cache,
+                                           double velocity)
+  {
+    // the prefetch jobs decode all the qualities of a slice
+    double jobDuration;
+    size_t threadsCount;
+    if (!cache.GetPrefetchJobDuration(jobDuration, threadsCount, CacheBundle_DecodedImage))
+    {
+      jobDuration = DEFAULT_JOB_DURATION;
+    }
+
+    double throughput = std::max(static_cast<size_t>(1), threadsCount) / jobDuration;  // slices per second
 
-  void ViewerPrefetchPolicy::PrefetchSeries(std::list<CacheIndex>& toPrefetch,
-                                            const std::string& seriesContent,
+    unsigned int still = static_cast<unsigned int>(throughput * IDLE_PREFETCH_TIME);
+    still = std::max(1u, std::min(PREFETCH_FORWARD, still));
+    behind = std::max(1u, still / 3);
+
+    double speed = std::abs(velocity);
+    if (speed < MIN_SCROLLING_VELOCITY)
+    {
+      ahead = still;
+    }
+    else if (speed >= throughput)
+    {
+      // the prefetchers can't keep up with the viewer: read ahead as far as
+      // possible, the closest slices are still decoded first
+      ahead = MAX_PREFETCH_WINDOW;
+    }
+    else
+    {
+      // "ahead" slices are decoded in ahead / throughput seconds, while the
+      // viewer moves by speed * (PREFETCH_LATENCY + ahead / throughput) slices
+      double window = std::ceil((still + speed * PREFETCH_LATENCY) / (1 - speed / throughput));
+      ahead = static_cast<unsigned int>(std::min(window, static_cast<double>(MAX_PREFETCH_WINDOW)));
+    }
+  }
+
+
+  void ViewerPrefetchPolicy::PrefetchSeries(std::list<PrefetchRequest>& toPrefetch,
+                                            const SeriesLayoutIndex::Layout& layout,
                                             unsigned int startIndex,
                                             unsigned int endIndex)
   {
-    Json::Value json;
-    Json::Reader reader;
-    if (!reader.parse(seriesContent, json) ||
-        !json.isMember("Slices"))
+    // preload the frames of the series in all available qualities
+    // (all the qualities of a frame are computed by a single prefetch job)
+    const std::vector<std::string>& slices = layout.GetSlices();
+
+    for (size_t i = startIndex;
+         i < std::min(slices.size(), static_cast<size_t>(endIndex));
+         i++)
     {
-      return;
+      unsigned int rank = 0;
+      BOOST_FOREACH(ImageQuality quality, layout.GetQualities()) {
+        toPrefetch.push_back(PrefetchRequest(CacheIndex(CacheBundle_DecodedImage, slices[i] + "/" + quality.toProcessingPolicytString()),
+                                             PrefetchPriority(layout.GetSeriesId(), static_cast<unsigned int>(i), rank++)));
+      }
     }
+  }
 
-    const Json::Value& slices = json["Slices"];
-    if (slices.type() != Json::arrayValue)
+
+  void ViewerPrefetchPolicy::PrefetchStudySeries(std::list<PrefetchRequest>& toPrefetch,
+                                                 const SeriesLayoutIndex::Layout& layout,
+                                                 unsigned int displayOrder)
+  {
+    // the first and middle frames at the lowest quality, after the
+    // prefetching of the viewed series (see PrefetchPriority)
+    const std::vector<std::string>& slices = layout.GetSlices();
+    if (slices.empty() ||
+        layout.GetQualities().empty())
     {
       return;
     }
 
-    // preload the first frames of the series in all available qualities
-    std::auto_ptr<Series> series = seriesRepository_->GetSeries(json["ID"].asString(), false);
+    std::string quality = ImageQuality(layout.GetQualities().front()).toProcessingPolicytString();
+    toPrefetch.push_back(PrefetchRequest(CacheIndex(CacheBundle_DecodedImage, slices.front() + "/" + quality),
+                                         PrefetchPriority(std::string(), displayOrder, 0)));
 
-    BOOST_FOREACH(ImageQuality quality, series->GetOrderedImageQualities()) {
+    if (slices.size() > 1)
+    {
+      toPrefetch.push_back(PrefetchRequest(CacheIndex(CacheBundle_DecodedImage, slices[slices.size() / 2] + "/" + quality),
+                                           PrefetchPriority(std::string(), displayOrder, 0)));
+    }
+  }
 
-      for (Json::Value::ArrayIndex i = std::max(0u, startIndex);
-           i < std::min(slices.size(), endIndex);
-           i++)
+
+  void ViewerPrefetchPolicy::ApplySeries(std::list<PrefetchRequest>& toPrefetch,
+                                         CacheScheduler& cache,
+                                         const std::string& series,
+                                         const std::string& content,
+                                         const PrefetchAccess& access)
+  {
+    // a new version of the series information has been computed: the
+    // layout is not indexed if the series has been invalidated since the
+    // content was read (see GetContentVersion())
+    SeriesLayoutIndex::LayoutPtr layout = BuildLayout(series, content, access.contentVersion);
+    if (layout.get() == NULL)
+    {
+      return;
+    }
+
+    if (access.prefetched)
+    {
+      // the series of an opened study (see ApplyStudy())
+      std::map<std::string, unsigned int>::iterator found = studySeries_.find(series);
+      if (found != studySeries_.end())
       {
-        toPrefetch.push_back(CacheIndex(CacheBundle_DecodedImage, slices[i].asString() + "/" + quality.toProcessingPolicytString()));
+        PrefetchStudySeries(toPrefetch, *layout, found->second);
+        studySeries_.erase(found);
       }
     }
+    else
+    {
+      unsigned int ahead, behind;
+      ComputeWindow(ahead, behind, cache, 0);
+      PrefetchSeries(toPrefetch, *layout, 0, ahead);
+    }
   }
 
 
-  void ViewerPrefetchPolicy::ApplySeries(std::list<CacheIndex>& toPrefetch,
-                                         CacheScheduler& cache,
-                                         const std::string& series,
-                                         const std::string& content)
+  void ViewerPrefetchPolicy::ApplyStudy(std::list<PrefetchRequest>& toPrefetch,
+                                        CacheScheduler& cache,
+                                        const std::string& study,
+                                        const std::vector<std::string>& series)
   {
-    PrefetchSeries(toPrefetch, content, 0, PREFETCH_FORWARD);
+    // the information of all the series of the study is computed in the
+    // background, so that switching to a series does not wait for it
+    for (size_t i = 0; i < series.size(); i++)
+    {
+      unsigned int displayOrder = static_cast<unsigned int>(i);
+
+      SeriesLayoutIndex::LayoutPtr layout = layouts_.Find(series[i]);
+      if (layout.get() == NULL)
+      {
+        uint64_t version = layouts_.GetVersion();
+        std::string seriesContent;
+        if (cache.Lookup(seriesContent, CacheBundle_SeriesInformation, series[i]))
+        {
+          layout = BuildLayout(series[i], seriesContent, version);
+        }
+      }
+
+      if (layout.get() != NULL)
+      {
+        PrefetchStudySeries(toPrefetch, *layout, displayOrder);
+      }
+      else
+      {
+        // the frames are prefetched once the series information has been
+        // computed (see ApplySeries())
+        if (studySeries_.size() >= MAX_STUDY_SERIES)
+        {
+          studySeries_.erase(studySeries_.begin());
+        }
+
+        studySeries_[series[i]] = displayOrder;
+        toPrefetch.push_back(PrefetchRequest(CacheIndex(CacheBundle_SeriesInformation, series[i]),
+                                             PrefetchPriority(std::string(), displayOrder, 0)));
+      }
+    }
   }
 
 
-  void ViewerPrefetchPolicy::ApplyInstance(std::list<CacheIndex>& toPrefetch,
+  void ViewerPrefetchPolicy::ApplyInstance(std::list<PrefetchRequest>& toPrefetch,
                                            CacheScheduler& cache,
-                                           const std::string& path)
+                                           const std::string& path,
+                                           const PrefetchAccess& access)
   {
     std::string instanceId;
     uint32_t frameIndex;
@@ -91,56 +262,73 @@ namespace OrthancPlugins
     ImageControllerUrlParser::parseUrlPostfix(path, instanceId, frameIndex, processingPolicy);
     std::string slice = instanceId + "/" + boost::lexical_cast<std::string>(frameIndex);
 
-    // get the instance information
-    Json::Value instanceJson;
-    if (!GetJsonFromOrthanc(instanceJson, context_, "/instances/" + instanceId) ||
-        !instanceJson.isMember("ParentSeries"))
+    // get the parent series of the instance (only from Orthanc if its series has not been indexed yet)
+    std::string seriesId;
+    if (!layouts_.LookupSeries(seriesId, instanceId))
     {
-      return;
-    }
-
-    // request the prefetch of all higher qualities in their order of quality
-    std::auto_ptr<Series> series = seriesRepository_->GetSeries(instanceJson["ParentSeries"].asString(), false);
-    // if the current quality is low, start to prefetch the higher quality:
-    std::string currentQuality = processingPolicy->ToString();
+      Json::Value instanceJson;
+      if (!GetJsonFromOrthanc(instanceJson, context_, "/instances/" + instanceId) ||
+          !instanceJson.isMember("ParentSeries"))
+      {
+        return;
+      }
 
-    BOOST_FOREACH(ImageQuality quality, series->GetOrderedImageQualities(ImageQuality::fromProcessingPolicytString(currentQuality))) {
-      toPrefetch.push_back(CacheIndex(CacheBundle_DecodedImage, slice + "/" + quality.toProcessingPolicytString()));
+      seriesId = instanceJson["ParentSeries"].asString();
     }
 
+    // find the index of this frame in the series
+    SeriesLayoutIndex::LayoutPtr layout = GetLayout(cache, seriesId);
+    unsigned int position = 0;
+    bool isInSeries = (layout.get() != NULL &&
+                       layout->LookupPosition(position, slice));
 
-    // get the series information
-    std::string seriesContent;
-    if (!cache.Access(seriesContent, CacheBundle_SeriesInformation, instanceJson["ParentSeries"].asString()))
+    if (isInSeries)
     {
-      return;
+      // the prefetch jobs of this series are now ordered by their distance to this slice
+      cache.SetViewerPosition(seriesId, position);
     }
 
-    // find the index of this frame in the series
-    Json::Value json;
-    Json::Reader reader;
-    if (!reader.parse(seriesContent, json) ||
-        !json.isMember("Slices"))
+    // request the prefetch of all higher qualities in their order of quality
+    // if the current quality is low, start to prefetch the higher quality:
+    ImageQuality currentQuality(ImageQuality::fromProcessingPolicytString(processingPolicy->ToString()));
+    std::vector<ImageQuality::EImageQuality> qualities;
+    if (layout.get() != NULL)
     {
-      return;
+      BOOST_FOREACH(ImageQuality quality, layout->GetQualities()) {
+        if (quality > currentQuality) {
+          qualities.push_back(quality.toInt());
+        }
+      }
     }
-
-    const Json::Value& slices = json["Slices"];
-    if (slices.type() != Json::arrayValue)
-      return;
-
-    Json::Value::ArrayIndex position = 0;
-    while (position < slices.size())
+    else
     {
-      if (slices[position] == slice)
-        break;
+      std::auto_ptr<Series> series = seriesRepository_->GetSeries(seriesId, false);
+      qualities = series->GetOrderedImageQualities(currentQuality.toInt());
+    }
 
-      position++;
+    unsigned int rank = 0;
+    BOOST_FOREACH(ImageQuality quality, qualities) {
+      toPrefetch.push_back(PrefetchRequest(CacheIndex(CacheBundle_DecodedImage, slice + "/" + quality.toProcessingPolicytString()),
+                                           PrefetchPriority(seriesId, position, rank++)));
     }
 
+    if (isInSeries)
+    {
+      // the window is larger in the scrolling direction of this viewer
+      double velocity = scrolling_.Update(seriesId, access.client, position, access.time);
 
+      unsigned int ahead, behind;
+      ComputeWindow(ahead, behind, cache, velocity);
 
-    PrefetchSeries(toPrefetch, seriesContent, position - PREFETCH_BACKWARD, position + PREFETCH_FORWARD);
+      if (velocity < 0)
+      {
+        PrefetchSeries(toPrefetch, *layout, position >= ahead ? position + 1 - ahead : 0, position + behind + 1);
+      }
+      else
+      {
+        PrefetchSeries(toPrefetch, *layout, position > behind ? position - behind : 0, position + ahead);
+      }
+    }
 
     //    Json::Value series;
     //    Json::Reader reader;
@@ -191,19 +379,51 @@ namespace OrthancPlugins
   }
 
 
-  void ViewerPrefetchPolicy::Apply(std::list<CacheIndex>& toPrefetch,
+  void ViewerPrefetchPolicy::Invalidate(int bundle,
+                                        const std::string& itemPrefix)
+  {
+    if (bundle == CacheBundle_SeriesInformation)
+    {
+      layouts_.Invalidate(itemPrefix);
+    }
+  }
+
+
+  bool ViewerPrefetchPolicy::IsContentNeeded(int bundle) const
+  {
+    // the images are not needed, only their path
+    return bundle == CacheBundle_SeriesInformation;
+  }
+
+
+  bool ViewerPrefetchPolicy::IsPrefetchNotified(int bundle) const
+  {
+    // the series information prefetched when a study is opened
+    return bundle == CacheBundle_SeriesInformation;
+  }
+
+
+  uint64_t ViewerPrefetchPolicy::GetContentVersion(int bundle)
+  {
+    // the version of the layouts when the series information is read
+    return (bundle == CacheBundle_SeriesInformation ? layouts_.GetVersion() : 0);
+  }
+
+
+  void ViewerPrefetchPolicy::Apply(std::list<PrefetchRequest>& toPrefetch,
                                    CacheScheduler& cache,
                                    const CacheIndex& accessed,
-                                   const std::string& content)
+                                   const std::string& content,
+                                   const PrefetchAccess& access)
   {
     switch (accessed.GetBundle())
     {
     case CacheBundle_SeriesInformation:
-      ApplySeries(toPrefetch, cache, accessed.GetItem(), content);
+      ApplySeries(toPrefetch, cache, accessed.GetItem(), content, access);
       return;
 
     case CacheBundle_DecodedImage:
-      ApplyInstance(toPrefetch, cache, accessed.GetItem());
+      ApplyInstance(toPrefetch, cache, accessed.GetItem(), access);
       return;
 
     default:
@@ -22,7 +22,10 @@
 #pragma once
 
 #include "IPrefetchPolicy.h"
+#include "SeriesLayoutIndex.h"
+#include "ScrollTracker.h"
 
+#include <map>
 #include <orthanc/OrthancCPlugin.h>
 class SeriesRepository;
 
@@ -33,29 +36,71 @@ namespace OrthancPlugins
   private:
     OrthancPluginContext* context_;
     SeriesRepository* seriesRepository_;
+    SeriesLayoutIndex layouts_;
+    ScrollTracker scrolling_;  // only used by Apply()
 
-    void ApplySeries(std::list<CacheIndex>& toPrefetch,
+    // series of the opened studies whose information is being prefetched,
+    // with their display order (only used by Apply() and ApplyStudy())
+    std::map<std::string, unsigned int> studySeries_;
+
+    SeriesLayoutIndex::LayoutPtr BuildLayout(const std::string& seriesId,
+                                             const std::string& seriesContent,
+                                             uint64_t version);
+
+    SeriesLayoutIndex::LayoutPtr GetLayout(CacheScheduler& cache,
+                                           const std::string& seriesId);
+
+    void ApplySeries(std::list<PrefetchRequest>& toPrefetch,
                      CacheScheduler& cache,
                      const std::string& series,
-                     const std::string& content);
+                     const std::string& content,
+                     const PrefetchAccess& access);
 
-    void ApplyInstance(std::list<CacheIndex>& toPrefetch,
+    void ApplyInstance(std::list<PrefetchRequest>& toPrefetch,
                        CacheScheduler& cache,
-                       const std::string& path);
+                       const std::string& path,
+                       const PrefetchAccess& access);
 
-    void PrefetchSeries(std::list<CacheIndex>& toPrefetch,
-                        const std::string& seriesContent,
+    // Number of slices to prefetch ahead of the viewed slice (in the
+    // scrolling direction) and behind it, given the scrolling velocity (in
+    // slices per second) and the decoding time of the slices
+    void ComputeWindow(unsigned int& ahead,
+                       unsigned int& behind,
+                       CacheScheduler& cache,
+                       double velocity);
+
+    void PrefetchSeries(std::list<PrefetchRequest>& toPrefetch,
+                        const SeriesLayoutIndex::Layout& layout,
                         unsigned int startIndex,
                         unsigned int endIndex);
 
+    void PrefetchStudySeries(std::list<PrefetchRequest>& toPrefetch,
+                             const SeriesLayoutIndex::Layout& layout,
+                             unsigned int displayOrder);
+
   public:
     ViewerPrefetchPolicy(OrthancPluginContext* context, SeriesRepository* seriesRepository) : context_(context), seriesRepository_(seriesRepository)
     {
     }
 
-    virtual void Apply(std::list<CacheIndex>& toPrefetch,
+    virtual void Invalidate(int bundle,
+                            const std::string& itemPrefix);
+
+    virtual bool IsContentNeeded(int bundle) const;
+
+    virtual bool IsPrefetchNotified(int bundle) const;
+
+    virtual uint64_t GetContentVersion(int bundle);
+
+    virtual void Apply(std::list<PrefetchRequest>& toPrefetch,
                        CacheScheduler& cache,
                        const CacheIndex& accessed,
-                       const std::string& content);
+                       const std::string& content,
+                       const PrefetchAccess& access);
+
+    virtual void ApplyStudy(std::list<PrefetchRequest>& toPrefetch,
+                            CacheScheduler& cache,
+                            const std::string& study,
+                            const std::vector<std::string>& series);
   };
 }
@@ -12,14 +12,20 @@
 #include "../Annotation/AnnotationRepository.h"
 #include "../BenchmarkHelper.h" // for BENCH(*)
 #include "../OrthancContextManager.h"
+#include "../ShortTermCache/CacheContext.h"
 #include "ViewerToolbox.h"
 
 AnnotationRepository* StudyController::annotationRepository_ = NULL;
+CacheContext* StudyController::cacheContext_ = NULL;
 
 template<>
 void StudyController::Inject<AnnotationRepository>(AnnotationRepository* obj) {
   StudyController::annotationRepository_ = obj;
 }
+template<>
+void StudyController::Inject<CacheContext>(CacheContext* obj) {
+  StudyController::cacheContext_ = obj;
+}
 
 StudyController::StudyController(OrthancPluginRestOutput* response, const std::string& url, const OrthancPluginHttpRequest* request)
   : BaseController(response, url, request)
@@ -197,6 +203,11 @@ int StudyController::ProcessStudyInfoRequest(OrthancPluginContext* context)
     studyInfo["Series"].append(seriesDisplayOrder[i]);
   }
 
+  // the study is being opened: prepare its series in the background
+  if (cacheContext_ != NULL) {
+    cacheContext_->GetScheduler().NotifyStudyOpened(this->studyId_, seriesDisplayOrder, this->_GetClientKey());
+  }
+
   return this->_AnswerBuffer(studyInfo);
 
 }
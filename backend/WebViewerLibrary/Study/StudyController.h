@@ -6,6 +6,7 @@
 #include "../BaseController.h"
 
 class AnnotationRepository;
+class CacheContext;
 
 // .../studies/<study_id>/annotations
 
@@ -22,6 +23,7 @@ protected:
 
 private:
   static AnnotationRepository* annotationRepository_;
+  static CacheContext* cacheContext_;  // NULL if the short term cache is disabled
 
   std::string studyId_;
   bool isAnnotationRequest_;
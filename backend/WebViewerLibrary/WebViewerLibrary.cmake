@@ -51,6 +51,7 @@ include(${ORTHANC_FRAMEWORK_ROOT}/../Resources/CMake/OrthancFrameworkParameters.
 set(ENABLE_LOCALE ON)
 set(ENABLE_GOOGLE_TEST ON)
 set(ENABLE_SQLITE ON)
+set(ENABLE_JPEG ON)  # libjpeg, for the reduced resolution decoding of the JPEG frames (ScaledJpegDecoder)
 
 include(${ORTHANC_FRAMEWORK_ROOT}/../Resources/CMake/OrthancFrameworkConfiguration.cmake)
 include_directories(
@@ -81,15 +82,26 @@ add_library(WebViewerLibrary
   ${VIEWER_LIBRARY_DIR}/ShortTermCache/CacheIndex.h
   ${VIEWER_LIBRARY_DIR}/ShortTermCache/ICacheFactory.h
   ${VIEWER_LIBRARY_DIR}/ShortTermCache/IPrefetchPolicy.h
+  ${VIEWER_LIBRARY_DIR}/ShortTermCache/PrefetchRequest.h
   ${VIEWER_LIBRARY_DIR}/ShortTermCache/CacheIndex.h
+  ${VIEWER_LIBRARY_DIR}/ShortTermCache/BackgroundGovernor.cpp
   ${VIEWER_LIBRARY_DIR}/ShortTermCache/CacheManager.cpp
   ${VIEWER_LIBRARY_DIR}/ShortTermCache/CacheContext.cpp
   ${VIEWER_LIBRARY_DIR}/ShortTermCache/CacheScheduler.cpp
+  ${VIEWER_LIBRARY_DIR}/ShortTermCache/CacheStatisticsController.cpp
+  ${VIEWER_LIBRARY_DIR}/ShortTermCache/FrequencySketch.cpp
+  ${VIEWER_LIBRARY_DIR}/ShortTermCache/MemoryCache.cpp
+  ${VIEWER_LIBRARY_DIR}/ShortTermCache/NegativeCache.cpp
+  ${VIEWER_LIBRARY_DIR}/ShortTermCache/SharedCacheDirectory.cpp
+  ${VIEWER_LIBRARY_DIR}/ShortTermCache/PackStorage.cpp
+  ${VIEWER_LIBRARY_DIR}/ShortTermCache/SeriesLayoutIndex.cpp
+  ${VIEWER_LIBRARY_DIR}/ShortTermCache/ScrollTracker.cpp
   ${VIEWER_LIBRARY_DIR}/ShortTermCache/ViewerPrefetchPolicy.cpp
   ${VIEWER_LIBRARY_DIR}/Annotation/AnnotationRepository.cpp
   ${VIEWER_LIBRARY_DIR}/Study/StudyController.cpp
   ${VIEWER_LIBRARY_DIR}/Language/LanguageController.cpp
   ${VIEWER_LIBRARY_DIR}/Instance/DicomRepository.cpp
+  ${VIEWER_LIBRARY_DIR}/Instance/FrameOffsetIndex.cpp
   ${VIEWER_LIBRARY_DIR}/Instance/InstanceRepository.cpp
   ${VIEWER_LIBRARY_DIR}/Series/SeriesFactory.cpp
   ${VIEWER_LIBRARY_DIR}/Series/SeriesHelpers.cpp
@@ -98,6 +110,10 @@ add_library(WebViewerLibrary
   ${VIEWER_LIBRARY_DIR}/Series/SeriesController.cpp
   ${VIEWER_LIBRARY_DIR}/Image/AvailableQuality/OnTheFlyDownloadAvailableQualityPolicy.cpp
   ${VIEWER_LIBRARY_DIR}/Image/Utilities/KLVWriter.cpp
+  ${VIEWER_LIBRARY_DIR}/Image/Utilities/PixelKernels.cpp
+  ${VIEWER_LIBRARY_DIR}/Image/Utilities/PixelKernelsSSE2.cpp
+  ${VIEWER_LIBRARY_DIR}/Image/Utilities/PixelKernelsAVX2.cpp
+  ${VIEWER_LIBRARY_DIR}/Image/Utilities/ScaledJpegDecoder.cpp
   ${VIEWER_LIBRARY_DIR}/Image/ImageContainer/RawImageContainer.cpp
   ${VIEWER_LIBRARY_DIR}/Image/ImageContainer/CompressedImageContainer.cpp
   ${VIEWER_LIBRARY_DIR}/Image/ImageContainer/CornerstoneKLVContainer.cpp
@@ -116,6 +132,7 @@ add_library(WebViewerLibrary
   ${VIEWER_LIBRARY_DIR}/Image/ImageMetaData.cpp
   ${VIEWER_LIBRARY_DIR}/Image/ImageRepository.cpp
   ${VIEWER_LIBRARY_DIR}/Image/ImageController.cpp
+  ${VIEWER_LIBRARY_DIR}/Image/ImageBatchController.cpp
   ${VIEWER_LIBRARY_DIR}/Config/WebViewerConfiguration.cpp
   ${VIEWER_LIBRARY_DIR}/Config/ConfigController.cpp
 
@@ -132,6 +149,32 @@ if (CMAKE_BUILD_TYPE STREQUAL "Debug")
   target_compile_definitions(WebViewerLibrary PUBLIC -DPLUGIN_ENABLE_DEBUG_ROUTE=1)
 endif()
 
+# Build the SIMD pixel kernels with the related instruction sets enabled. Only
+# these files are concerned: their kernels are selected at runtime (CPUID), so
+# the plugin still runs on CPUs without AVX2. When the compiler does not
+# support the flag (ie. non-x86 platforms), the kernels are not built and the
+# scalar implementation is used.
+include(CheckCXXCompilerFlag)
+if (MSVC)
+  # SSE2 is enabled by default on x64 and since VS2012 on x86
+  CHECK_CXX_COMPILER_FLAG("/arch:AVX2" COMPILER_SUPPORTS_AVX2)
+  if (COMPILER_SUPPORTS_AVX2)
+    set_source_files_properties(${VIEWER_LIBRARY_DIR}/Image/Utilities/PixelKernelsAVX2.cpp
+      PROPERTIES COMPILE_FLAGS "/arch:AVX2")
+  endif()
+else()
+  CHECK_CXX_COMPILER_FLAG("-msse2" COMPILER_SUPPORTS_SSE2)
+  CHECK_CXX_COMPILER_FLAG("-mavx2" COMPILER_SUPPORTS_AVX2)
+  if (COMPILER_SUPPORTS_SSE2)
+    set_source_files_properties(${VIEWER_LIBRARY_DIR}/Image/Utilities/PixelKernelsSSE2.cpp
+      PROPERTIES COMPILE_FLAGS "-msse2")
+  endif()
+  if (COMPILER_SUPPORTS_AVX2)
+    set_source_files_properties(${VIEWER_LIBRARY_DIR}/Image/Utilities/PixelKernelsAVX2.cpp
+      PROPERTIES COMPILE_FLAGS "-mavx2")
+  endif()
+endif()
+
 target_compile_definitions(WebViewerLibrary PUBLIC -DORTHANC_SANDBOXED=0 -DORTHANC_DEFAULT_DICOM_ENCODING=Encoding_Latin1)
 
 target_compile_definitions(WebViewerLibrary PUBLIC -DCMAKE_OSX_DEPLOYMENT_TARGET=${CMAKE_OSX_DEPLOYMENT_TARGET} -DCMAKE_OSX_ARCHITECTURES=${CMAKE_OSX_ARCHITECTURES})
@@ -0,0 +1,407 @@
+#include <gtest/gtest.h>
+
+#include <sstream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <json/value.h>
+#include <OrthancException.h>
+#include <Instance/FrameOffsetIndex.h>
+
+namespace
+{
+  const char* const EXPLICIT_LITTLE_ENDIAN = "1.2.840.10008.1.2.1";
+  const char* const IMPLICIT_LITTLE_ENDIAN = "1.2.840.10008.1.2";
+  const char* const JPEG_BASELINE = "1.2.840.10008.1.2.4.50";
+
+  // Writes a little endian DICOM file, element by element (the File Meta
+  // Information is always in explicit VR)
+  class DicomWriter
+  {
+  private:
+    std::string  content_;
+    bool         explicitVR_;
+
+    void AddUInt16(uint16_t value)
+    {
+      content_.push_back(static_cast<char>(value & 0xff));
+      content_.push_back(static_cast<char>(value >> 8));
+    }
+
+    void AddUInt32(uint32_t value)
+    {
+      AddUInt16(static_cast<uint16_t>(value & 0xffff));
+      AddUInt16(static_cast<uint16_t>(value >> 16));
+    }
+
+    void AddHeader(uint16_t group,
+                   uint16_t element,
+                   const char* vr,
+                   uint32_t length,
+                   bool explicitVR)
+    {
+      AddUInt16(group);
+      AddUInt16(element);
+
+      if (!explicitVR)
+      {
+        AddUInt32(length);
+      }
+      else if (std::string(vr) == "OB" ||
+               std::string(vr) == "OW" ||
+               std::string(vr) == "SQ")
+      {
+        content_.append(vr, 2);
+        AddUInt16(0);
+        AddUInt32(length);
+      }
+      else
+      {
+        content_.append(vr, 2);
+        AddUInt16(static_cast<uint16_t>(length));
+      }
+    }
+
+    // items and delimiters (group 0xFFFE)
+    void AddItemHeader(uint16_t element,
+                       uint32_t length)
+    {
+      AddUInt16(0xFFFE);
+      AddUInt16(element);
+      AddUInt32(length);
+    }
+
+    void AddItem(uint16_t element,
+                 const std::string& value)
+    {
+      AddItemHeader(element, static_cast<uint32_t>(value.size()));
+      content_ += value;
+    }
+
+  public:
+    explicit DicomWriter(const std::string& transferSyntax) :
+      content_(128, '\0'),
+      explicitVR_(transferSyntax != IMPLICIT_LITTLE_ENDIAN)
+    {
+      content_ += "DICM";
+
+      std::string value = transferSyntax;
+      if (value.size() % 2 != 0)
+      {
+        value.push_back('\0');
+      }
+
+      AddHeader(0x0002, 0x0010, "UI", static_cast<uint32_t>(value.size()), true);
+      content_ += value;
+    }
+
+    void AddString(uint16_t group,
+                   uint16_t element,
+                   const char* vr,
+                   std::string value)
+    {
+      if (value.size() % 2 != 0)
+      {
+        value.push_back(' ');
+      }
+
+      AddHeader(group, element, vr, static_cast<uint32_t>(value.size()), explicitVR_);
+      content_ += value;
+    }
+
+    void AddUnsignedShort(uint16_t group,
+                          uint16_t element,
+                          uint16_t value)
+    {
+      AddHeader(group, element, "US", 2, explicitVR_);
+      AddUInt16(value);
+    }
+
+    // A sequence of undefined length, with an item of undefined length
+    void AddSequence(uint16_t group,
+                     uint16_t element)
+    {
+      AddHeader(group, element, "SQ", 0xFFFFFFFF, explicitVR_);
+      AddItemHeader(0xE000, 0xFFFFFFFF);
+      AddString(0x0008, 0x1155, "UI", "1.2.3.4");
+      AddItemHeader(0xE00D, 0);
+      AddItemHeader(0xE0DD, 0);
+    }
+
+    void AddNativePixelData(const std::string& pixels)
+    {
+      AddHeader(0x7FE0, 0x0010, "OB", static_cast<uint32_t>(pixels.size()), explicitVR_);
+      content_ += pixels;
+    }
+
+    void AddEncapsulatedPixelData(const std::vector<uint32_t>& offsetTable,
+                                  const std::vector<std::string>& fragments)
+    {
+      AddHeader(0x7FE0, 0x0010, "OB", 0xFFFFFFFF, explicitVR_);
+
+      std::string table;
+      for (size_t i = 0; i < offsetTable.size(); i++)
+      {
+        for (unsigned int shift = 0; shift < 32; shift += 8)
+        {
+          table.push_back(static_cast<char>((offsetTable[i] >> shift) & 0xff));
+        }
+      }
+
+      AddItem(0xE000, table);
+      for (size_t i = 0; i < fragments.size(); i++)
+      {
+        AddItem(0xE000, fragments[i]);
+      }
+
+      AddItemHeader(0xE0DD, 0);
+    }
+
+    const std::string& GetContent() const
+    {
+      return content_;
+    }
+  };
+
+  std::string GetPixels(size_t size)
+  {
+    std::string pixels(size, '\0');
+    for (size_t i = 0; i < size; i++)
+    {
+      pixels[i] = static_cast<char>(i % 251);
+    }
+    return pixels;
+  }
+
+  // 3 frames of 2x3 pixels
+  std::string CreateNativeFile(const std::string& transferSyntax,
+                               uint16_t bitsAllocated)
+  {
+    DicomWriter writer(transferSyntax);
+    writer.AddSequence(0x0008, 0x1140);
+    writer.AddUnsignedShort(0x0028, 0x0002, 1);
+    writer.AddString(0x0028, 0x0008, "IS", "3");
+    writer.AddUnsignedShort(0x0028, 0x0010, 2);
+    writer.AddUnsignedShort(0x0028, 0x0011, 3);
+    writer.AddUnsignedShort(0x0028, 0x0100, bitsAllocated);
+    writer.AddNativePixelData(GetPixels(3 * 2 * 3 * (bitsAllocated / 8)));
+    return writer.GetContent();
+  }
+
+  std::string CreateEncapsulatedFile(const std::string& framesCount,
+                                     const std::vector<uint32_t>& offsetTable,
+                                     const std::vector<std::string>& fragments)
+  {
+    DicomWriter writer(JPEG_BASELINE);
+    writer.AddString(0x0028, 0x0008, "IS", framesCount);
+    writer.AddEncapsulatedPixelData(offsetTable, fragments);
+    return writer.GetContent();
+  }
+
+  // 2 frames: the first one in 2 fragments, the second one in a single one
+  std::string CreateEncapsulatedFileWithOffsetTable()
+  {
+    std::vector<std::string> fragments;
+    fragments.push_back("frame 0, fragment 0");  // odd sizes are padded
+    fragments.push_back("frame 0, fragment 1.");
+    fragments.push_back("frame 1");
+    for (size_t i = 0; i < fragments.size(); i++)
+    {
+      if (fragments[i].size() % 2 != 0)
+      {
+        fragments[i].push_back('\0');
+      }
+    }
+
+    std::vector<uint32_t> offsetTable;
+    offsetTable.push_back(0);
+    offsetTable.push_back(static_cast<uint32_t>(8 + fragments[0].size() + 8 + fragments[1].size()));
+
+    return CreateEncapsulatedFile("2", offsetTable, fragments);
+  }
+
+  std::string ExtractFrame(const FrameOffsetIndex& index,
+                           const std::string& file,
+                           unsigned int frameIndex)
+  {
+    std::string frame;
+    index.ExtractFrame(frame, file.c_str(), file.size(), frameIndex);
+    return frame;
+  }
+
+  Orthanc::ErrorCode GetExtractionError(const FrameOffsetIndex& index,
+                                        const std::string& file,
+                                        unsigned int frameIndex)
+  {
+    try
+    {
+      ExtractFrame(index, file, frameIndex);
+      return Orthanc::ErrorCode_Success;
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      return e.GetErrorCode();
+    }
+  }
+}
+
+
+TEST(FrameOffsetIndex, NativePixelData)
+{
+  const std::string file = CreateNativeFile(EXPLICIT_LITTLE_ENDIAN, 8);
+  const std::string pixels = GetPixels(18);
+
+  // the sequence before the PixelData is skipped
+  FrameOffsetIndex index;
+  ASSERT_TRUE(index.Build(file.c_str(), file.size()));
+  ASSERT_EQ(EXPLICIT_LITTLE_ENDIAN, index.GetTransferSyntax());
+  ASSERT_EQ(file.size(), index.GetFileSize());
+  ASSERT_EQ(file.size() - pixels.size(), index.GetPixelDataOffset());
+  ASSERT_EQ(3u, index.GetFramesCount());
+
+  for (unsigned int i = 0; i < 3; i++)
+  {
+    ASSERT_EQ(pixels.substr(6 * i, 6), ExtractFrame(index, file, i));
+  }
+
+  ASSERT_EQ(Orthanc::ErrorCode_ParameterOutOfRange, GetExtractionError(index, file, 3));
+
+  // another file than the indexed one
+  ASSERT_EQ(Orthanc::ErrorCode_CorruptedFile, GetExtractionError(index, file + "  ", 0));
+}
+
+
+TEST(FrameOffsetIndex, ImplicitVR)
+{
+  const std::string file = CreateNativeFile(IMPLICIT_LITTLE_ENDIAN, 16);
+  const std::string pixels = GetPixels(36);
+
+  FrameOffsetIndex index;
+  ASSERT_TRUE(index.Build(file.c_str(), file.size()));
+  ASSERT_EQ(IMPLICIT_LITTLE_ENDIAN, index.GetTransferSyntax());
+  ASSERT_EQ(3u, index.GetFramesCount());
+  ASSERT_EQ(pixels.substr(24, 12), ExtractFrame(index, file, 2));
+}
+
+
+TEST(FrameOffsetIndex, EncapsulatedWithOffsetTable)
+{
+  const std::string file = CreateEncapsulatedFileWithOffsetTable();
+
+  FrameOffsetIndex index;
+  ASSERT_TRUE(index.Build(file.c_str(), file.size()));
+  ASSERT_EQ(JPEG_BASELINE, index.GetTransferSyntax());
+  ASSERT_EQ(2u, index.GetFramesCount());
+
+  // the fragments of a frame are concatenated
+  ASSERT_EQ(std::string("frame 0, fragment 0") + '\0' + "frame 0, fragment 1.", ExtractFrame(index, file, 0));
+  ASSERT_EQ(std::string("frame 1") + '\0', ExtractFrame(index, file, 1));
+  ASSERT_EQ(Orthanc::ErrorCode_ParameterOutOfRange, GetExtractionError(index, file, 2));
+
+  // an offset table that does not match the fragments
+  std::vector<std::string> fragments(2, "fragment");
+  std::vector<uint32_t> offsetTable;
+  offsetTable.push_back(0);
+  offsetTable.push_back(10);
+
+  const std::string invalid = CreateEncapsulatedFile("2", offsetTable, fragments);
+  ASSERT_FALSE(index.Build(invalid.c_str(), invalid.size()));
+}
+
+
+TEST(FrameOffsetIndex, EncapsulatedWithoutOffsetTable)
+{
+  std::vector<std::string> fragments;
+  fragments.push_back("first ");
+  fragments.push_back("second");
+  fragments.push_back("third ");
+
+  FrameOffsetIndex index;
+
+  // a fragment per frame
+  std::string file = CreateEncapsulatedFile("3", std::vector<uint32_t>(), fragments);
+  ASSERT_TRUE(index.Build(file.c_str(), file.size()));
+  ASSERT_EQ(3u, index.GetFramesCount());
+  ASSERT_EQ("second", ExtractFrame(index, file, 1));
+
+  // all the fragments of a single frame instance
+  file = CreateEncapsulatedFile("1", std::vector<uint32_t>(), fragments);
+  ASSERT_TRUE(index.Build(file.c_str(), file.size()));
+  ASSERT_EQ(1u, index.GetFramesCount());
+  ASSERT_EQ("first secondthird ", ExtractFrame(index, file, 0));
+
+  // the frames of several fragments cannot be told apart
+  file = CreateEncapsulatedFile("2", std::vector<uint32_t>(), fragments);
+  ASSERT_FALSE(index.Build(file.c_str(), file.size()));
+  ASSERT_EQ(0u, index.GetFramesCount());
+}
+
+
+TEST(FrameOffsetIndex, TruncatedFile)
+{
+  const std::string native = CreateNativeFile(EXPLICIT_LITTLE_ENDIAN, 8);
+  const std::string encapsulated = CreateEncapsulatedFileWithOffsetTable();
+
+  FrameOffsetIndex index;
+
+  // in the pixel data, in the header of an element, in the File Meta Information
+  const size_t sizes[] = { native.size() - 1, native.size() - 20, 140, 100 };
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+  {
+    ASSERT_FALSE(index.Build(native.c_str(), sizes[i]));
+    ASSERT_EQ(0u, index.GetFramesCount());
+  }
+
+  // before the Sequence Delimitation Item of the fragments
+  ASSERT_FALSE(index.Build(encapsulated.c_str(), encapsulated.size() - 8));
+  ASSERT_EQ(0u, index.GetFramesCount());
+
+  ASSERT_FALSE(index.Build(encapsulated.c_str(), encapsulated.size() - 12));
+  ASSERT_EQ(0u, index.GetFramesCount());
+}
+
+
+TEST(FrameOffsetIndex, Serialization)
+{
+  const std::string file = CreateEncapsulatedFileWithOffsetTable();
+
+  FrameOffsetIndex index;
+  ASSERT_TRUE(index.Build(file.c_str(), file.size()));
+
+  Json::Value serialized;
+  index.Serialize(serialized);
+
+  FrameOffsetIndex unserialized;
+  ASSERT_TRUE(unserialized.Unserialize(serialized));
+  ASSERT_EQ(index.GetTransferSyntax(), unserialized.GetTransferSyntax());
+  ASSERT_EQ(index.GetFileSize(), unserialized.GetFileSize());
+  ASSERT_EQ(index.GetPixelDataOffset(), unserialized.GetPixelDataOffset());
+  ASSERT_EQ(index.GetFramesCount(), unserialized.GetFramesCount());
+
+  for (unsigned int i = 0; i < index.GetFramesCount(); i++)
+  {
+    ASSERT_EQ(ExtractFrame(index, file, i), ExtractFrame(unserialized, file, i));
+
+    // same content with ranged reads
+    std::istringstream stream(file);
+    std::string frame;
+    ASSERT_TRUE(unserialized.ReadFrame(frame, stream, i));
+    ASSERT_EQ(ExtractFrame(index, file, i), frame);
+  }
+
+  // the index of another version, or an inconsistent one, is rejected
+  Json::Value invalid = serialized;
+  invalid["Version"] = 0;
+  ASSERT_FALSE(unserialized.Unserialize(invalid));
+
+  invalid = serialized;
+  invalid["Frames"][1] = 10;
+  ASSERT_FALSE(unserialized.Unserialize(invalid));
+
+  invalid = serialized;
+  invalid["Segments"].append(0);
+  ASSERT_FALSE(unserialized.Unserialize(invalid));
+
+  // the previous content is kept
+  ASSERT_EQ(2u, unserialized.GetFramesCount());
+}
@@ -0,0 +1,278 @@
+#include <gtest/gtest.h>
+
+#include <stdlib.h> // for rand
+#include <string.h> // for memcmp
+#include <iostream>
+#include <vector>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <Images/ImageBuffer.h>
+#include <Image/Utilities/PixelKernels.h>
+
+namespace
+{
+  // 20 Mpixels, the size of a large CR/DX image
+  const unsigned int WIDTH = 4000;
+  const unsigned int HEIGHT = 5000;
+
+  const PixelKernels::InstructionSet instructionSets[] =
+  {
+    PixelKernels::InstructionSet_Scalar,
+    PixelKernels::InstructionSet_SSE2,
+    PixelKernels::InstructionSet_AVX2
+  };
+  const size_t instructionSetsCount = sizeof(instructionSets) / sizeof(instructionSets[0]);
+
+  class PixelKernelsTest : public ::testing::Test
+  {
+  protected:
+    PixelKernels::InstructionSet initialInstructionSet_;
+
+    virtual void SetUp()
+    {
+      initialInstructionSet_ = PixelKernels::GetInstructionSet();
+      srand(42);
+    }
+
+    virtual void TearDown()
+    {
+      PixelKernels::SetInstructionSet(initialInstructionSet_);
+    }
+
+    static void FillRandom(Orthanc::ImageAccessor& image)
+    {
+      for (unsigned int y = 0; y < image.GetHeight(); y++)
+      {
+        uint8_t* row = reinterpret_cast<uint8_t*>(image.GetRow(y));
+        for (unsigned int x = 0; x < image.GetWidth() * image.GetBytesPerPixel(); x++)
+        {
+          row[x] = static_cast<uint8_t>(rand() & 0xff);
+        }
+      }
+    }
+
+    static bool IsSame(const Orthanc::ImageAccessor& a, const Orthanc::ImageAccessor& b)
+    {
+      for (unsigned int y = 0; y < a.GetHeight(); y++)
+      {
+        if (memcmp(a.GetConstRow(y), b.GetConstRow(y), a.GetWidth() * a.GetBytesPerPixel()) != 0)
+        {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    static void LogThroughput(const char* kernel,
+                              PixelKernels::InstructionSet instructionSet,
+                              const boost::posix_time::ptime& start)
+    {
+      double seconds = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds() / 1000000.0;
+      double pixelsPerSecond = (seconds > 0 ? static_cast<double>(WIDTH) * HEIGHT / seconds : 0);
+      std::cout << kernel << " [" << PixelKernels::ToString(instructionSet) << "]: "
+                << pixelsPerSecond / 1000000.0 << " Mpixels/s" << std::endl;
+    }
+  };
+}
+
+TEST_F(PixelKernelsTest, ChangeDynamics)
+{
+  Orthanc::PixelFormat formats[] = { Orthanc::PixelFormat_Grayscale16, Orthanc::PixelFormat_SignedGrayscale16 };
+
+  for (size_t f = 0; f < 2; f++)
+  {
+    Orthanc::ImageBuffer source(formats[f], WIDTH, HEIGHT, false);
+    Orthanc::ImageAccessor sourceAccessor;
+    source.GetWriteableAccessor(sourceAccessor);
+    FillRandom(sourceAccessor);
+
+    // window smaller than the pixel range so both clamps are exercised
+    const float scale = 255.0f / 30000.0f;
+    const float offset = -scale * (formats[f] == Orthanc::PixelFormat_Grayscale16 ? 20000.0f : -15000.0f);
+
+    Orthanc::ImageBuffer reference(Orthanc::PixelFormat_Grayscale8, WIDTH, HEIGHT, false);
+    Orthanc::ImageAccessor referenceAccessor;
+    reference.GetWriteableAccessor(referenceAccessor);
+
+    for (size_t i = 0; i < instructionSetsCount; i++)
+    {
+      if (!PixelKernels::IsSupported(instructionSets[i]))
+      {
+        continue;
+      }
+      PixelKernels::SetInstructionSet(instructionSets[i]);
+
+      Orthanc::ImageBuffer target(Orthanc::PixelFormat_Grayscale8, WIDTH, HEIGHT, false);
+      Orthanc::ImageAccessor targetAccessor;
+      target.GetWriteableAccessor(targetAccessor);
+
+      boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+      PixelKernels::ChangeDynamics(i == 0 ? referenceAccessor : targetAccessor, sourceAccessor, scale, offset);
+      LogThroughput(formats[f] == Orthanc::PixelFormat_Grayscale16 ? "ChangeDynamics<uint16>" : "ChangeDynamics<int16>", instructionSets[i], start);
+
+      if (i != 0)
+      {
+        ASSERT_TRUE(IsSame(referenceAccessor, targetAccessor));
+      }
+    }
+  }
+}
+
+TEST_F(PixelKernelsTest, ConvertRGB48ToRGB24)
+{
+  Orthanc::ImageBuffer source(Orthanc::PixelFormat_RGB48, WIDTH, HEIGHT, false);
+  Orthanc::ImageAccessor sourceAccessor;
+  source.GetWriteableAccessor(sourceAccessor);
+  FillRandom(sourceAccessor);
+
+  Orthanc::ImageBuffer reference(Orthanc::PixelFormat_RGB24, WIDTH, HEIGHT, false);
+  Orthanc::ImageAccessor referenceAccessor;
+  reference.GetWriteableAccessor(referenceAccessor);
+
+  for (size_t i = 0; i < instructionSetsCount; i++)
+  {
+    if (!PixelKernels::IsSupported(instructionSets[i]))
+    {
+      continue;
+    }
+    PixelKernels::SetInstructionSet(instructionSets[i]);
+
+    Orthanc::ImageBuffer target(Orthanc::PixelFormat_RGB24, WIDTH, HEIGHT, false);
+    Orthanc::ImageAccessor targetAccessor;
+    target.GetWriteableAccessor(targetAccessor);
+
+    boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+    PixelKernels::ConvertRGB48ToRGB24(i == 0 ? referenceAccessor : targetAccessor, sourceAccessor);
+    LogThroughput("ConvertRGB48ToRGB24", instructionSets[i], start);
+
+    if (i == 0)
+    {
+      const uint16_t* p = reinterpret_cast<const uint16_t*>(sourceAccessor.GetConstRow(HEIGHT - 1));
+      const uint8_t* q = reinterpret_cast<const uint8_t*>(referenceAccessor.GetConstRow(HEIGHT - 1));
+      ASSERT_EQ(p[3 * WIDTH - 1] >> 8, q[3 * WIDTH - 1]);
+    }
+    else
+    {
+      ASSERT_TRUE(IsSame(referenceAccessor, targetAccessor));
+    }
+  }
+}
+
+TEST_F(PixelKernelsTest, GetMinMaxIntegerValue)
+{
+  Orthanc::PixelFormat formats[] = { Orthanc::PixelFormat_Grayscale8, Orthanc::PixelFormat_Grayscale16, Orthanc::PixelFormat_SignedGrayscale16 };
+
+  for (size_t f = 0; f < 3; f++)
+  {
+    Orthanc::ImageBuffer image(formats[f], WIDTH, HEIGHT, false);
+    Orthanc::ImageAccessor accessor;
+    image.GetWriteableAccessor(accessor);
+    FillRandom(accessor);
+
+    int64_t referenceMin = 0, referenceMax = 0;
+
+    for (size_t i = 0; i < instructionSetsCount; i++)
+    {
+      if (!PixelKernels::IsSupported(instructionSets[i]))
+      {
+        continue;
+      }
+      PixelKernels::SetInstructionSet(instructionSets[i]);
+
+      int64_t minValue, maxValue;
+      boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+      PixelKernels::GetMinMaxIntegerValue(minValue, maxValue, accessor);
+      LogThroughput("GetMinMaxIntegerValue", instructionSets[i], start);
+
+      if (i == 0)
+      {
+        referenceMin = minValue;
+        referenceMax = maxValue;
+      }
+      else
+      {
+        ASSERT_EQ(referenceMin, minValue);
+        ASSERT_EQ(referenceMax, maxValue);
+      }
+    }
+  }
+
+  // an empty image has no min/max
+  Orthanc::ImageBuffer empty(Orthanc::PixelFormat_Grayscale16, 0, 0, false);
+  Orthanc::ImageAccessor emptyAccessor;
+  empty.GetWriteableAccessor(emptyAccessor);
+  int64_t minValue = 1, maxValue = 1;
+  PixelKernels::GetMinMaxIntegerValue(minValue, maxValue, emptyAccessor);
+  ASSERT_EQ(0, minValue);
+  ASSERT_EQ(0, maxValue);
+}
+
+TEST_F(PixelKernelsTest, Invert)
+{
+  Orthanc::ImageBuffer source(Orthanc::PixelFormat_Grayscale8, WIDTH, HEIGHT, false);
+  Orthanc::ImageAccessor sourceAccessor;
+  source.GetWriteableAccessor(sourceAccessor);
+  FillRandom(sourceAccessor);
+
+  std::vector<uint8_t> reference;
+
+  for (size_t i = 0; i < instructionSetsCount; i++)
+  {
+    if (!PixelKernels::IsSupported(instructionSets[i]))
+    {
+      continue;
+    }
+    PixelKernels::SetInstructionSet(instructionSets[i]);
+
+    // inverting twice gives the source image back
+    boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+    PixelKernels::Invert(sourceAccessor);
+    LogThroughput("Invert", instructionSets[i], start);
+
+    const uint8_t* row = reinterpret_cast<const uint8_t*>(sourceAccessor.GetConstRow(HEIGHT / 2));
+    if (i == 0)
+    {
+      reference.assign(row, row + WIDTH);
+    }
+    else
+    {
+      ASSERT_EQ(0, memcmp(&reference[0], row, WIDTH));
+    }
+    PixelKernels::Invert(sourceAccessor);
+  }
+}
+
+TEST_F(PixelKernelsTest, UnalignedRegion)
+{
+  // the kernels must handle any pitch & row length (including the row ends
+  // processed by the scalar code)
+  Orthanc::ImageBuffer source(Orthanc::PixelFormat_Grayscale16, 1003, 37, false);
+  Orthanc::ImageAccessor sourceAccessor;
+  source.GetWriteableAccessor(sourceAccessor);
+  FillRandom(sourceAccessor);
+
+  Orthanc::ImageAccessor sourceRegion;
+  sourceAccessor.GetRegion(sourceRegion, 1, 1, 997, 35);
+
+  Orthanc::ImageBuffer reference(Orthanc::PixelFormat_Grayscale8, 997, 35, false);
+  Orthanc::ImageAccessor referenceAccessor;
+  reference.GetWriteableAccessor(referenceAccessor);
+
+  PixelKernels::SetInstructionSet(PixelKernels::InstructionSet_Scalar);
+  PixelKernels::ChangeDynamics(referenceAccessor, sourceRegion, 0.01f, -3.0f);
+
+  for (size_t i = 1; i < instructionSetsCount; i++)
+  {
+    if (!PixelKernels::IsSupported(instructionSets[i]))
+    {
+      continue;
+    }
+    PixelKernels::SetInstructionSet(instructionSets[i]);
+
+    Orthanc::ImageBuffer target(Orthanc::PixelFormat_Grayscale8, 997, 35, false);
+    Orthanc::ImageAccessor targetAccessor;
+    target.GetWriteableAccessor(targetAccessor);
+    PixelKernels::ChangeDynamics(targetAccessor, sourceRegion, 0.01f, -3.0f);
+
+    ASSERT_TRUE(IsSame(referenceAccessor, targetAccessor));
+  }
+}
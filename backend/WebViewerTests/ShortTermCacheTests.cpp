@@ -0,0 +1,1977 @@
+#include <gtest/gtest.h>
+
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/filesystem.hpp>
+#include <ShortTermCache/MemoryCache.h>
+#include <ShortTermCache/CacheManager.h>
+#include <ShortTermCache/SharedCacheDirectory.h>
+#include <ShortTermCache/PackStorage.h>
+#include <ShortTermCache/BackgroundGovernor.h>
+#include <ShortTermCache/NegativeCache.h>
+#include <ShortTermCache/FrequencySketch.h>
+#include <ShortTermCache/CacheScheduler.h>
+#include <ShortTermCache/CacheContext.h>
+#include <OrthancException.h>
+
+#if !defined(_WIN32)
+#  include <sys/types.h>
+#  include <sys/wait.h>
+#  include <unistd.h>
+#endif
+
+using OrthancPlugins::MemoryCache;
+using OrthancPlugins::CacheManager;
+using OrthancPlugins::SharedCacheDirectory;
+using OrthancPlugins::PackStorage;
+using OrthancPlugins::BackgroundGovernor;
+using OrthancPlugins::NegativeCache;
+using OrthancPlugins::FrequencySketch;
+using OrthancPlugins::CacheScheduler;
+using OrthancPlugins::CacheIndex;
+using OrthancPlugins::ICacheFactory;
+using OrthancPlugins::IPrefetchPolicy;
+using OrthancPlugins::PrefetchAccess;
+using OrthancPlugins::PrefetchPriority;
+using OrthancPlugins::PrefetchRequest;
+
+namespace
+{
+  const int BUNDLE = 1;
+  const size_t ITEMS_COUNT = 4096;
+  const size_t ITEM_SIZE = 1024;
+  const size_t ACCESSES_PER_THREAD = 50000;
+
+  std::string GetItem(size_t index)
+  {
+    return boost::lexical_cast<std::string>(index) + "/0/low-quality";
+  }
+
+  void AccessWorker(MemoryCache* cache,
+                    size_t seed,
+                    size_t* hits)
+  {
+    std::string content;
+    size_t index = seed;
+    *hits = 0;
+
+    for (size_t i = 0; i < ACCESSES_PER_THREAD; i++)
+    {
+      index = (index * 1103515245 + 12345) % ITEMS_COUNT;
+      if (cache->Access(content, BUNDLE, GetItem(index)))
+      {
+        (*hits)++;
+      }
+    }
+  }
+
+  // Returns the number of hits per second
+  double MeasureHitThroughput(MemoryCache& cache,
+                              size_t threadsCount)
+  {
+    std::vector<size_t> hits(threadsCount, 0);
+    boost::thread_group threads;
+
+    boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+    for (size_t i = 0; i < threadsCount; i++)
+    {
+      threads.create_thread(boost::bind(&AccessWorker, &cache, i, &hits[i]));
+    }
+    threads.join_all();
+    double seconds = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds() / 1000000.0;
+
+    size_t total = 0;
+    for (size_t i = 0; i < threadsCount; i++)
+    {
+      EXPECT_EQ(ACCESSES_PER_THREAD, hits[i]);  // everything fits in the cache
+      total += hits[i];
+    }
+
+    return total / (seconds > 0 ? seconds : 1e-6);
+  }
+}
+
+TEST(MemoryCache, StoreAndInvalidate)
+{
+  MemoryCache cache(1024 * 1024);
+  std::string content;
+
+  cache.Store(BUNDLE, "a/0/low-quality", "1");
+  cache.Store(BUNDLE, "a/0/high-quality", "2");
+  cache.Store(BUNDLE, "a/1/low-quality", "3");
+  cache.Store(BUNDLE + 1, "a/0/low-quality", "4");
+
+  ASSERT_TRUE(cache.Access(content, BUNDLE, "a/0/high-quality"));
+  ASSERT_EQ("2", content);
+  ASSERT_FALSE(cache.Access(content, BUNDLE, "b/0/high-quality"));
+
+  // the items sharing the prefix are spread over the shards
+  cache.Invalidate(BUNDLE, "a/0/");
+  ASSERT_FALSE(cache.IsCached(BUNDLE, "a/0/low-quality"));
+  ASSERT_FALSE(cache.IsCached(BUNDLE, "a/0/high-quality"));
+  ASSERT_TRUE(cache.IsCached(BUNDLE, "a/1/low-quality"));
+  ASSERT_TRUE(cache.IsCached(BUNDLE + 1, "a/0/low-quality"));
+
+  MemoryCache::Statistics statistics;
+  cache.GetStatistics(statistics);
+  ASSERT_EQ(2u, statistics.count);
+  ASSERT_EQ(2u, statistics.size);
+  ASSERT_EQ(1u, statistics.hits);
+  ASSERT_EQ(1u, statistics.misses);
+
+  cache.Clear();
+  cache.GetStatistics(statistics);
+  ASSERT_EQ(0u, statistics.count);
+  ASSERT_EQ(0u, statistics.size);
+}
+
+TEST(MemoryCache, GlobalBudget)
+{
+  // the budget is shared by all the shards
+  MemoryCache cache(10 * ITEM_SIZE);
+  const std::string content(ITEM_SIZE, 'x');
+
+  for (size_t i = 0; i < 100; i++)
+  {
+    cache.Store(BUNDLE, GetItem(i), content);
+  }
+
+  MemoryCache::Statistics statistics;
+  cache.GetStatistics(statistics);
+  ASSERT_EQ(10u, statistics.count);
+  ASSERT_EQ(10 * ITEM_SIZE, statistics.size);
+
+  // an item larger than a shard's share of the budget is still accepted
+  cache.Store(BUNDLE, "large", std::string(8 * ITEM_SIZE, 'y'));
+  ASSERT_TRUE(cache.IsCached(BUNDLE, "large"));
+
+  cache.SetMaxSize(0);
+  cache.GetStatistics(statistics);
+  ASSERT_EQ(0u, statistics.count);
+
+  cache.Store(BUNDLE, GetItem(0), content);
+  ASSERT_FALSE(cache.IsCached(BUNDLE, GetItem(0)));
+}
+
+TEST(MemoryCache, GlobalRecency)
+{
+  // the least recently used item is evicted, whatever its shard
+  MemoryCache cache(10 * ITEM_SIZE);
+  const std::string content(ITEM_SIZE, 'x');
+
+  for (size_t i = 0; i < 200; i++)
+  {
+    cache.Store(BUNDLE, GetItem(i), content);
+
+    // the 10 most recently stored items are kept
+    for (size_t j = (i < 9 ? 0 : i - 9); j <= i; j++)
+    {
+      ASSERT_TRUE(cache.IsCached(BUNDLE, GetItem(j)));
+    }
+  }
+
+  // an access makes the oldest item the most recent one
+  std::string accessed;
+  ASSERT_TRUE(cache.Access(accessed, BUNDLE, GetItem(190)));
+  cache.Store(BUNDLE, GetItem(200), content);
+  ASSERT_TRUE(cache.IsCached(BUNDLE, GetItem(190)));
+  ASSERT_FALSE(cache.IsCached(BUNDLE, GetItem(191)));
+  ASSERT_TRUE(cache.IsCached(BUNDLE, GetItem(200)));
+}
+
+TEST(MemoryCache, TimeToLive)
+{
+  // only the items of the first bundle expire, even if they are accessed
+  MemoryCache cache(10 * ITEM_SIZE);
+  cache.SetTimeToLive(BUNDLE, 1);
+
+  const std::string content(ITEM_SIZE, 'x');
+  cache.Store(BUNDLE, GetItem(0), content);
+  cache.Store(BUNDLE + 1, GetItem(0), content);
+
+  std::string accessed;
+  ASSERT_TRUE(cache.Access(accessed, BUNDLE, GetItem(0)));
+
+  boost::this_thread::sleep(boost::posix_time::milliseconds(1100));
+  ASSERT_FALSE(cache.Access(accessed, BUNDLE, GetItem(0)));
+  ASSERT_TRUE(cache.Access(accessed, BUNDLE + 1, GetItem(0)));
+
+  MemoryCache::Statistics statistics;
+  cache.GetStatistics(statistics);
+  ASSERT_EQ(1u, statistics.count);
+  ASSERT_EQ(ITEM_SIZE, statistics.size);
+}
+
+TEST(MemoryCache, HitThroughput)
+{
+  // Compares a single mutex (1 shard, the former implementation) with the
+  // default sharding, from 1 to 32 threads that only hit the cache
+  const size_t shardsCounts[] = { 1, MemoryCache::DEFAULT_SHARDS_COUNT };
+  const std::string content(ITEM_SIZE, 'x');
+
+  std::map<size_t, double> singleShard;  // throughput by threads count
+
+  for (size_t s = 0; s < sizeof(shardsCounts) / sizeof(shardsCounts[0]); s++)
+  {
+    MemoryCache cache(ITEMS_COUNT * ITEM_SIZE, shardsCounts[s]);
+    for (size_t i = 0; i < ITEMS_COUNT; i++)
+    {
+      cache.Store(BUNDLE, GetItem(i), content);
+    }
+
+    for (size_t threadsCount = 1; threadsCount <= 32; threadsCount *= 2)
+    {
+      double throughput = MeasureHitThroughput(cache, threadsCount);
+      std::cout << "MemoryCache [" << shardsCounts[s] << " shard(s), "
+                << threadsCount << " thread(s)]: " << static_cast<uint64_t>(throughput) << " hits/s" << std::endl;
+
+      if (s == 0)
+      {
+        singleShard[threadsCount] = throughput;
+      }
+      else if (threadsCount >= 8 &&
+               boost::thread::hardware_concurrency() >= 4)
+      {
+        // the hits on different items do not contend: this only shows with
+        // threads that actually run in parallel
+        EXPECT_GT(throughput, singleShard[threadsCount]);
+      }
+    }
+  }
+}
+
+
+namespace
+{
+  const size_t SHARED_ITEMS_COUNT = 200;
+
+  // An Orthanc node: its own index, the files in the shared directory
+  class Node : public boost::noncopyable
+  {
+  private:
+    SharedCacheDirectory         shared_;
+    Orthanc::FilesystemStorage   storage_;
+    Orthanc::SQLite::Connection  db_;
+    std::auto_ptr<CacheManager>  cache_;
+
+  public:
+    Node(const boost::filesystem::path& root,
+         const std::string& name,
+         uint64_t sharedSize) :
+      shared_((root / "shared").string(), sharedSize),
+      storage_((root / name).string())
+    {
+      db_.Open((root / name / "cache.db").string());
+      cache_.reset(new CacheManager(NULL, db_, storage_));
+      cache_->SetBundleQuota(BUNDLE, 0, 100 * 1024 * 1024);
+      cache_->SetSharedDirectory(BUNDLE, &shared_);
+    }
+
+    CacheManager& GetCache()
+    {
+      return *cache_;
+    }
+
+    SharedCacheDirectory& GetSharedDirectory()
+    {
+      return shared_;
+    }
+
+    bool Read(std::string& content,
+              const std::string& item)
+    {
+      std::string uuid;
+      uint64_t size;
+      return (cache_->LocateInCache(uuid, size, BUNDLE, item) &&
+              cache_->ReadCachedFile(content, uuid, size));
+    }
+  };
+
+  std::string GetSharedContent(size_t index)
+  {
+    return std::string(ITEM_SIZE + index, static_cast<char>('a' + index % 26));
+  }
+
+  boost::filesystem::path CreateTemporaryDirectory()
+  {
+    boost::filesystem::path root = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("viewer-cache-%%%%-%%%%-%%%%");
+    boost::filesystem::create_directories(root);
+    return root;
+  }
+}
+
+
+#if !defined(_WIN32)
+TEST(SharedCacheDirectory, TwoProcesses)
+{
+  const boost::filesystem::path root = CreateTemporaryDirectory();
+
+  // The first node stores the images, while the second one reads them:
+  // the second node either misses an image or reads it entirely
+  pid_t child = fork();
+  ASSERT_NE(-1, child);
+
+  if (child == 0)
+  {
+    int status = 0;
+
+    try
+    {
+      Node node(root, "node1", 0);
+      for (size_t i = 0; i < SHARED_ITEMS_COUNT; i++)
+      {
+        node.GetCache().Store(BUNDLE, GetItem(i), GetSharedContent(i), false);
+      }
+    }
+    catch (...)
+    {
+      status = 1;
+    }
+
+    _exit(status);
+  }
+
+  {
+    Node node(root, "node2", 0);
+
+    for (int round = 0; round < 50; round++)
+    {
+      for (size_t i = 0; i < SHARED_ITEMS_COUNT; i += 10)
+      {
+        std::string content;
+        if (node.Read(content, GetItem(i)))
+        {
+          ASSERT_EQ(GetSharedContent(i), content);
+        }
+      }
+    }
+
+    int status;
+    ASSERT_EQ(child, waitpid(child, &status, 0));
+    ASSERT_TRUE(WIFEXITED(status));
+    ASSERT_EQ(0, WEXITSTATUS(status));
+
+    // all the images decoded by the first node are served by the second one
+    for (size_t i = 0; i < SHARED_ITEMS_COUNT; i++)
+    {
+      std::string content;
+      ASSERT_TRUE(node.GetCache().IsCached(BUNDLE, GetItem(i)));
+      ASSERT_TRUE(node.Read(content, GetItem(i)));
+      ASSERT_EQ(GetSharedContent(i), content);
+    }
+
+    CacheManager::Statistics statistics;
+    node.GetCache().GetStatistics(statistics);
+    ASSERT_LT(0u, statistics.sharedHits);
+
+    // the second node invalidates an image for both nodes
+    node.GetCache().Invalidate(BUNDLE, "0/");
+    node.GetCache().Invalidate(BUNDLE, "1");
+  }
+
+  child = fork();
+  ASSERT_NE(-1, child);
+
+  if (child == 0)
+  {
+    int status = 0;
+
+    try
+    {
+      Node node(root, "node1", 0);
+      std::string content;
+      if (node.Read(content, GetItem(0)) ||
+          node.Read(content, GetItem(1)) ||
+          !node.Read(content, GetItem(2)) ||
+          content != GetSharedContent(2))
+      {
+        status = 1;
+      }
+    }
+    catch (...)
+    {
+      status = 2;
+    }
+
+    _exit(status);
+  }
+
+  int status;
+  ASSERT_EQ(child, waitpid(child, &status, 0));
+  ASSERT_TRUE(WIFEXITED(status));
+  ASSERT_EQ(0, WEXITSTATUS(status));
+
+  boost::filesystem::remove_all(root);
+}
+#endif
+
+
+TEST(SharedCacheDirectory, IndexWithoutLock)
+{
+  const boost::filesystem::path root = CreateTemporaryDirectory();
+
+  {
+    Node node1(root, "node1", 0);
+    Node node2(root, "node2", 0);
+
+    // the file is written, then indexed by the first node
+    std::string name;
+    ASSERT_TRUE(node1.GetCache().WriteSharedFile(name, BUNDLE, GetItem(0), GetSharedContent(0)));
+    node1.GetCache().StoreSharedFile(BUNDLE, GetItem(0), name, GetSharedContent(0).size(), false);
+    ASSERT_TRUE(node1.GetCache().IsIndexed(BUNDLE, GetItem(0)));
+
+    // the second node finds it in the shared directory only
+    ASSERT_FALSE(node2.GetCache().IsIndexed(BUNDLE, GetItem(0)));
+    ASSERT_TRUE(node2.GetCache().IsCached(BUNDLE, GetItem(0)));
+
+    std::string found;
+    uint64_t size;
+    ASSERT_TRUE(node2.GetCache().LookupSharedFile(found, size, BUNDLE, GetItem(0)));
+    ASSERT_EQ(name, found);
+    ASSERT_EQ(GetSharedContent(0).size(), size);
+    ASSERT_TRUE(node2.GetCache().IndexSharedFile(BUNDLE, GetItem(0), found, size));
+
+    std::string uuid, content;
+    ASSERT_TRUE(node2.GetCache().LocateInIndex(uuid, size, BUNDLE, GetItem(0)));
+    ASSERT_TRUE(node2.GetCache().ReadCachedFile(content, uuid, size));
+    ASSERT_EQ(GetSharedContent(0), content);
+
+    // the other bundles are not shared
+    ASSERT_FALSE(node1.GetCache().WriteSharedFile(name, BUNDLE + 1, GetItem(0), GetSharedContent(0)));
+    ASSERT_FALSE(node2.GetCache().LookupSharedFile(found, size, BUNDLE + 1, GetItem(0)));
+  }
+
+  boost::filesystem::remove_all(root);
+}
+
+TEST(SharedCacheDirectory, BundleVersion)
+{
+  const boost::filesystem::path root = CreateTemporaryDirectory();
+
+  {
+    SharedCacheDirectory former((root / "shared").string(), 0);
+    former.SetBundleVersion(BUNDLE, "1");
+    former.Write(BUNDLE, GetItem(0), GetSharedContent(0));
+
+    // the nodes that use another version of the format do not read the file
+    SharedCacheDirectory upgraded((root / "shared").string(), 0);
+    upgraded.SetBundleVersion(BUNDLE, "2");
+
+    std::string name;
+    uint64_t size;
+    ASSERT_FALSE(upgraded.Lookup(name, size, BUNDLE, GetItem(0)));
+    ASSERT_TRUE(former.Lookup(name, size, BUNDLE, GetItem(0)));
+
+    upgraded.Write(BUNDLE, GetItem(0), GetSharedContent(1));
+    ASSERT_TRUE(upgraded.Lookup(name, size, BUNDLE, GetItem(0)));
+    ASSERT_EQ(GetSharedContent(1).size(), size);
+    ASSERT_TRUE(former.Lookup(name, size, BUNDLE, GetItem(0)));
+    ASSERT_EQ(GetSharedContent(0).size(), size);
+  }
+
+  boost::filesystem::remove_all(root);
+}
+
+TEST(SharedCacheDirectory, Cleanup)
+{
+  const boost::filesystem::path root = CreateTemporaryDirectory();
+
+  {
+    // the directory can hold 10 images, the index of the node 100MB
+    SharedCacheDirectory shared((root / "shared").string(), 10 * (ITEM_SIZE + 64));
+    for (size_t i = 0; i < 40; i++)
+    {
+      shared.Write(BUNDLE, GetItem(i), std::string(ITEM_SIZE, 'x'));
+    }
+
+    shared.Cleanup();
+
+    size_t count = 0;
+    for (size_t i = 0; i < 40; i++)
+    {
+      std::string name;
+      uint64_t size;
+      if (shared.Lookup(name, size, BUNDLE, GetItem(i)))
+      {
+        ASSERT_EQ(ITEM_SIZE, size);
+        count++;
+      }
+    }
+
+    ASSERT_LT(0u, count);
+    ASSERT_GE(10u, count);
+  }
+
+  boost::filesystem::remove_all(root);
+}
+
+
+namespace
+{
+  // A cache index and its files in a temporary directory, removed at the
+  // end of the test.  Reopen() simulates a restart of Orthanc: the index and
+  // the files of the previous run are kept.
+  class CacheManagerTest : public ::testing::Test
+  {
+  private:
+    boost::filesystem::path                     root_;
+    std::auto_ptr<Orthanc::FilesystemStorage>   storage_;
+    std::auto_ptr<Orthanc::SQLite::Connection>  db_;
+    std::auto_ptr<PackStorage>                  packs_;
+    std::auto_ptr<CacheManager>                 cache_;
+
+    void Close()
+    {
+      cache_.reset(NULL);
+      packs_.reset(NULL);
+      db_.reset(NULL);
+      storage_.reset(NULL);
+    }
+
+  protected:
+    virtual void SetUp()
+    {
+      root_ = CreateTemporaryDirectory();
+      Reopen();
+    }
+
+    virtual void TearDown()
+    {
+      Close();
+      boost::filesystem::remove_all(root_);
+    }
+
+    CacheManager& Reopen()
+    {
+      Close();
+
+      storage_.reset(new Orthanc::FilesystemStorage((root_ / "files").string()));
+      db_.reset(new Orthanc::SQLite::Connection);
+      db_->Open((root_ / "cache.db").string());
+      cache_.reset(new CacheManager(NULL, *db_, *storage_));
+
+      return *cache_;
+    }
+
+    // Until the next Reopen()
+    void EnablePackStorage(uint64_t segmentSize)
+    {
+      packs_.reset(new PackStorage((root_ / "packs").string(), segmentSize));
+      cache_->SetPackStorage(packs_.get());
+    }
+
+    CacheManager& GetCache()
+    {
+      return *cache_;
+    }
+  };
+}
+
+
+TEST_F(CacheManagerTest, PackCompaction)
+{
+  const size_t count = 200;
+
+  for (int run = 0; run < 2; run++)
+  {
+    // the second run reopens the cache and its pack files
+    CacheManager& cache = (run == 0 ? GetCache() : Reopen());
+    cache.SetBundleQuota(BUNDLE, 50, 0);
+    EnablePackStorage(16 * ITEM_SIZE);
+
+    if (run == 0)
+    {
+      // the first items are evicted, their pack files are mostly unused
+      for (size_t i = 0; i < count; i++)
+      {
+        cache.Store(BUNDLE, GetItem(i), GetSharedContent(i), false);
+      }
+    }
+
+    // the space of the evicted items is released once their files are removed
+    std::vector<std::string> files;
+    cache.TakeRemovedFiles(files);
+    cache.RemoveFiles(files);
+
+    while (cache.CompactPackFiles(4 * ITEM_SIZE))
+    {
+    }
+
+    CacheManager::Statistics statistics;
+    cache.GetStatistics(statistics);
+    ASSERT_GT(statistics.packFilesSize, 0u);
+    ASSERT_LT(statistics.packFilesDeadSize * 2, statistics.packFilesSize);
+    ASSERT_GE(6u, statistics.packFiles);
+
+    for (size_t i = 0; i < count; i++)
+    {
+      std::string content;
+      if (i < count - 50)
+      {
+        ASSERT_FALSE(cache.Access(content, BUNDLE, GetItem(i)));
+      }
+      else
+      {
+        ASSERT_TRUE(cache.Access(content, BUNDLE, GetItem(i)));
+        ASSERT_EQ(GetSharedContent(i), content);
+      }
+    }
+  }
+}
+
+
+TEST_F(CacheManagerTest, PackStaleFiles)
+{
+  const int OTHER_BUNDLE = 3;
+  const size_t count = 50;
+
+  for (int run = 0; run < 3; run++)
+  {
+    // the second run drops the items of the first bundle, the third one
+    // restarts before their files are removed
+    CacheManager& cache = (run == 0 ? GetCache() : Reopen());
+    EnablePackStorage(16 * ITEM_SIZE);
+    cache.SetBundleVersion(BUNDLE, run == 0 ? "1" : "2");
+    cache.SetBundleVersion(OTHER_BUNDLE, "1");
+
+    if (run == 0)
+    {
+      // the items of both bundles share the same segments
+      for (size_t i = 0; i < count; i++)
+      {
+        cache.Store(BUNDLE, GetItem(i), GetSharedContent(i), false);
+        cache.Store(OTHER_BUNDLE, GetItem(i), GetSharedContent(i), false);
+      }
+    }
+  }
+
+  CacheManager& cache = GetCache();
+  while (cache.RemoveStaleFiles(10))
+  {
+  }
+
+  std::vector<std::string> files;
+  cache.TakeRemovedFiles(files);
+  ASSERT_EQ(count, files.size());
+  cache.RemoveFiles(files);
+
+  // the segments still used by the other bundle are not deleted
+  while (cache.CompactPackFiles(4 * ITEM_SIZE))
+  {
+  }
+
+  for (size_t i = 0; i < count; i++)
+  {
+    std::string content;
+    ASSERT_FALSE(cache.Access(content, BUNDLE, GetItem(i)));
+    ASSERT_TRUE(cache.Access(content, OTHER_BUNDLE, GetItem(i)));
+    ASSERT_EQ(GetSharedContent(i), content);
+  }
+
+  CacheManager::Statistics statistics;
+  cache.GetStatistics(statistics);
+  ASSERT_LT(statistics.packFilesDeadSize * 2, statistics.packFilesSize);
+}
+
+TEST_F(CacheManagerTest, ReclaimSpace)
+{
+  CacheManager& cache = GetCache();
+  cache.SetBundleQuota(BUNDLE, 100, 0);
+
+  for (size_t i = 0; i < 95; i++)
+  {
+    cache.Store(BUNDLE, GetItem(i), GetSharedContent(i), false);
+  }
+
+  // up to the high watermark: nothing to evict
+  ASSERT_FALSE(cache.ReclaimSpace());
+
+  // above the quota, the store path evicts the least recently used item,
+  // without removing its file
+  for (size_t i = 95; i < 101; i++)
+  {
+    cache.Store(BUNDLE, GetItem(i), GetSharedContent(i), false);
+  }
+
+  std::vector<std::string> files;
+  cache.TakeRemovedFiles(files);
+  ASSERT_EQ(1u, files.size());
+  cache.RemoveFiles(files);
+
+  // storing an item again replaces it, it is not evicted
+  cache.Store(BUNDLE, GetItem(100), GetSharedContent(100), false);
+
+  std::vector<std::pair<int, std::string> > evicted;
+  cache.TakeEvictedItems(evicted);
+  ASSERT_EQ(1u, evicted.size());
+  ASSERT_EQ(BUNDLE, evicted[0].first);
+  ASSERT_EQ(GetItem(0), evicted[0].second);
+
+  cache.TakeRemovedFiles(files);
+  cache.RemoveFiles(files);
+
+  // the reclaimer goes down to the low watermark
+  ASSERT_TRUE(cache.ReclaimSpace());
+
+  cache.TakeEvictedItems(evicted);
+  ASSERT_EQ(10u, evicted.size());
+
+  CacheManager::Statistics statistics;
+  cache.GetStatistics(statistics);
+  ASSERT_EQ(90u, statistics.protectedCount + statistics.probationCount);
+  ASSERT_EQ(10u, statistics.reclaimedItems);
+  ASSERT_EQ(10u, statistics.pendingRemovals);
+
+  cache.TakeRemovedFiles(files);
+  ASSERT_EQ(10u, files.size());
+  cache.RemoveFiles(files);
+
+  std::string content;
+  ASSERT_FALSE(cache.Access(content, BUNDLE, GetItem(10)));
+  ASSERT_TRUE(cache.Access(content, BUNDLE, GetItem(11)));
+  ASSERT_EQ(GetSharedContent(11), content);
+}
+
+
+TEST_F(CacheManagerTest, PendingRemovalsOverflow)
+{
+  CacheManager& cache = GetCache();
+  cache.SetBundleQuota(BUNDLE, 10, 0);
+
+  // nobody takes the files of the evicted items: past 4096 of them, they are
+  // recorded for RemoveStaleFiles(), the store path does not remove them
+  const size_t evictedCount = 4096 + 100;
+  const std::string content(ITEM_SIZE, 'x');
+  for (size_t i = 0; i < evictedCount + 10; i++)
+  {
+    cache.Store(BUNDLE, GetItem(i), content, false);
+  }
+
+  CacheManager::Statistics statistics;
+  cache.GetStatistics(statistics);
+  ASSERT_EQ(4096u, statistics.pendingRemovals);
+
+  std::vector<std::string> files;
+  cache.TakeRemovedFiles(files);
+
+  while (cache.RemoveStaleFiles(1000))
+  {
+    std::vector<std::string> stale;
+    cache.TakeRemovedFiles(stale);
+    files.insert(files.end(), stale.begin(), stale.end());
+  }
+
+  ASSERT_EQ(evictedCount, files.size());
+
+  std::string read;
+  for (size_t i = 0; i < files.size(); i++)
+  {
+    ASSERT_TRUE(cache.ReadCachedFile(read, files[i], ITEM_SIZE));
+  }
+
+  cache.RemoveFiles(files);
+  ASSERT_FALSE(cache.ReadCachedFile(read, files.front(), ITEM_SIZE));
+}
+
+
+TEST_F(CacheManagerTest, BundleVersion)
+{
+  const int OTHER_BUNDLE = 3;
+
+  for (int run = 0; run < 3; run++)
+  {
+    CacheManager& cache = (run == 0 ? GetCache() : Reopen());
+    cache.SetBundleVersion(BUNDLE, run < 2 ? "1" : "2");
+    cache.SetBundleVersion(OTHER_BUNDLE, "1");
+
+    CacheManager::Statistics statistics;
+    cache.GetStatistics(statistics);
+
+    std::vector<std::string> files;
+
+    switch (run)
+    {
+      case 0:
+        for (size_t i = 0; i < 10; i++)
+        {
+          cache.Store(BUNDLE, GetItem(i), GetSharedContent(i), false);
+          cache.Store(OTHER_BUNDLE, GetItem(i), GetSharedContent(i), false);
+        }
+        break;
+
+      case 1:
+        // the statistics are read from the headers of the bundles
+        ASSERT_EQ(20u, statistics.protectedCount + statistics.probationCount);
+        ASSERT_FALSE(cache.RemoveStaleFiles(100));
+        break;
+
+      case 2:
+        // only the items of the bundle whose version has changed are dropped,
+        // their files are removed afterwards
+        ASSERT_EQ(10u, statistics.protectedCount + statistics.probationCount);
+        ASSERT_FALSE(cache.IsCached(BUNDLE, GetItem(0)));
+        ASSERT_TRUE(cache.IsCached(OTHER_BUNDLE, GetItem(0)));
+
+        ASSERT_TRUE(cache.RemoveStaleFiles(6));
+        ASSERT_TRUE(cache.RemoveStaleFiles(6));
+        ASSERT_FALSE(cache.RemoveStaleFiles(6));
+        cache.TakeRemovedFiles(files);
+        ASSERT_EQ(10u, files.size());
+        cache.RemoveFiles(files);
+        break;
+    }
+  }
+}
+
+
+TEST_F(CacheManagerTest, InvalidatePrefix)
+{
+  for (int run = 0; run < 2; run++)
+  {
+    CacheManager& cache = (run == 0 ? GetCache() : Reopen());
+    cache.SetSanityCheckEnabled(true);
+
+    if (run == 0)
+    {
+      const char* instances[] = { "a", "ab", "b" };
+      for (size_t i = 0; i < 3; i++)
+      {
+        for (size_t frame = 0; frame < 3; frame++)
+        {
+          const std::string item = std::string(instances[i]) + "/" + boost::lexical_cast<std::string>(frame);
+          cache.Store(BUNDLE, item + "/low-quality", GetSharedContent(frame), false);
+          cache.Store(BUNDLE, item + "/high-quality", GetSharedContent(frame), false);
+        }
+      }
+
+      cache.Invalidate(BUNDLE, "a/1/");
+      cache.Invalidate(BUNDLE, "b");
+    }
+
+    // the invalidations have been persisted
+    CacheManager::Statistics statistics;
+    cache.GetStatistics(statistics);
+    ASSERT_EQ(10u, statistics.protectedCount + statistics.probationCount);
+
+    ASSERT_TRUE(cache.IsCached(BUNDLE, "a/0/low-quality"));
+    ASSERT_FALSE(cache.IsCached(BUNDLE, "a/1/low-quality"));
+    ASSERT_FALSE(cache.IsCached(BUNDLE, "a/1/high-quality"));
+    ASSERT_TRUE(cache.IsCached(BUNDLE, "a/2/high-quality"));
+    ASSERT_TRUE(cache.IsCached(BUNDLE, "ab/1/low-quality"));
+    ASSERT_FALSE(cache.IsCached(BUNDLE, "b/0/low-quality"));
+  }
+}
+
+
+TEST_F(CacheManagerTest, LazyEntries)
+{
+  const int OTHER_BUNDLE = 3;
+
+  for (int run = 0; run < 2; run++)
+  {
+    CacheManager& cache = (run == 0 ? GetCache() : Reopen());
+
+    if (run == 0)
+    {
+      for (size_t i = 0; i < 30; i++)
+      {
+        cache.Store(BUNDLE, GetItem(i), GetSharedContent(i), false);
+      }
+
+      for (size_t i = 0; i < 5; i++)
+      {
+        cache.Store(OTHER_BUNDLE, GetItem(i), GetSharedContent(i), false);
+      }
+
+      std::string content;
+      ASSERT_TRUE(cache.Access(content, BUNDLE, GetItem(0)));
+      continue;
+    }
+
+    // the entries of the bundles have not been read yet: they are counted
+    // as protected, like they will be read
+    CacheManager::Statistics statistics;
+    cache.GetStatistics(statistics);
+    ASSERT_EQ(35u, statistics.protectedCount);
+    ASSERT_EQ(0u, statistics.probationCount);
+
+    // until then, the entries are looked up in the database
+    std::string content;
+    ASSERT_TRUE(cache.Access(content, BUNDLE, GetItem(20)));
+    ASSERT_EQ(GetSharedContent(20), content);
+    ASSERT_FALSE(cache.Access(content, BUNDLE, "missing"));
+    cache.Invalidate(BUNDLE, "25/");
+    ASSERT_FALSE(cache.IsCached(BUNDLE, GetItem(25)));
+    ASSERT_TRUE(cache.IsCached(BUNDLE, GetItem(24)));
+
+    // the eviction reads the oldest entries first
+    cache.SetBundleQuota(BUNDLE, 29, 0);
+    cache.Store(BUNDLE, GetItem(30), GetSharedContent(30), false);
+    ASSERT_TRUE(cache.IsCached(BUNDLE, GetItem(0)));
+    ASSERT_FALSE(cache.IsCached(BUNDLE, GetItem(1)));
+    ASSERT_TRUE(cache.IsCached(BUNDLE, GetItem(2)));
+    ASSERT_TRUE(cache.IsCached(BUNDLE, GetItem(20)));
+
+    // the other bundle is read by batches
+    size_t batches = 0;
+    while (cache.LoadEntries(2))
+    {
+      batches++;
+    }
+
+    ASSERT_EQ(3u, batches);
+
+    cache.SetSanityCheckEnabled(true);
+    ASSERT_TRUE(cache.IsCached(OTHER_BUNDLE, GetItem(1)));
+
+    cache.GetStatistics(statistics);
+    ASSERT_EQ(34u, statistics.protectedCount + statistics.probationCount);
+  }
+}
+
+
+TEST_F(CacheManagerTest, Promotion)
+{
+  CacheManager& cache = GetCache();
+  cache.SetBundleQuota(BUNDLE, 10, 0);
+
+  // the speculative items are not read yet
+  for (size_t i = 0; i < 3; i++)
+  {
+    cache.Store(BUNDLE, GetItem(i), GetSharedContent(i), true);
+  }
+
+  CacheManager::Statistics statistics;
+  cache.GetStatistics(statistics);
+  ASSERT_EQ(3u, statistics.probationCount);
+  ASSERT_EQ(0u, statistics.protectedCount);
+
+  // they are protected once they are read, from the disk or from another tier
+  std::string content;
+  ASSERT_TRUE(cache.Access(content, BUNDLE, GetItem(1)));
+  cache.SignalRead(BUNDLE, GetItem(2));
+
+  cache.GetStatistics(statistics);
+  ASSERT_EQ(1u, statistics.probationCount);
+  ASSERT_EQ(2u, statistics.protectedCount);
+  ASSERT_EQ(2u, statistics.promotedItems);
+
+  // the protected segment is limited to 80% of the quota: the least
+  // recently read item goes back to the probationary segment
+  for (size_t i = 3; i < 10; i++)
+  {
+    cache.Store(BUNDLE, GetItem(i), GetSharedContent(i), false);
+  }
+
+  cache.GetStatistics(statistics);
+  ASSERT_EQ(2u, statistics.probationCount);
+  ASSERT_EQ(8u, statistics.protectedCount);
+
+  // the probationary segment is evicted first, the speculative item that
+  // has never been read before the demoted one
+  cache.Store(BUNDLE, GetItem(10), GetSharedContent(10), false);
+  ASSERT_FALSE(cache.IsCached(BUNDLE, GetItem(0)));
+  ASSERT_TRUE(cache.IsCached(BUNDLE, GetItem(1)));
+  ASSERT_TRUE(cache.IsCached(BUNDLE, GetItem(2)));
+}
+
+
+TEST_F(CacheManagerTest, Admission)
+{
+  CacheManager& cache = GetCache();
+  cache.SetBundleQuota(BUNDLE, 0, 10 * ITEM_SIZE);
+
+  // 8 items in the protected segment, 2 in the probationary one, each of
+  // them being read twice
+  for (size_t i = 0; i < 10; i++)
+  {
+    std::string content;
+    cache.Store(BUNDLE, GetItem(i), std::string(ITEM_SIZE, 'x'), false);
+    ASSERT_TRUE(cache.Access(content, BUNDLE, GetItem(i)));
+  }
+
+  // a speculative item that would evict a protected item, which is read
+  // more frequently, is not stored
+  const std::string large = "large/0/low-quality";
+  cache.Store(BUNDLE, large, std::string(3 * ITEM_SIZE, 'x'), true);
+  ASSERT_FALSE(cache.IsCached(BUNDLE, large));
+
+  CacheManager::Statistics statistics;
+  cache.GetStatistics(statistics);
+  ASSERT_EQ(1u, statistics.rejectedItems);
+  ASSERT_EQ(10u, statistics.probationCount + statistics.protectedCount);
+
+  // the speculative items that only evict probationary items are stored
+  cache.Store(BUNDLE, GetItem(10), std::string(2 * ITEM_SIZE, 'x'), true);
+  ASSERT_TRUE(cache.IsCached(BUNDLE, GetItem(10)));
+
+  // the rejected item is stored once it is requested more frequently than
+  // the protected item it evicts
+  cache.Store(BUNDLE, large, std::string(3 * ITEM_SIZE, 'x'), true);
+  ASSERT_FALSE(cache.IsCached(BUNDLE, large));
+  cache.Store(BUNDLE, large, std::string(3 * ITEM_SIZE, 'x'), true);
+  ASSERT_TRUE(cache.IsCached(BUNDLE, large));
+
+  cache.GetStatistics(statistics);
+  ASSERT_EQ(2u, statistics.rejectedItems);
+}
+
+
+TEST(FrequencySketch, ConservativeUpdate)
+{
+  FrequencySketch sketch(32);
+
+  // 100 items read from 1 to 5 times, in a sketch of 32 counters per row:
+  // there are many collisions
+  for (unsigned int round = 0; round < 5; round++)
+  {
+    for (size_t i = 0; i < 100; i++)
+    {
+      if (round <= i % 5)
+      {
+        sketch.Increment(BUNDLE, GetItem(i));
+      }
+    }
+  }
+
+  // the estimates are never too low, and only the smallest counters of an
+  // item are incremented: the overestimation stays below 2 per item (more
+  // than 4 if all the counters were incremented)
+  unsigned int overestimation = 0;
+  for (size_t i = 0; i < 100; i++)
+  {
+    unsigned int estimate = sketch.Estimate(BUNDLE, GetItem(i));
+    ASSERT_LE(i % 5 + 1, estimate);
+    overestimation += estimate - (i % 5 + 1);
+  }
+
+  ASSERT_GT(200u, overestimation);
+
+  // the counters are saturated
+  FrequencySketch large(4096);
+  for (size_t i = 0; i < 20; i++)
+  {
+    large.Increment(BUNDLE, GetItem(0));
+  }
+
+  ASSERT_EQ(15u, large.Estimate(BUNDLE, GetItem(0)));
+  ASSERT_EQ(0u, large.Estimate(BUNDLE + 1, GetItem(0)));
+}
+
+
+TEST(FrequencySketch, Aging)
+{
+  // a single counter per row, shared by all the items: the counters are
+  // halved every 10 increments
+  FrequencySketch sketch(1);
+
+  for (size_t i = 0; i < 9; i++)
+  {
+    sketch.Increment(BUNDLE, GetItem(0));
+  }
+
+  ASSERT_EQ(9u, sketch.Estimate(BUNDLE, GetItem(0)));
+  ASSERT_EQ(9u, sketch.Estimate(BUNDLE, GetItem(1)));
+
+  sketch.Increment(BUNDLE, GetItem(1));
+  ASSERT_EQ(5u, sketch.Estimate(BUNDLE, GetItem(0)));
+
+  // the count of increments is halved as well: the next aging comes after
+  // 5 increments
+  for (size_t i = 0; i < 4; i++)
+  {
+    sketch.Increment(BUNDLE, GetItem(1));
+  }
+
+  ASSERT_EQ(9u, sketch.Estimate(BUNDLE, GetItem(1)));
+  sketch.Increment(BUNDLE, GetItem(1));
+  ASSERT_EQ(5u, sketch.Estimate(BUNDLE, GetItem(1)));
+}
+
+namespace
+{
+  // A background job run by its own thread, until it is released.  The job
+  // yields to the interactive requests when it is asked to.
+  class HeldJob : public boost::noncopyable
+  {
+  private:
+    BackgroundGovernor&        governor_;
+    boost::mutex               mutex_;
+    boost::condition_variable  changed_;
+    bool                       acquired_;
+    bool                       released_;
+    unsigned int               yieldRequests_;
+    unsigned int               yields_;
+    BackgroundGovernor::BackgroundJob*  job_;  // NULL once released
+    boost::thread              thread_;
+
+    static void Worker(HeldJob* that)
+    {
+      that->governor_.RegisterBackgroundThread();
+      BackgroundGovernor::BackgroundJob job(that->governor_);
+
+      boost::mutex::scoped_lock lock(that->mutex_);
+      that->acquired_ = job.IsAcquired();
+      that->job_ = &job;
+      that->changed_.notify_all();
+
+      while (!that->released_)
+      {
+        if (that->yields_ < that->yieldRequests_)
+        {
+          lock.unlock();
+          BackgroundGovernor::YieldToInteractive();
+          lock.lock();
+
+          that->yields_++;
+          that->changed_.notify_all();
+        }
+        else
+        {
+          that->changed_.wait(lock);
+        }
+      }
+
+      that->job_ = NULL;
+    }
+
+    template <typename Predicate>
+    bool WaitFor(Predicate predicate)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      boost::system_time timeout = boost::get_system_time() + boost::posix_time::milliseconds(2000);
+      while (!predicate(*this))
+      {
+        if (!changed_.timed_wait(lock, timeout))
+        {
+          return predicate(*this);
+        }
+      }
+      return true;
+    }
+
+    static bool IsAcquiredPredicate(const HeldJob& job)
+    {
+      return job.acquired_;
+    }
+
+    static bool HasYieldedPredicate(const HeldJob& job)
+    {
+      return job.yields_ == job.yieldRequests_;
+    }
+
+  public:
+    explicit HeldJob(BackgroundGovernor& governor) :
+      governor_(governor),
+      acquired_(false),
+      released_(false),
+      yieldRequests_(0),
+      yields_(0),
+      job_(NULL)
+    {
+      thread_ = boost::thread(Worker, this);
+    }
+
+    ~HeldJob()
+    {
+      Release();
+      thread_.join();
+    }
+
+    // Waits (at most 2 seconds) for the job to start
+    bool WaitAcquired()
+    {
+      return WaitFor(IsAcquiredPredicate);
+    }
+
+    bool IsAcquired()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return acquired_;
+    }
+
+    void Release()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      released_ = true;
+      changed_.notify_all();
+    }
+
+    // As an interactive request waiting for an item computed by the job
+    void SignalAwaited()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      if (job_ != NULL)
+      {
+        job_->SignalAwaited();
+      }
+    }
+
+    void Yield()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      yieldRequests_++;
+      changed_.notify_all();
+    }
+
+    // Waits (at most 2 seconds) for the job to be back from YieldToInteractive()
+    bool WaitYielded()
+    {
+      return WaitFor(HasYieldedPredicate);
+    }
+
+    bool HasYielded()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return HasYieldedPredicate(*this);
+    }
+  };
+
+  unsigned int GetRunningJobs(BackgroundGovernor& governor)
+  {
+    BackgroundGovernor::Statistics statistics;
+    governor.GetStatistics(statistics);
+    return statistics.runningJobs;
+  }
+
+  void Pause()
+  {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+  }
+}
+
+
+TEST(BackgroundGovernor, JobCap)
+{
+  BackgroundGovernor governor(2);
+
+  HeldJob a(governor);
+  HeldJob b(governor);
+  ASSERT_TRUE(a.WaitAcquired());
+  ASSERT_TRUE(b.WaitAcquired());
+
+  HeldJob c(governor);
+  Pause();
+  ASSERT_FALSE(c.IsAcquired());
+  ASSERT_EQ(2u, GetRunningJobs(governor));
+
+  a.Release();
+  ASSERT_TRUE(c.WaitAcquired());
+
+  // a larger share of the cores starts the waiting jobs at once
+  HeldJob d(governor);
+  Pause();
+  ASSERT_FALSE(d.IsAcquired());
+  governor.SetMaxJobs(3);
+  ASSERT_TRUE(d.WaitAcquired());
+  ASSERT_EQ(3u, GetRunningJobs(governor));
+}
+
+
+TEST(BackgroundGovernor, InteractiveThrottling)
+{
+  BackgroundGovernor governor(4);
+
+  {
+    // the main thread is not a background thread: its requests are interactive
+    BackgroundGovernor::InteractiveScope interactive(governor);
+
+    HeldJob a(governor);
+    ASSERT_TRUE(a.WaitAcquired());
+
+    // throttled, not suspended: a single job runs
+    HeldJob b(governor);
+    Pause();
+    ASSERT_FALSE(b.IsAcquired());
+
+    a.Release();
+    ASSERT_TRUE(b.WaitAcquired());
+  }
+
+  HeldJob c(governor);
+  HeldJob d(governor);
+  ASSERT_TRUE(c.WaitAcquired());
+  ASSERT_TRUE(d.WaitAcquired());
+}
+
+
+TEST(BackgroundGovernor, YieldToInteractive)
+{
+  BackgroundGovernor governor(2);
+
+  // outside of a background job, nothing to yield
+  BackgroundGovernor::YieldToInteractive();
+
+  HeldJob a(governor);
+  HeldJob b(governor);
+  ASSERT_TRUE(a.WaitAcquired());
+  ASSERT_TRUE(b.WaitAcquired());
+
+  a.Yield();
+  ASSERT_TRUE(a.WaitYielded());  // no interactive request
+  ASSERT_EQ(2u, GetRunningJobs(governor));
+
+  {
+    BackgroundGovernor::InteractiveScope interactive(governor);
+
+    // the job in excess gives its slot back, the other one keeps running
+    a.Yield();
+    Pause();
+    ASSERT_FALSE(a.HasYielded());
+    ASSERT_EQ(1u, GetRunningJobs(governor));
+
+    b.Yield();
+    ASSERT_TRUE(b.WaitYielded());
+  }
+
+  // the interactive request is over
+  ASSERT_TRUE(a.WaitYielded());
+  ASSERT_EQ(2u, GetRunningJobs(governor));
+}
+
+
+TEST(BackgroundGovernor, AwaitedJob)
+{
+  BackgroundGovernor governor(2);
+
+  HeldJob a(governor);
+  HeldJob b(governor);
+  ASSERT_TRUE(a.WaitAcquired());
+  ASSERT_TRUE(b.WaitAcquired());
+
+  BackgroundGovernor::InteractiveScope interactive(governor);
+
+  a.Yield();
+  Pause();
+  ASSERT_FALSE(a.HasYielded());
+
+  // an interactive request waits for an item computed by the job that has
+  // given its slot back: the job resumes, and does not give way anymore
+  a.SignalAwaited();
+  ASSERT_TRUE(a.WaitYielded());
+  ASSERT_EQ(2u, GetRunningJobs(governor));
+
+  a.Yield();
+  ASSERT_TRUE(a.WaitYielded());
+  ASSERT_EQ(2u, GetRunningJobs(governor));
+}
+
+
+TEST(BackgroundGovernor, LatencyPercentiles)
+{
+  BackgroundGovernor governor(1);
+
+  BackgroundGovernor::Statistics statistics;
+  governor.GetStatistics(statistics);
+  ASSERT_EQ(0u, statistics.interactiveRequests);
+  ASSERT_EQ(0.0, statistics.interactiveP99LatencyMs);
+  ASSERT_EQ(0.0, statistics.interactiveP99LatencyUnderLoadMs);
+
+  for (int i = 100; i >= 1; i--)
+  {
+    governor.RecordInteractiveLatency(i, false);
+  }
+  governor.RecordInteractiveLatency(1000, true);
+
+  governor.GetStatistics(statistics);
+  ASSERT_EQ(101u, statistics.interactiveRequests);
+  ASSERT_EQ(1u, statistics.interactiveRequestsUnderLoad);
+  ASSERT_EQ(99.0, statistics.interactiveP99LatencyMs);
+  ASSERT_EQ(1000.0, statistics.interactiveP99LatencyUnderLoadMs);
+
+  // only the last 1000 requests are taken into account
+  for (int i = 0; i < 1000; i++)
+  {
+    governor.RecordInteractiveLatency(5, false);
+  }
+
+  governor.GetStatistics(statistics);
+  ASSERT_EQ(5.0, statistics.interactiveP99LatencyMs);
+  ASSERT_EQ(1101u, statistics.interactiveRequests);
+}
+
+
+TEST(NegativeCache, TimeToLive)
+{
+  NegativeCache failures(1);
+  failures.Store(BUNDLE, GetItem(0), Orthanc::ErrorCode_BadFileFormat);
+  failures.Store(BUNDLE, GetItem(1), Orthanc::ErrorCode_Success);
+
+  Orthanc::ErrorCode error;
+  ASSERT_TRUE(failures.Lookup(error, BUNDLE, GetItem(0)));
+  ASSERT_EQ(Orthanc::ErrorCode_BadFileFormat, error);
+  ASSERT_TRUE(failures.Lookup(error, BUNDLE, GetItem(1)));
+  ASSERT_EQ(Orthanc::ErrorCode_Success, error);
+  ASSERT_FALSE(failures.Lookup(error, BUNDLE + 1, GetItem(0)));
+
+  // the failures are forgotten after their time to live
+  boost::this_thread::sleep(boost::posix_time::milliseconds(1100));
+  ASSERT_FALSE(failures.Lookup(error, BUNDLE, GetItem(0)));
+  ASSERT_FALSE(failures.Lookup(error, BUNDLE, GetItem(1)));
+
+  NegativeCache::Statistics statistics;
+  failures.GetStatistics(statistics);
+  ASSERT_EQ(2u, statistics.hits);
+  ASSERT_EQ(0u, statistics.count);
+
+  // a bundle can have its own time to live
+  NegativeCache shared(300);
+  shared.SetTimeToLive(BUNDLE, 1);
+  shared.Store(BUNDLE, GetItem(0), Orthanc::ErrorCode_BadFileFormat);
+  shared.Store(BUNDLE + 1, GetItem(0), Orthanc::ErrorCode_BadFileFormat);
+
+  boost::this_thread::sleep(boost::posix_time::milliseconds(1100));
+  ASSERT_FALSE(shared.Lookup(error, BUNDLE, GetItem(0)));
+  ASSERT_TRUE(shared.Lookup(error, BUNDLE + 1, GetItem(0)));
+}
+
+
+TEST(NegativeCache, MaxFailures)
+{
+  NegativeCache failures(300);
+  const size_t maxFailures = 10000;
+
+  for (size_t i = 0; i <= maxFailures; i++)
+  {
+    failures.Store(BUNDLE, GetItem(i), Orthanc::ErrorCode_BadFileFormat);
+
+    if (i == 1)
+    {
+      // failed again: this is now the most recent failure
+      failures.Store(BUNDLE, GetItem(0), Orthanc::ErrorCode_BadFileFormat);
+    }
+  }
+
+  // the oldest failure is forgotten
+  NegativeCache::Statistics statistics;
+  failures.GetStatistics(statistics);
+  ASSERT_EQ(maxFailures, statistics.count);
+
+  Orthanc::ErrorCode error;
+  ASSERT_TRUE(failures.Lookup(error, BUNDLE, GetItem(0)));
+  ASSERT_FALSE(failures.Lookup(error, BUNDLE, GetItem(1)));
+  ASSERT_TRUE(failures.Lookup(error, BUNDLE, GetItem(2)));
+  ASSERT_TRUE(failures.Lookup(error, BUNDLE, GetItem(maxFailures)));
+
+  // the lookups do not refresh the failures, the item 0 is now the oldest one
+  failures.Store(BUNDLE, GetItem(2), Orthanc::ErrorCode_BadFileFormat);
+  failures.Store(BUNDLE, GetItem(maxFailures + 1), Orthanc::ErrorCode_BadFileFormat);
+  ASSERT_FALSE(failures.Lookup(error, BUNDLE, GetItem(0)));
+  ASSERT_TRUE(failures.Lookup(error, BUNDLE, GetItem(2)));
+  ASSERT_TRUE(failures.Lookup(error, BUNDLE, GetItem(3)));
+
+  failures.GetStatistics(statistics);
+  ASSERT_EQ(maxFailures, statistics.count);
+}
+
+
+TEST(NegativeCache, InvalidatePrefix)
+{
+  NegativeCache failures(300);
+  const char* items[] = { "a/0/low-quality", "a/1/low-quality", "ab/0/low-quality", "b/0/low-quality" };
+  for (size_t i = 0; i < 4; i++)
+  {
+    failures.Store(BUNDLE, items[i], Orthanc::ErrorCode_BadFileFormat);
+    failures.Store(BUNDLE + 1, items[i], Orthanc::ErrorCode_BadFileFormat);
+  }
+
+  failures.Invalidate(BUNDLE, "a/");
+
+  Orthanc::ErrorCode error;
+  ASSERT_FALSE(failures.Lookup(error, BUNDLE, "a/0/low-quality"));
+  ASSERT_FALSE(failures.Lookup(error, BUNDLE, "a/1/low-quality"));
+  ASSERT_TRUE(failures.Lookup(error, BUNDLE, "ab/0/low-quality"));
+  ASSERT_TRUE(failures.Lookup(error, BUNDLE, "b/0/low-quality"));
+
+  // the other bundles are not invalidated
+  ASSERT_TRUE(failures.Lookup(error, BUNDLE + 1, "a/0/low-quality"));
+
+  failures.Invalidate(BUNDLE, "");
+  ASSERT_FALSE(failures.Lookup(error, BUNDLE, "b/0/low-quality"));
+  ASSERT_TRUE(failures.Lookup(error, BUNDLE + 1, "b/0/low-quality"));
+}
+
+
+TEST(NegativeCache, TransientFailures)
+{
+  // the errors due to the state of the server are not remembered, the
+  // next access tries again
+  NegativeCache failures(300);
+  const Orthanc::ErrorCode transient[] = {
+    Orthanc::ErrorCode_InternalError,
+    Orthanc::ErrorCode_Timeout,
+    Orthanc::ErrorCode_Database,
+    Orthanc::ErrorCode_InexistentFile,
+    Orthanc::ErrorCode_UnknownResource,
+    Orthanc::ErrorCode_NotEnoughMemory
+  };
+
+  Orthanc::ErrorCode error;
+  for (size_t i = 0; i < sizeof(transient) / sizeof(transient[0]); i++)
+  {
+    ASSERT_FALSE(NegativeCache::IsPermanentFailure(transient[i]));
+    failures.Store(BUNDLE, GetItem(i), transient[i]);
+    ASSERT_FALSE(failures.Lookup(error, BUNDLE, GetItem(i)));
+  }
+
+  failures.Store(BUNDLE, GetItem(0), Orthanc::ErrorCode_IncompatibleImageFormat);
+  ASSERT_TRUE(failures.Lookup(error, BUNDLE, GetItem(0)));
+  ASSERT_EQ(Orthanc::ErrorCode_IncompatibleImageFormat, error);
+
+  NegativeCache::Statistics statistics;
+  failures.GetStatistics(statistics);
+  ASSERT_EQ(1u, statistics.count);
+}
+
+
+namespace
+{
+  const int TRIGGER_BUNDLE = 2;
+
+  std::string GetSlice(unsigned int position)
+  {
+    return "series/" + boost::lexical_cast<std::string>(position);
+  }
+
+  // A factory that records its calls.  While it is held, the calls to
+  // Create() wait, so that the accesses of several threads overlap.
+  class MockFactory : public ICacheFactory
+  {
+  private:
+    boost::mutex               mutex_;
+    boost::condition_variable  changed_;
+    bool                       held_;
+    Orthanc::ErrorCode         error_;    // thrown by Create(), unless ErrorCode_Success
+    std::vector<std::string>   created_;  // in the order of the calls
+
+  public:
+    MockFactory() :
+      held_(false),
+      error_(Orthanc::ErrorCode_Success)
+    {
+    }
+
+    virtual bool Create(std::string& content,
+                        const std::string& key)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      created_.push_back(key);
+      changed_.notify_all();
+
+      while (held_)
+      {
+        changed_.wait(lock);
+      }
+
+      if (error_ != Orthanc::ErrorCode_Success)
+      {
+        throw Orthanc::OrthancException(error_);
+      }
+
+      content = "content of " + key;
+      return true;
+    }
+
+    virtual void Invalidate(const std::string& item)
+    {
+    }
+
+    void Hold()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      held_ = true;
+    }
+
+    void Release()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      held_ = false;
+      changed_.notify_all();
+    }
+
+    void SetError(Orthanc::ErrorCode error)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      error_ = error;
+    }
+
+    // Waits (at most 2 seconds) for "count" calls to Create()
+    bool WaitCalls(size_t count)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      boost::system_time timeout = boost::get_system_time() + boost::posix_time::milliseconds(2000);
+      while (created_.size() < count)
+      {
+        if (!changed_.timed_wait(lock, timeout))
+        {
+          return created_.size() >= count;
+        }
+      }
+      return true;
+    }
+
+    std::vector<std::string> GetCreated()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return created_;
+    }
+  };
+
+  // When the item "series" of TRIGGER_BUNDLE is accessed, prefetches the
+  // slices of a series of 10 slices viewed at the position 5, and an item
+  // that is not related to a viewed series.  The access to "barrier" tells
+  // that the previous accesses have been processed, as the events are
+  // processed in their order.
+  class SeriesPolicy : public IPrefetchPolicy
+  {
+  private:
+    boost::mutex               mutex_;
+    boost::condition_variable  changed_;
+    bool                       barrier_;
+
+  public:
+    SeriesPolicy() :
+      barrier_(false)
+    {
+    }
+
+    virtual void Apply(std::list<PrefetchRequest>& toPrefetch,
+                       CacheScheduler& cache,
+                       const CacheIndex& index,
+                       const std::string& content,
+                       const PrefetchAccess& access)
+    {
+      if (index.GetBundle() != TRIGGER_BUNDLE)
+      {
+        return;
+      }
+
+      if (index.GetItem() == "series")
+      {
+        for (unsigned int i = 0; i < 10; i++)
+        {
+          toPrefetch.push_back(PrefetchRequest(CacheIndex(BUNDLE, GetSlice(i)), PrefetchPriority("series", i, 0)));
+        }
+
+        toPrefetch.push_back(PrefetchRequest(CacheIndex(BUNDLE, "other"), PrefetchPriority()));
+        cache.SetViewerPosition("series", 5);
+      }
+      else if (index.GetItem() == "barrier")
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        barrier_ = true;
+        changed_.notify_all();
+      }
+    }
+
+    // Waits (at most 2 seconds) for the access to "barrier"
+    bool WaitBarrier()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      boost::system_time timeout = boost::get_system_time() + boost::posix_time::milliseconds(2000);
+      while (!barrier_)
+      {
+        if (!changed_.timed_wait(lock, timeout))
+        {
+          return barrier_;
+        }
+      }
+      return true;
+    }
+  };
+
+  struct AccessResult
+  {
+    bool                success;
+    std::string         content;
+    Orthanc::ErrorCode  error;
+  };
+
+  void AccessItem(CacheScheduler* scheduler,
+                  std::string item,
+                  AccessResult* result)
+  {
+    try
+    {
+      result->success = scheduler->Access(result->content, BUNDLE, item);
+      result->error = Orthanc::ErrorCode_Success;
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      result->success = false;
+      result->error = e.GetErrorCode();
+    }
+  }
+
+  // Waits (at most 2 seconds) for "count" accesses to wait for the
+  // computation of another thread
+  bool WaitCoalescedAccesses(CacheScheduler& scheduler,
+                             uint64_t count)
+  {
+    for (unsigned int i = 0; i < 200; i++)
+    {
+      CacheScheduler::Statistics statistics;
+      scheduler.GetStatistics(statistics);
+      if (statistics.coalescedAccesses >= count)
+      {
+        return true;
+      }
+
+      boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+    }
+
+    return false;
+  }
+
+  // A scheduler whose factory of BUNDLE (a MockFactory) has a single
+  // prefetcher, with its cache in a temporary directory
+  class CacheSchedulerTest : public ::testing::Test
+  {
+  private:
+    boost::filesystem::path                     root_;
+    std::auto_ptr<Orthanc::FilesystemStorage>   storage_;
+    std::auto_ptr<Orthanc::SQLite::Connection>  db_;
+    std::auto_ptr<CacheManager>                 cache_;
+    std::auto_ptr<CacheLogger>                  logger_;
+    std::auto_ptr<CacheScheduler>               scheduler_;
+    MockFactory*                                factory_;  // owned by scheduler_
+
+  protected:
+    virtual void SetUp()
+    {
+      root_ = CreateTemporaryDirectory();
+      storage_.reset(new Orthanc::FilesystemStorage((root_ / "files").string()));
+      db_.reset(new Orthanc::SQLite::Connection);
+      db_->Open((root_ / "cache.db").string());
+      cache_.reset(new CacheManager(NULL, *db_, *storage_));
+      logger_.reset(new CacheLogger(NULL, false));
+      factory_ = NULL;
+    }
+
+    virtual void TearDown()
+    {
+      if (factory_ != NULL)
+      {
+        // the prefetchers are joined by the scheduler
+        factory_->Release();
+      }
+
+      scheduler_.reset(NULL);
+      cache_.reset(NULL);
+      db_.reset(NULL);
+      storage_.reset(NULL);
+      boost::filesystem::remove_all(root_);
+    }
+
+    CacheScheduler& CreateScheduler(unsigned int maxPrefetchSize)
+    {
+      scheduler_.reset(new CacheScheduler(*cache_, logger_.get(), maxPrefetchSize));
+      factory_ = new MockFactory;
+      scheduler_->Register(BUNDLE, factory_, 1);
+      return *scheduler_;
+    }
+
+    MockFactory& GetFactory()
+    {
+      return *factory_;
+    }
+
+    // Runs the policy on the accesses to TRIGGER_BUNDLE, while the
+    // prefetcher of BUNDLE is busy with the item "blocker": the prefetched
+    // items stay in the queue until the factory is released
+    void EnqueueSeries(CacheScheduler& scheduler)
+    {
+      SeriesPolicy* policy = new SeriesPolicy;
+      scheduler.RegisterPolicy(policy);
+      scheduler.Register(TRIGGER_BUNDLE, new MockFactory, 1);
+
+      GetFactory().Hold();
+      scheduler.Prefetch(BUNDLE, "blocker");
+      ASSERT_TRUE(GetFactory().WaitCalls(1));
+
+      std::string content;
+      ASSERT_TRUE(scheduler.Access(content, TRIGGER_BUNDLE, "series"));
+      ASSERT_TRUE(scheduler.Access(content, TRIGGER_BUNDLE, "barrier"));
+      ASSERT_TRUE(policy->WaitBarrier());
+    }
+  };
+}
+
+
+TEST_F(CacheSchedulerTest, CoalescedAccesses)
+{
+  const size_t THREADS_COUNT = 8;
+
+  CacheScheduler& scheduler = CreateScheduler(100);
+  GetFactory().Hold();
+
+  std::vector<AccessResult> results(THREADS_COUNT);
+  boost::thread_group threads;
+  for (size_t i = 0; i < THREADS_COUNT; i++)
+  {
+    threads.create_thread(boost::bind(AccessItem, &scheduler, "a", &results[i]));
+  }
+
+  // a single thread computes the item, the other ones wait for it
+  ASSERT_TRUE(GetFactory().WaitCalls(1));
+  ASSERT_TRUE(WaitCoalescedAccesses(scheduler, THREADS_COUNT - 1));
+
+  GetFactory().Release();
+  threads.join_all();
+
+  for (size_t i = 0; i < THREADS_COUNT; i++)
+  {
+    ASSERT_TRUE(results[i].success);
+    ASSERT_EQ("content of a", results[i].content);
+  }
+
+  ASSERT_EQ(1u, GetFactory().GetCreated().size());
+}
+
+
+TEST_F(CacheSchedulerTest, AbandonedPrefetch)
+{
+  CacheScheduler& scheduler = CreateScheduler(100);
+  GetFactory().Hold();
+
+  // an access waits for the prefetcher computing the item...
+  scheduler.Prefetch(BUNDLE, "a");
+  ASSERT_TRUE(GetFactory().WaitCalls(1));
+
+  AccessResult result;
+  boost::thread thread(boost::bind(AccessItem, &scheduler, "a", &result));
+  ASSERT_TRUE(WaitCoalescedAccesses(scheduler, 1));
+
+  // ... whose result is dropped as the item is invalidated meanwhile: the
+  // access computes the item itself
+  scheduler.Invalidate(BUNDLE, "a");
+  GetFactory().Release();
+  thread.join();
+
+  ASSERT_TRUE(result.success);
+  ASSERT_EQ("content of a", result.content);
+  ASSERT_EQ(2u, GetFactory().GetCreated().size());
+}
+
+
+TEST_F(CacheSchedulerTest, FailedComputation)
+{
+  CacheScheduler& scheduler = CreateScheduler(100);
+  GetFactory().Hold();
+  GetFactory().SetError(Orthanc::ErrorCode_CorruptedFile);
+
+  AccessResult first, second;
+  boost::thread thread1(boost::bind(AccessItem, &scheduler, "a", &first));
+  boost::thread thread2(boost::bind(AccessItem, &scheduler, "a", &second));
+
+  // the waiting thread gets the error of the computation
+  ASSERT_TRUE(GetFactory().WaitCalls(1));
+  ASSERT_TRUE(WaitCoalescedAccesses(scheduler, 1));
+
+  GetFactory().Release();
+  thread1.join();
+  thread2.join();
+
+  ASSERT_FALSE(first.success);
+  ASSERT_FALSE(second.success);
+  ASSERT_EQ(Orthanc::ErrorCode_CorruptedFile, first.error);
+  ASSERT_EQ(Orthanc::ErrorCode_CorruptedFile, second.error);
+  ASSERT_EQ(1u, GetFactory().GetCreated().size());
+}
+
+
+TEST_F(CacheSchedulerTest, RememberedFailures)
+{
+  CacheScheduler& scheduler = CreateScheduler(100);
+  AccessResult result;
+
+  // a transient error is not remembered, the next access tries again
+  GetFactory().SetError(Orthanc::ErrorCode_Timeout);
+  AccessItem(&scheduler, "a", &result);
+  ASSERT_EQ(Orthanc::ErrorCode_Timeout, result.error);
+  AccessItem(&scheduler, "a", &result);
+  ASSERT_EQ(Orthanc::ErrorCode_Timeout, result.error);
+  ASSERT_EQ(2u, GetFactory().GetCreated().size());
+
+  // a permanent one is, until the item is invalidated
+  GetFactory().SetError(Orthanc::ErrorCode_CorruptedFile);
+  AccessItem(&scheduler, "a", &result);
+  ASSERT_EQ(Orthanc::ErrorCode_CorruptedFile, result.error);
+  AccessItem(&scheduler, "a", &result);
+  ASSERT_EQ(Orthanc::ErrorCode_CorruptedFile, result.error);
+  ASSERT_EQ(3u, GetFactory().GetCreated().size());
+
+  scheduler.Invalidate(BUNDLE, "a");
+  GetFactory().SetError(Orthanc::ErrorCode_Success);
+  AccessItem(&scheduler, "a", &result);
+  ASSERT_TRUE(result.success);
+  ASSERT_EQ(4u, GetFactory().GetCreated().size());
+}
+
+
+TEST_F(CacheSchedulerTest, PrefetchOrder)
+{
+  CacheScheduler& scheduler = CreateScheduler(100);
+  EnqueueSeries(scheduler);
+  GetFactory().Release();
+
+  // the closest slices to the viewed one first (the most recently enqueued
+  // first at the same distance), then the items of no viewed series
+  const char* expected[] = {
+    "blocker", "series/5", "series/6", "series/4", "series/7", "series/3",
+    "series/8", "series/2", "series/9", "series/1", "series/0", "other"
+  };
+
+  const size_t count = sizeof(expected) / sizeof(expected[0]);
+  ASSERT_TRUE(GetFactory().WaitCalls(count));
+
+  std::vector<std::string> created = GetFactory().GetCreated();
+  ASSERT_EQ(count, created.size());
+  for (size_t i = 0; i < count; i++)
+  {
+    ASSERT_EQ(expected[i], created[i]);
+  }
+}
+
+
+TEST_F(CacheSchedulerTest, PrefetchQueueSize)
+{
+  // the jobs with the lowest priority are dropped from the full queue
+  CacheScheduler& scheduler = CreateScheduler(4);
+  EnqueueSeries(scheduler);
+  GetFactory().Release();
+
+  ASSERT_TRUE(GetFactory().WaitCalls(5));
+  Pause();
+
+  std::vector<std::string> created = GetFactory().GetCreated();
+  ASSERT_EQ(5u, created.size());
+  ASSERT_EQ("series/5", created[1]);
+  ASSERT_EQ("series/6", created[2]);
+  ASSERT_EQ("series/4", created[3]);
+  ASSERT_EQ("series/7", created[4]);
+}
+
+
+TEST_F(CacheSchedulerTest, CancelPrefetch)
+{
+  // the series is closed before its slices are prefetched
+  CacheScheduler& scheduler = CreateScheduler(100);
+  EnqueueSeries(scheduler);
+  scheduler.CancelPrefetch("series");
+  GetFactory().Release();
+
+  ASSERT_TRUE(GetFactory().WaitCalls(2));
+  Pause();
+
+  std::vector<std::string> created = GetFactory().GetCreated();
+  ASSERT_EQ(2u, created.size());
+  ASSERT_EQ("blocker", created[0]);
+  ASSERT_EQ("other", created[1]);
+}
@@ -31,6 +31,9 @@ add_executable(UnitTests
   ${GOOGLE_TEST_SOURCES}
 
   ${VIEWER_TESTS_DIR}/UnitTestsMain.cpp
+  ${VIEWER_TESTS_DIR}/FrameOffsetIndexTests.cpp
+  ${VIEWER_TESTS_DIR}/PixelKernelsTests.cpp
+  ${VIEWER_TESTS_DIR}/ShortTermCacheTests.cpp
   )
 add_dependencies(UnitTests WebViewerLibrary)
 target_link_libraries(UnitTests WebViewerLibrary)